@@ -0,0 +1,27 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Add one buffer into another
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Used to sum the outputs of several waves (i.e. batched phonon configurations) on the device. The first input is
+/// copied so the output doesn't need clearing first. Complex buffers can be passed as twice as many reals.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// input - buffer to add
+/// output - buffer to add to
+/// size - number of elements in the input
+/// offset - where the input starts in the output (so the output can be a stack)
+/// first - if not 0, the output is set to the input (instead of adding to it)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+__kernel void accumulate_d( __global const double* input,
+						   __global double* output,
+						   unsigned int size,
+						   unsigned int offset,
+						   int first)
+{
+	int id = get_global_id(0);
+
+	if(id < size) {
+		if (first)
+			output[offset + id] = input[id];
+		else
+			output[offset + id] += input[id];
+	}
+}
\ No newline at end of file
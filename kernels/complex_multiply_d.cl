@@ -1,25 +1,30 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /// Multiply two complex images
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-/// Multiples two complex images element wise
+/// Multiples two complex images element wise. The second input (and the output) can be a stack of images by using the
+/// third work dimension, in which case the first input is multiplied with every image of the stack
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /// input_a - first image to be multiplied
-/// input_b - second image to be multiplied
+/// input_b - second image (or stack of images) to be multiplied
 /// output - output of multiplication
 /// width - width of hte inputs
 /// height - height of the outputs
+/// batch_stride - distance (in elements) between the images of the stack
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 __kernel void complex_multiply_d( __global double2* input_a,
 								 __global double2* input_b,
 								 __global double2* output, 
 								 unsigned int width,
-								 unsigned int height)
+								 unsigned int height,
+								 unsigned int batch_stride)
 {
 	int xid = get_global_id(0);
 	int yid = get_global_id(1);
+	int zid = get_global_id(2);
 	if (xid < width && yid < height) {
 		int id = xid + width * yid;
-		output[id].x = input_a[id].x * input_b[id].x - input_a[id].y * input_b[id].y;
-		output[id].y = input_a[id].x * input_b[id].y + input_a[id].y * input_b[id].x;
+		int bid = id + batch_stride * zid;
+		output[bid].x = input_a[id].x * input_b[bid].x - input_a[id].y * input_b[bid].y;
+		output[bid].y = input_a[id].x * input_b[bid].y + input_a[id].y * input_b[bid].x;
 	}
 }
\ No newline at end of file
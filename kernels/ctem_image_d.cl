@@ -17,6 +17,7 @@
 /// k_y - k values for y axis of output (size needs to equal height)
 /// wavelength - wavelength of the electron beam (units?)
 /// C10 - C56 - aberration coefficients (units?)
+/// ZERO_C12 - ZERO_C56 - (build defines) the host defines these for any aberrations that are zero to compile them out
 /// obj_ap - size/convergence of the objective aperture (units?, semiangle?)
 /// beta - size/convergence of the condenser aperture semiangle (units)
 /// delta - the defocus spread (a term incorporating the chromatic aberrations, see Kirkland 2nd ed., equation 3.41)
@@ -83,23 +84,63 @@ __kernel void ctem_image_d( __global const double2* input,
 			// TODO: check the 0.25 factor here is correct (it was 0.5, but Kirkland 2nd ed. eq. 3.42 disagrees)
 			double temporalCoh = native_exp( -0.25 * M_PI*M_PI  * delta*delta * cModSq(w)*cModSq(w) / (wavelength*wavelength) );
 			double spatialCoh = native_exp( -1.0 * M_PI*M_PI * beta2*beta2 * cModSq(w) * pow((C10 + C30*cModSq(w) + C50*cModSq(w)*cModSq(w)), 2) );
+			double cchi = 0.0;
 			double tC10 = 0.5 * C10 * cModSq(w);
+			cchi += tC10;
+#ifndef ZERO_C12
 			double2 tC12 = 0.5 * cMult(C12, cPow(wc, 2));
+			cchi += tC12.x;
+#endif
+#ifndef ZERO_C21
 			double2 tC21 = cMult(C21, cMult(cPow(wc, 2), w)) / 3.0;
+			cchi += tC21.x;
+#endif
+#ifndef ZERO_C23
 			double2 tC23 = cMult(C23, cPow(wc, 3)) / 3.0;
+			cchi += tC23.x;
+#endif
+#ifndef ZERO_C30
 			double tC30 = 0.25 * C30 * cModSq(w)*cModSq(w);
+			cchi += tC30;
+#endif
+#ifndef ZERO_C32
 			double2 tC32 = 0.25 * cMult(C32, cMult(cPow(wc, 3), w));
+			cchi += tC32.x;
+#endif
+#ifndef ZERO_C34
 			double2 tC34 = 0.25 * cMult(C34, cPow(wc, 4));
+			cchi += tC34.x;
+#endif
 
+#ifndef ZERO_C41
 			double2 tC41 = 0.2 * cMult(C41, cMult(cPow(wc, 3), cPow(w ,2)));
+			cchi += tC41.x;
+#endif
+#ifndef ZERO_C43
 			double2 tC43 = 0.2 * cMult(C43, cMult(cPow(wc, 4), w));
+			cchi += tC43.x;
+#endif
+#ifndef ZERO_C45
 			double2 tC45 = 0.2 * cMult(C45, cPow(wc, 5));
+			cchi += tC45.x;
+#endif
+#ifndef ZERO_C50
 			double tC50 = C50 * cModSq(w)*cModSq(w)*cModSq(w) / 6.0;
+			cchi += tC50;
+#endif
+#ifndef ZERO_C52
 			double2 tC52 = cMult(C52, cMult(cPow(wc, 4), cPow(w ,2))) / 6.0;
+			cchi += tC52.x;
+#endif
+#ifndef ZERO_C54
 			double2 tC54 = cMult(C54, cMult(cPow(wc, 5), w)) / 6.0;
+			cchi += tC54.x;
+#endif
+#ifndef ZERO_C56
 			double2 tC56 = cMult(C56, cPow(wc, 6)) / 6.0;
+			cchi += tC56.x;
+#endif
 
-			double cchi = tC10 + tC12.x + tC21.x + tC23.x + tC30 + tC32.x + tC34.x + tC41.x + tC43.x + tC45.x + tC50 + tC52.x + tC54.x + tC56.x;
 			double chi = 2.0 * M_PI * cchi / wavelength;
 
             // smooth the aperture edge
@@ -0,0 +1,47 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Diffraction patterns for 4D-STEM
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Does the FFT shift and square abs (as in the fft_shift and complex_to_real kernels) for every parallel probe, but
+/// only keeps the centre crop x crop pixels (i.e. inside the band limit) and sums each binning x binning block of these
+/// into one output pixel. The global size is (crop / binning, crop / binning, number of probes).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// input - the (unshifted) reciprocal space wavefunctions of all the probes
+/// output - the binned intensities, one (crop / binning) squared image per probe
+/// width - width of each wavefunction
+/// height - height of each wavefunction
+/// batch_stride - distance between each probe in the input
+/// crop - width/height of the (shifted) centre region that is kept, must be a multiple of binning
+/// binning - number of pixels (in x and y) summed into each output pixel
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+__kernel void diffraction_pattern_d( __global const double2* restrict input,
+                                     __global double* output,
+                                     unsigned int width,
+                                     unsigned int height,
+                                     unsigned int batch_stride,
+                                     unsigned int crop,
+                                     unsigned int binning)
+{
+	int xid = get_global_id(0);
+	int yid = get_global_id(1);
+	int probe = get_global_id(2);
+	unsigned int out_size = crop / binning;
+
+	if (xid < out_size && yid < out_size)
+	{
+		__global const double2* wave = input + probe * batch_stride;
+
+		// the start of this bin in the shifted image
+		int x_start = width / 2 - crop / 2 + xid * binning;
+		int y_start = height / 2 - crop / 2 + yid * binning;
+
+		double sum = 0.0;
+		for (int j = 0; j < binning; ++j)
+			for (int i = 0; i < binning; ++i) {
+				// undo the FFT shift
+				int id = (x_start + i + width / 2) % width + width * ((y_start + j + height / 2) % height);
+				sum += wave[id].x * wave[id].x + wave[id].y * wave[id].y;
+			}
+
+		output[probe * out_size * out_size + yid * out_size + xid] = sum;
+	}
+}
@@ -18,6 +18,7 @@
 /// pixel_scale - real space pixel scale // TODO: can this be replaced with just the raw position values
 /// wavelength - wavelength of the electron beam (units?)
 /// C10 - C56 - aberration coefficients (units?)
+/// ZERO_C12 - ZERO_C56 - (build defines) the host defines these for any aberrations that are zero to compile them out
 /// cond_ap - size/convergence of the condenser aperture (units?)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /// cModSq - takes the square modulus of a complex number
@@ -80,24 +81,62 @@ __kernel void init_probe_wave_f( __global float2* output,
 			float2 w = (float2)(wavelength*k_x[xid], wavelength*k_y[yid]);
 			float2 wc = cConj(w);
 			// all the aberration terms, calculated in w (omega)
+			float cchi = 0.0f;
 			float tC10 = 0.5f * C10 * cModSq(w);
+			cchi += tC10;
+#ifndef ZERO_C12
 			float2 tC12 = 0.5f * cMult(C12, cPow(wc, 2));
+			cchi += tC12.x;
+#endif
+#ifndef ZERO_C21
 			float2 tC21 = cMult(C21, cMult(cPow(wc, 2), w)) / 3.0f;
+			cchi += tC21.x;
+#endif
+#ifndef ZERO_C23
 			float2 tC23 = cMult(C23, cPow(wc, 3)) / 3.0f;
+			cchi += tC23.x;
+#endif
+#ifndef ZERO_C30
 			float tC30 = 0.25f * C30 * cModSq(w)*cModSq(w);
+			cchi += tC30;
+#endif
+#ifndef ZERO_C32
 			float2 tC32 = 0.25f * cMult(C32, cMult(cPow(wc, 3), w));
+			cchi += tC32.x;
+#endif
+#ifndef ZERO_C34
 			float2 tC34 = 0.25f * cMult(C34, cPow(wc, 4));
+			cchi += tC34.x;
+#endif
 
+#ifndef ZERO_C41
 			float2 tC41 = 0.2f * cMult(C41, cMult(cPow(wc, 3), cPow(w ,2)));
+			cchi += tC41.x;
+#endif
+#ifndef ZERO_C43
 			float2 tC43 = 0.2f * cMult(C43, cMult(cPow(wc, 4), w));
+			cchi += tC43.x;
+#endif
+#ifndef ZERO_C45
 			float2 tC45 = 0.2f * cMult(C45, cPow(wc, 5));
+			cchi += tC45.x;
+#endif
+#ifndef ZERO_C50
 			float tC50 = C50 * cModSq(w)*cModSq(w)*cModSq(w) / 6.0f;
+			cchi += tC50;
+#endif
+#ifndef ZERO_C52
 			float2 tC52 = cMult(C52, cMult(cPow(wc, 4), cPow(w ,2))) / 6.0f;
+			cchi += tC52.x;
+#endif
+#ifndef ZERO_C54
 			float2 tC54 = cMult(C54, cMult(cPow(wc, 5), w)) / 6.0f;
+			cchi += tC54.x;
+#endif
+#ifndef ZERO_C56
 			float2 tC56 = cMult(C56, cPow(wc, 6)) / 6.0f;
-
-            // note because of the conjugates we only have real components left
-			float cchi = tC10 + tC12.x + tC21.x + tC23.x + tC30 + tC32.x + tC34.x + tC41.x + tC43.x + tC45.x + tC50 + tC52.x + tC54.x + tC56.x;
+			cchi += tC56.x;
+#endif
 			float chi = 2.0f * M_PI_F * cchi / wavelength;
 
             // smooth the aperture edge
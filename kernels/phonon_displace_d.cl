@@ -0,0 +1,101 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Frozen phonon displacements
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Moves each atom from its undisplaced position by a random thermal displacement along each of the displacement axes
+/// (normally distributed with the standard deviation of that atom). The random numbers come from a Philox4x32-10
+/// counter based generator, keyed by the seed and counted by the atom, job and configuration. This means each
+/// configuration is the same however (and wherever) it is made, and is the same as PhononScattering::generateTdsFactors
+/// on the host.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// base_x - undisplaced x position of the (sorted) atoms
+/// base_y - undisplaced y position of the atoms
+/// base_z - undisplaced z position of the atoms
+/// sigma - standard deviation of the displacement along u1, u2 and u3 (3 values for each atom)
+/// atom_id - index of each atom in the structure (so the displacements don't depend on the sorting)
+/// pos_x - displaced x position of the atoms
+/// pos_y - displaced y position of the atoms
+/// pos_z - displaced z position of the atoms
+/// n_atoms - number of atoms (or the end of the range to displace)
+/// seed_lo - lower 32 bits of the seed
+/// seed_hi - upper 32 bits of the seed
+/// job - id of the job making this configuration
+/// config - which configuration this is (for the job)
+/// u1_x, u1_y, u1_z - first displacement axis
+/// u2_x, u2_y, u2_z - second displacement axis
+/// u3_x, u3_y, u3_z - third displacement axis
+/// first_atom - the first atom to displace (so only the atoms of some slices can be done)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint4 philox_round(uint4 ctr, uint2 key)
+{
+	uint hi0 = mul_hi(0xD2511F53u, ctr.x);
+	uint lo0 = 0xD2511F53u * ctr.x;
+	uint hi1 = mul_hi(0xCD9E8D57u, ctr.z);
+	uint lo1 = 0xCD9E8D57u * ctr.z;
+	return (uint4)(hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);
+}
+
+uint4 philox4x32_10(uint4 ctr, uint2 key)
+{
+	for (int r = 0; r < 10; ++r)
+	{
+		if (r > 0)
+			key += (uint2)(0x9E3779B9u, 0xBB67AE85u);
+		ctr = philox_round(ctr, key);
+	}
+	return ctr;
+}
+
+// uniform in (0, 1], so the log is always finite
+double philox_uniform(uint x)
+{
+	return (x + 1.0) * (1.0 / 4294967296.0);
+}
+
+__kernel void phonon_displace_d( __global const double* restrict base_x,
+								 __global const double* restrict base_y,
+								 __global const double* restrict base_z,
+								 __global const double* restrict sigma,
+								 __global const int* restrict atom_id,
+								 __global double* restrict pos_x,
+								 __global double* restrict pos_y,
+								 __global double* restrict pos_z,
+								 int n_atoms,
+								 unsigned int seed_lo,
+								 unsigned int seed_hi,
+								 unsigned int job,
+								 unsigned int config,
+								 double u1_x,
+								 double u1_y,
+								 double u1_z,
+								 double u2_x,
+								 double u2_y,
+								 double u2_z,
+								 double u3_x,
+								 double u3_y,
+								 double u3_z,
+								 int first_atom)
+{
+	int id = first_atom + get_global_id(0);
+	if (id >= n_atoms)
+		return;
+
+	uint4 r = philox4x32_10((uint4)((uint)atom_id[id], config, job, 0u), (uint2)(seed_lo, seed_hi));
+
+	// Box-Muller, the 4 uniform numbers give 4 normal numbers (only 3 are needed)
+	double r_1 = sqrt(-2.0 * log(philox_uniform(r.x)));
+	double t_1 = 2.0 * M_PI * philox_uniform(r.y);
+	double r_2 = sqrt(-2.0 * log(philox_uniform(r.z)));
+	double t_2 = 2.0 * M_PI * philox_uniform(r.w);
+
+	double3 u1 = (double3)(u1_x, u1_y, u1_z);
+	double3 u2 = (double3)(u2_x, u2_y, u2_z);
+	double3 u3 = (double3)(u3_x, u3_y, u3_z);
+
+	double3 d = r_1 * cos(t_1) * sigma[3*id] * u1
+			 + r_1 * sin(t_1) * sigma[3*id + 1] * u2
+			 + r_2 * cos(t_2) * sigma[3*id + 2] * u3;
+
+	pos_x[id] = base_x[id] + d.x;
+	pos_y[id] = base_y[id] + d.y;
+	pos_z[id] = base_z[id] + d.z;
+}
@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Poisson (shot) noise
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Replaces each pixel of an image with the number of electrons counted from a Poisson distribution, with a mean of the
+/// dose times the (real part of the) pixel value. The random numbers come from a Philox4x32-10 counter based generator
+/// (as in phonon_displace) keyed by the seed and counted by the pixel, realisation and configuration, so each
+/// realisation is different and doesn't depend on how or where it is made.
+/// Small means use the multiplication method, larger means use Hormann's transformed rejection (PTRS).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// input - noiseless image (only the real part is used)
+/// output - noisy image (scaled by the conversion factor)
+/// width - width of the images
+/// height - height of the images
+/// dose - electrons per pixel for a pixel value of 1
+/// conversion - factor the counts are multiplied by
+/// seed_lo - lower 32 bits of the seed
+/// seed_hi - upper 32 bits of the seed
+/// config - the (phonon) configuration this image is from
+/// realisation - which noisy image this is (each image made from the configuration needs a different one)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+uint4 philox_round(uint4 ctr, uint2 key)
+{
+	uint hi0 = mul_hi(0xD2511F53u, ctr.x);
+	uint lo0 = 0xD2511F53u * ctr.x;
+	uint hi1 = mul_hi(0xCD9E8D57u, ctr.z);
+	uint lo1 = 0xCD9E8D57u * ctr.z;
+	return (uint4)(hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);
+}
+
+uint4 philox4x32_10(uint4 ctr, uint2 key)
+{
+	for (int r = 0; r < 10; ++r)
+	{
+		if (r > 0)
+			key += (uint2)(0x9E3779B9u, 0xBB67AE85u);
+		ctr = philox_round(ctr, key);
+	}
+	return ctr;
+}
+
+// uniform in (0, 1], so the log is always finite
+double philox_uniform(uint x)
+{
+	return (x + 1.0) * (1.0 / 4294967296.0);
+}
+
+// hands out the 4 numbers from each block, then moves the counter on for the next block
+typedef struct
+{
+	uint4 ctr;
+	uint2 key;
+	uint4 block;
+	int used;
+} philox_stream;
+
+double next_uniform(philox_stream* s)
+{
+	if (s->used == 4)
+	{
+		s->block = philox4x32_10(s->ctr, s->key);
+		s->ctr.w += 1;
+		s->used = 0;
+	}
+
+	uint x = s->used == 0 ? s->block.x : (s->used == 1 ? s->block.y : (s->used == 2 ? s->block.z : s->block.w));
+	s->used += 1;
+	return philox_uniform(x);
+}
+
+double poisson(double lambda, philox_stream* s)
+{
+	if (!(lambda > 0.0))
+		return 0.0;
+
+	if (lambda < 12.0)
+	{
+		double limit = exp(-lambda);
+		double p = next_uniform(s);
+		double k = 0.0;
+		while (p > limit)
+		{
+			p *= next_uniform(s);
+			k += 1.0;
+		}
+		return k;
+	}
+
+	double slam = sqrt(lambda);
+	double loglam = log(lambda);
+	double b = 0.931 + 2.53 * slam;
+	double a = -0.059 + 0.02483 * b;
+	double invalpha = 1.1239 + 1.1328 / (b - 3.4);
+	double vr = 0.9277 - 3.6224 / (b - 2.0);
+
+	while (true)
+	{
+		double u = next_uniform(s) - 0.5;
+		double v = next_uniform(s);
+		double us = 0.5 - fabs(u);
+		double k = floor((2.0 * a / us + b) * u + lambda + 0.43);
+
+		if (us >= 0.07 && v <= vr)
+			return k;
+
+		if (k < 0.0 || (us < 0.013 && v > us))
+			continue;
+
+		if (log(v) + log(invalpha) - log(a / (us * us) + b) <= -lambda + k * loglam - lgamma(k + 1.0))
+			return k;
+	}
+}
+
+__kernel void poisson_noise_d( __global const double2* restrict input,
+							   __global double2* restrict output,
+							   unsigned int width,
+							   unsigned int height,
+							   double dose,
+							   double conversion,
+							   unsigned int seed_lo,
+							   unsigned int seed_hi,
+							   unsigned int config,
+							   unsigned int realisation)
+{
+	int xid = get_global_id(0);
+	int yid = get_global_id(1);
+
+	if(xid < width && yid < height) {
+		int id = xid + yid*width;
+
+		philox_stream s;
+		s.ctr = (uint4)((uint)id, realisation, config, 0u);
+		s.key = (uint2)(seed_lo, seed_hi);
+		s.used = 4;
+
+		// the filtered image can ring slightly below 0, these pixels count nothing
+		double counts = poisson(dose * input[id].x, &s);
+
+		output[id].x = conversion * counts;
+		output[id].y = 0.0;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Deposit the atoms of a slice onto the grid (for the reciprocal space potentials)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Each atom adds a weight of one to the four pixels around it (bilinear weights), with a separate image for each
+/// species (element). The transforms of these images are then multiplied by each species' projected potential in
+/// reciprocal space (see potential_structure_factors). The grid is treated as periodic, so atoms just outside the
+/// left/top edges are wrapped (the rest of the atoms outside are skipped), so this isn't used for the moving STEM
+/// frames. Atoms can share pixels, so the weights are added atomically.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// species_density - stack of images, one for each species (only the real part is used), must be zeroed first
+/// pos_x - x position of the atoms
+/// pos_y - y position of the atoms
+/// atomic_num - atomic number of the atoms
+/// species_index - the image in the stack to use for each atomic number (-1 if not used)
+/// block_start_pos - the start positions of each block (as for transmission_potentials_projected)
+/// current_slice - current slice of the simulation
+/// blocks_xy - number of blocks in each slice
+/// width - width of the images
+/// height - height of the images
+/// startx - x start position of simulation
+/// starty - y start position of simulation
+/// pixelscale - pixel scale of the images in real space
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void atomic_add_f(volatile __global float* address, float value) {
+    union { unsigned int u; float f; } old_value, new_value;
+    do {
+        old_value.f = *address;
+        new_value.f = old_value.f + value;
+    } while (atomic_cmpxchg((volatile __global unsigned int*) address, old_value.u, new_value.u) != old_value.u);
+}
+
+__kernel void potential_deposit_f( __global float2* species_density,
+                                  __global const float* restrict pos_x,
+                                  __global const float* restrict pos_y,
+                                  __global const int* restrict atomic_num,
+                                  __global const int* restrict species_index,
+                                  __global const int* restrict block_start_pos,
+                                  int current_slice,
+                                  int blocks_xy,
+                                  unsigned int width,
+                                  unsigned int height,
+                                  float startx,
+                                  float starty,
+                                  float pixelscale)
+{
+	int start = block_start_pos[current_slice * blocks_xy];
+	int end = block_start_pos[(current_slice + 1) * blocks_xy];
+	int gid = start + get_global_id(0);
+
+	if (gid >= end)
+		return;
+
+	int s = species_index[atomic_num[gid]];
+	if (s < 0)
+		return;
+
+	// position in pixels (pixel centres are at startx + xid * pixelscale, the same as the real space potentials)
+	float px = (pos_x[gid] - startx) / pixelscale;
+	float py = (pos_y[gid] - starty) / pixelscale;
+	float px_0 = floor(px);
+	float py_0 = floor(py);
+	int x_0 = (int) px_0;
+	int y_0 = (int) py_0;
+
+	if (x_0 < -1 || x_0 >= (int) width || y_0 < -1 || y_0 >= (int) height)
+		return;
+
+	float wx = px - px_0;
+	float wy = py - py_0;
+
+	int x_1 = (x_0 + 1) % width;
+	int y_1 = (y_0 + 1) % height;
+	x_0 = (x_0 + width) % width;
+	y_0 = (y_0 + height) % height;
+
+	// only the real part of each pixel is used
+	volatile __global float* density = (volatile __global float*) (species_density + s * width * height);
+	atomic_add_f(density + 2 * (x_0 + width * y_0), (1 - wx) * (1 - wy));
+	atomic_add_f(density + 2 * (x_1 + width * y_0), wx * (1 - wy));
+	atomic_add_f(density + 2 * (x_0 + width * y_1), (1 - wx) * wy);
+	atomic_add_f(density + 2 * (x_1 + width * y_1), wx * wy);
+}
\ No newline at end of file
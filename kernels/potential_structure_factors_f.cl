@@ -0,0 +1,35 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Sum the species in reciprocal space (for the reciprocal space potentials)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Multiplies the transform of each species' deposited atoms by the transform of that species' projected potential and
+/// sums them. The inverse transform of the output is the projected potential of the slice. The factors already include
+/// the band limit and correct for the bilinear weights used in potential_deposit.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// species_spectrum - stack of the transformed species images (from potential_deposit)
+/// species_factors - stack of the (real) reciprocal space projected potential of each species
+/// potential - the output potential (in reciprocal space)
+/// width - width of the images
+/// height - height of the images
+/// n_species - number of images in the stacks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+__kernel void potential_structure_factors_f( __global const float2* restrict species_spectrum,
+                                            __global const float* restrict species_factors,
+                                            __global float2* potential,
+                                            unsigned int width,
+                                            unsigned int height,
+                                            unsigned int n_species)
+{
+	int xid = get_global_id(0);
+	int yid = get_global_id(1);
+
+	if(xid < width && yid < height) {
+		int id = xid + width * yid;
+		int image_size = width * height;
+
+		float2 sum = (float2)(0);
+		for (int s = 0; s < n_species; ++s)
+			sum += species_factors[s * image_size + id] * species_spectrum[s * image_size + id];
+
+		potential[id] = sum;
+	}
+}
\ No newline at end of file
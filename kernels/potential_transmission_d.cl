@@ -0,0 +1,26 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Potential to transmission function
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Converts the (real part of the) projected potential to the transmission function, exp(i * sigma * potential). This
+/// is the last step of the reciprocal space potentials, the same as the end of transmission_potentials_projected.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// potential - the potential (input) and transmission function (output)
+/// width - width of the potential
+/// height - height of the potential
+/// sigma - the interaction parameter (given by eq. 5.6 in Kirkland)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+__kernel void potential_transmission_d( __global double2* potential,
+                                       unsigned int width,
+                                       unsigned int height,
+                                       double sigma)
+{
+	int xid = get_global_id(0);
+	int yid = get_global_id(1);
+
+	if(xid < width && yid < height) {
+		int id = xid + width * yid;
+		double v = potential[id].x;
+		potential[id].x = native_cos(sigma * v);
+		potential[id].y = native_sin(sigma * v);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Form PRISM probes from the S-matrix
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Adds one batch of S-matrix beams (the exit waves of tilted plane waves) to the probes. Each probe is the sum of the
+/// beams weighted by the probe's coefficients (aperture, aberrations and position phase), but only a window around the
+/// probe is made (the beams are every few reciprocal pixels so the probe repeats over the size of the window). The
+/// window wraps around the edges of the S-matrix. The probes need to be zeroed before the first batch is added.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// s_matrix - stack of real space exit waves of this batch of beams
+/// probes - stack of the probe windows (output)
+/// coefficients - the coefficient of every beam for every probe (beam is the inner index)
+/// origins - the x and y start of each probe's window (in pixels of the s_matrix)
+/// width - width of the s_matrix waves
+/// height - height of the s_matrix waves
+/// beam_stride - distance between each beam in the s_matrix stack
+/// n_beams - number of beams in this batch
+/// beam_offset - index of the first beam of this batch (in the coefficients)
+/// total_beams - number of beams in total (for the coefficients)
+/// window - width and height of the probe windows
+/// scale - factor to keep the intensity of the windowed probe the same as the full probe
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+__kernel void prism_probes_d( __global const double2* restrict s_matrix,
+                              __global double2* probes,
+                              __global const double2* restrict coefficients,
+                              __global const int* restrict origins,
+                              unsigned int width,
+                              unsigned int height,
+                              unsigned int beam_stride,
+                              unsigned int n_beams,
+                              unsigned int beam_offset,
+                              unsigned int total_beams,
+                              unsigned int window,
+                              double scale)
+{
+	int xid = get_global_id(0);
+	int yid = get_global_id(1);
+	int probe = get_global_id(2);
+
+	if(xid < window && yid < window) {
+		int sx = (origins[2 * probe] + xid) % width;
+		int sy = (origins[2 * probe + 1] + yid) % height;
+		int s_id = sx + width * sy;
+
+		__global const double2* coef = coefficients + probe * total_beams + beam_offset;
+
+		double2 sum = (double2)(0.0);
+		for (int b = 0; b < n_beams; ++b) {
+			double2 c = coef[b];
+			double2 s = s_matrix[b * beam_stride + s_id];
+			sum += (double2)(c.x * s.x - c.y * s.y, c.x * s.y + c.y * s.x);
+		}
+
+		probes[probe * window * window + xid + window * yid] += scale * sum;
+	}
+}
@@ -0,0 +1,24 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Propagator FFT callback
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// This is not a kernel, it is given to clFFT as the post callback of the forward transform of the wavefunction stack
+/// so that the propagator multiply happens as the transform writes its output (instead of as a separate complex
+/// multiply through a temporary buffer). The propagator is already band limited, so this also applies the band limit.
+/// PROPAGATOR_STRIDE is defined when the callback is created and is the distance between each wavefunction in the
+/// stack (so we can index the propagator for each one).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// output - the output of the transform (the reciprocal space wavefunction stack)
+/// outoffset - the index (in float2) of the value being written
+/// userdata - the propagator function
+/// fftoutput - the value from the transform (already scaled)
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void propagator_callback_f(__global void* output,
+                           uint outoffset,
+                           __global void* userdata,
+                           float2 fftoutput)
+{
+	__global float2* propagator = (__global float2*) userdata;
+	float2 p = propagator[outoffset % PROPAGATOR_STRIDE];
+
+	((__global float2*) output)[outoffset] = (float2)(fftoutput.x*p.x - fftoutput.y*p.y, fftoutput.x*p.y + fftoutput.y*p.x);
+}
\ No newline at end of file
@@ -0,0 +1,109 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Integrate all the STEM detectors
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Does the FFT shift, square abs, translation, band pass and partial sum (as in the fft_shift, complex_to_real,
+/// bilinear_translate, band_pass and sum_reduction kernels) for every detector and every parallel probe in one go.
+/// The global size is (groups * local size, number of detectors, number of probes) and each work group outputs the
+/// partial sum of its part of the diffraction pattern, to be summed on the CPU (as for the sum reduction).
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// input - the (unshifted) reciprocal space wavefunctions of all the probes
+/// output - partial sums, ordered by group, then detector, then probe
+/// detectors - the inner radius, outer radius, x centre and y centre (all in pixels) of each detector
+/// n_detectors - the number of detectors
+/// width - width of each wavefunction
+/// height - height of each wavefunction
+/// batch_stride - distance between each probe in the input
+/// pixel_shift_x - integer shift amount in x
+/// pixel_shift_y - integer shift amount in y
+/// subpixel_shift_x - sub-pixel shift in x
+/// subpixel_shift_y - sub-pixel shift in y
+/// buffer - local buffer to store each work items part of the sum
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+double shifted_intensity_d(__global const double2* input, int xid, int yid, int width, int height)
+{
+	// wrap around the image, then undo the FFT shift
+	if (xid < 0)
+		xid += width;
+	if (yid < 0)
+		yid += height;
+
+	int id = (xid + width / 2) % width + width * ((yid + height / 2) % height);
+	return input[id].x * input[id].x + input[id].y * input[id].y;
+}
+
+__kernel void stem_detectors_d( __global const double2* input,
+                                __global double* output,
+                                __global const double* detectors,
+                                unsigned int n_detectors,
+                                unsigned int width,
+                                unsigned int height,
+                                unsigned int batch_stride,
+                                int pixel_shift_x,
+                                int pixel_shift_y,
+                                double subpixel_shift_x,
+                                double subpixel_shift_y,
+                                __local double* buffer)
+{
+	size_t idx = get_local_id(0);
+	size_t stride = get_global_size(0);
+	unsigned int det = get_global_id(1);
+	unsigned int probe = get_global_id(2);
+	unsigned int size = width * height;
+
+	__global const double2* wave = input + probe * batch_stride;
+
+	double inner = detectors[det * 4];
+	double outer = detectors[det * 4 + 1];
+	double centX = width / 2.0 + detectors[det * 4 + 2];
+	double centY = height / 2.0 + detectors[det * 4 + 3];
+
+	bool do_subpixel = subpixel_shift_x != 0.0 || subpixel_shift_y != 0.0;
+
+	double f_br = subpixel_shift_x * subpixel_shift_y;
+	double f_bl = (1.0 - subpixel_shift_x) * subpixel_shift_y;
+	double f_tr = subpixel_shift_x * (1.0 - subpixel_shift_y);
+	double f_tl = (1.0 - subpixel_shift_x) * (1.0 - subpixel_shift_y);
+
+	buffer[idx] = 0.0;
+
+	for(size_t pos = get_global_id(0); pos < size; pos += stride ) {
+		int xid = pos % width;
+		int yid = pos / width;
+
+		double radius = native_sqrt( (xid-centX) * (xid-centX) + (yid-centY) * (yid-centY) );
+		if (radius > outer || radius < inner)
+			continue;
+
+		// the translated position (wrapped like bilinear_translate)
+		int new_xid = xid - pixel_shift_x;
+		int new_yid = yid - pixel_shift_y;
+
+		if (new_xid < 0)
+			new_xid += width;
+		else if (new_xid >= width)
+			new_xid -= width;
+
+		if (new_yid < 0)
+			new_yid += height;
+		else if (new_yid >= height)
+			new_yid -= height;
+
+		if (do_subpixel)
+			buffer[idx] += f_tl * shifted_intensity_d(wave, new_xid, new_yid, width, height)
+						 + f_tr * shifted_intensity_d(wave, new_xid - 1, new_yid, width, height)
+						 + f_bl * shifted_intensity_d(wave, new_xid, new_yid - 1, width, height)
+						 + f_br * shifted_intensity_d(wave, new_xid - 1, new_yid - 1, width, height);
+		else
+			buffer[idx] += shifted_intensity_d(wave, new_xid, new_yid, width, height);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	double sum = 0.0;
+	if(!idx) {
+		for(size_t i = 0; i < get_local_size(0); ++i)
+			sum += fabs(buffer[i]);
+
+		output[(probe * n_detectors + det) * get_num_groups(0) + get_group_id(0)] = sum * M_SQRT2;
+	}
+}
\ No newline at end of file
@@ -40,6 +40,8 @@
 /// startx - x start position of simulation (when simulation is cropped)
 /// starty - y start position of simulation
 /// integrals - the number of sub-slices used to build the full 3d potential
+/// atx, aty, atz, atZ - local memory for a tile of the atoms (each tile_size long)
+/// tile_size - the number of atoms loaded into local memory at once (see SimulationGeneral::initialisePotentialLaunch)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /// Projected potential functions
 /// The lobato paper (10.1107/S205327331401643X) gives a good overview of these parameters. Kirkland's book 2nd ed. has
@@ -133,6 +135,58 @@ double peng(__constant double* params, int i_lim, int ZNum, double rad) {
     return 266.5157269 * sum;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Specialisation
+/// The host can fix some of the arguments when building this kernel (see SimulationGeneral::potentialDefines) so
+/// the compiler can unroll the loops and remove the unused paths. The arguments are used for anything not defined.
+/// FIXED_WIDTH, FIXED_HEIGHT - width and height
+/// FIXED_PARAM_FORM - param_selector (0 is kirkland, 1 is peng and 2 is lobato)
+/// FIXED_PARAM_COUNT - param_i_count
+/// FIXED_BLOCK_LOAD_X, FIXED_BLOCK_LOAD_Y, FIXED_SLICE_LOAD_Z - block_load_x, block_load_y and slice_load_z
+/// FIXED_INTEGRALS - integrals
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef FIXED_WIDTH
+#define WIDTH FIXED_WIDTH
+#else
+#define WIDTH width
+#endif
+#ifdef FIXED_HEIGHT
+#define HEIGHT FIXED_HEIGHT
+#else
+#define HEIGHT height
+#endif
+#ifdef FIXED_PARAM_FORM
+#define PARAM_FORM FIXED_PARAM_FORM
+#else
+#define PARAM_FORM param_selector
+#endif
+#ifdef FIXED_PARAM_COUNT
+#define PARAM_COUNT FIXED_PARAM_COUNT
+#else
+#define PARAM_COUNT param_i_count
+#endif
+#ifdef FIXED_BLOCK_LOAD_X
+#define BLOCK_LOAD_X FIXED_BLOCK_LOAD_X
+#else
+#define BLOCK_LOAD_X block_load_x
+#endif
+#ifdef FIXED_BLOCK_LOAD_Y
+#define BLOCK_LOAD_Y FIXED_BLOCK_LOAD_Y
+#else
+#define BLOCK_LOAD_Y block_load_y
+#endif
+#ifdef FIXED_SLICE_LOAD_Z
+#define SLICE_LOAD_Z FIXED_SLICE_LOAD_Z
+#else
+#define SLICE_LOAD_Z slice_load_z
+#endif
+#ifdef FIXED_INTEGRALS
+#define INTEGRALS FIXED_INTEGRALS
+#else
+#define INTEGRALS integrals
+#endif
+
 __kernel void transmission_potentials_full_3d_d( __global double2* potential,
 										         __global const double* restrict pos_x,
 										         __global const double* restrict pos_y,
@@ -163,19 +217,25 @@ __kernel void transmission_potentials_full_3d_d( __global double2* potential,
                                                  double current_z,
                                                  double slice_shift_x,
                                                  double slice_shift_y,
-                                                 int integrals)
+                                                 int integrals,
+                                                 __local double* atx,
+                                                 __local double* aty,
+                                                 __local double* atz,
+                                                 __local int* atZ,
+                                                 int tile_size)
 {
 	int xid = get_global_id(0);
 	int yid = get_global_id(1);
 	int lid = get_local_id(0) + get_local_size(0)*get_local_id(1);
-	int id = xid + width * yid;
+	int group_items = get_local_size(0) * get_local_size(1);
+	int id = xid + WIDTH * yid;
 	double sumz = 0.0;
 	int gx = get_group_id(0);
 	int gy = get_group_id(1);
 
-    int topz = current_slice - slice_load_z;
-    int bottomz = current_slice + slice_load_z;
-    double int_r = native_recip(integrals);
+    int topz = current_slice - SLICE_LOAD_Z;
+    int bottomz = current_slice + SLICE_LOAD_Z;
+    double int_r = native_recip(INTEGRALS);
     double sub_slice_thickness = dz * int_r;
 
 	if(topz < 0 )
@@ -183,11 +243,6 @@ __kernel void transmission_potentials_full_3d_d( __global double2* potential,
 	if(bottomz >= total_slices )
 		bottomz = total_slices - 1;
 
-	__local double atx[256];
-	__local double aty[256];
-	__local double atz[256];
-	__local int atZ[256];
-
 	// calculate the indices of the bins we will need
     // get the size of one workgroup
     double group_size_x = get_local_size(0) * pixel_scale;
@@ -204,10 +259,10 @@ __kernel void transmission_potentials_full_3d_d( __global double2* potential,
     double recip_range_x = native_recip(max_x - min_x);
     double recip_range_y = native_recip(max_y - min_y);
 
-    int starti = fmax(floor( blocks_x * (group_start_x - min_x) * recip_range_x) - block_load_x, 0);
-    int endi   = fmin( ceil( blocks_x * (group_end_x   - min_x) * recip_range_x) + block_load_x, blocks_x - 1);
-    int startj = fmax(floor( blocks_y * (group_start_y - min_y) * recip_range_y) - block_load_y, 0);
-    int endj   = fmin( ceil( blocks_y * (group_end_y   - min_y) * recip_range_y) + block_load_y, blocks_y - 1);
+    int starti = fmax(floor( blocks_x * (group_start_x - min_x) * recip_range_x) - BLOCK_LOAD_X, 0);
+    int endi   = fmin( ceil( blocks_x * (group_end_x   - min_x) * recip_range_x) + BLOCK_LOAD_X, blocks_x - 1);
+    int startj = fmax(floor( blocks_y * (group_start_y - min_y) * recip_range_y) - BLOCK_LOAD_Y, 0);
+    int endj   = fmin( ceil( blocks_y * (group_end_y   - min_y) * recip_range_y) + BLOCK_LOAD_Y, blocks_y - 1);
 
 	for(int k = topz; k <= bottomz; k++) {
 		for (int j = startj ; j <= endj; j++) {
@@ -215,75 +270,77 @@ __kernel void transmission_potentials_full_3d_d( __global double2* potential,
 			int start = block_start_pos[k*blocks_x*blocks_y + blocks_x*j + starti  ];
 			int end   = block_start_pos[k*blocks_x*blocks_y + blocks_x*j + endi + 1];
 
-			int gid = start + lid;
-
-			if(lid < end-start) {
-				atx[lid] = pos_x[gid];
-				aty[lid] = pos_y[gid];
-				atz[lid] = pos_z[gid];
-				atZ[lid] = atomic_num[gid];
-			}
-
-			barrier(CLK_LOCAL_MEM_FENCE);
-
-			double p2 = 0.0;
-
-			for (int l = 0; l < end-start; l++) {
-				// calculate the radius from the current position in space (i.e. pixel?)
-                double im_pos_x = startx + xid * pixel_scale;
-                double rad_x = im_pos_x - atx[l];
-
-                double im_pos_y = starty + yid * pixel_scale;
-                double rad_y = im_pos_y - aty[l];
-
-				for (int h = 0; h <= integrals; h++) {
-					// not sure how the integrals work here (integrals = integrals)
-					// I think we are generating multiple subslices for each slice (nut not propagating through them,
-					// just building our single slice potential from them
-
-                    // account for shift due to beam tilt
-                    rad_x -= slice_shift_x;
-                    rad_y -= slice_shift_y;
-
-                    double xyrad2 = rad_x*rad_x + rad_y*rad_y;
-
-					// current_z is the slice position, h is the 'sub' integral, dz is the slice thickness and int_r is 1/integrals
-                    // so basically this gets our exact z position...
-                    double im_pos_z = current_z - h * dz * int_r;
-                    double rad_z = im_pos_z - atz[l];
-
-                    double rad = native_sqrt(xyrad2 + rad_z*rad_z);
-
-					double r_min = 0.25 * pixel_scale;
-                    if(rad < r_min) // avoid singularity at 0 (value used by kirkland)
-                        rad = r_min;
-
-					double p1 = 0.0;
-
-					if(xyrad2 <= 64.0 && rad_z <= 3.0) {
-    					double p1;
-
-    					if (param_selector == 0)
-    					    p1 = kirkland(params, param_i_count, atZ[l], rad);
-                        else if (param_selector == 1)
-                            p1 = peng(params, param_i_count, atZ[l], rad);
-                        else if (param_selector == 2)
-                            p1 = lobato(params, param_i_count, atZ[l], rad);
-
-    					// Q: why make sure h!=0 when we can just remove it from the loop?
-                        // A: because p1 is used in the next iteration (why it is set to p2)
-                        // note that the sub slice thickness is included in the final sin/cos
-    					sumz += (h != 0) * (p1 + p2) * 0.5;
-    					p2 = p1;
-					}
-				}
-			}
-
-			barrier(CLK_LOCAL_MEM_FENCE);
+            // the atoms are loaded (in parallel over the work group) in tiles that fit in the local memory
+            for (int tile_start = start; tile_start < end; tile_start += tile_size) {
+                int tile_count = min(end - tile_start, tile_size);
+                for (int i = lid; i < tile_count; i += group_items) {
+                    atx[i] = pos_x[tile_start + i];
+                    aty[i] = pos_y[tile_start + i];
+                    atz[i] = pos_z[tile_start + i];
+                    atZ[i] = atomic_num[tile_start + i];
+                }
+
+                barrier(CLK_LOCAL_MEM_FENCE);
+
+                double p2 = 0.0;
+
+                for (int l = 0; l < tile_count; l++) {
+                    // calculate the radius from the current position in space (i.e. pixel?)
+                    double im_pos_x = startx + xid * pixel_scale;
+                    double rad_x = im_pos_x - atx[l];
+
+                    double im_pos_y = starty + yid * pixel_scale;
+                    double rad_y = im_pos_y - aty[l];
+
+                    for (int h = 0; h <= INTEGRALS; h++) {
+                        // not sure how the integrals work here (integrals = integrals)
+                        // I think we are generating multiple subslices for each slice (nut not propagating through them,
+                        // just building our single slice potential from them
+
+                        // account for shift due to beam tilt
+                        rad_x -= slice_shift_x;
+                        rad_y -= slice_shift_y;
+
+                        double xyrad2 = rad_x*rad_x + rad_y*rad_y;
+
+                        // current_z is the slice position, h is the 'sub' integral, dz is the slice thickness and int_r is 1/integrals
+                        // so basically this gets our exact z position...
+                        double im_pos_z = current_z - h * dz * int_r;
+                        double rad_z = im_pos_z - atz[l];
+
+                        double rad = native_sqrt(xyrad2 + rad_z*rad_z);
+
+                        double r_min = 0.25 * pixel_scale;
+                        if(rad < r_min) // avoid singularity at 0 (value used by kirkland)
+                            rad = r_min;
+
+                        double p1 = 0.0;
+
+                        if(xyrad2 <= 64.0 && rad_z <= 3.0) {
+                            double p1;
+
+                            if (PARAM_FORM == 0)
+                                p1 = kirkland(params, PARAM_COUNT, atZ[l], rad);
+                            else if (PARAM_FORM == 1)
+                                p1 = peng(params, PARAM_COUNT, atZ[l], rad);
+                            else if (PARAM_FORM == 2)
+                                p1 = lobato(params, PARAM_COUNT, atZ[l], rad);
+
+                            // Q: why make sure h!=0 when we can just remove it from the loop?
+                            // A: because p1 is used in the next iteration (why it is set to p2)
+                            // note that the sub slice thickness is included in the final sin/cos
+                            sumz += (h != 0) * (p1 + p2) * 0.5;
+                            p2 = p1;
+                        }
+                    }
+                }
+
+                barrier(CLK_LOCAL_MEM_FENCE);
+            }
 		}
 	}
 
-	if(xid < width && yid < height) {
+	if(xid < WIDTH && yid < HEIGHT) {
 		potential[id].x = native_cos(sub_slice_thickness * sigma * sumz);
 		potential[id].y = native_sin(sub_slice_thickness * sigma * sumz);
 	}
@@ -7,6 +7,8 @@
 #include <utilities/fileio.h>
 #include <utilities/jsonutils.h>
 #include <utilities/simutils.h>
+#include <utilities/chunkedfile.h>
+#include <utilities/deviceprofiles.h>
 
 #include "getopt.h"
 #include "parseopencl.h"
@@ -34,6 +36,9 @@ namespace fs = std::filesystem;
 
 static std::string out_path;
 
+// all the images are saved to this one file (if it is null, they are saved as separate .tif files)
+static std::shared_ptr<fileio::ChunkedFileWriter> out_file;
+
 static std::mutex out_mtx;
 
 static int total_pcnt;
@@ -53,6 +58,8 @@ void printHelp()
                  "             finite-maths     : disregard NaNs and infinities\n"
                  "             native-functions : use (often) faster but less accurate native functions\n"
                  "    -o : (--output) REQUIRED set the output directory for the simulation results\n"
+                 "    --tiff : save each image (and each slice of it) as a .tif file with a .json of the settings,\n"
+                 "             instead of all of them in one output.cltc file\n"
                  "    -c : (--config) REQUIRED set the .json config file for the simulation\n"
                  "    -d : (--device) REQUIRED set the OpenCL device(s). Options are:\n"
                  "             default : uses the default OpenCL device(s)\n"
@@ -62,6 +69,19 @@ void printHelp()
                  "             gpu     : use the first gpu available\n"
                  "             cpu     : use the first cpu available\n"
                  "             #:#     : comma separated list in for format platform:device (ids)\n"
+                 "             native  : run on the host CPU without OpenCL (can be native:# to set the thread\n"
+                 "                       count, and can be part of the comma separated list)\n"
+                 "    --stem-4d : save the diffraction pattern of every STEM probe to this file (the other 4D-STEM\n"
+                 "                settings are from the config file, if 4D-STEM is enabled there with no file, the\n"
+                 "                patterns are saved to 4dstem.cltc in the output directory)\n"
+                 "    --profile : record the OpenCL timing of every kernel, FFT and transfer and save it to this file\n"
+                 "                as a Chrome trace (open in chrome://tracing or Perfetto), a summary is also printed\n"
+                 "    --kernel-cache : directory to save the compiled OpenCL kernels in (so they are not compiled every\n"
+                 "                     time), defaults to kernel_cache in the clTEM data directory, 'none' disables it\n"
+                 "    --device-profiles : directory to save the tuned work group sizes of each device in, defaults to\n"
+                 "                        device_profiles in the clTEM data directory, 'none' disables the tuning\n"
+                 "    --phonon-seed : the seed for the frozen phonon displacements (so the configurations can be\n"
+                 "                    reproduced), overrides the config file, a random one is used if neither sets it\n"
                  "    --debug : show full debug output\n"
                  "  .cif only options:\n"
                  "    -s : (--size) REQUIRED the size of the supercell (x,y,z values separated by commas)\n"
@@ -185,10 +205,24 @@ void saveTiffOutput(std::string filename, Image<double> im, nlohmann::json j_set
     }
 }
 
-void imageReturned(SimulationManager sm)
-{
-    nlohmann::json settings = JSONUtils::BasicManagerToJson(sm, false, true);
-    settings["filename"] = sm.simulationCell()->crystalStructure()->fileName();
+void saveContainerOutput(const std::string &name, Image<double> im, const nlohmann::json &j_settings) {
+    unsigned int w = im.getWidth();
+    unsigned int h = im.getHeight();
+    unsigned int d = im.getDepth();
+
+    // each slice is a chunk, these are compressed and written to the disk on the writer's thread
+    auto id = out_file->addDataset(name, {d, h, w}, {1, h, w}, true, j_settings.dump());
+    for (unsigned int i = 0; i < d; ++i) {
+        auto slice = im.getWeightedSlice(i, false);
+        out_file->writeChunk(id, {i, 0, 0}, std::vector<float>(slice.begin(), slice.end()));
+    }
+}
+
+void saveOutput(const std::string &name, Image<double> im, const nlohmann::json &j_settings) {
+    if (out_file) {
+        saveContainerOutput(name, im, j_settings);
+        return;
+    }
 
 #ifdef _WIN32
     std::wstring w_sep(&fs::path::preferred_separator);
@@ -197,6 +231,26 @@ void imageReturned(SimulationManager sm)
     std::string sep = &fs::path::preferred_separator;
 #endif
 
+    std::string out_name = out_path + sep + name;
+    fileio::SaveSettingsJson(out_name + ".json", j_settings);
+    saveTiffOutput(out_name, im, j_settings);
+}
+
+void imageReturned(SimulationManager sm)
+{
+    nlohmann::json settings = JSONUtils::BasicManagerToJson(sm, false, true);
+    settings["filename"] = sm.simulationCell()->crystalStructure()->fileName();
+
+    // the settings common to all the images (each image also has its own)
+    if (out_file) {
+        try {
+            out_file->writeMetadata(settings.dump(4));
+        } catch (std::runtime_error &e) {
+            std::cout << "Error saving settings: " << e.what() << std::endl;
+            CLOG(ERROR, "cmd") << "Could not save settings: " << e.what();
+        }
+    }
+
     auto ims = sm.images();
 
     // save the images....
@@ -214,7 +268,7 @@ void imageReturned(SimulationManager sm)
             settings["microscope"].erase("delta");
             settings["microscope"].erase("objective aperture");
         }
-        else if (name == "Image") {
+        else if (name == "Image" || name == "Image realisations") {
             // Nothing to do here?
         }
         else {
@@ -226,8 +280,6 @@ void imageReturned(SimulationManager sm)
             settings["microscope"].erase("delta");
         }
 
-        std::string out_name = out_path + sep + name;
-
         try {
             if (name == "EW") { // save amplitude and phase
                 if (im.getSliceSize() % 2 != 0)
@@ -246,14 +298,10 @@ void imageReturned(SimulationManager sm)
                     }
 
 
-                fileio::SaveSettingsJson(out_name + "_amplitude.json", settings);
-                fileio::SaveSettingsJson(out_name + "_phase.json", settings);
-
-                saveTiffOutput(out_name+"_amplitude", abs, settings);
-                saveTiffOutput(out_name+"_phase", arg, settings);
+                saveOutput(name + "_amplitude", abs, settings);
+                saveOutput(name + "_phase", arg, settings);
             } else {
-                fileio::SaveSettingsJson(out_name + ".json", settings);
-                saveTiffOutput(out_name, im, settings);
+                saveOutput(name, im, settings);
             }
         } catch (std::runtime_error &e) {
             std::cout << "Error saving image: " << e.what() << std::endl;
@@ -266,6 +314,7 @@ int main(int argc, char *argv[])
 {
     int verbose_flag = 0;
     int fix_cif = 0;
+    int tiff_flag = 0;
     total_pcnt = 0;
     slice_pcnt = 0;
     int c;
@@ -278,7 +327,7 @@ int main(int argc, char *argv[])
 
     std::vector<std::string> non_option_args;
 
-    std::string size_arg, zone_arg, normal_arg, tilt_arg, flag_arg;
+    std::string size_arg, zone_arg, normal_arg, tilt_arg, flag_arg, stem_4d_arg, profile_arg, kernel_cache_arg, device_profiles_arg, phonon_seed_arg;
 
     while (true)
     {
@@ -296,6 +345,12 @@ int main(int argc, char *argv[])
                         {"normal",   required_argument, nullptr,       'n'},
                         {"tilts",   required_argument, nullptr,       't'},
                         {"fix",   no_argument, &fix_cif,       1},
+                        {"tiff",   no_argument, &tiff_flag,       1},
+                        {"stem-4d",   required_argument, nullptr,       'D'},
+                        {"profile",   required_argument, nullptr,       'P'},
+                        {"kernel-cache",   required_argument, nullptr,       'K'},
+                        {"device-profiles",   required_argument, nullptr,       'T'},
+                        {"phonon-seed",   required_argument, nullptr,       'S'},
                         {"debug",  no_argument,       &verbose_flag, 1},
                         {nullptr, 0, nullptr, 0}
                 };
@@ -344,6 +399,21 @@ int main(int argc, char *argv[])
             case 't':
                 tilt_arg = optarg;
                 break;
+            case 'D':
+                stem_4d_arg = optarg;
+                break;
+            case 'P':
+                profile_arg = optarg;
+                break;
+            case 'K':
+                kernel_cache_arg = optarg;
+                break;
+            case 'T':
+                device_profiles_arg = optarg;
+                break;
+            case 'S':
+                phonon_seed_arg = optarg;
+                break;
             case '?':
                 // getopt_long already printed an error message.
                 break;
@@ -480,14 +550,17 @@ int main(int argc, char *argv[])
     std::string sep = &fs::path::preferred_separator;
 #endif
 
-    if (verbose_flag) {
 #ifdef _WIN32 // windows
-        std::string appdata_loc = std::string(std::getenv("LOCALAPPDATA")) + sep + "PetersSoft" + sep + "clTEM";
+    const char* appdata_env = std::getenv("LOCALAPPDATA");
+    std::string appdata_loc = appdata_env ? std::string(appdata_env) + sep + "PetersSoft" + sep + "clTEM" : "";
 #else // I only support linux (no apple stuff)
-        // I think I am fine 'hard coding' the .config location
-        std::string appdata_loc = std::string(std::getenv("HOME")) + sep + ".local" + sep + "share" + sep + "PetersSoft" + sep + "clTEM";
+    // I think I am fine 'hard coding' the .config location
+    const char* appdata_env = std::getenv("HOME");
+    std::string appdata_loc = appdata_env ? std::string(appdata_env) + sep + ".local" + sep + "share" + sep + "PetersSoft" + sep + "clTEM" : "";
 #endif
 
+    if (verbose_flag) {
+
         // Get a writable location to save the log file
         std::string log_dir = appdata_loc + sep + "log.log";
 
@@ -589,6 +662,18 @@ int main(int argc, char *argv[])
 
     KernelSource::setOptions(enable_mad, no_signed_zeros, unsafe_maths, finite_maths, native_functions);
 
+    // the compiled kernels are saved so they don't need compiling every time
+    if (kernel_cache_arg.empty() && !appdata_loc.empty())
+        kernel_cache_arg = appdata_loc + sep + "kernel_cache";
+    if (kernel_cache_arg != "none")
+        clBinaryCache::setDirectory(kernel_cache_arg);
+
+    // the work group sizes are tuned the first time each kernel is used on a device, and saved for next time
+    if (device_profiles_arg.empty() && !appdata_loc.empty())
+        device_profiles_arg = appdata_loc + sep + "device_profiles";
+    if (device_profiles_arg != "none")
+        DeviceProfiles::getInstance().setDirectory(device_profiles_arg);
+
     // read the config file in
     nlohmann::json j;
 
@@ -654,6 +739,25 @@ int main(int argc, char *argv[])
         std::cout << "Successfully created folder" << std::endl;
     }
 
+    if (!phonon_seed_arg.empty()) {
+        try {
+            man_ptr->incoherenceEffects()->phonons()->setSeed(std::stoull(phonon_seed_arg));
+        } catch (std::logic_error& e) {
+            std::cerr << "Could not parse phonon seed: " << phonon_seed_arg << std::endl;
+            return 1;
+        }
+    }
+
+    // 4D-STEM output file
+    if (!stem_4d_arg.empty()) {
+        man_ptr->setStem4D(true);
+        man_ptr->setStem4DPath(stem_4d_arg);
+    } else if (man_ptr->stem4DEnabled() && man_ptr->stem4DPath().empty())
+        man_ptr->setStem4DPath(output_dir + sep + "4dstem.cltc");
+
+    if (man_ptr->stem4DEnabled())
+        std::cout << "4D-STEM file: " << man_ptr->stem4DPath() << std::endl;
+
     // load external sources
 
     std::string exe_path_string;
@@ -725,7 +829,6 @@ int main(int argc, char *argv[])
     std::string kernel_path = exe_path_string + sep + "kernels";
 
     if (man_ptr->doublePrecisionEnabled()) {
-        Kernels::atom_sort_d = Utils::resourceToChar(kernel_path, "atom_sort_d.cl");
         Kernels::band_limit_d = Utils::resourceToChar(kernel_path, "band_limit_d.cl");
         Kernels::band_pass_d = Utils::resourceToChar(kernel_path, "band_pass_d.cl");
         Kernels::ccd_dqe_d = Utils::resourceToChar(kernel_path, "ccd_dqe_d.cl");
@@ -742,8 +845,17 @@ int main(int argc, char *argv[])
         Kernels::sum_reduction_d = Utils::resourceToChar(kernel_path, "sum_reduction_d.cl");
         Kernels::bilinear_translate_d = Utils::resourceToChar(kernel_path, "bilinear_translate_d.cl");
         Kernels::complex_to_real_d = Utils::resourceToChar(kernel_path, "complex_to_real_d.cl");
+        Kernels::propagator_callback_d = Utils::resourceToChar(kernel_path, "propagator_callback_d.cl");
+        Kernels::stem_detectors_d = Utils::resourceToChar(kernel_path, "stem_detectors_d.cl");
+        Kernels::potential_deposit_d = Utils::resourceToChar(kernel_path, "potential_deposit_d.cl");
+        Kernels::potential_structure_factors_d = Utils::resourceToChar(kernel_path, "potential_structure_factors_d.cl");
+        Kernels::potential_transmission_d = Utils::resourceToChar(kernel_path, "potential_transmission_d.cl");
+        Kernels::prism_probes_d = Utils::resourceToChar(kernel_path, "prism_probes_d.cl");
+        Kernels::diffraction_pattern_d = Utils::resourceToChar(kernel_path, "diffraction_pattern_d.cl");
+        Kernels::phonon_displace_d = Utils::resourceToChar(kernel_path, "phonon_displace_d.cl");
+        Kernels::accumulate_d = Utils::resourceToChar(kernel_path, "accumulate_d.cl");
+        Kernels::poisson_noise_d = Utils::resourceToChar(kernel_path, "poisson_noise_d.cl");
     } else {
-        Kernels::atom_sort_f = Utils::resourceToChar(kernel_path, "atom_sort_f.cl");
         Kernels::band_limit_f = Utils::resourceToChar(kernel_path, "band_limit_f.cl");
         Kernels::band_pass_f = Utils::resourceToChar(kernel_path, "band_pass_f.cl");
         Kernels::ccd_dqe_f = Utils::resourceToChar(kernel_path, "ccd_dqe_f.cl");
@@ -760,6 +872,16 @@ int main(int argc, char *argv[])
         Kernels::sum_reduction_f = Utils::resourceToChar(kernel_path, "sum_reduction_f.cl");
         Kernels::bilinear_translate_f = Utils::resourceToChar(kernel_path, "bilinear_translate_f.cl");
         Kernels::complex_to_real_f = Utils::resourceToChar(kernel_path, "complex_to_real_f.cl");
+        Kernels::propagator_callback_f = Utils::resourceToChar(kernel_path, "propagator_callback_f.cl");
+        Kernels::stem_detectors_f = Utils::resourceToChar(kernel_path, "stem_detectors_f.cl");
+        Kernels::potential_deposit_f = Utils::resourceToChar(kernel_path, "potential_deposit_f.cl");
+        Kernels::potential_structure_factors_f = Utils::resourceToChar(kernel_path, "potential_structure_factors_f.cl");
+        Kernels::potential_transmission_f = Utils::resourceToChar(kernel_path, "potential_transmission_f.cl");
+        Kernels::prism_probes_f = Utils::resourceToChar(kernel_path, "prism_probes_f.cl");
+        Kernels::diffraction_pattern_f = Utils::resourceToChar(kernel_path, "diffraction_pattern_f.cl");
+        Kernels::phonon_displace_f = Utils::resourceToChar(kernel_path, "phonon_displace_f.cl");
+        Kernels::accumulate_f = Utils::resourceToChar(kernel_path, "accumulate_f.cl");
+        Kernels::poisson_noise_f = Utils::resourceToChar(kernel_path, "poisson_noise_f.cl");
     }
 
     auto ccd_name = man_ptr->ccdName();
@@ -775,13 +897,55 @@ int main(int argc, char *argv[])
     // global because I am lazy (or smart?)
     out_path = output_dir;
 
+    if (!tiff_flag) {
+        std::string out_file_path = output_dir + sep + "output.cltc";
+        std::cout << "Output file: " << out_file_path << std::endl;
+        try {
+            out_file = std::make_shared<fileio::ChunkedFileWriter>();
+            out_file->open(out_file_path);
+        } catch (const std::runtime_error &e) {
+            std::cout << "Error opening output file: " << e.what() << std::endl;
+            CLOG(ERROR, "cmd") << "Could not open output file: " << e.what();
+            return 1;
+        }
+    }
+
     std::vector<std::shared_ptr<SimulationManager>> man_list;
 
     man_list.emplace_back(man_ptr);
 
+    // this has to be before the simulation contexts are made
+    if (!profile_arg.empty())
+        clProfiler::setEnabled(true);
+
     auto simRunner = std::make_shared<SimulationRunner>(man_list, device_list, man_ptr->doublePrecisionEnabled());
 
     simRunner->runSimulations();
 
+    // wait for everything to be written
+    if (out_file) {
+        try {
+            out_file->close();
+        } catch (const std::runtime_error &e) {
+            std::cout << "Error saving output file: " << e.what() << std::endl;
+            CLOG(ERROR, "cmd") << "Could not save output file: " << e.what();
+            return 1;
+        }
+    }
+
+    if (!profile_arg.empty()) {
+        try {
+            clProfiler::saveChromeTrace(profile_arg);
+            std::cout << "Profile saved to: " << profile_arg << std::endl;
+            std::cout << clProfiler::summary() << std::endl;
+            if (clProfiler::droppedRecords() > 0)
+                CLOG(WARNING, "cmd") << "Profile is incomplete, " << clProfiler::droppedRecords()
+                                     << " commands were not recorded (the limit is " << clProfiler::max_records << ")";
+        } catch (const std::runtime_error &e) {
+            std::cout << "Error saving profile: " << e.what() << std::endl;
+            CLOG(ERROR, "cmd") << "Could not save profile: " << e.what();
+        }
+    }
+
     return 0;
 }
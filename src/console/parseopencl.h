@@ -6,6 +6,8 @@
 #define CLTEM_GUI_PARSEOPENCL_H
 
 #include <clwrapper/cldevice.h>
+#include <algorithm>
+#include <thread>
 #include <vector>
 #include <sstream>
 
@@ -67,13 +69,51 @@ std::vector<clDevice> getDevices(std::string d_str)
             parts.emplace_back( substr );
         }
 
-        std::vector<clDevice> dev_all = OpenCL::GetDeviceList(Device::DeviceType::All);
-
-        if (dev_all.size() < 1)
-            throw std::runtime_error("Could not get OpenCL devices to choose from");
+        // only get the OpenCL devices if we need them (so the native backend works without any OpenCL devices)
+        std::vector<clDevice> dev_all;
 
         for (auto& p : parts)
         {
+            // the native backend is given as native or native:# (the number of threads, default is all of them)
+            if (p.rfind("native", 0) == 0)
+            {
+                unsigned int n_threads = 0;
+                bool valid = true;
+
+                if (p.size() > 6) {
+                    try {
+                        if (p[6] != ':')
+                            throw std::invalid_argument(p);
+                        int n = std::stoi(p.substr(7));
+                        if (n <= 0)
+                            throw std::invalid_argument(p);
+                        n_threads = static_cast<unsigned int>(n);
+                    } catch (std::logic_error& e) {
+                        valid = false;
+                    }
+                }
+
+                // more threads than this won't help (and a typo could ask for millions)
+                unsigned int max_threads = 4 * std::max(std::thread::hardware_concurrency(), 1u);
+                if (valid && n_threads > max_threads) {
+                    std::cout << "Native device " << p << " has too many threads, using " << max_threads << std::endl;
+                    n_threads = max_threads;
+                }
+
+                if (valid)
+                    devices.emplace_back(clDevice::Native(n_threads));
+                else
+                    std::cout << "Could not parse native device identifier: " << p << ". Ignoring it..." << std::endl;
+                continue;
+            }
+
+            if (dev_all.empty()) {
+                dev_all = OpenCL::GetDeviceList(Device::DeviceType::All);
+
+                if (dev_all.size() < 1)
+                    throw std::runtime_error("Could not get OpenCL devices to choose from");
+            }
+
             std::stringstream pss(p);
             int pid = -1;
             int did = -1;
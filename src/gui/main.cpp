@@ -9,6 +9,7 @@
 #include <QtCore/QStandardPaths>
 #include <QtCore/QDir>
 #include "utilities/logging.h"
+#include "utilities/deviceprofiles.h"
 
 #ifdef _WIN32
     #include <theme/thememanager.h>
@@ -81,6 +82,14 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // save the compiled kernels so they don't need compiling every time
+    auto kernel_cache_dir = QDir::cleanPath(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QDir::separator() + QString("kernel_cache"));
+    clBinaryCache::setDirectory(kernel_cache_dir.toStdString());
+
+    // the tuned work group sizes for each device
+    auto profiles_dir = QDir::cleanPath(QStandardPaths::writableLocation(QStandardPaths::DataLocation) + QDir::separator() + QString("device_profiles"));
+    DeviceProfiles::getInstance().setDirectory(profiles_dir.toStdString());
+
 #ifdef _WIN32
 
     if (!settings.contains("theme"))
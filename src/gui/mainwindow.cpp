@@ -405,6 +405,9 @@ void MainWindow::on_actionSimulate_EW_triggered()
 
     auto temp = std::make_shared<SimulationManager>(*Manager);
 
+    // there is no tab to show the dose realisations in, so don't make them (they can still be made from the console)
+    temp->setDoseRealisations(1);
+
     man_list.push_back(temp);
 
     std::vector<clDevice> &d = Devices;
@@ -626,7 +629,6 @@ void MainWindow::cancel_simulation()
 void MainWindow::loadExternalSources()
 {
     // Populate the kernels from files...
-    Kernels::atom_sort_f = Utils_Qt::kernelToChar("atom_sort_f.cl");
     Kernels::band_limit_f = Utils_Qt::kernelToChar("band_limit_f.cl");
     Kernels::band_pass_f = Utils_Qt::kernelToChar("band_pass_f.cl");
     Kernels::ccd_dqe_f = Utils_Qt::kernelToChar("ccd_dqe_f.cl");
@@ -643,8 +645,17 @@ void MainWindow::loadExternalSources()
     Kernels::sum_reduction_f = Utils_Qt::kernelToChar("sum_reduction_f.cl");
     Kernels::bilinear_translate_f = Utils_Qt::kernelToChar("bilinear_translate_f.cl");
     Kernels::complex_to_real_f = Utils_Qt::kernelToChar("complex_to_real_f.cl");
+    Kernels::propagator_callback_f = Utils_Qt::kernelToChar("propagator_callback_f.cl");
+    Kernels::stem_detectors_f = Utils_Qt::kernelToChar("stem_detectors_f.cl");
+    Kernels::potential_deposit_f = Utils_Qt::kernelToChar("potential_deposit_f.cl");
+    Kernels::potential_structure_factors_f = Utils_Qt::kernelToChar("potential_structure_factors_f.cl");
+    Kernels::potential_transmission_f = Utils_Qt::kernelToChar("potential_transmission_f.cl");
+    Kernels::prism_probes_f = Utils_Qt::kernelToChar("prism_probes_f.cl");
+    Kernels::diffraction_pattern_f = Utils_Qt::kernelToChar("diffraction_pattern_f.cl");
+    Kernels::phonon_displace_f = Utils_Qt::kernelToChar("phonon_displace_f.cl");
+    Kernels::accumulate_f = Utils_Qt::kernelToChar("accumulate_f.cl");
+    Kernels::poisson_noise_f = Utils_Qt::kernelToChar("poisson_noise_f.cl");
 
-    Kernels::atom_sort_d = Utils_Qt::kernelToChar("atom_sort_d.cl");
     Kernels::band_limit_d = Utils_Qt::kernelToChar("band_limit_d.cl");
     Kernels::band_pass_d = Utils_Qt::kernelToChar("band_pass_d.cl");
     Kernels::ccd_dqe_d = Utils_Qt::kernelToChar("ccd_dqe_d.cl");
@@ -661,6 +672,16 @@ void MainWindow::loadExternalSources()
     Kernels::sum_reduction_d = Utils_Qt::kernelToChar("sum_reduction_d.cl");
     Kernels::bilinear_translate_d = Utils_Qt::kernelToChar("bilinear_translate_d.cl");
     Kernels::complex_to_real_d = Utils_Qt::kernelToChar("complex_to_real_d.cl");
+    Kernels::propagator_callback_d = Utils_Qt::kernelToChar("propagator_callback_d.cl");
+    Kernels::stem_detectors_d = Utils_Qt::kernelToChar("stem_detectors_d.cl");
+    Kernels::potential_deposit_d = Utils_Qt::kernelToChar("potential_deposit_d.cl");
+    Kernels::potential_structure_factors_d = Utils_Qt::kernelToChar("potential_structure_factors_d.cl");
+    Kernels::potential_transmission_d = Utils_Qt::kernelToChar("potential_transmission_d.cl");
+    Kernels::prism_probes_d = Utils_Qt::kernelToChar("prism_probes_d.cl");
+    Kernels::diffraction_pattern_d = Utils_Qt::kernelToChar("diffraction_pattern_d.cl");
+    Kernels::phonon_displace_d = Utils_Qt::kernelToChar("phonon_displace_d.cl");
+    Kernels::accumulate_d = Utils_Qt::kernelToChar("accumulate_d.cl");
+    Kernels::poisson_noise_d = Utils_Qt::kernelToChar("poisson_noise_d.cl");
 
     // load parameters
     // get all the files in the parameters folder
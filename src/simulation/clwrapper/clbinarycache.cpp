@@ -0,0 +1,176 @@
+#include "clbinarycache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
+
+std::mutex clBinaryCache::dir_mutex;
+std::string clBinaryCache::cache_dir;
+
+namespace {
+    const char cache_magic[4] = {'C', 'L', 'B', 'C'};
+    const uint32_t cache_version = 1;
+
+    uint64_t fnv1a(const std::string &s) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : s) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+}
+
+void clBinaryCache::setDirectory(const std::string &dir) {
+    std::lock_guard<std::mutex> lock(dir_mutex);
+    cache_dir = dir;
+}
+
+std::string clBinaryCache::directory() {
+    std::lock_guard<std::mutex> lock(dir_mutex);
+    return cache_dir;
+}
+
+std::string clBinaryCache::makeKey(clDevice &device, const std::string &source, const std::string &options) {
+    // the lengths are included so the parts can't run into each other
+    std::ostringstream key;
+    key << device.GetDeviceName().size() << ":" << device.GetDeviceName() << "\n"
+        << device.GetDriverVersion().size() << ":" << device.GetDriverVersion() << "\n"
+        << options.size() << ":" << options << "\n"
+        << source.size() << ":" << source;
+    return key.str();
+}
+
+std::string clBinaryCache::makePath(const std::string &dir, const std::string &name, const std::string &key) {
+    std::ostringstream file_name;
+    file_name << name << "_" << std::hex << std::setw(16) << std::setfill('0') << fnv1a(key) << ".clbin";
+    return (std::filesystem::path(dir) / file_name.str()).string();
+}
+
+bool clBinaryCache::loadBinary(const std::string &path, const std::string &key, std::vector<unsigned char> &binary) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open())
+        return false;
+
+    char magic[4];
+    uint32_t version;
+    uint64_t key_size;
+    f.read(magic, 4);
+    f.read(reinterpret_cast<char*>(&version), sizeof(version));
+    f.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+    if (!f || !std::equal(magic, magic + 4, cache_magic) || version != cache_version || key_size != key.size())
+        return false;
+
+    std::string file_key(key_size, '\0');
+    f.read(&file_key[0], key_size);
+    if (!f || file_key != key)
+        return false;
+
+    uint64_t binary_size;
+    f.read(reinterpret_cast<char*>(&binary_size), sizeof(binary_size));
+    if (!f || binary_size == 0)
+        return false;
+
+    binary.resize(binary_size);
+    f.read(reinterpret_cast<char*>(binary.data()), binary_size);
+    return static_cast<bool>(f);
+}
+
+void clBinaryCache::saveBinary(const std::string &path, const std::string &key, cl::Program &program) {
+    // the program is only ever built for the one device
+    size_t binary_size = 0;
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, nullptr) != CL_SUCCESS || binary_size == 0)
+        return;
+
+    std::vector<unsigned char> binary(binary_size);
+    unsigned char *binary_ptr = binary.data();
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary_ptr, nullptr) != CL_SUCCESS)
+        return;
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+    // write to a unique temporary file, then rename it so no one ever reads a partial file
+    std::random_device rd;
+    std::ostringstream temp_name;
+    temp_name << path << "." << std::hex << rd() << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+    std::string temp_path = temp_name.str();
+
+    {
+        std::ofstream f(temp_path, std::ios::binary);
+        if (!f.is_open())
+            return;
+
+        uint64_t key_size = key.size();
+        uint64_t size = binary_size;
+        f.write(cache_magic, 4);
+        f.write(reinterpret_cast<const char*>(&cache_version), sizeof(cache_version));
+        f.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+        f.write(key.data(), key_size);
+        f.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        f.write(reinterpret_cast<const char*>(binary.data()), binary_size);
+
+        if (!f) {
+            f.close();
+            std::remove(temp_path.c_str());
+            return;
+        }
+    }
+
+    // this can fail if another process has just done the same (i.e. on windows), their file is just as good
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec)
+        std::remove(temp_path.c_str());
+}
+
+cl::Program clBinaryCache::BuildProgram(clContext &context, const std::string &source, const std::string &name,
+                                        const std::string &options, cl_int &status, std::string &build_log) {
+    clDevice &device = context.GetContextDevice();
+    std::string dir = directory();
+
+    std::string key, path;
+    if (!dir.empty()) {
+        key = makeKey(device, source, options);
+        path = makePath(dir, name, key);
+
+        std::vector<unsigned char> binary;
+        if (loadBinary(path, key, binary)) {
+            cl_device_id device_id = device.getDevice()();
+            const unsigned char *binary_ptr = binary.data();
+            size_t binary_size = binary.size();
+            cl_int binary_status, create_status;
+
+            cl_program p = clCreateProgramWithBinary(context.GetContext()(), 1, &device_id, &binary_size, &binary_ptr,
+                                                     &binary_status, &create_status);
+
+            if (create_status == CL_SUCCESS) {
+                // this takes ownership of p
+                cl::Program program(p);
+                if (binary_status == CL_SUCCESS && program.build(options.c_str()) == CL_SUCCESS) {
+                    build_log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device.getDevice(), &status);
+                    return program;
+                }
+            }
+            // otherwise the binary is no good (i.e. the driver has changed in a way we can't tell), so rebuild it
+        }
+    }
+
+    cl::Program program(context.GetContext(), source, false, &status);
+    clError::Throw(status, name);
+    cl_int build_status = program.build(options.c_str());
+
+    build_log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device.getDevice(), &status);
+    if (build_status != CL_SUCCESS)
+        status = build_status;
+
+    if (status == CL_SUCCESS && !dir.empty())
+        saveBinary(path, key, program);
+
+    return program;
+}
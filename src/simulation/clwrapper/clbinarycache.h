@@ -0,0 +1,50 @@
+#ifndef CLWRAPPER_CLBINARYCACHE_H
+#define CLWRAPPER_CLBINARYCACHE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CL/cl.hpp"
+
+#include "clcontext.h"
+
+// Saves the compiled program binaries to disk so the same kernel doesn't have to be compiled from source for every
+// context (and every time the program is run).
+//
+// Each binary is keyed by the source (after any changes, i.e. removing the native functions), the build options and the
+// device name and driver version. The full key is stored with the binary and checked when it is loaded, so a mismatch
+// (or a binary the driver won't accept) just falls back to building from source, and the new binary replaces the old.
+//
+// Files are written to a temporary file and then renamed, so other processes (or threads) using the same directory only
+// ever see complete files.
+class clBinaryCache
+{
+public:
+    // an empty directory disables the cache (this is the default)
+    static void setDirectory(const std::string &dir);
+
+    static std::string directory();
+
+    static bool enabled() {return !directory().empty();}
+
+    // builds the program for the context's device, from the cache if possible. The status and build log are from the
+    // build that was used.
+    static cl::Program BuildProgram(clContext &context, const std::string &source, const std::string &name,
+                                    const std::string &options, cl_int &status, std::string &build_log);
+
+private:
+    static std::mutex dir_mutex;
+    static std::string cache_dir;
+
+    static std::string makeKey(clDevice &device, const std::string &source, const std::string &options);
+
+    static std::string makePath(const std::string &dir, const std::string &name, const std::string &key);
+
+    // returns false if the file doesn't exist or is for a different key
+    static bool loadBinary(const std::string &path, const std::string &key, std::vector<unsigned char> &binary);
+
+    static void saveBinary(const std::string &path, const std::string &key, cl::Program &program);
+};
+
+#endif //CLWRAPPER_CLBINARYCACHE_H
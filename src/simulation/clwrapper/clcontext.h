@@ -15,6 +15,7 @@
 #include "cldevice.h"
 #include "CL/cl.hpp"
 #include "notify.h"
+#include "clprofiler.h"
 
 template <class T, template <class> class AutoPolicy> class clMemory_impl;
 
@@ -22,7 +23,9 @@ enum MemoryFlags
 {
     ReadWrite = CL_MEM_READ_WRITE,
     ReadOnly = CL_MEM_READ_ONLY,
-    WriteOnly = CL_MEM_WRITE_ONLY
+    WriteOnly = CL_MEM_WRITE_ONLY,
+    // allocated where the host can map it without a copy (i.e. pinned memory), for staging results to be read back
+    HostReadWrite = CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR
 };
 
 class clContext
@@ -32,28 +35,43 @@ private:
     cl::Context Context;
     cl::CommandQueue Queue;
     cl::CommandQueue IOQueue;
+    // only made if it is used (see GetReadbackQueue)
+    cl::CommandQueue ReadbackQueue;
     clDevice ContextDevice;
 
+    // if the buffers are allocated in (and mapped from) the host memory
+    bool HostMemory;
+
     std::vector<std::weak_ptr<Notify>> MemList;
 
 public:
-    clContext() {}
+    clContext() : HostMemory(false) {}
 
     clContext(const cl::Context& _context, const cl::CommandQueue& _queue, clDevice _device)
-            : Context(_context), Queue(_queue), IOQueue(_queue), ContextDevice(std::move(_device)){}
+            : Context(_context), Queue(_queue), IOQueue(_queue), ContextDevice(std::move(_device)),
+              HostMemory(ContextDevice.HasHostUnifiedMemory()) {}
 
     clContext(const cl::Context& _context, const cl::CommandQueue& _queue, const cl::CommandQueue& _ioqueue, clDevice _device)
-            : Context(_context), Queue(_queue), IOQueue(_ioqueue), ContextDevice(std::move(_device)){}
+            : Context(_context), Queue(_queue), IOQueue(_ioqueue), ContextDevice(std::move(_device)),
+              HostMemory(ContextDevice.HasHostUnifiedMemory()) {}
 
     ~clContext() = default;
 
     void WaitForQueueFinish() {
+        bool profile = clProfiler::enabled();
+        auto start = profile ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
         int status = Queue.finish();
         clError::Throw(status);
+        if (profile)
+            clProfiler::recordHost("WaitForQueueFinish", "sync", ContextDevice, start, std::chrono::steady_clock::now());
     }
     void WaitForIOQueueFinish() {
+        bool profile = clProfiler::enabled();
+        auto start = profile ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
         int status = IOQueue.finish();
         clError::Throw(status);
+        if (profile)
+            clProfiler::recordHost("WaitForIOQueueFinish", "sync", ContextDevice, start, std::chrono::steady_clock::now());
     }
     void QueueFlush() {
         int status = Queue.flush();
@@ -65,10 +83,26 @@ public:
     }
 
     clDevice& GetContextDevice(){ return ContextDevice; }
+    bool UsesHostMemory(){ return HostMemory; }
     cl::Context& GetContext(){ return Context;}
     cl::CommandQueue& GetQueue(){ return Queue; }
     cl::CommandQueue& GetIOQueue(){ return IOQueue; }
 
+    // A separate queue for reading back results that have been staged (copied) on the other queues, so the reads don't
+    // wait behind the work queued after them. This can be used from another thread, but it is made on first use so
+    // that must happen on the thread that owns the context.
+    cl::CommandQueue& GetReadbackQueue() {
+        if (!ReadbackQueue()) {
+            cl_int status;
+            // keep the same properties so it is profiled the same way
+            auto properties = Queue.getInfo<CL_QUEUE_PROPERTIES>(&status);
+            clError::Throw(status, "Readback queue");
+            ReadbackQueue = cl::CommandQueue(Context, ContextDevice.getDevice(), properties, &status);
+            clError::Throw(status, "Readback queue");
+        }
+        return ReadbackQueue;
+    }
+
     cl_context& GetContextHandle(){ return Context();}
     cl_command_queue& GetQueueHandle(){ return Queue();}
     cl_command_queue& GetIOQueueHandle(){ return IOQueue();}
@@ -4,9 +4,82 @@
 
 #include "cldevice.h"
 
+#include <algorithm>
+#include <thread>
+
 Device::DeviceType clDevice::getDeviceType() {
+    if (native)
+        return Device::DeviceType::CPU;
+
     cl_int status;
     auto deviceType = static_cast<Device::DeviceType>(device.getInfo<CL_DEVICE_TYPE>(&status));
     clError::Throw(status, "clDevice");
     return deviceType;
-};
\ No newline at end of file
+};
+
+std::string clDevice::GetDriverVersion() {
+    if (native)
+        return "";
+
+    cl_int status;
+    auto version = device.getInfo<CL_DRIVER_VERSION>(&status);
+    clError::Throw(status, "clDevice");
+    return version;
+}
+
+size_t clDevice::GetMemBaseAddressAlign() {
+    if (native)
+        return 1;
+
+    cl_int status;
+    // this is given in bits
+    auto align = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>(&status);
+    clError::Throw(status, "clDevice");
+    return std::max<size_t>(align / 8, 1);
+}
+
+size_t clDevice::GetGlobalMemSize() {
+    if (native)
+        return 0;
+
+    cl_int status;
+    auto size = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>(&status);
+    clError::Throw(status, "clDevice");
+    return static_cast<size_t>(size);
+}
+
+size_t clDevice::GetLocalMemSize() {
+    if (native)
+        return 0;
+
+    cl_int status;
+    auto size = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>(&status);
+    clError::Throw(status, "clDevice");
+    return static_cast<size_t>(size);
+}
+
+bool clDevice::HasHostUnifiedMemory() {
+    // native devices don't use OpenCL buffers at all
+    if (native)
+        return false;
+
+    if (getDeviceType() & Device::DeviceType::CPU)
+        return true;
+
+    cl_int status;
+    auto unified = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>(&status);
+    clError::Throw(status, "clDevice");
+    return unified == CL_TRUE;
+}
+
+clDevice clDevice::Native(unsigned int threads) {
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    clDevice dev;
+    dev.native = true;
+    dev.native_threads = threads;
+    dev.platform_name = "Native";
+    dev.device_name = "Host CPU (" + std::to_string(threads) + " threads)";
+    return dev;
+}
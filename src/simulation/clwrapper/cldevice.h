@@ -34,10 +34,14 @@ private:
     std::string device_name;
     unsigned int device_number;
 
+    // native devices are not OpenCL devices, the simulation is run on the host using this many threads
+    bool native;
+    unsigned int native_threads;
+
 
 public:
-    clDevice() : device(nullptr) {};
-    clDevice(cl::Device _device, std::string _platform_name, unsigned int _platform_number, unsigned int _device_number) : device(_device), platform_name(_platform_name), platform_number(_platform_number), device_number(_device_number)  {
+    clDevice() : device(nullptr), platform_number(0), device_number(0), native(false), native_threads(0) {};
+    clDevice(cl::Device _device, std::string _platform_name, unsigned int _platform_number, unsigned int _device_number) : device(_device), platform_name(_platform_name), platform_number(_platform_number), device_number(_device_number), native(false), native_threads(0)  {
         cl_int status;
         device_name = device.getInfo<CL_DEVICE_NAME>(&status);
         clError::Throw(status, "clDevice");
@@ -51,6 +55,25 @@ public:
     unsigned int GetPlatformNumber(){ return (int) platform_number; };
     Device::DeviceType getDeviceType();
 
+    std::string GetDriverVersion();
+
+    // alignment (in bytes) that sub-buffer offsets need to be a multiple of
+    size_t GetMemBaseAddressAlign();
+
+    // total global memory (in bytes), 0 for native devices (they just use the host memory)
+    size_t GetGlobalMemSize();
+
+    // local memory available to each work group (in bytes)
+    size_t GetLocalMemSize();
+
+    // true if the device uses the host memory (CPUs and integrated GPUs), so buffers can be mapped instead of copied
+    bool HasHostUnifiedMemory();
+
+    // creates a device that runs the simulation on the host cpu (0 threads will use all available cores)
+    static clDevice Native(unsigned int threads = 0);
+    bool isNative(){ return native; };
+    unsigned int GetNativeThreads(){ return native_threads; };
+
 };
 
 
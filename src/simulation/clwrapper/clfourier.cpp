@@ -4,6 +4,7 @@
 
 #include "clfourier.h"
 
+#include <algorithm>
 #include <cmath>
 #include <utility>
 
@@ -35,7 +36,7 @@ void clFourier<T>::Setup(unsigned int _width, unsigned int _height) {
     size_t clLengths[ 3 ];
     size_t clPadding[ 3 ] = {0, 0, 0 };
     size_t clStrides[ 4 ];
-    size_t batchSize = 1;
+    size_t batchSize = batch_size;
 
     clLengths[0] = _width;
     clLengths[1] = _height;
@@ -67,6 +68,17 @@ void clFourier<T>::Setup(unsigned int _width, unsigned int _height) {
     fftStatus = clfftSetPlanBatchSize( fftplan, batchSize );
     clFftError::Throw(fftStatus, "clFourier");
 
+    // the distance between the images of the batch (this can be more than the image size so the images are aligned)
+    if (batchSize > 1) {
+        size_t plane_strides[2] = {clStrides[0], clStrides[1]};
+        fftStatus = clfftSetPlanInStride(fftplan, fftdim, plane_strides);
+        clFftError::Throw(fftStatus, "clFourier");
+        fftStatus = clfftSetPlanOutStride(fftplan, fftdim, plane_strides);
+        clFftError::Throw(fftStatus, "clFourier");
+        fftStatus = clfftSetPlanDistance(fftplan, batch_distance, batch_distance);
+        clFftError::Throw(fftStatus, "clFourier");
+    }
+
     fftStatus = clfftSetPlanScale (fftplan, CLFFT_FORWARD, 1.0f / sqrtf(_width * _height));
     clFftError::Throw(fftStatus, "clFourier");
 
@@ -80,6 +92,16 @@ void clFourier<T>::Setup(unsigned int _width, unsigned int _height) {
         clfftSetPlanDistance(fftplan, clStrides[fftdim], clStrides[fftdim]);
     }
 
+    if (!post_callback_name.empty()) {
+#if defined(clfftVersionMajor) && (clfftVersionMajor > 2 || (clfftVersionMajor == 2 && clfftVersionMinor >= 10))
+        fftStatus = clfftSetPlanCallback(fftplan, post_callback_name.c_str(), post_callback_source.c_str(), 0,
+                                         POSTCALLBACK, &post_callback_data(), 1);
+        clFftError::Throw(fftStatus, "clFourier");
+#else
+        throw std::runtime_error("clFourier: this version of clFFT does not support callbacks");
+#endif
+    }
+
     fftStatus = clfftBakePlan( fftplan, 1, &Context->GetQueueHandle(), nullptr, nullptr);
     clFftError::Throw(fftStatus, "clFourier");
 
@@ -95,10 +117,38 @@ void clFourier<T>::Setup(unsigned int _width, unsigned int _height) {
 }
 
 template <class T>
-clFourier<T>::clFourier(std::shared_ptr<clContext> Context, unsigned int _width, unsigned int _height): Context(std::move(Context)), width(_width), height(_height), buffersize(0), fftplan(0) {
+clFourier<T>::clFourier(std::shared_ptr<clContext> Context, unsigned int _width, unsigned int _height, unsigned int _batch_size, size_t _batch_distance)
+        : Context(std::move(Context)), width(_width), height(_height), buffersize(0), fftplan(0),
+          batch_size(std::max(_batch_size, 1u)), batch_distance(_batch_distance) {
+    if (batch_distance == 0)
+        batch_distance = static_cast<size_t>(width) * height;
+    if (batch_distance < static_cast<size_t>(width) * height)
+        throw std::runtime_error("clFourier: batch distance is smaller than the image size");
     Setup(_width,_height);
     AutoTeardownFFT::GetInstance();
 }
 
+template <class T>
+void clFourier<T>::SetPostCallback(const std::string &name, const std::string &source, cl::Buffer &user_data) {
+    releasePlan();
+
+    post_callback_name = name;
+    post_callback_source = source;
+    post_callback_data = user_data;
+
+    try {
+        Setup(width, height);
+    } catch (...) {
+        // don't leave a half made plan (or the callback) lying around
+        if (fftplan)
+            clfftDestroyPlan(&fftplan);
+        fftplan = 0;
+        post_callback_name.clear();
+        post_callback_source.clear();
+        post_callback_data = cl::Buffer();
+        throw;
+    }
+}
+
 template class clFourier<float>;
 template class clFourier<double>;
\ No newline at end of file
@@ -8,18 +8,23 @@
 #include "clFFT.h"
 
 #include <complex>
+#include <string>
 #include "CL/cl.hpp"
 
 #include "clstatic.h"
 #include "clcontext.h"
 #include "clevent.h"
 #include "clmemory.h"
+#include "clprofiler.h"
 
 class AutoTeardownFFT;
 template <class T, template <class> class AutoPolicy> class clMemory;
 template <class T> class Manual;
 
 // Can't use scoped enums for legacy code
+// (this is guarded as the native FFT uses the same enum)
+#ifndef CLTEM_FOURIER_DIRECTION
+#define CLTEM_FOURIER_DIRECTION
 namespace Direction
 {
     enum TransformDirection
@@ -28,6 +33,7 @@ namespace Direction
         Inverse
     };
 }
+#endif
 
 template <class T>
 class clFourier
@@ -43,24 +49,49 @@ class clFourier
     unsigned int width, height;
     size_t buffersize;
 
+    // number of transforms done by each run (the images are batch_distance elements apart in the buffers)
+    unsigned int batch_size;
+    size_t batch_distance;
+
+    // optional function that clFFT calls to store each output value (empty name means no callback)
+    std::string post_callback_name;
+    std::string post_callback_source;
+    cl::Buffer post_callback_data;
+
 public:
 
-    clFourier() : fftplan(0), width(0), height(0) {}
+    clFourier() : fftplan(0), width(0), height(0), buffersize(0), batch_size(1), batch_distance(0) {}
 
-    clFourier(std::shared_ptr<clContext> Context, unsigned int _width, unsigned int _height);
+    // a batch size > 1 transforms a stack of images in one go, a distance of 0 means the images are contiguous
+    clFourier(std::shared_ptr<clContext> Context, unsigned int _width, unsigned int _height, unsigned int _batch_size = 1, size_t _batch_distance = 0);
 
-    clFourier(const clFourier &RHS): Context(RHS.Context), fftplan(0), width(RHS.width), height(RHS.height), buffersize(0) {
+    clFourier(const clFourier &RHS): Context(RHS.Context), fftplan(0), width(RHS.width), height(RHS.height), buffersize(0),
+                                     batch_size(RHS.batch_size), batch_distance(RHS.batch_distance),
+                                     post_callback_name(RHS.post_callback_name), post_callback_source(RHS.post_callback_source),
+                                     post_callback_data(RHS.post_callback_data) {
         if (Context && Context->GetContextHandle())
             Setup(width,height);
     };
 
     ~clFourier();
 
-    void releaseResources() {
+    void releasePlan() {
         if (fftplan) {
             fftStatus = clfftDestroyPlan(&fftplan);
             clFftError::Throw(fftStatus, "clFourier");
+            fftplan = 0;
         }
+    }
+
+    // Rebuilds the plan so that clFFT stores the output through the named callback function. The source is OpenCL
+    // with the signature void name(__global void* output, uint outoffset, __global void* userdata, float2/double2 fftoutput)
+    // and user_data is passed in as userdata. Throws if clFFT cannot use the callback for this plan.
+    void SetPostCallback(const std::string &name, const std::string &source, cl::Buffer &user_data);
+
+    cl_mem GetPostCallbackData() { return post_callback_data(); }
+
+    void releaseResources() {
+        releasePlan();
 
         fftStatus = clfftTeardown();
         clFftError::Throw(fftStatus, "FourierTearDownTest");
@@ -91,6 +122,10 @@ public:
                                                !eventwaitlist.empty() ? &eventwaitlist[0] : nullptr, &finished.event(),
                                                &input.GetBufferHandle(), &output.GetBufferHandle(), NULL );
 
+        if (clProfiler::enabled())
+            clProfiler::record(finished.event, "FFT " + std::to_string(width) + "x" + std::to_string(height) + "x" +
+                               std::to_string(batch_size), "fft", Context->GetContextDevice());
+
         if(output.getAuto())
             output.Update(finished);
 
@@ -99,6 +134,8 @@ public:
 
     unsigned int GetWidth() { return width; }
     unsigned int GetHeight() { return height; }
+    unsigned int GetBatchSize() { return batch_size; }
+    size_t GetBatchDistance() { return batch_distance; }
 
 private:
     void Setup(unsigned int _width, unsigned int _height);
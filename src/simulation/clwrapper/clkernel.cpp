@@ -38,6 +38,9 @@ clEvent clKernel::run(clWorkGroup Global) {
     cl_int status = Context->GetQueue().enqueueNDRangeKernel(Kernel, cl::NullRange, Global.worksize, cl::NullRange, &eventwaitlist, &KernelFinished.event);
     clError::Throw(status, Name);
 
+    if (clProfiler::enabled())
+        clProfiler::record(KernelFinished.event, Name, "kernel", Context->GetContextDevice());
+
     RunCallbacks(KernelFinished);
     return KernelFinished;
 }
@@ -65,6 +68,9 @@ clEvent clKernel::run(clWorkGroup Global, clWorkGroup Local) {
     cl_int status = Context->GetQueue().enqueueNDRangeKernel(Kernel, cl::NullRange, Global.worksize, Local.worksize, &eventwaitlist, &KernelFinished.event);
     clError::Throw(status, Name);
 
+    if (clProfiler::enabled())
+        clProfiler::record(KernelFinished.event, Name, "kernel", Context->GetContextDevice());
+
     RunCallbacks(KernelFinished);
     return KernelFinished;
 }
\ No newline at end of file
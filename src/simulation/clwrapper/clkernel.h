@@ -14,6 +14,8 @@
 #include "clevent.h"
 #include "clworkgroup.h"
 #include "clerror.h"
+#include "clprofiler.h"
+#include "clbinarycache.h"
 
 
 // Optionally passed to argument setting.
@@ -55,10 +57,9 @@ public:
         Callbacks.resize(NumberOfArgs);
 
         cl_int status;
-        Program = cl::Program(Context->GetContext(), codestring, false, &status);
-        status = Program.build(opts.c_str()); // could just put true above - need to remember to pass it the string
-
-        std::string buildlog_str = Program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(Context->GetContextDevice().getDevice(), &status);
+        std::string buildlog_str;
+        // this uses a saved binary if there is one (and the cache is enabled)
+        Program = clBinaryCache::BuildProgram(*Context, codestring, Name, opts, status, buildlog_str);
         clError::Throw(status, Name + "\nBuild log:\n" + buildlog_str);
 
         Kernel = cl::Kernel(Program, Name.c_str(), &status);
@@ -89,6 +90,16 @@ public:
         clError::Throw(status,  Name + " arg " + std::to_string(index));
     }
 
+    std::string GetName() {return Name;}
+
+    // the largest work group this kernel can be run with (on the context's device)
+    size_t GetMaxWorkGroupSize() {
+        cl_int status;
+        auto size = Kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(Context->GetContextDevice().getDevice(), &status);
+        clError::Throw(status, Name);
+        return size;
+    }
+
     clEvent run(clWorkGroup Global);
 //    clEvent run(clWorkGroup Global, clEvent StartEvent);
     clEvent run(clWorkGroup Global, clWorkGroup Local);
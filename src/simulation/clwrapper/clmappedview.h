@@ -0,0 +1,70 @@
+#ifndef CLWRAPPER_CLMAPPEDVIEW_H
+#define CLWRAPPER_CLMAPPEDVIEW_H
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+// A read only host view of the contents of a buffer (see clMemory::GetMapped). When the device shares the host memory
+// this points straight at the mapped buffer, which is unmapped when the view is destroyed. Otherwise it holds a copy of
+// the contents (i.e. the same as GetLocal).
+//
+// The buffer shouldn't be written to (by a kernel or a write) while the view exists.
+template <class T>
+class clMappedView
+{
+public:
+    clMappedView() : ptr(nullptr), count(0) {}
+
+    // a view of mapped memory, unmap is called (once) when the view is finished with
+    clMappedView(const T *mapped, size_t size, std::function<void()> unmap)
+            : ptr(mapped), count(size), unmap_fn(std::move(unmap)) {}
+
+    // a view of a copy of the memory
+    explicit clMappedView(std::vector<T> &&data) : local(std::move(data)), ptr(local.data()), count(local.size()) {}
+
+    clMappedView(const clMappedView &) = delete;
+    clMappedView &operator=(const clMappedView &) = delete;
+
+    clMappedView(clMappedView &&rhs) noexcept : ptr(nullptr), count(0) { *this = std::move(rhs); }
+
+    clMappedView &operator=(clMappedView &&rhs) noexcept {
+        if (this != &rhs) {
+            release();
+            // the vector's data pointer is kept by the move
+            local = std::move(rhs.local);
+            ptr = rhs.ptr;
+            count = rhs.count;
+            unmap_fn = std::move(rhs.unmap_fn);
+
+            rhs.ptr = nullptr;
+            rhs.count = 0;
+            rhs.unmap_fn = nullptr;
+        }
+        return *this;
+    }
+
+    ~clMappedView() { release(); }
+
+    const T *data() const { return ptr; }
+    size_t size() const { return count; }
+
+    const T &operator[](size_t i) const { return ptr[i]; }
+
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + count; }
+
+private:
+    std::vector<T> local;
+    const T *ptr;
+    size_t count;
+    std::function<void()> unmap_fn;
+
+    void release() {
+        if (unmap_fn)
+            unmap_fn();
+        unmap_fn = nullptr;
+    }
+};
+
+#endif //CLWRAPPER_CLMAPPEDVIEW_H
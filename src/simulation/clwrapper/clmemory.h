@@ -12,6 +12,8 @@
 #include "auto.h"
 #include "manual.h"
 #include "notify.h"
+#include "clprofiler.h"
+#include "clmappedview.h"
 
 #include <iostream>
 
@@ -50,11 +52,25 @@ public:
     clMemory_impl<T,AutoPolicy>(const std::shared_ptr<clContext>& context, size_t size, enum MemoryFlags flags = MemoryFlags::ReadWrite)
             : AutoPolicy<T>(size), Context(context), Size(size), BufferFlags(flags),
               FinishedReadEvent(), FinishedWriteEvent(), StartReadEvent(), StartWriteEvent() {
-        Buffer = cl::Buffer(context->GetContext(), flags, Size*sizeof(T));
+        // when the device uses the host memory anyway, let it allocate memory that can be mapped without a copy
+        cl_mem_flags mem_flags = flags;
+        if (context->UsesHostMemory())
+            mem_flags |= CL_MEM_ALLOC_HOST_PTR;
+        Buffer = cl::Buffer(context->GetContext(), mem_flags, Size*sizeof(T));
 
         Fill(0);
     }
 
+    // Creates a sub-buffer of a region of an existing buffer (the offset must meet the device base address alignment)
+    clMemory_impl<T,AutoPolicy>(const std::shared_ptr<clContext>& context, cl::Buffer& parent, size_t offset, size_t size, enum MemoryFlags flags = MemoryFlags::ReadWrite)
+            : AutoPolicy<T>(size), Context(context), Size(size), BufferFlags(flags),
+              FinishedReadEvent(), FinishedWriteEvent(), StartReadEvent(), StartWriteEvent() {
+        cl_int status;
+        cl_buffer_region region = {offset * sizeof(T), Size * sizeof(T)};
+        Buffer = parent.createSubBuffer(flags, CL_BUFFER_CREATE_TYPE_REGION, &region, &status);
+        clError::Throw(status, "clMemory sub-buffer");
+    }
+
     cl::Buffer& GetBuffer(){ return Buffer; }
     cl_mem& GetBufferHandle(){ return Buffer(); }
     size_t	GetSize() { return Size; }
@@ -72,6 +88,7 @@ public:
         cl_int status;
         status = Context->GetIOQueue().enqueueReadBuffer(Buffer, CL_FALSE, 0, Size*sizeof(T), &data[0], nullptr, &FinishedReadEvent.event);
         clError::Throw(status);
+        Profile(FinishedReadEvent, "Read", "read", Size * sizeof(T));
         return FinishedReadEvent;
     }
 
@@ -85,6 +102,7 @@ public:
         status = Context->GetIOQueue().enqueueReadBuffer(Buffer, CL_FALSE, 0, Size * sizeof(T), &data[0],
                                                          &start_vector, &FinishedReadEvent.event);
         clError::Throw(status);
+        Profile(FinishedReadEvent, "Read", "read", Size * sizeof(T));
         return FinishedReadEvent;
     }
 
@@ -93,6 +111,7 @@ public:
         status = Context->GetIOQueue().enqueueWriteBuffer(Buffer, CL_FALSE, 0, Size*sizeof(T), &data[0], nullptr, &FinishedWriteEvent.event);
 
         clError::Throw(status);
+        Profile(FinishedWriteEvent, "Write", "write", Size * sizeof(T));
 
         return FinishedWriteEvent;
     }
@@ -101,6 +120,7 @@ public:
         cl_int status;
         status = Context->GetIOQueue().enqueueWriteBuffer(Buffer, CL_FALSE, 0, Size*sizeof(T), &data[0], nullptr, &FinishedWriteEvent.event);
         clError::Throw(status);
+        Profile(FinishedWriteEvent, "Write", "write", Size * sizeof(T));
 
         return status;
     }
@@ -114,24 +134,104 @@ public:
             start_vector.push_back(StartWriteEvent.event);
         status = Context->GetIOQueue().enqueueWriteBuffer(Buffer, CL_FALSE, 0, Size*sizeof(T), &data[0], &start_vector, &FinishedWriteEvent.event);
         clError::Throw(status);
+        Profile(FinishedWriteEvent, "Write", "write", Size * sizeof(T));
+
+        return FinishedWriteEvent;
+    }
+
+    // Write count elements from data to the buffer, starting at offset (both in elements). The data must stay valid
+    // until the write has finished.
+    clEvent Write(const T* data, size_t offset, size_t count) {
+        cl_int status;
+        status = Context->GetIOQueue().enqueueWriteBuffer(Buffer, CL_FALSE, offset*sizeof(T), count*sizeof(T), data, nullptr, &FinishedWriteEvent.event);
+        clError::Throw(status);
+        Profile(FinishedWriteEvent, "Write", "write", count * sizeof(T));
 
         return FinishedWriteEvent;
     }
 
-    clEvent Fill(T value) {
+    // the fill can be made to wait for an event (i.e. the last thing to read the buffer)
+    clEvent Fill(T value, clEvent after = clEvent()) {
+        std::vector<cl::Event> wait_vector;
+        if (after.event())
+            wait_vector.push_back(after.event);
+
         cl_int status;
-        status = Context->GetIOQueue().enqueueFillBuffer(Buffer, &value, 0, Size, nullptr,
+        status = Context->GetIOQueue().enqueueFillBuffer(Buffer, &value, 0, Size, &wait_vector,
                                                          &FinishedWriteEvent.event);
 
         clError::Throw(status);
+        Profile(FinishedWriteEvent, "Fill", "fill", Size * sizeof(T));
 
         return FinishedWriteEvent;
     }
 
+    // Copies all of this buffer to the start of dest (on the IO queue), dest must be at least as big
+    // The copy waits for the last output to this buffer and for the last read of dest (i.e. it to be unmapped), then
+    // acts as a read of this buffer and a write to dest
+    clEvent CopyTo(clMemory_impl<T,AutoPolicy>& dest) {
+        std::vector<cl::Event> wait_vector;
+        for (auto e : {StartReadEvent, FinishedWriteEvent, dest.FinishedReadEvent})
+            if (e.event())
+                wait_vector.push_back(e.event);
+
+        cl_int status;
+        status = Context->GetIOQueue().enqueueCopyBuffer(Buffer, dest.Buffer, 0, 0, Size*sizeof(T), &wait_vector,
+                                                         &dest.FinishedWriteEvent.event);
+        clError::Throw(status);
+        Profile(dest.FinishedWriteEvent, "Copy", "copy", Size * sizeof(T));
+
+        FinishedReadEvent = dest.FinishedWriteEvent;
+        return dest.FinishedWriteEvent;
+    }
+
+    // Maps the whole buffer for reading once the last kernel (or copy) to output to it has finished (this blocks until
+    // it is mapped). It must be unmapped, on the same queue, before anything writes to the buffer.
+    const T* MapRead() {
+        return MapRead(Context->GetIOQueue());
+    }
+
+    const T* MapRead(cl::CommandQueue &queue) {
+        std::vector<cl::Event> start_vector;
+        for (auto e : {StartReadEvent, FinishedWriteEvent})
+            if (e.event())
+                start_vector.push_back(e.event);
+
+        cl_int status;
+        clEvent map_event;
+        void *ptr = queue.enqueueMapBuffer(Buffer, CL_TRUE, CL_MAP_READ, 0, Size*sizeof(T), &start_vector,
+                                           &map_event.event, &status);
+        clError::Throw(status, "clMemory map");
+        Profile(map_event, "Map", "map", Size * sizeof(T));
+
+        return static_cast<const T*>(ptr);
+    }
+
+    // Kernels that output to this buffer will wait for the unmap. This doesn't throw as it is used by destructors.
+    cl_int Unmap(const T* ptr) {
+        return Unmap(Context->GetIOQueue(), ptr);
+    }
+
+    cl_int Unmap(cl::CommandQueue &queue, const T* ptr) {
+        cl_int status = queue.enqueueUnmapMemObject(Buffer, const_cast<T*>(ptr), nullptr, &FinishedReadEvent.event);
+        if (status != CL_SUCCESS)
+            return status;
+
+        Profile(FinishedReadEvent, "Unmap", "map", 0);
+        // other queues can wait for the unmap, which is only allowed once it has been flushed on this one
+        return queue.flush();
+    }
+
     size_t GetSizeInBytes() {
         return Size * sizeof(T);
     }
 
+private:
+    void Profile(clEvent &e, const char *name, const char *category, size_t bytes) {
+        if (clProfiler::enabled())
+            clProfiler::record(e.event, name, category, Context->GetContextDevice(), bytes);
+    }
+
 };
 
 
@@ -163,6 +263,11 @@ public:
         mem_ptr->Context->AddMemRecord(mem_ptr);
     };
 
+    // This is a view of part of the parent buffer, so it is not added to the memory record (it would be counted twice)
+    clMemory<T,AutoPolicy>(clMemory<T,AutoPolicy>& parent, size_t offset, size_t size, enum MemoryFlags flags = MemoryFlags::ReadWrite) {
+        mem_ptr = std::make_shared<clMemory_impl<T,AutoPolicy>>(parent.mem_ptr->Context, parent.GetBuffer(), offset, size, flags);
+    };
+
     void SetNeededNow(bool value) {
         mem_ptr->SetNeededNow(value);
     }
@@ -217,6 +322,21 @@ public:
         return mem_ptr->Write(data, Start);
     }
 
+    // Write part of the buffer (the data must stay valid until the write has finished)
+    clEvent Write(const T* data, size_t offset, size_t count) {
+        return mem_ptr->Write(data, offset, count);
+    }
+
+    // Sets every element of the buffer (on the IO queue)
+    clEvent Fill(T value, clEvent after = clEvent()) {
+        return mem_ptr->Fill(value, after);
+    }
+
+    // Copies all of this buffer to the start of dest (on the IO queue)
+    clEvent CopyTo(clMemory<T,AutoPolicy>& dest) {
+        return mem_ptr->CopyTo(*dest.mem_ptr);
+    }
+
 
     void SetFinishedEvent(clEvent& KernelFinished) {
         mem_ptr->SetFinishedEvent(KernelFinished);
@@ -238,6 +358,26 @@ public:
         return mem_ptr->GetLocal();
     }
 
+    // The current contents (blocks like GetLocal). If the device shares the host memory, the buffer is mapped instead
+    // of being copied into a new vector (and is unmapped when the view is destroyed)
+    clMappedView<T> GetMapped() {
+        if (!mem_ptr->Context->UsesHostMemory())
+            return clMappedView<T>(std::vector<T>(mem_ptr->GetLocal()));
+
+        // the view keeps the memory alive until it is unmapped
+        auto mem = mem_ptr;
+        const T *ptr = mem->MapRead();
+        return clMappedView<T>(ptr, mem->GetSize(), [mem, ptr]() { mem->Unmap(ptr); });
+    }
+
+    // Always maps the buffer, on the given queue (i.e. the context's readback queue from another thread). This is for
+    // buffers made with MemoryFlags::HostReadWrite, which can be mapped without a copy
+    clMappedView<T> GetMapped(cl::CommandQueue &queue) {
+        auto mem = mem_ptr;
+        const T *ptr = mem->MapRead(queue);
+        return clMappedView<T>(ptr, mem->GetSize(), [mem, &queue, ptr]() { mem->Unmap(queue, ptr); });
+    }
+
 };
 
 #endif //CLWRAPPER_MAIN_CLMEMORY_H
@@ -0,0 +1,270 @@
+#include "clprofiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+std::atomic<bool> clProfiler::enabled_flag(false);
+std::mutex clProfiler::record_mutex;
+std::vector<clProfiler::Record> clProfiler::records;
+size_t clProfiler::dropped_records = 0;
+std::vector<std::string> clProfiler::device_names;
+std::vector<std::string> clProfiler::thread_names;
+
+namespace {
+    thread_local std::string current_thread_name;
+    thread_local int current_job = -1;
+    thread_local int current_slice = -1;
+
+    // cached index of this thread's name (-1 if the name has changed)
+    thread_local int current_thread_index = -1;
+
+    std::string escapeJson(const std::string &s) {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            if (static_cast<unsigned char>(c) >= 0x20)
+                out += c;
+        }
+        return out;
+    }
+}
+
+void clProfiler::setThreadName(const std::string &name) {
+    current_thread_name = name;
+    current_thread_index = -1;
+}
+
+void clProfiler::setJob(int job) {
+    current_job = job;
+}
+
+void clProfiler::setSlice(int slice) {
+    current_slice = slice;
+}
+
+int64_t clProfiler::hostNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+unsigned int clProfiler::deviceIndex(clDevice &device) {
+    std::string name = "p" + std::to_string(device.GetPlatformNumber()) + ":d" + std::to_string(device.GetDeviceNumber())
+                       + " " + device.GetDeviceName();
+
+    auto it = std::find(device_names.begin(), device_names.end(), name);
+    if (it != device_names.end())
+        return static_cast<unsigned int>(it - device_names.begin());
+
+    device_names.push_back(name);
+    return static_cast<unsigned int>(device_names.size() - 1);
+}
+
+unsigned int clProfiler::threadIndex() {
+    if (current_thread_index >= 0)
+        return static_cast<unsigned int>(current_thread_index);
+
+    std::string name = current_thread_name.empty() ? "main" : current_thread_name;
+    auto it = std::find(thread_names.begin(), thread_names.end(), name);
+    if (it == thread_names.end()) {
+        thread_names.push_back(name);
+        it = thread_names.end() - 1;
+    }
+
+    current_thread_index = static_cast<int>(it - thread_names.begin());
+    return static_cast<unsigned int>(current_thread_index);
+}
+
+void clProfiler::record(const cl::Event &event, const std::string &name, const char *category, clDevice &device,
+                        size_t bytes) {
+    if (!enabled() || !event())
+        return;
+
+    // this is after the command was enqueued, so it is an upper bound of the queued time on the host clock
+    int64_t now = hostNow();
+
+    std::lock_guard<std::mutex> lock(record_mutex);
+    if (records.size() >= max_records) {
+        ++dropped_records;
+        return;
+    }
+    records.push_back({event, name, category, deviceIndex(device), threadIndex(), current_job, current_slice, bytes, now, 0});
+}
+
+void clProfiler::recordHost(const std::string &name, const char *category, clDevice &device,
+                            std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    if (!enabled())
+        return;
+
+    auto to_ns = [](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    };
+
+    std::lock_guard<std::mutex> lock(record_mutex);
+    if (records.size() >= max_records) {
+        ++dropped_records;
+        return;
+    }
+    records.push_back({cl::Event(), name, category, deviceIndex(device), threadIndex(), current_job, current_slice, 0,
+                       to_ns(start), to_ns(end)});
+}
+
+std::vector<std::pair<bool, clProfiler::Times>> clProfiler::resolveTimes() {
+    std::vector<std::pair<bool, Times>> times(records.size(), {false, {0, 0, 0, 0}});
+
+    // the device clocks are only lined up with the host (and each other) by the smallest difference between when the
+    // host enqueued a command and when the device says it was queued
+    std::vector<int64_t> offsets(device_names.size(), std::numeric_limits<int64_t>::max());
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        auto &r = records[i];
+        if (!r.event()) {
+            times[i] = {true, {r.host_ns, r.host_ns, r.host_ns, r.host_end_ns}};
+            continue;
+        }
+
+        r.event.wait();
+
+        cl_ulong queued, submit, start, end;
+        if (r.event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &queued) != CL_SUCCESS ||
+            r.event.getProfilingInfo(CL_PROFILING_COMMAND_SUBMIT, &submit) != CL_SUCCESS ||
+            r.event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start) != CL_SUCCESS ||
+            r.event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end) != CL_SUCCESS)
+            continue; // the queue was made without profiling
+
+        times[i] = {true, {static_cast<int64_t>(queued), static_cast<int64_t>(submit),
+                           static_cast<int64_t>(start), static_cast<int64_t>(end)}};
+        offsets[r.device] = std::min(offsets[r.device], r.host_ns - static_cast<int64_t>(queued));
+    }
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (!times[i].first || !records[i].event())
+            continue;
+        int64_t o = offsets[records[i].device];
+        auto &t = times[i].second;
+        t.queued += o;
+        t.submit += o;
+        t.start += o;
+        t.end += o;
+    }
+
+    return times;
+}
+
+void clProfiler::saveChromeTrace(const std::string &path) {
+    std::lock_guard<std::mutex> lock(record_mutex);
+    auto times = resolveTimes();
+
+    int64_t t0 = std::numeric_limits<int64_t>::max();
+    for (auto &t : times)
+        if (t.first)
+            t0 = std::min(t0, t.second.queued);
+
+    std::ofstream f(path);
+    if (!f.is_open())
+        throw std::runtime_error("Could not open profile trace file: " + path);
+
+    f << std::fixed << std::setprecision(3);
+    f << "{\"traceEvents\":[\n";
+
+    bool first = true;
+    auto separator = [&]() {
+        if (!first)
+            f << ",\n";
+        first = false;
+    };
+
+    // name the 'processes' (devices) and 'threads' so the timeline is readable
+    for (size_t d = 0; d < device_names.size(); ++d) {
+        separator();
+        f << R"({"name":"process_name","ph":"M","pid":)" << d << R"(,"args":{"name":")" << escapeJson(device_names[d]) << "\"}}";
+        for (size_t t = 0; t < thread_names.size(); ++t) {
+            separator();
+            f << R"({"name":"thread_name","ph":"M","pid":)" << d << ",\"tid\":" << t << R"(,"args":{"name":")"
+              << escapeJson(thread_names[t]) << "\"}}";
+        }
+    }
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (!times[i].first)
+            continue;
+        auto &r = records[i];
+        auto &t = times[i].second;
+
+        separator();
+        f << R"({"name":")" << escapeJson(r.name) << R"(","cat":")" << r.category << R"(","ph":"X","pid":)" << r.device
+          << ",\"tid\":" << r.thread << ",\"ts\":" << (t.start - t0) / 1000.0 << ",\"dur\":" << (t.end - t.start) / 1000.0
+          << ",\"args\":{\"job\":" << r.job << ",\"slice\":" << r.slice;
+        if (r.event())
+            f << ",\"queued_us\":" << (t.start - t.queued) / 1000.0 << ",\"submit_us\":" << (t.start - t.submit) / 1000.0;
+        if (r.bytes > 0)
+            f << ",\"bytes\":" << r.bytes;
+        f << "}}";
+    }
+
+    f << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+std::string clProfiler::summary() {
+    std::lock_guard<std::mutex> lock(record_mutex);
+    auto times = resolveTimes();
+
+    struct Stage {
+        size_t count = 0;
+        double total = 0.0;
+        size_t bytes = 0;
+    };
+
+    std::map<std::pair<std::string, std::string>, Stage> stages;
+    double total = 0.0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (!times[i].first)
+            continue;
+        auto &s = stages[{records[i].category, records[i].name}];
+        double dt = (times[i].second.end - times[i].second.start) * 1e-6;
+        s.count++;
+        s.total += dt;
+        s.bytes += records[i].bytes;
+        total += dt;
+    }
+
+    std::vector<std::pair<std::pair<std::string, std::string>, Stage>> sorted(stages.begin(), stages.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second.total > b.second.total; });
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << std::left << std::setw(10) << "category" << std::setw(42) << "name" << std::right << std::setw(10) << "count"
+        << std::setw(14) << "total (ms)" << std::setw(14) << "mean (us)" << std::setw(9) << "%" << std::setw(12)
+        << "GB/s" << "\n";
+
+    for (auto &s : sorted) {
+        auto &st = s.second;
+        out << std::left << std::setw(10) << s.first.first << std::setw(42) << s.first.second << std::right
+            << std::setw(10) << st.count << std::setw(14) << st.total << std::setw(14) << 1000.0 * st.total / st.count
+            << std::setw(9) << (total > 0.0 ? 100.0 * st.total / total : 0.0);
+        if (st.bytes > 0 && st.total > 0.0)
+            out << std::setw(12) << st.bytes / (st.total * 1e6);
+        out << "\n";
+    }
+
+    out << "(times are summed over all threads and devices, so overlapping commands are counted separately)\n";
+    if (dropped_records > 0)
+        out << "(only the first " << max_records << " commands were recorded, " << dropped_records << " were dropped)\n";
+
+    return out.str();
+}
+
+void clProfiler::clear() {
+    std::lock_guard<std::mutex> lock(record_mutex);
+    records.clear();
+    dropped_records = 0;
+}
+
+size_t clProfiler::droppedRecords() {
+    std::lock_guard<std::mutex> lock(record_mutex);
+    return dropped_records;
+}
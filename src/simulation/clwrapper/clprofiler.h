@@ -0,0 +1,95 @@
+#ifndef CLWRAPPER_CLPROFILER_H
+#define CLWRAPPER_CLPROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CL/cl.hpp"
+
+#include "cldevice.h"
+
+// Records the OpenCL command times of every kernel, FFT and buffer transfer (and the time the host spends waiting on
+// the queues), tagged with the thread, device, job and slice they were enqueued from. This can be saved as a Chrome
+// trace (that can be opened in chrome://tracing or Perfetto) or summarised as a table of the time spent in each stage.
+//
+// This is off by default and has to be enabled before the contexts are made (so the queues are made with profiling
+// enabled). When it is off, the only cost is checking the flag. The event timestamps are only read when the results
+// are saved, so recording doesn't wait on anything. Each record holds on to its event, so only the first max_records
+// are kept and anything after that is counted but dropped.
+class clProfiler
+{
+public:
+    static void setEnabled(bool enable) {enabled_flag.store(enable, std::memory_order_relaxed);}
+
+    static bool enabled() {return enabled_flag.load(std::memory_order_relaxed);}
+
+    // tags for everything recorded from the calling thread
+    static void setThreadName(const std::string &name);
+    static void setJob(int job);
+    static void setSlice(int slice);
+
+    // Records an enqueued command, the category is the type of command (i.e. kernel, fft, read) and the name is what
+    // it is (i.e. the kernel name). Bytes is the size of any transfer.
+    static void record(const cl::Event &event, const std::string &name, const char *category, clDevice &device,
+                       size_t bytes = 0);
+
+    // records time the host spent waiting (i.e. for a queue to finish)
+    static void recordHost(const std::string &name, const char *category, clDevice &device,
+                           std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+    // waits for all the recorded commands (they should be finished by the time this is used anyway)
+    static void saveChromeTrace(const std::string &path);
+
+    // time spent in each category and name, sorted by total time
+    static std::string summary();
+
+    static void clear();
+
+    // the number of records that were dropped because the limit was reached
+    static size_t droppedRecords();
+
+    static const size_t max_records = 1000000;
+
+private:
+    struct Record {
+        cl::Event event;
+        std::string name;
+        const char *category;
+        // index into the device and thread names (these are the pid and tid in the trace)
+        unsigned int device;
+        unsigned int thread;
+        int job;
+        int slice;
+        size_t bytes;
+        // host time when this was enqueued, used to line up the device clocks with the host (and each other)
+        int64_t host_ns;
+        // for host records (that have no event)
+        int64_t host_end_ns;
+    };
+
+    // the device times (in ns, on the host clock), false if the event has no profiling info
+    struct Times {
+        int64_t queued, submit, start, end;
+    };
+
+    static std::atomic<bool> enabled_flag;
+
+    static std::mutex record_mutex;
+    static std::vector<Record> records;
+    static size_t dropped_records;
+    static std::vector<std::string> device_names;
+    static std::vector<std::string> thread_names;
+
+    static unsigned int deviceIndex(clDevice &device);
+    static unsigned int threadIndex();
+
+    static int64_t hostNow();
+
+    // gets the times of all the records (in order), host records are copied over
+    static std::vector<std::pair<bool, Times>> resolveTimes();
+};
+
+#endif //CLWRAPPER_CLPROFILER_H
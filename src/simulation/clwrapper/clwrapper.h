@@ -17,7 +17,10 @@
 #include "clfourier.h"
 
 #include "clmemory.h"
+#include "clmappedview.h"
 #include "clkernel.h"
+#include "clprofiler.h"
+#include "clbinarycache.h"
 
 #include "auto.h"
 
@@ -4,9 +4,38 @@
 
 #include "phonon.h"
 
+#include <cmath>
+
+namespace {
+    // Philox4x32-10 (Salmon et al. 2011), this must match the phonon_displace kernels
+    std::array<uint32_t, 4> philox4x32_10(std::array<uint32_t, 4> ctr, std::array<uint32_t, 2> key) {
+        for (int r = 0; r < 10; ++r) {
+            if (r > 0) {
+                key[0] += 0x9E3779B9u;
+                key[1] += 0xBB67AE85u;
+            }
+            uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * ctr[0];
+            uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * ctr[2];
+            ctr = {static_cast<uint32_t>(p1 >> 32) ^ ctr[1] ^ key[0], static_cast<uint32_t>(p1),
+                   static_cast<uint32_t>(p0 >> 32) ^ ctr[3] ^ key[1], static_cast<uint32_t>(p0)};
+        }
+        return ctr;
+    }
+
+    // uniform in (0, 1], so the log is always finite
+    double philoxUniform(uint32_t x) {
+        return (x + 1.0) / 4294967296.0;
+    }
+
+    uint64_t makeSeed() {
+        std::random_device rd;
+        return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+    }
+}
+
 PhononScattering::PhononScattering() {
-    dist = std::normal_distribution<>(0, 1);
-    rng = std::mt19937_64(std::chrono::system_clock::now().time_since_epoch().count());
+    seed = makeSeed();
+    seed_fixed = false;
 
     frozen_phonon_enabled = false;
     force_default = false;
@@ -18,8 +47,8 @@ PhononScattering::PhononScattering() {
 }
 
 PhononScattering::PhononScattering(const PhononScattering &ps) {
-    dist = std::normal_distribution<>(0, 1);
-    rng = std::mt19937_64(std::chrono::system_clock::now().time_since_epoch().count());
+    seed = ps.seed_fixed ? ps.seed : makeSeed();
+    seed_fixed = ps.seed_fixed;
 
     frozen_phonon_enabled = ps.frozen_phonon_enabled;
     force_default = ps.force_default;
@@ -31,8 +60,8 @@ PhononScattering::PhononScattering(const PhononScattering &ps) {
 }
 
 PhononScattering& PhononScattering::operator=(const PhononScattering &ps) {
-    dist = std::normal_distribution<>(0, 1);
-    rng = std::mt19937_64(std::chrono::system_clock::now().time_since_epoch().count());
+    seed = ps.seed_fixed ? ps.seed : makeSeed();
+    seed_fixed = ps.seed_fixed;
 
     frozen_phonon_enabled = ps.frozen_phonon_enabled;
     force_default = ps.force_default;
@@ -95,15 +124,10 @@ double PhononScattering::getVibrations(unsigned int element) {
     return u_squareds[element-1]; // -1 as hydrogen is 1, but element 0
 }
 
-double PhononScattering::generateTdsFactor(AtomSite& at, int direction) {
+double PhononScattering::getTdsSigma(const AtomSite& at, int direction) {
     if (direction < 0 || direction > 2)
         throw std::runtime_error("Error trying to apply thermal displacement to axis: " + std::to_string(direction));
 
-    // need element (just pass atom?)
-
-    // TODO: check this behaves as expected, may want to reset the random stuff
-    // sqrt as we have the mean squared displacement (variance), but want the standard deviation
-
     double u = 0.0;
 
     if ( force_default )
@@ -122,10 +146,20 @@ double PhononScattering::generateTdsFactor(AtomSite& at, int direction) {
         u = getVibrations((unsigned int) at.A);
     }
 
-    auto jj = dist(rng);
-    double randNormal = std::sqrt(u) * jj;
+    // sqrt as we have the mean squared displacement (variance), but want the standard deviation
+    return std::sqrt(u);
+}
 
-    return randNormal;
+std::array<double, 3> PhononScattering::generateTdsFactors(const AtomSite& at, unsigned int atom, unsigned int job, unsigned int config) {
+    auto r = philox4x32_10({atom, config, job, 0u}, {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
 
+    // Box-Muller, the 4 uniform numbers give 4 normal numbers (only 3 are needed)
+    double r_1 = std::sqrt(-2.0 * std::log(philoxUniform(r[0])));
+    double t_1 = 2.0 * M_PI * philoxUniform(r[1]);
+    double r_2 = std::sqrt(-2.0 * std::log(philoxUniform(r[2])));
+    double t_2 = 2.0 * M_PI * philoxUniform(r[3]);
 
+    return {r_1 * std::cos(t_1) * getTdsSigma(at, 0),
+            r_1 * std::sin(t_1) * getTdsSigma(at, 1),
+            r_2 * std::cos(t_2) * getTdsSigma(at, 2)};
 }
@@ -5,6 +5,8 @@
 #ifndef CLTEM_THERMAL_H
 #define CLTEM_THERMAL_H
 
+#include <array>
+#include <cstdint>
 #include <vector>
 #include <stdexcept>
 #include <structure/atom.h>
@@ -25,8 +27,10 @@ class PhononScattering {
 
     std::vector<int> set_elements;
 
-    std::mt19937_64 rng;
-    std::normal_distribution<> dist;
+    // the key for the random displacements, a new one is made for each copy (so each simulation is different) unless
+    // it has been set (so the configurations can be reproduced)
+    uint64_t seed;
+    bool seed_fixed;
 
     // if this is set, then the default value is used for everything
     bool force_default;
@@ -46,7 +50,17 @@ public:
     void setFrozenPhononEnabled(bool enabled) {frozen_phonon_enabled = enabled;}
     bool getFrozenPhononEnabled() {return frozen_phonon_enabled;}
 
-    double generateTdsFactor(AtomSite& at, int direction);
+    uint64_t getSeed() {return seed;}
+    void setSeed(uint64_t s) {seed = s; seed_fixed = true;}
+    bool seedFixed() {return seed_fixed;}
+
+    // the standard deviation of the thermal displacement of this atom along one of the axes
+    double getTdsSigma(const AtomSite& at, int direction);
+
+    // The displacements of an atom along the three axes for a configuration. These are made from a counter based
+    // generator, so they only depend on the seed, the atom (its index in the structure), the job and the configuration.
+    // The same numbers are made on the device by the phonon_displace kernel.
+    std::array<double, 3> generateTdsFactors(const AtomSite& at, unsigned int atom, unsigned int job, unsigned int config);
 
     std::vector<double> getDefinedVibrations();
 
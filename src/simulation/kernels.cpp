@@ -3,7 +3,6 @@
 std::string KernelSource::cl_opts = "";
 bool KernelSource::use_native_funcs = false;
 
-KernelSource Kernels::atom_sort_f;
 KernelSource Kernels::band_limit_f;
 KernelSource Kernels::band_pass_f;
 KernelSource Kernels::ccd_dqe_f;
@@ -20,8 +19,17 @@ KernelSource Kernels::sqabs_f;
 KernelSource Kernels::sum_reduction_f;
 KernelSource Kernels::bilinear_translate_f;
 KernelSource Kernels::complex_to_real_f;
+KernelSource Kernels::propagator_callback_f;
+KernelSource Kernels::stem_detectors_f;
+KernelSource Kernels::potential_deposit_f;
+KernelSource Kernels::potential_structure_factors_f;
+KernelSource Kernels::potential_transmission_f;
+KernelSource Kernels::prism_probes_f;
+KernelSource Kernels::diffraction_pattern_f;
+KernelSource Kernels::phonon_displace_f;
+KernelSource Kernels::accumulate_f;
+KernelSource Kernels::poisson_noise_f;
 
-KernelSource Kernels::atom_sort_d;
 KernelSource Kernels::band_limit_d;
 KernelSource Kernels::band_pass_d;
 KernelSource Kernels::ccd_dqe_d;
@@ -37,4 +45,14 @@ KernelSource Kernels::propagator_d;
 KernelSource Kernels::sqabs_d;
 KernelSource Kernels::sum_reduction_d;
 KernelSource Kernels::bilinear_translate_d;
-KernelSource Kernels::complex_to_real_d;
\ No newline at end of file
+KernelSource Kernels::complex_to_real_d;
+KernelSource Kernels::propagator_callback_d;
+KernelSource Kernels::stem_detectors_d;
+KernelSource Kernels::potential_deposit_d;
+KernelSource Kernels::potential_structure_factors_d;
+KernelSource Kernels::potential_transmission_d;
+KernelSource Kernels::prism_probes_d;
+KernelSource Kernels::diffraction_pattern_d;
+KernelSource Kernels::phonon_displace_d;
+KernelSource Kernels::accumulate_d;
+KernelSource Kernels::poisson_noise_d;
\ No newline at end of file
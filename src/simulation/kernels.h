@@ -35,13 +35,23 @@ public:
     unsigned int getNumArgs() { std::lock_guard<std::mutex> lck(mtx); return num_args; }
 
     clKernel BuildToKernel(std::shared_ptr<clContext> ctx) {
+        return BuildToKernel(std::move(ctx), "");
+    }
+
+    // builds a variant of the kernel with extra build options, i.e. -D definitions so some of the arguments are
+    // fixed when it is compiled (see each kernel for what it supports)
+    clKernel BuildToKernel(std::shared_ptr<clContext> ctx, const std::string &defines) {
         std::lock_guard<std::mutex> lck(mtx);
 
         std::string kernel_string = source;
         if (!use_native_funcs)
             Utils::replace(kernel_string, "native_", "");
 
-        return clKernel(ctx, kernel_string, name, num_args, cl_opts);
+        std::string opts = cl_opts;
+        if (!defines.empty())
+            opts = opts.empty() ? defines : opts + " " + defines;
+
+        return clKernel(ctx, kernel_string, name, num_args, opts);
     }
 
     static void setOptions(bool mad, bool no_signed_0, bool unsafe_math, bool finite_math, bool use_native) {
@@ -102,7 +112,6 @@ private:
 
 struct Kernels
 {
-    static KernelSource atom_sort_f;
     static KernelSource band_limit_f;
     static KernelSource band_pass_f;
     static KernelSource ccd_dqe_f;
@@ -119,8 +128,17 @@ struct Kernels
     static KernelSource sum_reduction_f;
     static KernelSource bilinear_translate_f;
     static KernelSource complex_to_real_f;
+    static KernelSource propagator_callback_f;
+    static KernelSource stem_detectors_f;
+    static KernelSource potential_deposit_f;
+    static KernelSource potential_structure_factors_f;
+    static KernelSource potential_transmission_f;
+    static KernelSource prism_probes_f;
+    static KernelSource diffraction_pattern_f;
+    static KernelSource phonon_displace_f;
+    static KernelSource accumulate_f;
+    static KernelSource poisson_noise_f;
 
-    static KernelSource atom_sort_d;
     static KernelSource band_limit_d;
     static KernelSource band_pass_d;
     static KernelSource ccd_dqe_d;
@@ -137,6 +155,16 @@ struct Kernels
     static KernelSource sum_reduction_d;
     static KernelSource bilinear_translate_d;
     static KernelSource complex_to_real_d;
+    static KernelSource propagator_callback_d;
+    static KernelSource stem_detectors_d;
+    static KernelSource potential_deposit_d;
+    static KernelSource potential_structure_factors_d;
+    static KernelSource potential_transmission_d;
+    static KernelSource prism_probes_d;
+    static KernelSource diffraction_pattern_d;
+    static KernelSource phonon_displace_d;
+    static KernelSource accumulate_d;
+    static KernelSource poisson_noise_d;
 
 };
 
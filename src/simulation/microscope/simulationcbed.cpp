@@ -13,9 +13,11 @@ void SimulationCbed<T>::initialiseBuffers() {
 template <>
 void SimulationCbed<float>::initialiseKernels() {
 
-    if (do_initialise_cbed) {
-        InitProbeWavefunction = Kernels::init_probe_wave_f.BuildToKernel(ctx);
-    }
+    // the zero aberrations are compiled out, so this is rebuilt when they change
+    std::string defines = aberrationDefines();
+    if (do_initialise_cbed || defines != probe_defines)
+        InitProbeWavefunction = Kernels::init_probe_wave_f.BuildToKernel(ctx, defines);
+    probe_defines = defines;
 
     do_initialise_cbed = false;
 }
@@ -23,9 +25,11 @@ void SimulationCbed<float>::initialiseKernels() {
 template <>
 void SimulationCbed<double>::initialiseKernels() {
 
-    if (do_initialise_cbed) {
-        InitProbeWavefunction = Kernels::init_probe_wave_d.BuildToKernel(ctx);
-    }
+    // the zero aberrations are compiled out, so this is rebuilt when they change
+    std::string defines = aberrationDefines();
+    if (do_initialise_cbed || defines != probe_defines)
+        InitProbeWavefunction = Kernels::init_probe_wave_d.BuildToKernel(ctx, defines);
+    probe_defines = defines;
 
     do_initialise_cbed = false;
 }
@@ -130,7 +134,10 @@ void SimulationCbed<GPU_Type>::simulate() {
     auto pos = job->simManager->cbedPosition();
     unsigned int resolution = job->simManager->resolution();
 
-    initialiseProbeWave(pos->getXPos(), pos->getYPos());
+    // every batched phonon configuration starts with the same probe (the outputs are summed over these)
+    unsigned int configs = job->configs;
+    for (unsigned int k = 0; k < clWaveFunctionReal.size(); ++k)
+        initialiseProbeWave(pos->getXPos(), pos->getYPos(), k);
 
     // TODO: set this properly
     // This will be a pre-calculated variable to set how often we pull our our slice data
@@ -190,7 +197,7 @@ void SimulationCbed<GPU_Type>::simulate() {
             return;
 
         if (slice_step > 0 && (i+1) % slice_step == 0) {
-            diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+            diff.getSliceRef(output_counter) = getDiffractionSum(configs, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
             output_counter++;
         }
 
@@ -201,12 +208,14 @@ void SimulationCbed<GPU_Type>::simulate() {
     }
 
     if (output_counter < output_count) {
-        diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+        diff.getSliceRef(output_counter) = getDiffractionSum(configs, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
     }
 
+    diff.getWeightingRef() = {static_cast<double>(configs)};
+
     Images.insert(return_map::value_type("Diff", diff));
 
-    job->simManager->updateImages(Images, 1); // Update this if we ever do more than one TDS in a job
+    job->simManager->updateImages(Images, configs);
 }
 
 template class SimulationCbed<float>;
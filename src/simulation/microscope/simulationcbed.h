@@ -25,7 +25,8 @@ protected:
 
     using SimulationGeneral<GPU_Type>::doMultiSliceStep;
     using SimulationGeneral<GPU_Type>::modifyBeamTilt;
-    using SimulationGeneral<GPU_Type>::getDiffractionImage;
+    using SimulationGeneral<GPU_Type>::getDiffractionSum;
+    using SimulationGeneral<GPU_Type>::aberrationDefines;
 
     using SimulationGeneral<GPU_Type>::reference_perturb_x;
     using SimulationGeneral<GPU_Type>::reference_perturb_y;
@@ -38,6 +39,8 @@ protected:
     void initialiseKernels();
 
     bool do_initialise_cbed;
+    // what the probe kernel was last built with
+    std::string probe_defines;
 
 public:
     explicit SimulationCbed(clDevice &_dev, ThreadPool &s, unsigned int _id) : SimulationCtem<GPU_Type>(_dev, s, _id), do_initialise_cbed(true) {}
@@ -17,7 +17,45 @@ void SimulationCtem<T>::initialiseBuffers() {
 
         // TODO: I can further split these up, but they aren't a huge issue
         clTempBuffer = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
-        clCcdBuffer = clMemory<T, Manual>(ctx, 725);
+        clDoseNoiseless = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
+        clDqeBuffer = clMemory<T, Manual>(ctx, 725);
+        clNtfBuffer = clMemory<T, Manual>(ctx, 725);
+    }
+
+    // the realisations are only needed when there is noise to add
+    dose_realisations = 1;
+    if (sim_mode == SimulationMode::CTEM && sm->ctemImageEnabled() && CCDParams::nameExists(sm->ccdName()))
+        dose_realisations = sm->doseRealisations();
+
+    if (dose_realisations < 2)
+        clDoseRealisations = clMemory<std::complex<T>, Manual>();
+    else if (clDoseRealisations.GetSize() != dose_realisations * rs * rs)
+        clDoseRealisations = clMemory<std::complex<T>, Manual>(ctx, dose_realisations * rs * rs);
+
+    // the images of the batched phonon configurations are summed into this
+    if (sim_mode != SimulationMode::CTEM || !sm->ctemImageEnabled() || sm->waveStackSize() < 2)
+        clImageSum = clMemory<std::complex<T>, Manual>();
+    else if (clImageSum.GetSize() != rs * rs)
+        clImageSum = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
+
+    // the readbacks have all finished by now, so these can be replaced
+    if (sim_mode == SimulationMode::CTEM) {
+        for (auto &set : staging) {
+            if (set.exit_wave.GetSize() != rs * rs) {
+                set.exit_wave = clMemory<std::complex<T>, Manual>(ctx, rs * rs, MemoryFlags::HostReadWrite);
+                set.diffraction = clMemory<T, Manual>(ctx, rs * rs, MemoryFlags::HostReadWrite);
+            }
+
+            if (!sm->ctemImageEnabled())
+                set.image = clMemory<std::complex<T>, Manual>();
+            else if (set.image.GetSize() != rs * rs)
+                set.image = clMemory<std::complex<T>, Manual>(ctx, rs * rs, MemoryFlags::HostReadWrite);
+
+            if (dose_realisations < 2)
+                set.realisations = clMemory<std::complex<T>, Manual>();
+            else if (set.realisations.GetSize() != dose_realisations * rs * rs)
+                set.realisations = clMemory<std::complex<T>, Manual>(ctx, dose_realisations * rs * rs, MemoryFlags::HostReadWrite);
+        }
     }
 }
 
@@ -26,12 +64,18 @@ void SimulationCtem<float>::initialiseKernels() {
 
     if (do_initialise_ctem) {
         InitPlaneWavefunction = Kernels::init_plane_wave_f.BuildToKernel(ctx);
-        ImagingKernel = Kernels::ctem_image_f.BuildToKernel(ctx);
         ABS2 = Kernels::sqabs_f.BuildToKernel(ctx);
         NtfKernel = Kernels::ccd_ntf_f.BuildToKernel(ctx);
         DqeKernel = Kernels::ccd_dqe_f.BuildToKernel(ctx);
+        PoissonNoise = Kernels::poisson_noise_f.BuildToKernel(ctx);
     }
 
+    // the zero aberrations are compiled out, so this is rebuilt when they change
+    std::string defines = aberrationDefines();
+    if (do_initialise_ctem || defines != imaging_defines)
+        ImagingKernel = Kernels::ctem_image_f.BuildToKernel(ctx, defines);
+    imaging_defines = defines;
+
     do_initialise_ctem = false;
 }
 
@@ -40,12 +84,18 @@ void SimulationCtem<double>::initialiseKernels() {
 
     if (do_initialise_ctem) {
         InitPlaneWavefunction = Kernels::init_plane_wave_d.BuildToKernel(ctx);
-        ImagingKernel = Kernels::ctem_image_d.BuildToKernel(ctx);
         ABS2 = Kernels::sqabs_d.BuildToKernel(ctx);
         NtfKernel = Kernels::ccd_ntf_d.BuildToKernel(ctx);
         DqeKernel = Kernels::ccd_dqe_d.BuildToKernel(ctx);
+        PoissonNoise = Kernels::poisson_noise_d.BuildToKernel(ctx);
     }
 
+    // the zero aberrations are compiled out, so this is rebuilt when they change
+    std::string defines = aberrationDefines();
+    if (do_initialise_ctem || defines != imaging_defines)
+        ImagingKernel = Kernels::ctem_image_d.BuildToKernel(ctx, defines);
+    imaging_defines = defines;
+
     do_initialise_ctem = false;
 }
 
@@ -75,43 +125,52 @@ bool SimulationCtem<T>::initialiseSimulation()
 
     clWorkGroup WorkSize(resolution, resolution, 1);
     double InitialValue = 1.0;
-    InitPlaneWavefunction.SetArg(0, clWaveFunctionReal[0], ArgumentType::Output);
     InitPlaneWavefunction.SetArg(1, resolution);
     InitPlaneWavefunction.SetArg(2, resolution);
     InitPlaneWavefunction.SetArg(3, static_cast<T>(InitialValue));
-    InitPlaneWavefunction.run(WorkSize);
 
-    ctx->WaitForQueueFinish();
+    // every batched phonon configuration starts with the same plane wave
+    for (auto &wave : clWaveFunctionReal) {
+        InitPlaneWavefunction.SetArg(0, wave, ArgumentType::Output);
+        InitPlaneWavefunction.run(WorkSize);
+    }
 
-    return true;
-}
+    syncStep();
 
-template <class T>
-void SimulationCtem<T>::simulateCtemImage() {
-    // Check if have a CCD set, then do that method instead
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Upload the CCD curves
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     std::string ccd = job->simManager->ccdName();
-    if (CCDParams::nameExists(ccd)) {
+    if (job->simManager->ctemImageEnabled() && CCDParams::nameExists(ccd)) {
+        CLOG(DEBUG, "sim") << "Upload DQE and NTF buffers";
+        // convert these to our GPU type
         std::vector<double> dqe_d = CCDParams::getDQE(ccd);
         std::vector<double> ntf_d = CCDParams::getNTF(ccd);
-        // convert these to our GPU type
         std::vector<T> dqe(dqe_d.begin(), dqe_d.end());
         std::vector<T> ntf(ntf_d.begin(), ntf_d.end());
-        int binning = job->simManager->ccdBinning();
-        // get dose
-        double dose = job->simManager->ccdDose(); // electrons per area
-        // get electrons per pixel
-        double scale = job->simManager->realScale();
-        scale *= scale; // square it to get area of pixel
-        double dose_per_pix = dose * scale;
-
-        simulateImageDose(dqe, ntf, binning, dose_per_pix);
+
+        clDqeBuffer.Write(dqe);
+        clNtfBuffer.Write(ntf);
+        // the vectors only last until we return
+        ctx->WaitForIOQueueFinish();
+    }
+
+    return true;
+}
+
+template <class T>
+void SimulationCtem<T>::simulateCtemImage(unsigned int slot, unsigned int realisation) {
+    // Check if have a CCD set, then do that method instead
+    if (CCDParams::nameExists(job->simManager->ccdName())) {
+        simulateImageDose(slot);
+        addDoseNoise(slot, realisation);
     } else {
-        simulateImagePerfect();
+        simulateImagePerfect(slot);
     }
 }
 
 template <class T>
-void SimulationCtem<T>::simulateImagePerfect()
+void SimulationCtem<T>::simulateImagePerfect(unsigned int slot)
 {
     CLOG(DEBUG, "sim") << "Start CTEM image simulation (no dose calculation)";
     unsigned int resolution = job->simManager->resolution();
@@ -120,7 +179,7 @@ void SimulationCtem<T>::simulateImagePerfect()
 
     CLOG(DEBUG, "sim") << "Calculating CTEM image from wavefunction";
     // Set arguments for imaging kernel
-    ImagingKernel.SetArg(0, clWaveFunctionRecip[0], ArgumentType::Input);
+    ImagingKernel.SetArg(0, clWaveFunctionRecip[slot], ArgumentType::Input);
     ImagingKernel.SetArg(1, clImageWaveFunction, ArgumentType::Output);
     ImagingKernel.SetArg(2, resolution);
     ImagingKernel.SetArg(3, resolution);
@@ -149,12 +208,12 @@ void SimulationCtem<T>::simulateImagePerfect()
     clWorkGroup Work(resolution, resolution, 1);
 
     ImagingKernel.run(Work);
-    ctx->WaitForQueueFinish();
+    syncStep();
 
     // Now get and display absolute value
     CLOG(DEBUG, "sim") << "IFFT to real space";
     FourierTrans.run(clImageWaveFunction, clWaveFunctionTemp_1, Direction::Inverse);
-    ctx->WaitForQueueFinish();
+    syncStep();
 
     CLOG(DEBUG, "sim") << "Calculate absolute squared";
     ABS2.SetArg(0, clWaveFunctionTemp_1, ArgumentType::Input);
@@ -162,20 +221,17 @@ void SimulationCtem<T>::simulateImagePerfect()
     ABS2.SetArg(2, resolution);
     ABS2.SetArg(3, resolution);
     ABS2.run(Work);
-    ctx->WaitForQueueFinish();
+    syncStep();
 }
 
-// TODO: what should be done with the conversion factor?
-// I think it might be like an amplification thing - as in if the detector gets n electrons, it will 'detect' n*conversion factor?
 template <class T>
-void SimulationCtem<T>::simulateImageDose(std::vector<T> dqe_data, std::vector<T> ntf_data, int binning,
-                                                double doseperpix, double conversionfactor)
+void SimulationCtem<T>::simulateImageDose(unsigned int slot)
 {
     // all the NTF, DQE stuff can be found here: 10.1016/j.jsb.2013.05.008
     CLOG(DEBUG, "sim") << "Start CTEM image simulation (with calculation)";
 
     unsigned int resolution = job->simManager->resolution();
-    auto mParams = job->simManager->microscopeParams();
+    int binning = job->simManager->ccdBinning();
 
     clWorkGroup Work(resolution, resolution, 1);
 
@@ -183,7 +239,7 @@ void SimulationCtem<T>::simulateImageDose(std::vector<T> dqe_data, std::vector<T
     // Do the 'normal' image calculation
     //
 
-    simulateImagePerfect();
+    simulateImagePerfect(slot);
 
     //
     // Dose stuff starts here!
@@ -192,93 +248,178 @@ void SimulationCtem<T>::simulateImageDose(std::vector<T> dqe_data, std::vector<T
     // FFT
     CLOG(DEBUG, "sim") << "FFT back to reciprocal space";
     FourierTrans.run(clImageWaveFunction, clTempBuffer, Direction::Forwards);
-    ctx->WaitForQueueFinish();
-
-    // write DQE to opencl
-    CLOG(DEBUG, "sim") << "Upload DQE buffer";
-    clCcdBuffer.Write(dqe_data);
-    ctx->WaitForQueueFinish();
+    syncStep();
 
     CLOG(DEBUG, "sim") << "Apply DQE";
     // apply DQE
     DqeKernel.SetArg(0, clTempBuffer, ArgumentType::InputOutput);
-    DqeKernel.SetArg(1, clCcdBuffer, ArgumentType::Input);
+    DqeKernel.SetArg(1, clDqeBuffer, ArgumentType::Input);
     DqeKernel.SetArg(2, resolution);
     DqeKernel.SetArg(3, resolution);
     DqeKernel.SetArg(4, binning);
 
     DqeKernel.run(Work);
-    ctx->WaitForQueueFinish();
+    syncStep();
 
     // IFFT back
     CLOG(DEBUG, "sim") << "IFFT to real space";
-    FourierTrans.run(clTempBuffer, clImageWaveFunction, Direction::Inverse);
-    ctx->WaitForQueueFinish();
-
-    CLOG(DEBUG, "sim") << "Read from buffer";
-    double N_tot = doseperpix * binning * binning; // Get this passed in, its dose per binned pixel i think.
-    std::vector<std::complex<T>> compdata = clImageWaveFunction.GetLocal();
-
-    CLOG(DEBUG, "sim") << "Add noise";
+    FourierTrans.run(clTempBuffer, clDoseNoiseless, Direction::Inverse);
+    syncStep();
+}
 
-//    std::random_device rd;
-    std::mt19937_64 rng(std::mt19937_64(std::chrono::system_clock::now().time_since_epoch().count()));
+// TODO: what should be done with the conversion factor?
+// I think it might be like an amplification thing - as in if the detector gets n electrons, it will 'detect' n*conversion factor?
+template <class T>
+void SimulationCtem<T>::addDoseNoise(unsigned int slot, unsigned int realisation, double conversionfactor)
+{
+    auto sm = job->simManager;
+    unsigned int resolution = sm->resolution();
+    int binning = sm->ccdBinning();
 
-    for (int i = 0; i < resolution * resolution; i++) {
-        // previously was using a Box-Muller transform to get a normal dist and assuming it would approximate a poisson distribution
-        // see: https://stackoverflow.com/questions/19944111/creating-a-gaussian-random-generator-with-a-mean-and-standard-deviation
+    clWorkGroup Work(resolution, resolution, 1);
 
-        // use the built in stuff for ease
-        std::poisson_distribution<int> dist(N_tot * compdata[i].real()); // TODO: here we are assuming this function is only real?
-        double poiss = dist(rng);
+    // get electrons per pixel (the dose is per area)
+    double scale = sm->realScale();
+    double N_tot = sm->ccdDose() * scale * scale * binning * binning; // its dose per binned pixel i think.
 
-        compdata[i].real(conversionfactor * poiss);
-        compdata[i].imag(0);
-    }
+    // the noise comes from a counter based generator, so it only depends on the seed, the phonon configuration (each
+    // job has its own) and the realisation
+    uint64_t seed = sm->doseSeed();
+    unsigned int config = job->id * sm->waveStackSize() + slot;
 
-    CLOG(DEBUG, "sim") << "Write back to buffer";
-    clImageWaveFunction.Write(compdata);
-    ctx->WaitForQueueFinish();
+    CLOG(DEBUG, "sim") << "Add noise";
+    PoissonNoise.SetArg(0, clDoseNoiseless, ArgumentType::Input);
+    PoissonNoise.SetArg(1, clImageWaveFunction, ArgumentType::Output);
+    PoissonNoise.SetArg(2, resolution);
+    PoissonNoise.SetArg(3, resolution);
+    PoissonNoise.SetArg(4, static_cast<T>(N_tot));
+    PoissonNoise.SetArg(5, static_cast<T>(conversionfactor));
+    PoissonNoise.SetArg(6, static_cast<unsigned int>(seed));
+    PoissonNoise.SetArg(7, static_cast<unsigned int>(seed >> 32));
+    PoissonNoise.SetArg(8, config);
+    PoissonNoise.SetArg(9, realisation);
+
+    PoissonNoise.run(Work);
+    syncStep();
 
     CLOG(DEBUG, "sim") << "FFT to reciprocal space";
     FourierTrans.run(clImageWaveFunction, clTempBuffer, Direction::Forwards);
-    ctx->WaitForQueueFinish();
-
-    CLOG(DEBUG, "sim") << "Upload NTF buffer";
-    clCcdBuffer.Write(ntf_data);
-    ctx->WaitForQueueFinish();
+    syncStep();
 
     CLOG(DEBUG, "sim") << "Apply NTF";
     NtfKernel.SetArg(0, clTempBuffer, ArgumentType::InputOutput);
-    NtfKernel.SetArg(1, clCcdBuffer, ArgumentType::Input);
+    NtfKernel.SetArg(1, clNtfBuffer, ArgumentType::Input);
     NtfKernel.SetArg(2, resolution);
     NtfKernel.SetArg(3, resolution);
     NtfKernel.SetArg(4, binning);
 
     NtfKernel.run(Work);
-    ctx->WaitForQueueFinish();
+    syncStep();
 
     CLOG(DEBUG, "sim") << "FFT to real space";
     FourierTrans.run(clTempBuffer, clImageWaveFunction, Direction::Inverse);
-    ctx->WaitForQueueFinish();
+    syncStep();
 }
 
 template <class T>
-std::vector<double> SimulationCtem<T>::getCtemImage()
+void SimulationCtem<T>::stageOutputs(Image<double> &ew, Image<double> &diff, Image<double> &ctem_im, Image<double> &dose_im,
+                                     unsigned int index, bool sim_im, double d_kx, double d_ky, unsigned int configs)
 {
-    CLOG(DEBUG, "sim") << "Getting CTEM image image";
+    auto &set = staging[next_staging];
+    next_staging = (next_staging + 1) % staging.size();
+
+    // this set can't be copied over until its last readback is done
+    if (set.readback.valid())
+        set.readback.get();
+
+    CLOG(DEBUG, "sim") << "Staging outputs " << index;
+    // the batched phonon configurations are summed on the device, so there is still only one set to read back
+    calculateExitWaveSum(configs).CopyTo(set.exit_wave);
+
+    calculateDiffractionSum(configs, d_kx, d_ky).CopyTo(set.diffraction);
+
     unsigned int resolution = job->simManager->resolution();
-    std::vector<double> data_out(resolution*resolution);
+    unsigned int n_real = dose_realisations;
+
+    if (sim_im && n_real > 1) {
+        // the noiseless image is only made once, then each realisation is summed into its own part of the stack
+        for (unsigned int k = 0; k < configs; ++k) {
+            simulateImageDose(k);
+            for (unsigned int r = 0; r < n_real; ++r) {
+                addDoseNoise(k, index * n_real + r);
+                accumulate(clImageWaveFunction, clDoseRealisations, k == 0, r * resolution * resolution);
+            }
+        }
+        clDoseRealisations.CopyTo(set.realisations);
+    } else if (sim_im) {
+        for (unsigned int k = 0; k < configs; ++k) {
+            simulateCtemImage(k, index);
+            if (configs > 1)
+                accumulate(clImageWaveFunction, clImageSum, k == 0);
+        }
+        (configs > 1 ? clImageSum : clImageWaveFunction).CopyTo(set.image);
+    }
+
+    // get the copies going before the next slices are queued behind them
+    ctx->QueueFlush();
+
+    cl::CommandQueue &queue = ctx->GetReadbackQueue();
 
-    // Original data is complex so copy complex version down first
-    CLOG(DEBUG, "sim") << "Copy from buffer";
-    std::vector<std::complex<T>> compdata = clImageWaveFunction.GetLocal();
+    // each readback only writes to its own slice of the images
+    set.readback = std::async(std::launch::async, [exit_wave = set.exit_wave, diffraction = set.diffraction,
+                                                   image = set.image, realisations = set.realisations, &ew, &diff,
+                                                   &ctem_im, &dose_im, &queue, index, resolution, sim_im,
+                                                   n_real]() mutable {
+        ew.getSliceRef(index) = exitWaveToImage(exit_wave.GetMapped(queue), resolution);
 
-    CLOG(DEBUG, "sim") << "Getting only real part";
-    for (int i = 0; i < resolution * resolution; i++)
-        data_out[i] = compdata[i].real(); // already abs in simulateCTEM function (but is still 'complex' type?)
+        auto diff_data = diffraction.GetMapped(queue);
+        diff.getSliceRef(index) = std::vector<double>(diff_data.begin(), diff_data.end());
+
+        if (sim_im && n_real > 1) {
+            auto compdata = realisations.GetMapped(queue);
+            unsigned int size = resolution * resolution;
+
+            for (unsigned int r = 0; r < n_real; ++r) {
+                std::vector<double> data_out(size);
+                for (unsigned int i = 0; i < size; i++)
+                    data_out[i] = compdata[r * size + i].real();
+
+                // the first realisation is also the usual image
+                if (r == 0)
+                    ctem_im.getSliceRef(index) = data_out;
+                dose_im.getSliceRef(index * n_real + r) = std::move(data_out);
+            }
+        } else if (sim_im) {
+            auto compdata = image.GetMapped(queue);
+            std::vector<double> data_out(resolution * resolution);
 
-    return data_out;
+            // already abs in simulateCTEM function (but is still 'complex' type?)
+            for (unsigned int i = 0; i < resolution * resolution; i++)
+                data_out[i] = compdata[i].real();
+
+            ctem_im.getSliceRef(index) = std::move(data_out);
+        }
+    });
+}
+
+template <class T>
+void SimulationCtem<T>::finishStaging(bool rethrow)
+{
+    // everything is waited for before anything is rethrown, so nothing is left writing to the images
+    std::exception_ptr error;
+    for (auto &set : staging) {
+        if (!set.readback.valid())
+            continue;
+        try {
+            set.readback.get();
+        } catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+
+    if (error && rethrow)
+        std::rethrow_exception(error);
 }
 
 template<class GPU_Type>
@@ -296,6 +437,8 @@ void SimulationCtem<GPU_Type>::simulate() {
     unsigned int resolution = job->simManager->resolution();
     std::valarray<unsigned int> im_crop = job->simManager->imageCrop();
     bool sim_im = job->simManager->ctemImageEnabled();
+    // the number of phonon configurations in the stack (that are summed into the outputs)
+    unsigned int configs = job->configs;
 
     // TODO: set this properly
     // This will be a pre-calculated variable to set how often we pull our our slice data
@@ -311,6 +454,16 @@ void SimulationCtem<GPU_Type>::simulate() {
     Image<double> ctem_im;
     if (sim_im)
         ctem_im = Image<double>(resolution, resolution, output_count, im_crop[0], im_crop[1], im_crop[2], im_crop[3]);
+    // all the realisations of each thickness are together
+    Image<double> dose_im;
+    if (sim_im && dose_realisations > 1)
+        dose_im = Image<double>(resolution, resolution, output_count * dose_realisations, im_crop[0], im_crop[1], im_crop[2], im_crop[3]);
+
+    // the readbacks write into the images above, so they must be finished before they go (i.e. when cancelling)
+    struct StagingGuard {
+        SimulationCtem *sim;
+        ~StagingGuard() { sim->finishStaging(false); }
+    } staging_guard{this};
 
     //
     // plasmon setup
@@ -361,15 +514,9 @@ void SimulationCtem<GPU_Type>::simulate() {
             return;
 
         // get data when we have the right number of slices (unless it is the end, that is always done after the loop)
+        // this is read back on another thread while the next slices are simulated
         if (slice_step > 0 && (i + 1) % slice_step == 0) {
-            ew.getSliceRef(output_counter) = getExitWaveImage();
-            diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
-
-            if (sim_im) {
-                simulateCtemImage();
-                ctem_im.getSliceRef(output_counter) = getCtemImage();
-            }
-
+            stageOutputs(ew, diff, ctem_im, dose_im, output_counter, sim_im, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1], configs);
             ++output_counter;
         }
 
@@ -380,23 +527,29 @@ void SimulationCtem<GPU_Type>::simulate() {
     }
 
     // get the final slice output
-    if (output_counter < output_count) {
-        ew.getSliceRef(output_counter) = getExitWaveImage();
-        diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
-        if (sim_im) {
-            simulateCtemImage();
-            ctem_im.getSliceRef(output_counter) = getCtemImage();
-        }
-    }
+    if (output_counter < output_count)
+        stageOutputs(ew, diff, ctem_im, dose_im, output_counter, sim_im, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1], configs);
+
     CLOG(DEBUG, "sim") << "Getting return images";
+    finishStaging();
+
+    // the outputs are sums over the configurations, so they are weighted to match
+    ew.getWeightingRef() = {static_cast<double>(configs)};
+    diff.getWeightingRef() = {static_cast<double>(configs)};
+    if (sim_im)
+        ctem_im.getWeightingRef() = {static_cast<double>(configs)};
+    if (sim_im && dose_realisations > 1)
+        dose_im.getWeightingRef() = {static_cast<double>(configs)};
 
     // get the images we need
     Images.insert(return_map::value_type("EW", ew));
     Images.insert(return_map::value_type("Diff", diff));
     if (sim_im)
         Images.insert(return_map::value_type("Image", ctem_im));
+    if (sim_im && dose_realisations > 1)
+        Images.insert(return_map::value_type("Image realisations", dose_im));
 
-    job->simManager->updateImages(Images, 1);
+    job->simManager->updateImages(Images, configs);
 }
 
 template class SimulationCtem<float>;
@@ -5,6 +5,9 @@
 #ifndef CLTEM_SIMULATIONCTEM_H
 #define CLTEM_SIMULATIONCTEM_H
 
+#include <array>
+#include <future>
+
 #include "simulationgeneral.h"
 #include "ccdparams.h"
 
@@ -16,18 +19,23 @@ protected:
     using SimulationGeneral<GPU_Type>::job;
     using SimulationGeneral<GPU_Type>::last_mode;
     using SimulationGeneral<GPU_Type>::ctx;
+    using SimulationGeneral<GPU_Type>::syncStep;
 
     using SimulationGeneral<GPU_Type>::clWaveFunctionReal;
     using SimulationGeneral<GPU_Type>::clWaveFunctionRecip;
     using SimulationGeneral<GPU_Type>::clWaveFunctionTemp_1;
+    using SimulationGeneral<GPU_Type>::clWaveFunctionTemp_3;
     using SimulationGeneral<GPU_Type>::clXFrequencies;
     using SimulationGeneral<GPU_Type>::clYFrequencies;
     using SimulationGeneral<GPU_Type>::FourierTrans;
 
     using SimulationGeneral<GPU_Type>::doMultiSliceStep;
     using SimulationGeneral<GPU_Type>::modifyBeamTilt;
-    using SimulationGeneral<GPU_Type>::getDiffractionImage;
-    using SimulationGeneral<GPU_Type>::getExitWaveImage;
+    using SimulationGeneral<GPU_Type>::calculateDiffractionSum;
+    using SimulationGeneral<GPU_Type>::calculateExitWaveSum;
+    using SimulationGeneral<GPU_Type>::accumulate;
+    using SimulationGeneral<GPU_Type>::exitWaveToImage;
+    using SimulationGeneral<GPU_Type>::aberrationDefines;
 
     using SimulationGeneral<GPU_Type>::reference_perturb_x;
     using SimulationGeneral<GPU_Type>::reference_perturb_y;
@@ -36,34 +44,72 @@ protected:
     void initialiseKernels();
 
     bool do_initialise_ctem;
+    // what the imaging kernel was last built with
+    std::string imaging_defines;
 
 public:
     explicit SimulationCtem(clDevice &_dev, ThreadPool &s, unsigned int _id) : SimulationGeneral<GPU_Type>(_dev, s, _id), do_initialise_ctem(true) {}
 
-    ~SimulationCtem() {ctx->WaitForQueueFinish(); ctx->WaitForIOQueueFinish();}
+    ~SimulationCtem() {finishStaging(false); ctx->WaitForQueueFinish(); ctx->WaitForIOQueueFinish();}
 
     void simulate();
 
 private:
     bool initialiseSimulation();
 
-    void simulateCtemImage();
+    // slot is the wave in the stack (i.e. the batched phonon configuration) to image, the image is left in clImageWaveFunction
+    // realisation picks the shot noise (if there is a CCD)
+    void simulateCtemImage(unsigned int slot = 0, unsigned int realisation = 0);
+
+    void simulateImagePerfect(unsigned int slot = 0);
 
-    void simulateImagePerfect();
+    // the image with the DQE applied (but no noise yet), this is left in clDoseNoiseless
+    void simulateImageDose(unsigned int slot = 0);
 
-    void simulateImageDose(std::vector<GPU_Type> dqe_data, std::vector<GPU_Type> ntf_data, int binning, double doseperpix, double conversionfactor = 1);
+    // makes one noisy image from clDoseNoiseless (and applies the NTF), the same slot and realisation give the same noise
+    void addDoseNoise(unsigned int slot, unsigned int realisation, double conversionfactor = 1);
 
-    std::vector<double> getCtemImage();
+    // copies the current exit wave, diffraction pattern (and image) into the next staging set, then reads them back
+    // into these slices on another thread (the outputs are summed over the first configs waves in the stack)
+    // the dose realisations (if there is more than one) go in slices index * realisations onwards of dose_im
+    void stageOutputs(Image<double> &ew, Image<double> &diff, Image<double> &ctem_im, Image<double> &dose_im,
+                      unsigned int index, bool sim_im, double d_kx, double d_ky, unsigned int configs);
+
+    // waits for all the readbacks, rethrowing the first error they had (if rethrow)
+    void finishStaging(bool rethrow = true);
 
     clMemory<std::complex<GPU_Type>, Manual> clImageWaveFunction;
+    clMemory<std::complex<GPU_Type>, Manual> clImageSum;
 
     clKernel InitPlaneWavefunction;
     clKernel ImagingKernel;
     clKernel ABS2;
     clKernel NtfKernel;
     clKernel DqeKernel;
-    clMemory<GPU_Type, Manual> clCcdBuffer;
+    clKernel PoissonNoise;
+    // the CCD curves are uploaded once per simulation
+    clMemory<GPU_Type, Manual> clDqeBuffer;
+    clMemory<GPU_Type, Manual> clNtfBuffer;
+    clMemory<std::complex<GPU_Type>, Manual> clDoseNoiseless;
     clMemory<std::complex<GPU_Type>, Manual> clTempBuffer;
+
+    // the noisy images made from each noiseless image (only used with more than one realisation)
+    unsigned int dose_realisations = 1;
+    clMemory<std::complex<GPU_Type>, Manual> clDoseRealisations;
+
+    // The outputs for a thickness are copied into one of these sets (on the device) so the multislice can carry on while
+    // they are read back. A set is only reused once its last readback has finished.
+    struct OutputStaging {
+        clMemory<std::complex<GPU_Type>, Manual> exit_wave;
+        clMemory<GPU_Type, Manual> diffraction;
+        clMemory<std::complex<GPU_Type>, Manual> image;
+        clMemory<std::complex<GPU_Type>, Manual> realisations;
+        std::future<void> readback;
+    };
+
+    // double buffered, so one set is copied into while the other is read back
+    std::array<OutputStaging, 2> staging;
+    unsigned int next_staging = 0;
 };
 
 
@@ -2,8 +2,15 @@
 // Created by Jon on 31/01/2020.
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
 #include <utilities/simutils.h>
 #include "simulationgeneral.h"
+#include "native/nativekernels.h"
+#include "native/nativefourier.h"
 
 template <class T>
 void SimulationGeneral<T>::initialiseBuffers() {
@@ -15,8 +22,25 @@ void SimulationGeneral<T>::initialiseBuffers() {
     if (size_t ps = p_sz; ps != ClParameterisation.GetSize())
         ClParameterisation = clMemory<T, Manual>(ctx, ps);
 
+    // the reciprocal space potentials only make the projected potential without any beam tilt (plasmons change the tilt
+    // part way through). They are also periodic, which is wrong at the edges of the moving STEM frames (the real space
+    // potentials include the atoms just outside these)
+    bool moving_frame = sm->mode() == SimulationMode::STEM && !sm->parallelStem();
+    use_reciprocal_potentials = sm->reciprocalPotentials() && !sm->full3dEnabled() && sm->microscopeParams()->BeamTilt == 0.0 &&
+                                !sm->incoherenceEffects()->plasmons()->enabled() && !moving_frame;
+    if (sm->reciprocalPotentials() && !use_reciprocal_potentials)
+        CLOG(WARNING, "sim") << "Reciprocal space potentials do not support full 3d, beam tilt, plasmons or moving STEM frames, using real space potentials";
+
     // these need to change if the atom_count changes
-    if (size_t as = sm->simulationCell()->crystalStructure()->atoms().size(); as != ClAtomA.GetSize()) {
+    // when streaming the atoms these are not used (the slab buffers are made once the atoms are sorted)
+    use_atom_slabs = sm->atomSlabSlices() > 0;
+    if (use_atom_slabs) {
+        ClAtomA = clMemory<int, Manual>();
+        ClAtomX = clMemory<T, Manual>();
+        ClAtomY = clMemory<T, Manual>();
+        ClAtomZ = clMemory<T, Manual>();
+        ClBlockStartPositions = clMemory<int, Manual>();
+    } else if (size_t as = sm->simulationCell()->crystalStructure()->atoms().size(); as != ClAtomA.GetSize()) {
         ClAtomA = clMemory<int, Manual>(ctx, as);
         ClAtomX = clMemory<T, Manual>(ctx, as);
         ClAtomY = clMemory<T, Manual>(ctx, as);
@@ -26,57 +50,88 @@ void SimulationGeneral<T>::initialiseBuffers() {
         unsigned int blocks_y = job->simManager->blocksY();
         unsigned int number_of_slices = job->simManager->simulationCell()->sliceCount();
         ClBlockStartPositions = clMemory<int, Manual>(ctx, number_of_slices * blocks_x * blocks_y + 1);
+    }
 
-        ClBlockIds = clMemory<int, Manual>(ctx, as);
-        ClZIds = clMemory<int, Manual>(ctx, as);
+    // the undisplaced atoms, for when the phonons are made on the device
+    if (!useDevicePhonons()) {
+        ClAtomBaseX = clMemory<T, Manual>();
+        ClAtomBaseY = clMemory<T, Manual>();
+        ClAtomBaseZ = clMemory<T, Manual>();
+        ClAtomSigma = clMemory<T, Manual>();
+        ClAtomId = clMemory<int, Manual>();
+        phonon_atoms_manager = nullptr;
+    } else if (size_t as = sm->simulationCell()->crystalStructure()->atoms().size(); as != ClAtomBaseX.GetSize()) {
+        ClAtomBaseX = clMemory<T, Manual>(ctx, as);
+        ClAtomBaseY = clMemory<T, Manual>(ctx, as);
+        ClAtomBaseZ = clMemory<T, Manual>(ctx, as);
+        ClAtomSigma = clMemory<T, Manual>(ctx, 3 * as);
+        ClAtomId = clMemory<int, Manual>(ctx, as);
+        phonon_atoms_manager = nullptr;
     }
 
     // change when the resolution does
     unsigned int rs = sm->resolution();
-    if (rs != clXFrequencies.GetSize()) {
+    bool resolution_changed = rs != clXFrequencies.GetSize();
+    if (resolution_changed) {
         clXFrequencies = clMemory<T, Manual>(ctx, rs);
         clYFrequencies = clMemory<T, Manual>(ctx, rs);
         clPropagator = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
 
-        bool precalc_transmisson = job->simManager->precalculateTransmission();
-        if (precalc_transmisson) {
-            int n_random = job->simManager->parallelPotentialsCount();
-            rng = std::mt19937_64(std::chrono::system_clock::now().time_since_epoch().count());
-            dist = std::uniform_int_distribution<>(0, n_random-1);
-
-            int n_slice = job->simManager->simulationCell()->sliceCount();
-            clTransmissionFunction.resize(n_random);
-            for (int nr = 0; nr < n_random; ++nr) {
-                clTransmissionFunction[nr].resize(n_slice);
-                for (int ns = 0; ns < n_slice; ++ns)
-                    clTransmissionFunction[nr][ns] = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
-            }
-        } else {
-            clTransmissionFunction.resize(1);
-            clTransmissionFunction[0].resize(1);
-            clTransmissionFunction[0][0] = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
-        }
-
-        clWaveFunctionTemp_1 = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
         clWaveFunctionTemp_2 = clMemory<T, Manual>(ctx, rs * rs);
         clWaveFunctionTemp_3 = clMemory<T, Manual>(ctx, rs * rs);
 
+        // the stacks need to be remade
         clWaveFunctionReal.clear();
         clWaveFunctionRecip.clear();
+    }
 
-        for (int i = 0; i < sm->parallelPixels(); ++i) {
-            clWaveFunctionReal.emplace_back(ctx, rs * rs);
-            clWaveFunctionRecip.emplace_back(ctx, rs * rs);
+    // When batching phonon configurations, each wave in the stack has its own set of transmission functions. Otherwise
+    // there is a set for each of the parallel potentials (that are picked at random for each probe).
+    size_t n_parallel = sm->waveStackSize();
+    batch_phonons = sm->mode() != SimulationMode::STEM && n_parallel > 1;
+
+    bool precalc_transmisson = sm->precalculateTransmission();
+    size_t n_sets = batch_phonons ? n_parallel : (precalc_transmisson ? sm->parallelPotentialsCount() : 1);
+    size_t n_slice = precalc_transmisson ? sm->simulationCell()->sliceCount() : 1;
+    if (resolution_changed || n_sets != clTransmissionFunction.size() || n_slice != clTransmissionFunction[0].size()) {
+        rng = std::mt19937_64(std::chrono::system_clock::now().time_since_epoch().count());
+        dist = std::uniform_int_distribution<>(0, static_cast<int>(n_sets) - 1);
+
+        clTransmissionFunction.resize(n_sets);
+        for (auto &set : clTransmissionFunction) {
+            set.resize(n_slice);
+            for (auto &trans : set)
+                trans = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
         }
     }
 
-    if (sm->parallelPixels() < clWaveFunctionReal.size()) {
-        clWaveFunctionReal.resize(sm->parallelPixels());
-        clWaveFunctionRecip.resize(sm->parallelPixels());
-    } else if (sm->parallelPixels() > clWaveFunctionReal.size()) {
-        for (int i = 0; i < sm->parallelPixels() - clWaveFunctionReal.size(); ++i) {
-            clWaveFunctionReal.emplace_back(ctx, rs * rs);
-            clWaveFunctionRecip.emplace_back(ctx, rs * rs);
+    if (!batch_phonons) {
+        clDiffractionSum = clMemory<T, Manual>();
+        clExitWaveSum = clMemory<std::complex<T>, Manual>();
+    } else if (rs * rs != clDiffractionSum.GetSize()) {
+        clDiffractionSum = clMemory<T, Manual>(ctx, rs * rs);
+        clExitWaveSum = clMemory<std::complex<T>, Manual>(ctx, rs * rs);
+    }
+
+    // the wavefunction stacks change with the resolution or number of parallel pixels (or batched configurations)
+    if (n_parallel != clWaveFunctionReal.size()) {
+        // each probe has to start on an aligned address to be used as a sub-buffer
+        size_t align = ctx->GetContextDevice().GetMemBaseAddressAlign() / sizeof(std::complex<T>);
+        align = std::max<size_t>(align, 1);
+        wave_stride = ((rs * rs + align - 1) / align) * align;
+
+        clWaveFunctionReal.clear();
+        clWaveFunctionRecip.clear();
+        clWaveFunctionTempProbe.clear();
+
+        clWaveFunctionRealStack = clMemory<std::complex<T>, Manual>(ctx, wave_stride * n_parallel);
+        clWaveFunctionRecipStack = clMemory<std::complex<T>, Manual>(ctx, wave_stride * n_parallel);
+        clWaveFunctionTemp_1 = clMemory<std::complex<T>, Manual>(ctx, wave_stride * n_parallel);
+
+        for (size_t i = 0; i < n_parallel; ++i) {
+            clWaveFunctionReal.emplace_back(clWaveFunctionRealStack, i * wave_stride, rs * rs);
+            clWaveFunctionRecip.emplace_back(clWaveFunctionRecipStack, i * wave_stride, rs * rs);
+            clWaveFunctionTempProbe.emplace_back(clWaveFunctionTemp_1, i * wave_stride, rs * rs);
         }
     }
 
@@ -91,23 +146,47 @@ void SimulationGeneral<float>::initialiseKernels() {
     if (rs != FourierTrans.GetWidth() || rs != FourierTrans.GetHeight())
         FourierTrans = clFourier<float>(ctx, rs, rs);
 
+    // transforms all the parallel probes (or phonon configurations) in one go
+    unsigned int n_parallel = sm->waveStackSize();
+    if (rs != FourierTransBatch.GetWidth() || n_parallel != FourierTransBatch.GetBatchSize() || wave_stride != FourierTransBatch.GetBatchDistance()) {
+        // the destructor doesn't destroy the plan
+        FourierTransBatch.releasePlan();
+        FourierTransBatch = clFourier<float>(ctx, rs, rs, n_parallel, wave_stride);
+    }
+
+    initialiseFusedPropagation(Kernels::propagator_callback_f, "propagator_callback_f");
+
     bool isFull3D = sm->full3dEnabled();
-    if (do_initialise_general || isFull3D != last_do_3d) {
+    // the potential kernel is built for this simulation, so it only needs rebuilding if that changes
+    std::string defines = potentialDefines(isFull3D);
+    if (do_initialise_general || isFull3D != last_do_3d || defines != potential_defines) {
         if (isFull3D)
-            CalculateTransmissionFunction = Kernels::transmission_potentials_full_3d_f.BuildToKernel(ctx);
+            CalculateTransmissionFunction = Kernels::transmission_potentials_full_3d_f.BuildToKernel(ctx, defines);
         else
-            CalculateTransmissionFunction = Kernels::transmission_potentials_projected_f.BuildToKernel(ctx);
+            CalculateTransmissionFunction = Kernels::transmission_potentials_projected_f.BuildToKernel(ctx, defines);
+        // the new kernel needs its local memory arguments (and the profile is per kernel)
+        potential_launch_set = false;
     }
     last_do_3d = isFull3D;
+    potential_defines = defines;
 
     if (do_initialise_general) {
-        AtomSort = Kernels::atom_sort_f.BuildToKernel(ctx);
         FftShift = Kernels::fft_shift_f.BuildToKernel(ctx);
         BandLimit = Kernels::band_limit_f.BuildToKernel(ctx);
         GeneratePropagator = Kernels::propagator_f.BuildToKernel(ctx);
         ComplexMultiply = Kernels::complex_multiply_f.BuildToKernel(ctx);
         BilinearTranslate = Kernels::bilinear_translate_f.BuildToKernel(ctx);
         ComplexToReal = Kernels::complex_to_real_f.BuildToKernel(ctx);
+        PhononDisplace = Kernels::phonon_displace_f.BuildToKernel(ctx);
+        Accumulate = Kernels::accumulate_f.BuildToKernel(ctx);
+    }
+
+    // these are only built when needed (the double deposit needs 64 bit atomics)
+    if (use_reciprocal_potentials && !reciprocal_kernels_built) {
+        PotentialDeposit = Kernels::potential_deposit_f.BuildToKernel(ctx);
+        PotentialStructureFactors = Kernels::potential_structure_factors_f.BuildToKernel(ctx);
+        PotentialTransmission = Kernels::potential_transmission_f.BuildToKernel(ctx);
+        reciprocal_kernels_built = true;
     }
 
     do_initialise_general = false;
@@ -121,46 +200,176 @@ void SimulationGeneral<double>::initialiseKernels() {
     if (rs != FourierTrans.GetWidth() || rs != FourierTrans.GetHeight())
         FourierTrans = clFourier<double>(ctx, rs, rs);
 
+    // transforms all the parallel probes (or phonon configurations) in one go
+    unsigned int n_parallel = sm->waveStackSize();
+    if (rs != FourierTransBatch.GetWidth() || n_parallel != FourierTransBatch.GetBatchSize() || wave_stride != FourierTransBatch.GetBatchDistance()) {
+        // the destructor doesn't destroy the plan
+        FourierTransBatch.releasePlan();
+        FourierTransBatch = clFourier<double>(ctx, rs, rs, n_parallel, wave_stride);
+    }
+
+    initialiseFusedPropagation(Kernels::propagator_callback_d, "propagator_callback_d");
+
     bool isFull3D = sm->full3dEnabled();
-    if (do_initialise_general || isFull3D != last_do_3d) {
+    // the potential kernel is built for this simulation, so it only needs rebuilding if that changes
+    std::string defines = potentialDefines(isFull3D);
+    if (do_initialise_general || isFull3D != last_do_3d || defines != potential_defines) {
         if (isFull3D)
-            CalculateTransmissionFunction = Kernels::transmission_potentials_full_3d_d.BuildToKernel(ctx);
+            CalculateTransmissionFunction = Kernels::transmission_potentials_full_3d_d.BuildToKernel(ctx, defines);
         else
-            CalculateTransmissionFunction = Kernels::transmission_potentials_projected_d.BuildToKernel(ctx);
+            CalculateTransmissionFunction = Kernels::transmission_potentials_projected_d.BuildToKernel(ctx, defines);
+        // the new kernel needs its local memory arguments (and the profile is per kernel)
+        potential_launch_set = false;
     }
     last_do_3d = isFull3D;
+    potential_defines = defines;
 
     if (do_initialise_general) {
-        AtomSort = Kernels::atom_sort_d.BuildToKernel(ctx);
         FftShift = Kernels::fft_shift_d.BuildToKernel(ctx);
         BandLimit = Kernels::band_limit_d.BuildToKernel(ctx);
         GeneratePropagator = Kernels::propagator_d.BuildToKernel(ctx);
         ComplexMultiply = Kernels::complex_multiply_d.BuildToKernel(ctx);
         BilinearTranslate = Kernels::bilinear_translate_d.BuildToKernel(ctx);
         ComplexToReal = Kernels::complex_to_real_d.BuildToKernel(ctx);
+        PhononDisplace = Kernels::phonon_displace_d.BuildToKernel(ctx);
+        Accumulate = Kernels::accumulate_d.BuildToKernel(ctx);
+    }
+
+    // these are only built when needed (the double deposit needs 64 bit atomics)
+    if (use_reciprocal_potentials && !reciprocal_kernels_built) {
+        PotentialDeposit = Kernels::potential_deposit_d.BuildToKernel(ctx);
+        PotentialStructureFactors = Kernels::potential_structure_factors_d.BuildToKernel(ctx);
+        PotentialTransmission = Kernels::potential_transmission_d.BuildToKernel(ctx);
+        reciprocal_kernels_built = true;
     }
 
     do_initialise_general = false;
 }
 
 template <class T>
-void SimulationGeneral<T>::sortAtoms() {
-    CLOG(DEBUG, "sim") << "Sorting Atoms";
+std::string SimulationGeneral<T>::potentialDefines(bool full_3d) {
+    auto sm = job->simManager;
+    unsigned int resolution = sm->resolution();
 
-    bool do_phonon = job->simManager->incoherenceEffects()->phonons()->getFrozenPhononEnabled();
+    // these need to match the arguments set in initialiseSimulation
+    int load_blocks_x = (int) std::ceil(8.0 / sm->blockScaleX());
+    int load_blocks_y = (int) std::ceil(8.0 / sm->blockScaleY());
 
-    std::vector<AtomSite> atoms = job->simManager->simulationCell()->crystalStructure()->atoms();
-    auto atom_count = static_cast<unsigned int>(atoms.size()); // Needs to be cast to int as opencl kernel expects that size
+    std::string defines = "-DFIXED_WIDTH=" + std::to_string(resolution) + " -DFIXED_HEIGHT=" + std::to_string(resolution) +
+                          " -DFIXED_BLOCK_LOAD_X=" + std::to_string(load_blocks_x) +
+                          " -DFIXED_BLOCK_LOAD_Y=" + std::to_string(load_blocks_y);
+
+    if (full_3d) {
+        int load_blocks_z = (int) std::ceil(3.0 / sm->simulationCell()->sliceThickness());
+        auto param_set = sm->structureParameters();
+
+        defines += " -DFIXED_SLICE_LOAD_Z=" + std::to_string(load_blocks_z) +
+                   " -DFIXED_PARAM_FORM=" + std::to_string(static_cast<int>(param_set.form)) +
+                   " -DFIXED_PARAM_COUNT=" + std::to_string(param_set.i_per_atom) +
+                   " -DFIXED_INTEGRALS=" + std::to_string(sm->full3dIntegrals());
+    } else {
+        defines += " -DFIXED_TABLE_SAMPLES=" + std::to_string(NativeKernels::potential_table_samples);
+
+        // plasmon scattering can tilt the beam part way through the simulation
+        bool do_plasmon = sm->incoherenceEffects()->plasmons()->enabled();
+        if (sm->microscopeParams()->BeamTilt == 0.0 && !do_plasmon)
+            defines += " -DNO_BEAM_TILT";
+    }
 
-    std::vector<int> AtomANum;
-    std::vector<T> AtomXPos;
-    std::vector<T> AtomYPos;
-    std::vector<T> AtomZPos;
+    return defines;
+}
+
+template <class T>
+std::string SimulationGeneral<T>::aberrationDefines() {
+    auto mParams = job->simManager->microscopeParams();
+
+    std::string defines;
+    auto zero = [&defines](const std::string &name, double value) {
+        if (value == 0.0)
+            defines += (defines.empty() ? "-DZERO_" : " -DZERO_") + name;
+    };
+
+    // the defocus is always used (it is changed for the chromatic aberration)
+    zero("C12", mParams->C12.Mag);
+    zero("C21", mParams->C21.Mag);
+    zero("C23", mParams->C23.Mag);
+    zero("C30", mParams->C30);
+    zero("C32", mParams->C32.Mag);
+    zero("C34", mParams->C34.Mag);
+    zero("C41", mParams->C41.Mag);
+    zero("C43", mParams->C43.Mag);
+    zero("C45", mParams->C45.Mag);
+    zero("C50", mParams->C50);
+    zero("C52", mParams->C52.Mag);
+    zero("C54", mParams->C54.Mag);
+    zero("C56", mParams->C56.Mag);
+
+    return defines;
+}
+
+template <class T>
+void SimulationGeneral<T>::initialiseFusedPropagation(KernelSource &callback, const std::string &callback_name) {
+    auto sm = job->simManager;
 
-    AtomANum.reserve(atom_count);
-    AtomXPos.reserve(atom_count);
-    AtomYPos.reserve(atom_count);
-    AtomZPos.reserve(atom_count);
+    use_fused_propagation = false;
+    if (!sm->fusedPropagation() || !fused_propagation_supported)
+        return;
+
+    // the plan only needs remaking if the stack or the propagator buffer have changed
+    unsigned int rs = sm->resolution();
+    unsigned int n_parallel = sm->waveStackSize();
+    if (rs == FourierTransPropagate.GetWidth() && n_parallel == FourierTransPropagate.GetBatchSize() &&
+        wave_stride == FourierTransPropagate.GetBatchDistance() && FourierTransPropagate.GetPostCallbackData() == clPropagator.GetBufferHandle()) {
+        use_fused_propagation = true;
+        return;
+    }
+
+    FourierTransPropagate.releasePlan();
+
+    try {
+        FourierTransPropagate = clFourier<T>(ctx, rs, rs, n_parallel, wave_stride);
+
+        std::string source = "#define PROPAGATOR_STRIDE " + std::to_string(wave_stride) + "\n" + callback.getSource();
+        FourierTransPropagate.SetPostCallback(callback_name, source, clPropagator.GetBuffer());
+
+        use_fused_propagation = true;
+    } catch (const std::exception &e) {
+        // not all clFFT versions/plans support callbacks, so just use the separate multiply from now on
+        CLOG(WARNING, "sim") << "Could not fuse propagator with FFT, using separate kernels: " << e.what();
+        FourierTransPropagate.releasePlan();
+        FourierTransPropagate = clFourier<T>();
+        fused_propagation_supported = false;
+    }
+}
+
+template <class T>
+bool SimulationGeneral<T>::useDevicePhonons() {
+    auto sm = job->simManager;
+    return sm->incoherenceEffects()->phonons()->getFrozenPhononEnabled() && sm->atomSlabSlices() == 0 &&
+           !sm->forcePhononAtomResort();
+}
+
+template <class T>
+void SimulationGeneral<T>::sortAtoms(unsigned int config) {
+    auto phonons = job->simManager->incoherenceEffects()->phonons();
+    bool do_phonon = phonons->getFrozenPhononEnabled();
+
+    // The atoms are binned by where they sit and are displaced on the device, so they only need sorting once. The
+    // displacements are much smaller than the potential cut off, so an atom being near the edge of its block (or
+    // slice) doesn't matter. When streaming the atoms, or when the resort is forced, they are displaced here first.
+    bool device_phonons = useDevicePhonons();
+    // without precalculated transmission functions, the batched configurations are displaced for each slice instead
+    bool displace_now = !batch_phonons || job->simManager->precalculateTransmission();
+    if (device_phonons && phonon_atoms_manager == job->simManager) {
+        if (displace_now)
+            displaceAtoms(config);
+        return;
+    }
+
+    CLOG(DEBUG, "sim") << "Sorting Atoms";
+
+    const std::vector<AtomSite> &atoms = job->simManager->simulationCell()->crystalStructure()->atoms();
+    auto atom_count = static_cast<unsigned int>(atoms.size()); // Needs to be cast to int as opencl kernel expects that size
 
     CLOG(DEBUG, "sim") << "Getting atom positions";
     if (do_phonon)
@@ -174,6 +383,21 @@ void SimulationGeneral<T>::sortAtoms() {
     std::valarray<double> y_lims = job->simManager->paddedFullLimitsY();
     std::valarray<double> z_lims = job->simManager->paddedSimLimitsZ();
 
+    // NOTE: DONT CHANGE UNLESS CHANGE ELSEWHERE ASWELL!
+    // Or fix it so they are all referencing same variable.
+    unsigned int BlocksX = job->simManager->blocksX();
+    unsigned int BlocksY = job->simManager->blocksY();
+
+    double dz = job->simManager->simulationCell()->sliceThickness();
+    unsigned int numberOfSlices = job->simManager->simulationCell()->sliceCount();
+
+    // the slabs may still be uploading from the binner
+    if (use_atom_slabs)
+        ctx->WaitForIOQueueFinish();
+
+    atom_binner.setGrid(x_lims[0], x_lims[1], y_lims[0], y_lims[1], z_lims[1], dz, BlocksX, BlocksY, numberOfSlices);
+    atom_binner.clear(atom_count);
+
     Eigen::Vector3d u1v = {1.0, 0.0, 0.0};
     Eigen::Vector3d u2v = {0.0, 1.0, 0.0};
     Eigen::Vector3d u3v = {0.0, 0.0, 1.0};
@@ -185,13 +409,15 @@ void SimulationGeneral<T>::sortAtoms() {
         u3v = job->simManager->simulationCell()->crystalStructure()->getU3Vector();
     }
 
+    phonon_atom_ids.clear();
+
     for(int i = 0; i < atom_count; i++) {
         double disp_1 = 0.0, disp_2 = 0.0, disp_3 = 0.0;
-        if (do_phonon) {
-            // TODO: need a log guard here or in the structure file?
-            disp_1 = job->simManager->incoherenceEffects()->phonons()->generateTdsFactor(atoms[i], 0);
-            disp_2 = job->simManager->incoherenceEffects()->phonons()->generateTdsFactor(atoms[i], 1);
-            disp_3 = job->simManager->incoherenceEffects()->phonons()->generateTdsFactor(atoms[i], 2);
+        if (do_phonon && !device_phonons) {
+            auto disp = phonons->generateTdsFactors(atoms[i], i, job->id, config);
+            disp_1 = disp[0];
+            disp_2 = disp[1];
+            disp_3 = disp[2];
         }
 
         auto d1 = disp_1 * u1v;
@@ -208,137 +434,511 @@ void SimulationGeneral<T>::sortAtoms() {
         bool in_z = new_z > z_lims[0] && new_z < z_lims[1];
 
         if (in_x && in_y && in_z) {
-            // puch back is OK because I have reserved the vector
-            AtomANum.push_back(atoms[i].A);
-            AtomXPos.push_back(new_x);
-            AtomYPos.push_back(new_y);
-            AtomZPos.push_back(new_z);
+            atom_binner.addAtom(static_cast<T>(new_x), static_cast<T>(new_y), static_cast<T>(new_z), atoms[i].A);
+            if (device_phonons)
+                phonon_atom_ids.push_back(i);
         }
     }
 
-    // update our atom count to be the atoms we have in range
-    atom_count = AtomANum.size();
+    // This replaces the old atom_sort kernel (and the read back from it), the bins are found and the atoms put into
+    // a linear block of memory ordered by z then y then x in one go
+    CLOG(DEBUG, "sim") << "Binning atoms";
+    atom_binner.sort();
 
-    CLOG(DEBUG, "sim") << "Writing to buffers";
+    // used to identify this set of atoms in the transmission cache
+    atom_hash = TransmissionKey().add(atom_binner.sortedX()).add(atom_binner.sortedY()).add(atom_binner.sortedZ())
+            .add(atom_binner.sortedA()).add(atom_binner.blockStartPositions()).value();
 
-    ClAtomX.Write(AtomXPos);
-    ClAtomY.Write(AtomYPos);
-    ClAtomZ.Write(AtomZPos);
-    ClAtomA.Write(AtomANum);
+    if (use_atom_slabs) {
+        // only the first slab is uploaded now, the rest are uploaded as they are needed
+        initialiseAtomSlabs();
+        return;
+    }
 
-    CLOG(DEBUG, "sim") << "Creating sort kernel";
+    CLOG(DEBUG, "sim") << "Writing binned atom posisitons to bufffers";
 
-    // NOTE: DONT CHANGE UNLESS CHANGE ELSEWHERE ASWELL!
-    // Or fix it so they are all referencing same variable.
-    unsigned int BlocksX = job->simManager->blocksX();
-    unsigned int BlocksY = job->simManager->blocksY();
+    // Now upload the sorted atoms onto the device..
+    ClAtomA.Write(atom_binner.sortedA());
+    ClBlockStartPositions.Write(atom_binner.blockStartPositions());
+
+    if (!device_phonons) {
+        ClAtomX.Write(atom_binner.sortedX());
+        ClAtomY.Write(atom_binner.sortedY());
+        ClAtomZ.Write(atom_binner.sortedZ());
+
+        // wait for the IO queue here so that we are sure the data is uploaded before we start using it
+        ctx->WaitForIOQueueFinish();
+        phonon_atoms_manager = nullptr;
+        return;
+    }
 
-    double dz = job->simManager->simulationCell()->sliceThickness();
-    unsigned int numberOfSlices = job->simManager->simulationCell()->sliceCount();
+    // the displacements of each atom are looked up by its index in the structure (so they don't depend on the sort)
+    auto &sorted_index = atom_binner.sortedIndex();
+    int n_sorted = atom_binner.blockStartPositions().back();
+    std::vector<T> sigma(3 * atom_count, T(0));
+    std::vector<int> ids(atom_count, 0);
+    for (int p = 0; p < n_sorted; ++p) {
+        int id = phonon_atom_ids[sorted_index[p]];
+        ids[p] = id;
+        for (int d = 0; d < 3; ++d)
+            sigma[3 * p + d] = static_cast<T>(phonons->getTdsSigma(atoms[id], d));
+    }
+
+    ClAtomBaseX.Write(atom_binner.sortedX());
+    ClAtomBaseY.Write(atom_binner.sortedY());
+    ClAtomBaseZ.Write(atom_binner.sortedZ());
+    ClAtomSigma.Write(sigma);
+    ClAtomId.Write(ids);
+
+    ctx->WaitForIOQueueFinish();
+
+    uint64_t seed = phonons->getSeed();
+    PhononDisplace.SetArg(0, ClAtomBaseX, ArgumentType::Input);
+    PhononDisplace.SetArg(1, ClAtomBaseY, ArgumentType::Input);
+    PhononDisplace.SetArg(2, ClAtomBaseZ, ArgumentType::Input);
+    PhononDisplace.SetArg(3, ClAtomSigma, ArgumentType::Input);
+    PhononDisplace.SetArg(4, ClAtomId, ArgumentType::Input);
+    PhononDisplace.SetArg(5, ClAtomX, ArgumentType::Output);
+    PhononDisplace.SetArg(6, ClAtomY, ArgumentType::Output);
+    PhononDisplace.SetArg(7, ClAtomZ, ArgumentType::Output);
+    PhononDisplace.SetArg(9, static_cast<unsigned int>(seed));
+    PhononDisplace.SetArg(10, static_cast<unsigned int>(seed >> 32));
+    for (int d = 0; d < 3; ++d) {
+        PhononDisplace.SetArg(13 + d, static_cast<T>(u1v[d]));
+        PhononDisplace.SetArg(16 + d, static_cast<T>(u2v[d]));
+        PhononDisplace.SetArg(19 + d, static_cast<T>(u3v[d]));
+    }
 
-    AtomSort.SetArg(0, ClAtomX, ArgumentType::Input);
-    AtomSort.SetArg(1, ClAtomY, ArgumentType::Input);
-    AtomSort.SetArg(2, ClAtomZ, ArgumentType::Input);
-    AtomSort.SetArg(3, atom_count);
-    AtomSort.SetArg(4, static_cast<T>(x_lims[0]));
-    AtomSort.SetArg(5, static_cast<T>(x_lims[1]));
-    AtomSort.SetArg(6, static_cast<T>(y_lims[0]));
-    AtomSort.SetArg(7, static_cast<T>(y_lims[1]));
-    AtomSort.SetArg(8, static_cast<T>(z_lims[0]));
-    AtomSort.SetArg(9, static_cast<T>(z_lims[1]));
-    AtomSort.SetArg(10, BlocksX);
-    AtomSort.SetArg(11, BlocksY);
-    AtomSort.SetArg(12, ClBlockIds, ArgumentType::Output);
-    AtomSort.SetArg(13, ClZIds, ArgumentType::Output);
-    AtomSort.SetArg(14, static_cast<T>(dz));
-    AtomSort.SetArg(15, numberOfSlices);
-
-    clWorkGroup SortSize(atom_count, 1, 1);
-    CLOG(DEBUG, "sim") << "Running sort kernel";
-    AtomSort.run(SortSize);
-
-    ctx->WaitForQueueFinish(); // test
-
-    CLOG(DEBUG, "sim") << "Reading sort kernel output";
-
-    std::vector<int> HostBlockIDs = ClBlockIds.GetLocal();
-    std::vector<int> HostZIDs = ClZIds.GetLocal();
+    phonon_atoms_hash = TransmissionKey().add(atom_hash).add(seed).value();
+    phonon_atoms_manager = job->simManager;
 
-    CLOG(DEBUG, "sim") << "Binning atoms";
+    if (displace_now)
+        displaceAtoms(config);
+}
 
-    // this silly initialising is to make the first two levels of our vectors, we then dynamically
-    // fill the next level in the following loop :)
-    std::vector<std::vector<std::vector<T>>> Binnedx( BlocksX*BlocksY, std::vector<std::vector<T>>(numberOfSlices) );
-    std::vector<std::vector<std::vector<T>>> Binnedy( BlocksX*BlocksY, std::vector<std::vector<T>>(numberOfSlices) );
-    std::vector<std::vector<std::vector<T>>> Binnedz( BlocksX*BlocksY, std::vector<std::vector<T>>(numberOfSlices) );
-    std::vector<std::vector<std::vector<int>>>   BinnedA( BlocksX*BlocksY, std::vector<std::vector<int>>  (numberOfSlices) );
-
-    int count_in_range = 0;
-    for(int i = 0; i < atom_count; ++i) {
-        if (HostZIDs[i] >= 0 && HostBlockIDs[i] >= 0) {
-            Binnedx[HostBlockIDs[i]][HostZIDs[i]].push_back(AtomXPos[i]);
-            Binnedy[HostBlockIDs[i]][HostZIDs[i]].push_back(AtomYPos[i]);
-            Binnedz[HostBlockIDs[i]][HostZIDs[i]].push_back(AtomZPos[i]);
-            BinnedA[HostBlockIDs[i]][HostZIDs[i]].push_back(AtomANum[i]);
-            ++count_in_range;
-        }
+template <class T>
+void SimulationGeneral<T>::displaceAtoms(unsigned int config, int slice) {
+    CLOG(DEBUG, "sim") << "Displacing atoms (phonon configuration " << config << ")";
+
+    auto &block_starts = atom_binner.blockStartPositions();
+    int first = 0;
+    int last = block_starts.back();
+
+    if (slice >= 0) {
+        // the full 3d potentials also use the atoms from the slices either side (same as load_blocks_z)
+        int number_of_slices = job->simManager->simulationCell()->sliceCount();
+        int blocks_xy = job->simManager->blocksX() * job->simManager->blocksY();
+        int margin = 0;
+        if (job->simManager->full3dEnabled())
+            margin = static_cast<int>(std::ceil(3.0 / job->simManager->simulationCell()->sliceThickness()));
+
+        first = block_starts[std::max(slice - margin, 0) * blocks_xy];
+        last = block_starts[(std::min(slice + margin, number_of_slices - 1) + 1) * blocks_xy];
+    }
+
+    // The batched configurations are counted the same as if each was its own job, so a configuration is the same
+    // however many are batched together (this depends on the device memory)
+    unsigned int job_index = job->id;
+    if (batch_phonons) {
+        job_index = job->id * job->simManager->phononBatchSize() + config;
+        config = 0;
     }
 
-    unsigned long long max_bin_xy = 0;
-    unsigned long long max_bin_z = 0;
+    PhononDisplace.SetArg(8, last);
+    PhononDisplace.SetArg(11, job_index);
+    PhononDisplace.SetArg(12, config);
+    PhononDisplace.SetArg(22, first);
+
+    // there is nothing to do if there are no atoms (and a global size of 0 isn't allowed)
+    if (last > first)
+        PhononDisplace.run(clWorkGroup(static_cast<unsigned int>(last - first), 1, 1));
 
-    //
-    // This only works because x and y have the same number of blocks (so I only need to look at one of x or y)
-    //
-    for (auto &bx_1 : Binnedx) {
-        if (bx_1.size() > max_bin_xy)
-            max_bin_xy = bx_1.size();
+    atom_hash = TransmissionKey().add(phonon_atoms_hash).add(job_index).add(config).value();
+}
 
-        for (auto &bx_2 : bx_1)
-            if (bx_2.size() > max_bin_z)
-                max_bin_z = bx_2.size();
+template <class T>
+void SimulationGeneral<T>::initialiseAtomSlabs() {
+    bool isFull3D = job->simManager->full3dEnabled();
+    int number_of_slices = job->simManager->simulationCell()->sliceCount();
+    int blocks_xy = job->simManager->blocksX() * job->simManager->blocksY();
+    auto &block_starts = atom_binner.blockStartPositions();
+
+    slab_slices = std::min(static_cast<int>(job->simManager->atomSlabSlices()), number_of_slices);
+    // the full 3d potentials also use the atoms from the slices either side (same as load_blocks_z)
+    slab_margin = isFull3D ? static_cast<int>(std::ceil(3.0 / job->simManager->simulationCell()->sliceThickness())) : 0;
+
+    // the buffers need to fit the biggest slab
+    int max_slab_atoms = 1;
+    for (int first = 0; first < number_of_slices; first += slab_slices) {
+        int lo = std::max(first - slab_margin, 0);
+        int hi = std::min(first + slab_slices + slab_margin, number_of_slices);
+        max_slab_atoms = std::max(max_slab_atoms, block_starts[hi * blocks_xy] - block_starts[lo * blocks_xy]);
     }
 
-    int atomIterator = 0;
+    CLOG(DEBUG, "sim") << "Streaming atoms in slabs of " << slab_slices << " slices (max " << max_slab_atoms << " atoms)";
 
-    std::vector<int> blockStartPositions(numberOfSlices*BlocksX*BlocksY+1);
+    for (auto &slab : atom_slabs) {
+        // only ever grow these, the phonons will change the sizes slightly
+        if (slab.a.GetSize() < static_cast<size_t>(max_slab_atoms)) {
+            slab.x = clMemory<T, Manual>(ctx, max_slab_atoms);
+            slab.y = clMemory<T, Manual>(ctx, max_slab_atoms);
+            slab.z = clMemory<T, Manual>(ctx, max_slab_atoms);
+            slab.a = clMemory<int, Manual>(ctx, max_slab_atoms);
+        }
+        if (slab.block_starts.GetSize() != block_starts.size())
+            slab.block_starts = clMemory<int, Manual>(ctx, block_starts.size());
+        slab.first_slice = -1;
+    }
 
-    // Put all bins into a linear block of memory ordered by z then y then x and record start positions for every block.
-    CLOG(DEBUG, "sim") << "Putting binned atoms into continuous array";
+    // this is set as the 'other' slab so the next selectAtomSlab(0) uses what we upload here
+    current_slab = 1;
+    uploadAtomSlab(0, 0);
+}
 
-    for(int slicei = 0; slicei < numberOfSlices; slicei++) {
-        for(int j = 0; j < BlocksY; j++) {
-            for(int k = 0; k < BlocksX; k++) {
-                blockStartPositions[slicei*BlocksX*BlocksY+ j*BlocksX + k] = atomIterator;
+template <class T>
+void SimulationGeneral<T>::uploadAtomSlab(int index, int first_slice) {
+    int number_of_slices = job->simManager->simulationCell()->sliceCount();
+    int blocks_xy = job->simManager->blocksX() * job->simManager->blocksY();
+    auto &block_starts = atom_binner.blockStartPositions();
+    auto &slab = atom_slabs[index];
+
+    int lo = std::max(first_slice - slab_margin, 0);
+    int hi = std::min(first_slice + slab_slices + slab_margin, number_of_slices);
+    int offset = block_starts[lo * blocks_xy];
+    int count = block_starts[hi * blocks_xy] - offset;
+
+    // the last upload into this slab reads from host_block_starts, make sure it is done before it is overwritten
+    if (slab.uploaded.event() != nullptr)
+        slab.uploaded.Wait();
+
+    // the kernels index the atoms using the block start positions, so make them relative to this slab (anything
+    // outside the slab is never used, but is clamped so it stays in the buffer)
+    slab.host_block_starts.resize(block_starts.size());
+    for (size_t i = 0; i < block_starts.size(); ++i)
+        slab.host_block_starts[i] = std::min(std::max(block_starts[i] - offset, 0), count);
+
+    // these are all on the (in order) IO queue, so the last event tells us when they are all done. The IO queue is the
+    // same queue the kernels use, so they will not start until the upload is finished (no host wait is needed)
+    if (count > 0) {
+        slab.x.Write(atom_binner.sortedX().data() + offset, 0, count);
+        slab.y.Write(atom_binner.sortedY().data() + offset, 0, count);
+        slab.z.Write(atom_binner.sortedZ().data() + offset, 0, count);
+        slab.a.Write(atom_binner.sortedA().data() + offset, 0, count);
+    }
+    slab.uploaded = slab.block_starts.Write(slab.host_block_starts.data(), 0, slab.host_block_starts.size());
+    slab.first_slice = first_slice;
+}
 
-                if(!Binnedx[j * BlocksX + k][slicei].empty()) {
-                    for(int l = 0; l < Binnedx[j*BlocksX+k][slicei].size(); l++) {
-                        AtomXPos[atomIterator] = Binnedx[j*BlocksX+k][slicei][l];
-                        AtomYPos[atomIterator] = Binnedy[j*BlocksX+k][slicei][l];
-                        AtomZPos[atomIterator] = Binnedz[j*BlocksX+k][slicei][l];
-                        AtomANum[atomIterator] = BinnedA[j*BlocksX+k][slicei][l];
-                        atomIterator++;
-                    }
-                }
+template <class T>
+void SimulationGeneral<T>::selectAtomSlab(int slice) {
+    if (!use_atom_slabs)
+        return;
+
+    int number_of_slices = job->simManager->simulationCell()->sliceCount();
+    int first_slice = (slice / slab_slices) * slab_slices;
+
+    if (atom_slabs[current_slab].first_slice != first_slice) {
+        // the next slab should already be queued, unless we have jumped (i.e. started the next pixel)
+        int next = 1 - current_slab;
+        if (atom_slabs[next].first_slice != first_slice)
+            uploadAtomSlab(next, first_slice);
+        current_slab = next;
+
+        // Queue the following slab into the one we have just finished with (going back to the start once we reach the
+        // end for the next pixel/simulation). The queue is in order, so this only runs once the kernels that are still
+        // queued for the old slab are done (the queue isn't always finished at the end of a slice).
+        int next_first = first_slice + slab_slices;
+        if (next_first >= number_of_slices)
+            next_first = 0;
+        if (next_first != first_slice)
+            uploadAtomSlab(1 - current_slab, next_first);
+    }
+
+    // always set these as the kernel might have been rebuilt
+    auto &slab = atom_slabs[current_slab];
+    CalculateTransmissionFunction.SetArg(1, slab.x, ArgumentType::Input);
+    CalculateTransmissionFunction.SetArg(2, slab.y, ArgumentType::Input);
+    CalculateTransmissionFunction.SetArg(3, slab.z, ArgumentType::Input);
+    CalculateTransmissionFunction.SetArg(4, slab.a, ArgumentType::Input);
+    CalculateTransmissionFunction.SetArg(8, slab.block_starts, ArgumentType::Input);
+
+    if (use_reciprocal_potentials) {
+        PotentialDeposit.SetArg(1, slab.x, ArgumentType::Input);
+        PotentialDeposit.SetArg(2, slab.y, ArgumentType::Input);
+        PotentialDeposit.SetArg(3, slab.a, ArgumentType::Input);
+        PotentialDeposit.SetArg(5, slab.block_starts, ArgumentType::Input);
+    }
+}
+
+template <class T>
+void SimulationGeneral<T>::initialiseReciprocalPotentials(const std::vector<T> &k_x, const std::vector<T> &k_y, double k_max) {
+    auto sm = job->simManager;
+    unsigned int resolution = sm->resolution();
+    size_t image_size = static_cast<size_t>(resolution) * resolution;
+    double pixelscale = sm->realScale();
+    auto param_set = sm->structureParameters();
+    double table_r_min = 0.25 * pixelscale;
+
+    // index of each species in the stacks (in order of atomic number)
+    std::vector<int> species_index(param_set.max_atomic_number + 1, -1);
+    for (auto &a : sm->simulationCell()->crystalStructure()->atoms())
+        if (a.A > 0 && a.A <= param_set.max_atomic_number)
+            species_index[a.A] = 0;
+
+    std::vector<int> species;
+    for (size_t z = 1; z < species_index.size(); ++z)
+        if (species_index[z] == 0) {
+            species_index[z] = static_cast<int>(species.size());
+            species.push_back(static_cast<int>(z));
+        }
+
+    uint64_t key = TransmissionKey().add(param_set.parameters).add(param_set.form).add(param_set.i_per_atom)
+            .add(species).add(resolution).add(pixelscale).add(k_max).value();
+    if (key == species_factors_key && ClSpeciesFactors.GetSize() != 0)
+        return;
+
+    CLOG(DEBUG, "sim") << "Sampling reciprocal space potentials for " << species.size() << " species";
+    n_species = std::max<unsigned int>(species.size(), 1);
+
+    std::vector<double> table;
+    NativeKernels::projectedPotentialTable(table, param_set.parameters, static_cast<unsigned int>(param_set.form),
+                                           param_set.i_per_atom, param_set.max_atomic_number,
+                                           NativeKernels::potential_table_samples, table_r_min);
+    double table_scale = 1.0 / (NativeKernels::potential_table_r_max - table_r_min);
+
+    // Every worker does this at the same time (and it is only a few transforms), so it is done on this thread rather than
+    // starting a pool for each worker (a pool of one doesn't start any threads).
+    auto threads = std::make_shared<NativeThreads>(1);
+    NativeFourier<double> fourier(threads, resolution, resolution);
+    std::vector<std::complex<double>> atom_image(image_size);
+    std::vector<T> factors(image_size * n_species, T(0));
+
+    for (size_t sp = 0; sp < species.size(); ++sp) {
+        // one atom at the origin (wrapped around the edges) so its transform is real
+        for (unsigned int y = 0; y < resolution; ++y) {
+            double dy = (y <= resolution / 2 ? static_cast<double>(y) : static_cast<double>(y) - resolution) * pixelscale;
+            for (unsigned int x = 0; x < resolution; ++x) {
+                double dx = (x <= resolution / 2 ? static_cast<double>(x) : static_cast<double>(x) - resolution) * pixelscale;
+                double rad = std::sqrt(dx * dx + dy * dy);
+
+                double v = 0.0;
+                if (rad <= NativeKernels::potential_table_r_max)
+                    v = NativeKernels::potentialLookup(table.data(), NativeKernels::potential_table_samples,
+                                                       species[sp], std::max(rad, table_r_min), table_r_min, table_scale);
+                atom_image[x + resolution * y] = v;
             }
         }
+
+        fourier.run(atom_image, atom_image, Direction::Forwards);
+
+        // Scale so the (normalised) transforms give a circular convolution, divide by the transform of the bilinear
+        // weights used to deposit the atoms, and band limit the potential.
+        T *f = factors.data() + sp * image_size;
+        for (unsigned int y = 0; y < resolution; ++y) {
+            double sy = k_y[y] * pixelscale;
+            double wy = sy == 0.0 ? 1.0 : std::sin(M_PI * sy) / (M_PI * sy);
+            for (unsigned int x = 0; x < resolution; ++x) {
+                double sx = k_x[x] * pixelscale;
+                double wx = sx == 0.0 ? 1.0 : std::sin(M_PI * sx) / (M_PI * sx);
+                double k = std::sqrt(static_cast<double>(k_x[x]) * k_x[x] + static_cast<double>(k_y[y]) * k_y[y]);
+
+                if (k <= k_max)
+                    f[x + resolution * y] = static_cast<T>(atom_image[x + resolution * y].real() * resolution / (wx * wx * wy * wy));
+            }
+        }
+    }
+
+    if (ClSpeciesFactors.GetSize() != factors.size()) {
+        ClSpeciesFactors = clMemory<T, Manual>(ctx, factors.size());
+        clSpeciesDensity = clMemory<std::complex<T>, Manual>(ctx, factors.size());
+        clSpeciesSpectrum = clMemory<std::complex<T>, Manual>(ctx, factors.size());
     }
+    if (ClSpeciesIndex.GetSize() != species_index.size())
+        ClSpeciesIndex = clMemory<int, Manual>(ctx, species_index.size());
 
-    // Last element indicates end of last block as total number of atoms.
-    blockStartPositions[numberOfSlices*BlocksX*BlocksY] = count_in_range;
+    if (FourierTransSpecies.GetWidth() != resolution || FourierTransSpecies.GetBatchSize() != n_species) {
+        FourierTransSpecies.releasePlan();
+        FourierTransSpecies = clFourier<T>(ctx, resolution, resolution, n_species);
+    }
 
-    CLOG(DEBUG, "sim") << "Writing binned atom posisitons to bufffers";
+    ClSpeciesFactors.Write(factors);
+    ClSpeciesIndex.Write(species_index);
+    ctx->WaitForIOQueueFinish();
 
-    // Now upload the sorted atoms onto the device..
-    ClAtomX.Write(AtomXPos);
-    ClAtomY.Write(AtomYPos);
-    ClAtomZ.Write(AtomZPos);
-    ClAtomA.Write(AtomANum);
+    species_factors_key = key;
+}
+
+template <class T>
+void SimulationGeneral<T>::calculateTransmissionFunction(clMemory<std::complex<T>, Manual> &output, int slice) {
+    selectAtomSlab(slice);
+
+    unsigned int resolution = job->simManager->resolution();
+    clWorkGroup Work(resolution, resolution, 1);
+
+    if (use_reciprocal_potentials) {
+        auto &block_starts = atom_binner.blockStartPositions();
+        int blocks_xy = job->simManager->blocksX() * job->simManager->blocksY();
+        int n_atoms = block_starts[(slice + 1) * blocks_xy] - block_starts[slice * blocks_xy];
+
+        // the deposit waits for this (as its output), and this waits for the last slice to transform them
+        clSpeciesDensity.Fill(std::complex<T>(0), species_density_read);
+
+        if (n_atoms > 0) {
+            PotentialDeposit.SetArg(6, slice);
+            PotentialDeposit.run(clWorkGroup(static_cast<unsigned int>(n_atoms)));
+        }
+
+        species_density_read = FourierTransSpecies.run(clSpeciesDensity, clSpeciesSpectrum, Direction::Forwards);
+        PotentialStructureFactors.run(Work);
+        FourierTrans.run(clWaveFunctionTemp_1, output, Direction::Inverse);
+
+        PotentialTransmission.SetArg(0, output, ArgumentType::InputOutput);
+        PotentialTransmission.run(Work);
+        return;
+    }
+
+    CalculateTransmissionFunction.SetArg(0, output, ArgumentType::Output);
+    CalculateTransmissionFunction.SetArg(11, slice);
+
+    if (job->simManager->full3dEnabled()) {
+        double dz = job->simManager->simulationCell()->sliceThickness();
+        auto min_z = job->simManager->paddedSimLimitsZ()[0];
+        int number_of_slices = job->simManager->simulationCell()->sliceCount();
+
+        double slice_z = min_z + (number_of_slices - slice) * dz;
+        CalculateTransmissionFunction.SetArg(27, static_cast<T>(slice_z));
+    }
+
+    if (!potential_launch_set)
+        initialisePotentialLaunch(slice);
+
+    clWorkGroup LocalWork(potential_local_x, potential_local_y, 1);
+    CalculateTransmissionFunction.run(Work, LocalWork);
+}
+
+template <class T>
+void SimulationGeneral<T>::setPotentialLaunch(unsigned int local_x, unsigned int local_y, unsigned int tile) {
+    // the projected kernel doesn't need the z positions
+    unsigned int first = job->simManager->full3dEnabled() ? 31 : 29;
+    unsigned int n_positions = job->simManager->full3dEnabled() ? 3 : 2;
+
+    for (unsigned int i = 0; i < n_positions; ++i)
+        CalculateTransmissionFunction.SetLocalMemoryArg<T>(first + i, tile);
+    CalculateTransmissionFunction.SetLocalMemoryArg<int>(first + n_positions, tile);
+    CalculateTransmissionFunction.SetArg(first + n_positions + 1, static_cast<int>(tile));
+
+    potential_local_x = local_x;
+    potential_local_y = local_y;
+    potential_tile = tile;
+}
+
+template <class T>
+bool SimulationGeneral<T>::validPotentialLaunch(unsigned int local_x, unsigned int local_y, unsigned int tile) {
+    unsigned int resolution = job->simManager->resolution();
+    if (local_x == 0 || local_y == 0 || tile == 0 || resolution % local_x != 0 || resolution % local_y != 0)
+        return false;
+
+    if (local_x * local_y > CalculateTransmissionFunction.GetMaxWorkGroupSize())
+        return false;
+
+    size_t n_positions = job->simManager->full3dEnabled() ? 3 : 2;
+    size_t local_mem = tile * (n_positions * sizeof(T) + sizeof(int));
+    return local_mem <= ctx->GetContextDevice().GetLocalMemSize();
+}
+
+template <class T>
+void SimulationGeneral<T>::initialisePotentialLaunch(int slice) {
+    auto &profiles = DeviceProfiles::getInstance();
+    clDevice &device = ctx->GetContextDevice();
+
+    // the best sizes change with the resolution (and the kernel is built for it anyway)
+    unsigned int resolution = job->simManager->resolution();
+    std::string key = CalculateTransmissionFunction.GetName() + "_" + std::to_string(resolution);
+
+    std::vector<unsigned int> settings;
+    if (profiles.get(device, key, settings) && settings.size() == 3 && validPotentialLaunch(settings[0], settings[1], settings[2])) {
+        setPotentialLaunch(settings[0], settings[1], settings[2]);
+        potential_launch_set = true;
+        return;
+    }
+
+    setPotentialLaunch(16, 16, 256);
+
+    if (!profiles.enabled()) {
+        potential_launch_set = true;
+        return;
+    }
+
+    // timing an empty slice would only measure the launch overhead, so wait for a slice with some atoms
+    auto &block_starts = atom_binner.blockStartPositions();
+    int blocks_xy = job->simManager->blocksX() * job->simManager->blocksY();
+    if (block_starts[(slice + 1) * blocks_xy] == block_starts[slice * blocks_xy])
+        return;
+
+    CLOG(INFO, "sim") << "Tuning " << key << " for " << device.GetDeviceName();
+
+    const std::vector<std::pair<unsigned int, unsigned int>> local_sizes = {{8, 8}, {16, 8}, {8, 16}, {16, 16},
+                                                                            {32, 8}, {8, 32}, {32, 16}, {16, 32},
+                                                                            {32, 32}};
+    const std::vector<unsigned int> tiles = {64, 128, 256, 512, 1024};
+
+    clWorkGroup Work(resolution, resolution, 1);
+    double best_time = std::numeric_limits<double>::max();
+    unsigned int best_x = 16, best_y = 16, best_tile = 256;
+
+    auto time_launch = [&](unsigned int local_x, unsigned int local_y, unsigned int tile) {
+        if (!validPotentialLaunch(local_x, local_y, tile))
+            return;
+
+        try {
+            setPotentialLaunch(local_x, local_y, tile);
+            double t = benchmarkKernel(CalculateTransmissionFunction, Work, clWorkGroup(local_x, local_y, 1));
+            CLOG(DEBUG, "sim") << "  " << local_x << "x" << local_y << ", tile " << tile << ": " << t * 1000.0 << " ms";
+            if (t < best_time) {
+                best_time = t;
+                best_x = local_x;
+                best_y = local_y;
+                best_tile = tile;
+            }
+        } catch (const std::runtime_error &e) {
+            // some devices will claim to support sizes they can't actually run
+            CLOG(DEBUG, "sim") << "  " << local_x << "x" << local_y << ", tile " << tile << " failed: " << e.what();
+        }
+    };
+
+    // the work group is tuned first (with the default tile), then the tile with the best work group
+    for (auto &ls : local_sizes)
+        time_launch(ls.first, ls.second, 256);
 
-    ClBlockStartPositions.Write(blockStartPositions);
+    unsigned int tuned_x = best_x, tuned_y = best_y;
+    for (auto tile : tiles)
+        if (tile != 256)
+            time_launch(tuned_x, tuned_y, tile);
 
-    // wait for the IO queue here so that we are sure the data is uploaded before we start using it
+    setPotentialLaunch(best_x, best_y, best_tile);
+    potential_launch_set = true;
+
+    // nothing ran, so just use the defaults (and don't save them)
+    if (best_time == std::numeric_limits<double>::max())
+        return;
+
+    CLOG(INFO, "sim") << "Using " << best_x << "x" << best_y << " work groups with " << best_tile << " atom tiles for " << key;
+    profiles.put(device, key, {best_x, best_y, best_tile});
+}
+
+template <class T>
+double SimulationGeneral<T>::benchmarkKernel(clKernel &kernel, clWorkGroup global, clWorkGroup local, int repeats) {
+    // the first run can include some set up (i.e. the driver finishing the compile)
+    kernel.run(global, local);
+    ctx->WaitForQueueFinish();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; ++i)
+        kernel.run(global, local);
     ctx->WaitForQueueFinish();
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start).count() / repeats;
 }
 
 template <class T>
@@ -346,6 +946,10 @@ bool SimulationGeneral<T>::initialiseSimulation() {
 
     bool same_simulation = job->simManager == current_manager;
 
+    queue_depth = job->simManager->queueDepth();
+    async_queue = queue_depth > 0;
+    queued_slices.clear();
+
     bool do_phonon = job->simManager->incoherenceEffects()->phonons()->getFrozenPhononEnabled();
     bool do_plasmon = job->simManager->incoherenceEffects()->plasmons()->enabled();
     bool moving_stem_frame = !job->simManager->parallelStem();
@@ -377,6 +981,27 @@ bool SimulationGeneral<T>::initialiseSimulation() {
     CLOG(DEBUG, "sim") << "Uploading parameters";
     ClParameterisation.Write(params);
 
+    // the projected potentials are interpolated from a table instead of using the parameters directly
+    if (!job->simManager->full3dEnabled()) {
+        auto param_set = job->simManager->structureParameters();
+        double table_r_min = 0.25 * job->simManager->realScale();
+        uint64_t table_key = TransmissionKey().add(param_set.parameters).add(param_set.form).add(param_set.i_per_atom)
+                .add(table_r_min).value();
+
+        if (ClPotentialTable.GetSize() == 0 || table_key != potential_table_key) {
+            CLOG(DEBUG, "sim") << "Sampling potential table";
+            NativeKernels::projectedPotentialTable(potential_table, param_set.parameters,
+                                                   static_cast<unsigned int>(param_set.form), param_set.i_per_atom,
+                                                   param_set.max_atomic_number, NativeKernels::potential_table_samples,
+                                                   table_r_min);
+            if (ClPotentialTable.GetSize() != potential_table.size())
+                ClPotentialTable = clMemory<T, Manual>(ctx, potential_table.size());
+            ClPotentialTable.Write(potential_table);
+            ctx->WaitForIOQueueFinish();
+            potential_table_key = table_key;
+        }
+    }
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     /// Sort our atoms!
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -532,14 +1157,23 @@ bool SimulationGeneral<T>::initialiseSimulation() {
 
     // Set some of the arguments which dont change each iteration
 //    CalculateTransmissionFunction.SetArg(0, clTransmissionFunction, ArgumentType::Output);
-    CalculateTransmissionFunction.SetArg(1, ClAtomX, ArgumentType::Input);
-    CalculateTransmissionFunction.SetArg(2, ClAtomY, ArgumentType::Input);
-    CalculateTransmissionFunction.SetArg(3, ClAtomZ, ArgumentType::Input);
-    CalculateTransmissionFunction.SetArg(4, ClAtomA, ArgumentType::Input);
-    CalculateTransmissionFunction.SetArg(5, ClParameterisation, ArgumentType::Input);
-    CalculateTransmissionFunction.SetArg(6, static_cast<int>(job->simManager->structureParameters().form));
-    CalculateTransmissionFunction.SetArg(7, job->simManager->structureParameters().i_per_atom);
-    CalculateTransmissionFunction.SetArg(8, ClBlockStartPositions, ArgumentType::Input);
+    // the atoms are set for each slice when streaming them (see selectAtomSlab)
+    if (!use_atom_slabs) {
+        CalculateTransmissionFunction.SetArg(1, ClAtomX, ArgumentType::Input);
+        CalculateTransmissionFunction.SetArg(2, ClAtomY, ArgumentType::Input);
+        CalculateTransmissionFunction.SetArg(3, ClAtomZ, ArgumentType::Input);
+        CalculateTransmissionFunction.SetArg(4, ClAtomA, ArgumentType::Input);
+        CalculateTransmissionFunction.SetArg(8, ClBlockStartPositions, ArgumentType::Input);
+    }
+    if (isFull3D) {
+        CalculateTransmissionFunction.SetArg(5, ClParameterisation, ArgumentType::Input);
+        CalculateTransmissionFunction.SetArg(6, static_cast<int>(job->simManager->structureParameters().form));
+        CalculateTransmissionFunction.SetArg(7, job->simManager->structureParameters().i_per_atom);
+    } else {
+        CalculateTransmissionFunction.SetArg(5, ClPotentialTable, ArgumentType::Input);
+        CalculateTransmissionFunction.SetArg(6, NativeKernels::potential_table_samples);
+        CalculateTransmissionFunction.SetArg(7, static_cast<T>(0.25 * pixelscale));
+    }
     CalculateTransmissionFunction.SetArg(9, resolution);
     CalculateTransmissionFunction.SetArg(10, resolution);
 //    CalculateTransmissionFunction.SetArg(11, slice);
@@ -571,27 +1205,81 @@ bool SimulationGeneral<T>::initialiseSimulation() {
         CalculateTransmissionFunction.SetArg(28, static_cast<T>(mParams->BeamAzimuth));
     }
 
+    if (use_reciprocal_potentials) {
+        initialiseReciprocalPotentials(k0x, k0y, bandwidthkmax * job->simManager->inverseLimitFactor());
+
+        // the atoms are set for each slice when streaming them (see selectAtomSlab)
+        PotentialDeposit.SetArg(0, clSpeciesDensity, ArgumentType::InputOutput);
+        if (!use_atom_slabs) {
+            PotentialDeposit.SetArg(1, ClAtomX, ArgumentType::Input);
+            PotentialDeposit.SetArg(2, ClAtomY, ArgumentType::Input);
+            PotentialDeposit.SetArg(3, ClAtomA, ArgumentType::Input);
+            PotentialDeposit.SetArg(5, ClBlockStartPositions, ArgumentType::Input);
+        }
+        PotentialDeposit.SetArg(4, ClSpeciesIndex, ArgumentType::Input);
+        PotentialDeposit.SetArg(7, static_cast<int>(blocks_x * blocks_y));
+        PotentialDeposit.SetArg(8, resolution);
+        PotentialDeposit.SetArg(9, resolution);
+        PotentialDeposit.SetArg(10, static_cast<T>(startx + reference_perturb_x));
+        PotentialDeposit.SetArg(11, static_cast<T>(starty + reference_perturb_y));
+        PotentialDeposit.SetArg(12, static_cast<T>(pixelscale));
+
+        PotentialStructureFactors.SetArg(0, clSpeciesSpectrum, ArgumentType::Input);
+        PotentialStructureFactors.SetArg(1, ClSpeciesFactors, ArgumentType::Input);
+        PotentialStructureFactors.SetArg(2, clWaveFunctionTemp_1, ArgumentType::Output);
+        PotentialStructureFactors.SetArg(3, resolution);
+        PotentialStructureFactors.SetArg(4, resolution);
+        PotentialStructureFactors.SetArg(5, n_species);
+
+        PotentialTransmission.SetArg(1, resolution);
+        PotentialTransmission.SetArg(2, resolution);
+        PotentialTransmission.SetArg(3, static_cast<T>(sigma));
+    }
+
     bool precalc_transmisson = job->simManager->precalculateTransmission();
 
     if (precalc_transmisson) {
-        clWorkGroup LocalWork(16, 16, 1);
 
-        int n_random = job->simManager->parallelPotentialsCount();
+        // one set for each parallel potential or batched phonon configuration (the last batch can be part full)
+        int n_random = static_cast<int>(clTransmissionFunction.size());
+        if (batch_phonons)
+            n_random = std::min(n_random, static_cast<int>(job->configs));
+
+        // The transmission functions can be reused from previous simulations if everything that goes into them is the
+        // same. Phonons are skipped as the atoms are randomly displaced (so it would never be used again)
+        auto &cache = TransmissionCache::getInstance();
+        cache.setLimits(static_cast<size_t>(job->simManager->transmissionCacheSize()) * 1024 * 1024,
+                        job->simManager->transmissionCacheDirectory());
+        bool use_cache = cache.enabled() && !do_phonon;
+
+        TransmissionKey base_key;
+        base_key.add(sizeof(T)).add(param_name).add(job->simManager->structureParameters().parameters).add(sigma)
+                .add(resolution).add(pixelscale).add(dz).add(startx + reference_perturb_x).add(starty + reference_perturb_y)
+                .add(number_of_slices).add(blocks_x).add(blocks_y).add(full_lims_x[0]).add(full_lims_x[1])
+                .add(full_lims_y[0]).add(full_lims_y[1]).add(load_blocks_x).add(load_blocks_y).add(load_blocks_z)
+                .add(bandwidthkmax).add(job->simManager->inverseLimitFactor()).add(isFull3D).add(use_reciprocal_potentials);
+        if (isFull3D)
+            base_key.add(min_z).add(full3dints).add(wavevector[0] / wavevector[2]).add(wavevector[1] / wavevector[2]);
+        else
+            base_key.add(mParams->BeamTilt).add(mParams->BeamAzimuth);
+
+        std::vector<std::complex<T>> cached_data;
 
         // loop over
         for (int j = 0; j < n_random; ++j) {
 
             for (int i = 0; i < number_of_slices; ++i) {
-                CLOG(DEBUG, "sim") << "Calculating potentials";
-                CalculateTransmissionFunction.SetArg(0, clTransmissionFunction[j][i], ArgumentType::Output);
-                CalculateTransmissionFunction.SetArg(11, i);
+                uint64_t key = TransmissionKey(base_key).add(atom_hash).add(i).value();
 
-                if (isFull3D) {
-                    double slice_z = min_z + (number_of_slices - i) * dz;
-                    CalculateTransmissionFunction.SetArg(27, static_cast<T>(slice_z));
+                if (use_cache && cache.get(key, cached_data) && cached_data.size() == clTransmissionFunction[j][i].GetSize()) {
+                    CLOG(DEBUG, "sim") << "Using cached potentials";
+                    clTransmissionFunction[j][i].Write(cached_data);
+                    ctx->WaitForIOQueueFinish();
+                    continue;
                 }
 
-                CalculateTransmissionFunction.run(WorkSize, LocalWork);
+                CLOG(DEBUG, "sim") << "Calculating potentials";
+                calculateTransmissionFunction(clTransmissionFunction[j][i], i);
 
                 /// Apply low pass filter to transmission function
                 CLOG(DEBUG, "sim") << "FFT transmission function";
@@ -599,9 +1287,12 @@ bool SimulationGeneral<T>::initialiseSimulation() {
                 CLOG(DEBUG, "sim") << "Band limit transmission function";
                 BandLimit.run(WorkSize);
                 CLOG(DEBUG, "sim") << "IFFT band limited transmission function";
-                FourierTrans.run(clWaveFunctionTemp_1, clTransmissionFunction[j][i], Direction::Inverse);
+                clEvent finished = FourierTrans.run(clWaveFunctionTemp_1, clTransmissionFunction[j][i], Direction::Inverse);
+
+                syncSlice(finished);
 
-                ctx->WaitForQueueFinish();
+                if (use_cache)
+                    cache.put(key, clTransmissionFunction[j][i].GetLocal());
 
                 if (pool.isStopped())
                     return false;
@@ -609,7 +1300,7 @@ bool SimulationGeneral<T>::initialiseSimulation() {
 
             // sort for our next iteration
             if (j < n_random - 1)
-                sortAtoms();
+                sortAtoms(j + 1);
         }
     } else {
         CalculateTransmissionFunction.SetArg(0, clTransmissionFunction[0][0], ArgumentType::Output);
@@ -634,13 +1325,14 @@ bool SimulationGeneral<T>::initialiseSimulation() {
 
     // actually run this kernel now
     GeneratePropagator.run(WorkSize);
-    ctx->WaitForQueueFinish();
+    syncStep();
 
 
     CLOG(DEBUG, "sim") << "Set up complex multiply kernel";
 
     ComplexMultiply.SetArg(3, resolution);
     ComplexMultiply.SetArg(4, resolution);
+    ComplexMultiply.SetArg(5, static_cast<unsigned int>(wave_stride));
 
     return true;
 }
@@ -664,8 +1356,9 @@ void SimulationGeneral<T>::modifyBeamTilt(double kx, double ky, double kz){
         double new_azimuth = std::atan(ky / kx);
         double new_tilt = std::atan( std::sqrt(kx*kx + ky*ky) / kz );
 
+        // the same arguments as in initialiseSimulation (29 onwards are the local memory tiles), the tilt is in mrad
+        CalculateTransmissionFunction.SetArg(27, static_cast<T>(new_tilt * 1000.0));
         CalculateTransmissionFunction.SetArg(28, static_cast<T>(new_azimuth));
-        CalculateTransmissionFunction.SetArg(29, static_cast<T>(new_tilt));
     }
 
     // The propagator does need to be recalculated now
@@ -675,24 +1368,24 @@ void SimulationGeneral<T>::modifyBeamTilt(double kx, double ky, double kz){
 
     clWorkGroup WorkSize(resolution, resolution, 1);
     GeneratePropagator.run(WorkSize);
-    ctx->WaitForQueueFinish();
+    syncStep();
 }
 
 template <class T>
 void SimulationGeneral<T>::doMultiSliceStep(int slice) {
     CLOG(DEBUG, "sim") << "Start multislice step " << slice;
 
+    clProfiler::setSlice(slice);
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     /// Create local variables for convenience
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    double dz = job->simManager->simulationCell()->sliceThickness();
     unsigned int resolution = job->simManager->resolution();
-    // in the current format, Tds is handled by job splitting so this is always 1??
-    int n_parallel = job->simManager->parallelPixels(); // total number of parallel pixels
+    // the parallel pixels, or the phonon configurations when they are batched
+    int n_parallel = job->simManager->waveStackSize();
     auto z_lim = job->simManager->paddedSimLimitsZ();
 
     clWorkGroup Work(resolution, resolution, 1);
-    clWorkGroup LocalWork(16, 16, 1);
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     /// Generate transmission function if we need to!
@@ -704,28 +1397,24 @@ void SimulationGeneral<T>::doMultiSliceStep(int slice) {
     if (!precalc_transmisson) {
         trans_id = 0;
 
-        CLOG(DEBUG, "sim") << "Calculating potentials";
-        CalculateTransmissionFunction.SetArg(0, clTransmissionFunction[0][0], ArgumentType::Output);
-        CalculateTransmissionFunction.SetArg(11, slice);
-
-        bool isFull3D = job->simManager->full3dEnabled();
-        if (isFull3D) {
-            auto min_z = job->simManager->paddedSimLimitsZ()[0];
-            int number_of_slices = job->simManager->simulationCell()->sliceCount();
-
-            double slice_z = min_z + (number_of_slices - slice) * dz;
-            CalculateTransmissionFunction.SetArg(27, static_cast<T>(slice_z));
+        // each batched configuration needs its own transmission function (only the atoms this slice uses are displaced
+        // for each), the unused slots of a part full batch are skipped as they are never summed
+        size_t n_sets = batch_phonons ? std::min<size_t>(job->configs, clTransmissionFunction.size()) : clTransmissionFunction.size();
+        for (size_t k = 0; k < n_sets; ++k) {
+            if (batch_phonons)
+                displaceAtoms(static_cast<unsigned int>(k), slice);
+
+            CLOG(DEBUG, "sim") << "Calculating potentials";
+            calculateTransmissionFunction(clTransmissionFunction[k][0], slice);
+
+            /// Apply low pass filter to transmission function
+            CLOG(DEBUG, "sim") << "FFT transmission function";
+            FourierTrans.run(clTransmissionFunction[k][0], clWaveFunctionTemp_1, Direction::Forwards);
+            CLOG(DEBUG, "sim") << "Band limit transmission function";
+            BandLimit.run(Work);
+            CLOG(DEBUG, "sim") << "IFFT band limited transmission function";
+            FourierTrans.run(clWaveFunctionTemp_1, clTransmissionFunction[k][0], Direction::Inverse);
         }
-
-        CalculateTransmissionFunction.run(Work, LocalWork);
-
-        /// Apply low pass filter to transmission function
-        CLOG(DEBUG, "sim") << "FFT transmission function";
-        FourierTrans.run(clTransmissionFunction[0][0], clWaveFunctionTemp_1, Direction::Forwards);
-        CLOG(DEBUG, "sim") << "Band limit transmission function";
-        BandLimit.run(Work);
-        CLOG(DEBUG, "sim") << "IFFT band limited transmission function";
-        FourierTrans.run(clWaveFunctionTemp_1, clTransmissionFunction[0][0], Direction::Inverse);
     }
 
     bool do_multi_potential_tds = job->simManager->useParallelPotentials();
@@ -733,44 +1422,83 @@ void SimulationGeneral<T>::doMultiSliceStep(int slice) {
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     /// Propogate slice
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    for (int i = 0; i < n_parallel; i++) {
-        CLOG(DEBUG, "sim") << "Propogating (" << i << " of " << n_parallel << " parallel)";
-
-        int nv = 0;
-
-        if (do_multi_potential_tds)
-            nv = dist(rng);
-
-        // Multiply transmission function with wavefunction
-        ComplexMultiply.SetArg(0, clTransmissionFunction[nv][trans_id], ArgumentType::Input);
-        ComplexMultiply.SetArg(1, clWaveFunctionReal[i], ArgumentType::Input);
-        ComplexMultiply.SetArg(2, clWaveFunctionRecip[i], ArgumentType::Output);
-        CLOG(DEBUG, "sim") << "Multiply wavefunction and potentials";
-        ComplexMultiply.run(Work);
+    // All the parallel probes are done together, the transmission function is applied to every probe in the stack
+    // unless each probe needs its own (random) transmission function, or each wave is its own phonon configuration
+    clWorkGroup StackWork(resolution, resolution, n_parallel);
+
+    // When fused, the transmitted wave goes to temp and the forward transform applies the propagator as it writes
+    // the reciprocal stack. Otherwise the transform goes through temp and the propagator is a separate multiply.
+    auto &trans_stack = use_fused_propagation ? clWaveFunctionTemp_1 : clWaveFunctionRecipStack;
+    auto &trans_probe = use_fused_propagation ? clWaveFunctionTempProbe : clWaveFunctionRecip;
+
+    // Multiply transmission function with wavefunction
+    CLOG(DEBUG, "sim") << "Multiply wavefunction and potentials";
+    if (do_multi_potential_tds || batch_phonons) {
+        for (int i = 0; i < n_parallel; i++) {
+            int set = batch_phonons ? i : dist(rng);
+            ComplexMultiply.SetArg(0, clTransmissionFunction[set][trans_id], ArgumentType::Input);
+            ComplexMultiply.SetArg(1, clWaveFunctionReal[i], ArgumentType::Input);
+            ComplexMultiply.SetArg(2, trans_probe[i], ArgumentType::Output);
+            ComplexMultiply.run(Work);
+        }
+    } else {
+        ComplexMultiply.SetArg(0, clTransmissionFunction[0][trans_id], ArgumentType::Input);
+        ComplexMultiply.SetArg(1, clWaveFunctionRealStack, ArgumentType::Input);
+        ComplexMultiply.SetArg(2, trans_stack, ArgumentType::Output);
+        ComplexMultiply.run(StackWork);
+    }
 
+    if (use_fused_propagation) {
+        // go to reciprocal space and convolve with propagator
+        CLOG(DEBUG, "sim") << "FFT to reciprocal space with propagator (" << n_parallel << " parallel)";
+        FourierTransPropagate.run(clWaveFunctionTemp_1, clWaveFunctionRecipStack, Direction::Forwards);
+    } else {
         // go to reciprocal space
-        CLOG(DEBUG, "sim") << "FFT to reciprocal space";
-        FourierTrans.run(clWaveFunctionRecip[i], clWaveFunctionTemp_1, Direction::Forwards);
+        CLOG(DEBUG, "sim") << "FFT to reciprocal space (" << n_parallel << " parallel)";
+        FourierTransBatch.run(clWaveFunctionRecipStack, clWaveFunctionTemp_1, Direction::Forwards);
 
         // convolve with propagator
-        ComplexMultiply.SetArg(0, clWaveFunctionTemp_1, ArgumentType::Input);
-        ComplexMultiply.SetArg(1, clPropagator, ArgumentType::Input);
-        ComplexMultiply.SetArg(2, clWaveFunctionRecip[i], ArgumentType::Output);
+        ComplexMultiply.SetArg(0, clPropagator, ArgumentType::Input);
+        ComplexMultiply.SetArg(1, clWaveFunctionTemp_1, ArgumentType::Input);
+        ComplexMultiply.SetArg(2, clWaveFunctionRecipStack, ArgumentType::Output);
         CLOG(DEBUG, "sim") << "Convolve with propagator";
-        ComplexMultiply.run(Work);
+        ComplexMultiply.run(StackWork);
+    }
+
+    // IFFT back to real space
+    CLOG(DEBUG, "sim") << "IFFT to real space";
+    clEvent finished = FourierTransBatch.run(clWaveFunctionRecipStack, clWaveFunctionRealStack, Direction::Inverse);
+
+    // the queue is in order, so nothing from the next slice can overwrite these buffers early
+    syncSlice(finished);
+}
 
-        // IFFT back to real space
-        CLOG(DEBUG, "sim") << "IFFT to real space";
-        FourierTrans.run(clWaveFunctionRecip[i], clWaveFunctionReal[i], Direction::Inverse);
+template <class T>
+void SimulationGeneral<T>::syncStep() {
+    if (!async_queue)
+        ctx->WaitForQueueFinish();
+}
 
-        // I think this is important as each parallel pixel shares (and particularly writes) to shared buffers
+template <class T>
+void SimulationGeneral<T>::syncSlice(const clEvent &finished) {
+    if (!async_queue) {
         ctx->WaitForQueueFinish();
+        return;
+    }
+
+    // make sure the device is working on what we have queued so far
+    ctx->QueueFlush();
+
+    queued_slices.push_back(finished);
+    while (queued_slices.size() > queue_depth) {
+        queued_slices.front().Wait();
+        queued_slices.pop_front();
     }
 }
 
 template <class T>
-std::vector<double> SimulationGeneral<T>::getDiffractionImage(int parallel_ind, double d_kx, double d_ky) {
-    CLOG(DEBUG, "sim") << "Getting diffraction image";
+void SimulationGeneral<T>::calculateDiffractionImage(int parallel_ind, double d_kx, double d_ky) {
+    CLOG(DEBUG, "sim") << "Calculating diffraction image";
     unsigned int resolution = job->simManager->resolution();
 
     // Original data is complex so copy complex version down first
@@ -797,21 +1525,96 @@ std::vector<double> SimulationGeneral<T>::getDiffractionImage(int parallel_ind,
         ComplexToReal.SetArg(2, static_cast<int>(output_type)); // should be 4
         ComplexToReal.run(Work);
     }
+}
+
+template <class T>
+std::vector<double> SimulationGeneral<T>::getDiffractionImage(int parallel_ind, double d_kx, double d_ky) {
+    CLOG(DEBUG, "sim") << "Getting diffraction image";
+    calculateDiffractionImage(parallel_ind, d_kx, d_ky);
 
     CLOG(DEBUG, "sim") << "Copy from buffer";
-    std::vector<T> data_typed = clWaveFunctionTemp_3.GetLocal();
+    auto data_typed = clWaveFunctionTemp_3.GetMapped();
+
+    return std::vector<double>(data_typed.begin(), data_typed.end());
+}
+
+template <class T>
+clMemory<T, Manual> &SimulationGeneral<T>::calculateDiffractionSum(unsigned int n, double d_kx, double d_ky) {
+    if (n <= 1) {
+        calculateDiffractionImage(0, d_kx, d_ky);
+        return clWaveFunctionTemp_3;
+    }
+
+    CLOG(DEBUG, "sim") << "Summing " << n << " diffraction images";
+    for (unsigned int i = 0; i < n; ++i) {
+        calculateDiffractionImage(i, d_kx, d_ky);
+        accumulate(clWaveFunctionTemp_3, clDiffractionSum, i == 0);
+    }
+
+    return clDiffractionSum;
+}
+
+template <class T>
+clMemory<std::complex<T>, Manual> &SimulationGeneral<T>::calculateExitWaveSum(unsigned int n) {
+    if (n <= 1)
+        return clWaveFunctionReal[0];
+
+    CLOG(DEBUG, "sim") << "Summing " << n << " exit waves";
+    for (unsigned int i = 0; i < n; ++i)
+        accumulate(clWaveFunctionReal[i], clExitWaveSum, i == 0);
+
+    return clExitWaveSum;
+}
+
+template <class T>
+std::vector<double> SimulationGeneral<T>::getDiffractionSum(unsigned int n, double d_kx, double d_ky) {
+    CLOG(DEBUG, "sim") << "Getting diffraction sum";
+    auto data_typed = calculateDiffractionSum(n, d_kx, d_ky).GetMapped();
 
     return std::vector<double>(data_typed.begin(), data_typed.end());
 }
 
+template <class T>
+void SimulationGeneral<T>::accumulate(clMemory<T, Manual> &input, clMemory<T, Manual> &output, bool first, size_t offset) {
+    auto size = static_cast<unsigned int>(input.GetSize());
+
+    Accumulate.SetArg(0, input, ArgumentType::Input);
+    Accumulate.SetArg(1, output, ArgumentType::InputOutput);
+    Accumulate.SetArg(2, size);
+    Accumulate.SetArg(3, static_cast<unsigned int>(offset));
+    Accumulate.SetArg(4, static_cast<int>(first));
+    Accumulate.run(clWorkGroup(size, 1, 1));
+}
+
+template <class T>
+void SimulationGeneral<T>::accumulate(clMemory<std::complex<T>, Manual> &input, clMemory<std::complex<T>, Manual> &output,
+                                      bool first, size_t offset) {
+    // the kernel just sees the real and imaginary parts as separate elements
+    auto size = static_cast<unsigned int>(2 * input.GetSize());
+
+    Accumulate.SetArg(0, input, ArgumentType::Input);
+    Accumulate.SetArg(1, output, ArgumentType::InputOutput);
+    Accumulate.SetArg(2, size);
+    Accumulate.SetArg(3, static_cast<unsigned int>(2 * offset));
+    Accumulate.SetArg(4, static_cast<int>(first));
+    Accumulate.run(clWorkGroup(size, 1, 1));
+}
+
 template <class T>
 std::vector<double> SimulationGeneral<T>::getExitWaveImage(unsigned int t, unsigned int l, unsigned int b, unsigned int r) {
     CLOG(DEBUG, "sim") << "Getting exit wave image";
     unsigned int resolution = job->simManager->resolution();
-    std::vector<double> data_out(2*((resolution - t - b) * (resolution - l - r)));
 
     CLOG(DEBUG, "sim") << "Copy from buffer";
-    std::vector<std::complex<T>> compdata = clWaveFunctionReal[0].GetLocal();
+    auto compdata = clWaveFunctionReal[0].GetMapped();
+
+    return exitWaveToImage(compdata, resolution, t, l, b, r);
+}
+
+template <class T>
+std::vector<double> SimulationGeneral<T>::exitWaveToImage(const clMappedView<std::complex<T>> &compdata, unsigned int resolution,
+                                                          unsigned int t, unsigned int l, unsigned int b, unsigned int r) {
+    std::vector<double> data_out(2*((resolution - t - b) * (resolution - l - r)));
 
     CLOG(DEBUG, "sim") << "Process complex data";
     int cnt = 0;
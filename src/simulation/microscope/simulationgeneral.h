@@ -5,6 +5,8 @@
 #ifndef CLTEM_SIMULATIONGENERAL_H
 #define CLTEM_SIMULATIONGENERAL_H
 
+#include <deque>
+
 #include "clwrapper.h"
 
 #include "kernels.h"
@@ -12,6 +14,9 @@
 #include "simulationmanager.h"
 #include "threading/threadworker.h"
 #include <utilities/simutils.h>
+#include <utilities/transmissioncache.h>
+#include <utilities/atombinner.h>
+#include <utilities/deviceprofiles.h>
 
 template <class GPU_Type>
 class SimulationGeneral : public ThreadWorker
@@ -20,9 +25,16 @@ public:
     explicit SimulationGeneral(clDevice &_dev_list, ThreadPool &s, unsigned int _id)
         : ThreadWorker(s, _id),
         last_mode(SimulationMode::None), last_do_3d(false), do_initialise_general(true),
-        reference_perturb_x(0.0), reference_perturb_y(0.0) {
+        use_fused_propagation(false), fused_propagation_supported(true),
+        reference_perturb_x(0.0), reference_perturb_y(0.0), atom_hash(0), potential_table_key(0), phonon_atoms_hash(0),
+        use_atom_slabs(false), slab_slices(0), slab_margin(0), current_slab(0), use_reciprocal_potentials(false),
+        reciprocal_kernels_built(false), species_factors_key(0), n_species(0), wave_stride(0),
+        potential_local_x(16), potential_local_y(16), potential_tile(256), potential_launch_set(false),
+        async_queue(false), queue_depth(0), batch_phonons(false) {
 
-        ctx = OpenCL::MakeSharedContext(_dev_list);
+        // the queue has to be made with profiling enabled to get the event times
+        auto queue_type = clProfiler::enabled() ? Queue::QueueType::InOrderWithProfiling : Queue::QueueType::InOrder;
+        ctx = OpenCL::MakeSharedContext(_dev_list, queue_type);
 
     }
 
@@ -30,18 +42,30 @@ public:
         ctx->WaitForQueueFinish();
         ctx->WaitForIOQueueFinish();
 
+        FourierTransBatch.releasePlan();
+        FourierTransPropagate.releasePlan();
+        FourierTransSpecies.releasePlan();
         FourierTrans.releaseResources();
     }
 
 protected:
     SimulationMode last_mode;
     bool last_do_3d;
+    // what the potential kernel was last built with
+    std::string potential_defines;
     bool last_double_precision;
     bool do_initialise_general;
 
+    // if the propagator is applied by the forward transform (set to not supported if clFFT fails to make the plan)
+    bool use_fused_propagation;
+    bool fused_propagation_supported;
+
     // these are used to perturb the reference frame (i.e. when moving the source)
     double reference_perturb_x, reference_perturb_y;
 
+    // identifies the current sorted atoms (for the transmission cache)
+    uint64_t atom_hash;
+
     std::shared_ptr<clContext> ctx;
 
     // this is only used to check if the manager has changed (only to avoid sorting atoms multiple times)
@@ -50,21 +74,92 @@ protected:
 
     std::shared_ptr<SimulationJob> job;
 
-    void sortAtoms();
+    // config picks the phonon configuration (for the parallel potentials)
+    void sortAtoms(unsigned int config = 0);
+
+    // if the phonon displacements are made on the device (not when streaming the atoms or forcing them to be resorted)
+    bool useDevicePhonons();
+
+    // makes the displaced atoms for a phonon configuration on the device (from the undisplaced atoms already there),
+    // only the atoms the potentials of a slice use are displaced if slice is not -1
+    void displaceAtoms(unsigned int config, int slice = -1);
+
+    void initialiseAtomSlabs();
+
+    void uploadAtomSlab(int index, int first_slice);
+
+    // makes sure the atoms for this slice are queued for the device, and queues the next slab after them
+    void selectAtomSlab(int slice);
+
+    // samples each species' projected potential in reciprocal space (only when the species or sampling changes)
+    void initialiseReciprocalPotentials(const std::vector<GPU_Type> &k_x, const std::vector<GPU_Type> &k_y, double k_max);
+
+    // runs the potential kernel(s) for one slice, this is before the band limit
+    void calculateTransmissionFunction(clMemory<std::complex<GPU_Type>, Manual> &output, int slice);
+
+    // sets the work group and atom tile size of the potential kernel (the local memory arguments depend on the tile)
+    void setPotentialLaunch(unsigned int local_x, unsigned int local_y, unsigned int tile);
+
+    // if the potential kernel can be run with these sizes on this device (and resolution)
+    bool validPotentialLaunch(unsigned int local_x, unsigned int local_y, unsigned int tile);
+
+    // Uses the device profile for the potential kernel if there is one, otherwise times the candidate sizes on this
+    // slice and saves the fastest. The output and slice arguments must already be set.
+    void initialisePotentialLaunch(int slice);
+
+    // the average time (in seconds) of a few runs of a kernel, after one untimed run
+    double benchmarkKernel(clKernel &kernel, clWorkGroup global, clWorkGroup local, int repeats = 3);
 
     bool initialiseSimulation();
 
     void doMultiSliceStep(int slice);
 
+    // finishes the queue after a step, unless running asynchronously (the in-order queue keeps everything in order)
+    void syncStep();
+
+    // Called with the last event of each slice. When running asynchronously this only waits for the oldest slices once
+    // there are more than queue_depth queued, otherwise it finishes the queue.
+    void syncSlice(const clEvent &finished);
+
+    // queues the kernels to make the diffraction pattern, which is left in clWaveFunctionTemp_3
+    void calculateDiffractionImage(int parallel_ind, double d_kx = 0.0, double d_ky = 0.0);
+
     std::vector<double> getDiffractionImage(int parallel_ind, double d_kx = 0.0, double d_ky = 0.0);
 
+    // Sums the diffraction patterns (or exit waves) of the first n waves in the stack (i.e. the batched phonon
+    // configurations) on the device, returns the buffer the sum is in. Nothing is summed when n is 1.
+    clMemory<GPU_Type, Manual> &calculateDiffractionSum(unsigned int n, double d_kx = 0.0, double d_ky = 0.0);
+
+    clMemory<std::complex<GPU_Type>, Manual> &calculateExitWaveSum(unsigned int n);
+
+    std::vector<double> getDiffractionSum(unsigned int n, double d_kx = 0.0, double d_ky = 0.0);
+
+    // adds the input to the output starting at offset (or copies it if first)
+    void accumulate(clMemory<GPU_Type, Manual> &input, clMemory<GPU_Type, Manual> &output, bool first, size_t offset = 0);
+
+    void accumulate(clMemory<std::complex<GPU_Type>, Manual> &input, clMemory<std::complex<GPU_Type>, Manual> &output,
+                    bool first, size_t offset = 0);
+
     std::vector<double> getExitWaveImage(unsigned int t = 0, unsigned int l = 0, unsigned int b = 0, unsigned int r = 0);
 
+    // interleaves the real and imaginary parts (cropped), this doesn't touch anything else so it can run on any thread
+    static std::vector<double> exitWaveToImage(const clMappedView<std::complex<GPU_Type>> &compdata, unsigned int resolution,
+                                               unsigned int t = 0, unsigned int l = 0, unsigned int b = 0, unsigned int r = 0);
+
     virtual void simulate() = 0;
 
     void initialiseBuffers();
     void initialiseKernels();
 
+    // the -D definitions to build the potential kernel for this simulation (so the compiler knows more of the arguments)
+    std::string potentialDefines(bool full_3d);
+
+    // the -D definitions to compile out any aberrations that are zero (for the probe and imaging kernels)
+    std::string aberrationDefines();
+
+    // makes the batched forward transform that applies the propagator as it stores the output
+    void initialiseFusedPropagation(KernelSource &callback, const std::string &callback_name);
+
     // this tilts the beam mid simulation - used for plasmon scattering.
     void modifyBeamTilt(double kx, double ky, double kz);
 
@@ -73,18 +168,77 @@ protected:
     // OpenCL stuff
     clMemory<GPU_Type, Manual> ClParameterisation;
 
+    // the sampled projected potentials (see NativeKernels::projectedPotentialTable), only uploaded when they change
+    clMemory<GPU_Type, Manual> ClPotentialTable;
+    std::vector<GPU_Type> potential_table;
+    uint64_t potential_table_key;
+
     clMemory<GPU_Type, Manual> ClAtomX;
     clMemory<GPU_Type, Manual> ClAtomY;
     clMemory<GPU_Type, Manual> ClAtomZ;
     clMemory<int, Manual> ClAtomA;
 
     clMemory<int, Manual> ClBlockStartPositions;
-    clMemory<int, Manual> ClBlockIds;
-    clMemory<int, Manual> ClZIds;
 
+    // With frozen phonons, the atoms are binned by their undisplaced positions and kept on the device, then each
+    // configuration is made by displacing them into the buffers above (see displaceAtoms). The atoms are the same as
+    // long as the manager is the same.
+    clMemory<GPU_Type, Manual> ClAtomBaseX;
+    clMemory<GPU_Type, Manual> ClAtomBaseY;
+    clMemory<GPU_Type, Manual> ClAtomBaseZ;
+    clMemory<GPU_Type, Manual> ClAtomSigma;
+    clMemory<int, Manual> ClAtomId;
+    std::shared_ptr<SimulationManager> phonon_atoms_manager;
+    uint64_t phonon_atoms_hash;
+    // the atoms (their index in the structure) in the order they are given to the binner
+    std::vector<int> phonon_atom_ids;
+
+    // sorts the atoms on the host (kept so the arrays are reused for each phonon configuration)
+    AtomBinner<GPU_Type> atom_binner;
+
+    // When streaming the atoms (atomSlabSlices > 0) only the atoms for a range of slices (plus the slices either side
+    // that the full 3d potentials need) are on the device. There are two slabs so the next one can be queued up (on the
+    // same in order queue, so it does not overlap the kernels) before the current one is finished with. The block start
+    // positions are relative to the start of each slab.
+    struct AtomSlab {
+        clMemory<GPU_Type, Manual> x;
+        clMemory<GPU_Type, Manual> y;
+        clMemory<GPU_Type, Manual> z;
+        clMemory<int, Manual> a;
+        clMemory<int, Manual> block_starts;
+        std::vector<int> host_block_starts;
+        int first_slice;
+        clEvent uploaded;
+    };
+    bool use_atom_slabs;
+    int slab_slices;
+    int slab_margin;
+    int current_slab;
+    AtomSlab atom_slabs[2];
+
+    // The reciprocal space potentials deposit the atoms of each species onto a stack of images, transform them and sum
+    // them weighted by each species' projected potential in reciprocal space, then transform back.
+    bool use_reciprocal_potentials;
+    bool reciprocal_kernels_built;
+    uint64_t species_factors_key;
+    unsigned int n_species;
+    clMemory<int, Manual> ClSpeciesIndex;
+    clMemory<GPU_Type, Manual> ClSpeciesFactors;
+    clMemory<std::complex<GPU_Type>, Manual> clSpeciesDensity;
+    // the last transform of the densities, so they aren't cleared for the next slice before it is done
+    clEvent species_density_read;
+    clMemory<std::complex<GPU_Type>, Manual> clSpeciesSpectrum;
+
+    // The wavefunctions for all the parallel probes are stored in one stack (so they can be transformed in one go),
+    // the vectors are sub-buffers of each probe in the stack. Each probe is wave_stride elements apart in the stack.
+    clMemory<std::complex<GPU_Type>, Manual> clWaveFunctionRealStack;
+    clMemory<std::complex<GPU_Type>, Manual> clWaveFunctionRecipStack;
     std::vector<clMemory<std::complex<GPU_Type>, Manual>> clWaveFunctionReal;
     std::vector<clMemory<std::complex<GPU_Type>, Manual>> clWaveFunctionRecip;
+    size_t wave_stride;
+    // this is big enough to be used as the intermediate stack for the batched transforms
     clMemory<std::complex<GPU_Type>, Manual> clWaveFunctionTemp_1;
+    std::vector<clMemory<std::complex<GPU_Type>, Manual>> clWaveFunctionTempProbe;
     clMemory<GPU_Type, Manual> clWaveFunctionTemp_2;
     clMemory<GPU_Type, Manual> clWaveFunctionTemp_3;
 
@@ -99,7 +253,9 @@ protected:
 
     // General kernels
     clFourier<GPU_Type> FourierTrans;
-    clKernel AtomSort;
+    clFourier<GPU_Type> FourierTransBatch;
+    clFourier<GPU_Type> FourierTransPropagate;
+    clFourier<GPU_Type> FourierTransSpecies;
     clKernel BandLimit;
     clKernel FftShift;
     clKernel CalculateTransmissionFunction;
@@ -107,6 +263,29 @@ protected:
     clKernel ComplexMultiply;
     clKernel BilinearTranslate;
     clKernel ComplexToReal;
+    clKernel PotentialDeposit;
+    clKernel PotentialStructureFactors;
+    clKernel PotentialTransmission;
+    clKernel PhononDisplace;
+    clKernel Accumulate;
+
+    // The work group size and the number of atoms each work group loads into local memory at once for the potential
+    // kernel. These are tuned for each device the first time a slice with atoms is calculated (see DeviceProfiles)
+    unsigned int potential_local_x, potential_local_y, potential_tile;
+    bool potential_launch_set;
+
+    // When running asynchronously the kernels, transforms and transfers are just queued (the clMemory events handle the
+    // transfers) and the host only waits when it reads something back or when too many slices are queued (so it can
+    // still stop promptly when cancelled).
+    bool async_queue;
+    unsigned int queue_depth;
+    std::deque<clEvent> queued_slices;
+
+    // CTEM/CBED: each wave in the stack is a different phonon configuration (with its own transmission functions), the
+    // outputs are summed over the configurations into these buffers
+    bool batch_phonons;
+    clMemory<GPU_Type, Manual> clDiffractionSum;
+    clMemory<std::complex<GPU_Type>, Manual> clExitWaveSum;
 };
 
 
@@ -0,0 +1,857 @@
+#include "simulationnative.h"
+
+#include <chrono>
+
+#include "ccdparams.h"
+#include "utilities/vectorutils.h"
+
+namespace {
+    NativeKernels::Aberrations getAberrations(const std::shared_ptr<MicroscopeParameters> &mParams, double delta_focus = 0.0) {
+        NativeKernels::Aberrations ab{};
+        ab.C10 = mParams->C10 + delta_focus;
+        ab.C12 = mParams->C12.getComplex();
+        ab.C21 = mParams->C21.getComplex();
+        ab.C23 = mParams->C23.getComplex();
+        ab.C30 = mParams->C30;
+        ab.C32 = mParams->C32.getComplex();
+        ab.C34 = mParams->C34.getComplex();
+        ab.C41 = mParams->C41.getComplex();
+        ab.C43 = mParams->C43.getComplex();
+        ab.C45 = mParams->C45.getComplex();
+        ab.C50 = mParams->C50;
+        ab.C52 = mParams->C52.getComplex();
+        ab.C54 = mParams->C54.getComplex();
+        ab.C56 = mParams->C56.getComplex();
+        return ab;
+    }
+}
+
+template <class T>
+SimulationNative<T>::SimulationNative(clDevice &_dev, ThreadPool &s, unsigned int _id)
+        : ThreadWorker(s, _id), reference_perturb_x(0.0), reference_perturb_y(0.0), potential_args(),
+          potential_table_key(0), bandwidth_k_max(0.0), propagator_dz(0.0) {
+    threads = std::make_shared<NativeThreads>(_dev.GetNativeThreads());
+}
+
+template <class T>
+void SimulationNative<T>::Run(const std::shared_ptr<SimulationJob> &_job) {
+    el::Helpers::setThreadName("native:" + std::to_string(id));
+
+    CLOG(DEBUG, "sim") << "Running native simulation worker (" << threads->size() << " threads)";
+
+    job = _job;
+
+    if (!_job->simManager) {
+        CLOG(DEBUG, "sim") << "Cannot access simulation parameters";
+        pool.setStopped();
+    }
+
+    if (pool.isStopped()) {
+        CLOG(DEBUG, "sim") << "Threadpool stopping";
+        _job->promise.set_value();
+        return;
+    }
+
+    // start the simulation timing
+    _job->simManager->startTimer();
+
+    auto mode = _job->simManager->mode();
+
+    try {
+        if (_job->simManager->full3dEnabled())
+            throw std::runtime_error("Full 3D potentials are not supported by the native backend");
+
+        if (_job->simManager->stemPrismEnabled())
+            throw std::runtime_error("PRISM STEM is not supported by the native backend");
+
+        if (mode == SimulationMode::CTEM) {
+            CLOG(DEBUG, "sim") << "Doing CTEM simulation";
+            simulateCtem();
+        } else if (mode == SimulationMode::CBED) {
+            CLOG(DEBUG, "sim") << "Doing CBED simulation";
+            simulateCbed();
+        } else if (mode == SimulationMode::STEM) {
+            CLOG(DEBUG, "sim") << "Doing STEM simulation";
+            simulateStem();
+        }
+    } catch (const std::runtime_error &e) {
+        CLOG(ERROR, "sim") << "Error performing simulation: " << e.what();
+        pool.setStopped();
+        _job->simManager->failedSimulation();
+    }
+
+    CLOG(DEBUG, "sim") << "Completed simulation";
+    _job->promise.set_value();
+}
+
+template <class T>
+void SimulationNative<T>::initialiseBuffers() {
+    auto sm = job->simManager;
+    unsigned int rs = sm->resolution();
+    size_t rs2 = static_cast<size_t>(rs) * rs;
+
+    if (rs != x_frequencies.size()) {
+        x_frequencies.resize(rs);
+        y_frequencies.resize(rs);
+        propagator.resize(rs2);
+
+        wave_function_temp_1.resize(rs2);
+        wave_function_temp_2.resize(rs2);
+        wave_function_temp_3.resize(rs2);
+
+        wave_function_real.clear();
+        wave_function_recip.clear();
+
+        fourier_trans = NativeFourier<T>(threads, rs, rs);
+    }
+
+    // the transmission functions are cheap to resize (compared to generating them) so just always check these
+    if (sm->precalculateTransmission()) {
+        int n_random = sm->parallelPotentialsCount();
+        rng = std::mt19937_64(std::chrono::system_clock::now().time_since_epoch().count());
+        dist = std::uniform_int_distribution<>(0, n_random - 1);
+
+        int n_slice = sm->simulationCell()->sliceCount();
+        transmission_function.resize(n_random);
+        for (auto &tf : transmission_function) {
+            tf.resize(n_slice);
+            for (auto &t : tf)
+                t.resize(rs2);
+        }
+    } else {
+        transmission_function.resize(1);
+        transmission_function[0].resize(1);
+        transmission_function[0][0].resize(rs2);
+    }
+
+    size_t n_parallel = sm->parallelPixels();
+    wave_function_real.resize(n_parallel, std::vector<std::complex<T>>(rs2));
+    wave_function_recip.resize(n_parallel, std::vector<std::complex<T>>(rs2));
+
+    if (sm->mode() == SimulationMode::CTEM) {
+        image_wave_function.resize(rs2);
+        temp_buffer.resize(rs2);
+    }
+}
+
+template <class T>
+void SimulationNative<T>::sortAtoms(unsigned int config) {
+    CLOG(DEBUG, "sim") << "Sorting Atoms";
+
+    bool do_phonon = job->simManager->incoherenceEffects()->phonons()->getFrozenPhononEnabled();
+
+    const std::vector<AtomSite> &atoms = job->simManager->simulationCell()->crystalStructure()->atoms();
+    auto atom_count = static_cast<unsigned int>(atoms.size());
+
+    std::valarray<double> x_lims = job->simManager->paddedFullLimitsX();
+    std::valarray<double> y_lims = job->simManager->paddedFullLimitsY();
+    std::valarray<double> z_lims = job->simManager->paddedSimLimitsZ();
+
+    Eigen::Vector3d u1v = {1.0, 0.0, 0.0};
+    Eigen::Vector3d u2v = {0.0, 1.0, 0.0};
+    Eigen::Vector3d u3v = {0.0, 0.0, 1.0};
+
+    // If NOT forcing xyz, then get actual values
+    if (!job->simManager->incoherenceEffects()->phonons()->forceXyzDisps()) {
+        u1v = job->simManager->simulationCell()->crystalStructure()->getU1Vector();
+        u2v = job->simManager->simulationCell()->crystalStructure()->getU2Vector();
+        u3v = job->simManager->simulationCell()->crystalStructure()->getU3Vector();
+    }
+
+    double dz = job->simManager->simulationCell()->sliceThickness();
+    unsigned int n_slices = job->simManager->simulationCell()->sliceCount();
+
+    atom_binner.setGrid(x_lims[0], x_lims[1], y_lims[0], y_lims[1], z_lims[1], dz, job->simManager->blocksX(),
+                        job->simManager->blocksY(), n_slices);
+    atom_binner.clear();
+
+    CLOG(DEBUG, "sim") << "Getting atom positions";
+    if (do_phonon)
+        CLOG(DEBUG, "sim") << "Using TDS";
+
+    for (unsigned int i = 0; i < atom_count; i++) {
+        double disp_1 = 0.0, disp_2 = 0.0, disp_3 = 0.0;
+        if (do_phonon) {
+            auto disp = job->simManager->incoherenceEffects()->phonons()->generateTdsFactors(atoms[i], i, job->id, config);
+            disp_1 = disp[0];
+            disp_2 = disp[1];
+            disp_3 = disp[2];
+        }
+
+        auto d1 = disp_1 * u1v;
+        auto d2 = disp_2 * u2v;
+        auto d3 = disp_3 * u3v;
+
+        double new_x = atoms[i].x + d1[0] + d2[0] + d3[0];
+        double new_y = atoms[i].y + d1[1] + d2[1] + d3[1];
+        double new_z = atoms[i].z + d1[2] + d2[2] + d3[2];
+        bool in_x = new_x > x_lims[0] && new_x < x_lims[1];
+        bool in_y = new_y > y_lims[0] && new_y < y_lims[1];
+        bool in_z = new_z > z_lims[0] && new_z < z_lims[1];
+
+        if (in_x && in_y && in_z)
+            atom_binner.addAtom(static_cast<T>(new_x), static_cast<T>(new_y), static_cast<T>(new_z), atoms[i].A);
+    }
+
+    // the same binning as the OpenCL path, ordered by z then y then x
+    CLOG(DEBUG, "sim") << "Binning atoms";
+    atom_binner.sort();
+}
+
+template <class T>
+bool SimulationNative<T>::initialiseSimulation() {
+    bool same_simulation = job->simManager == current_manager;
+
+    bool do_phonon = job->simManager->incoherenceEffects()->phonons()->getFrozenPhononEnabled();
+    bool do_plasmon = job->simManager->incoherenceEffects()->plasmons()->enabled();
+    bool moving_stem_frame = !job->simManager->parallelStem();
+    bool do_multi_potential_tds = job->simManager->useParallelPotentials();
+
+    // see SimulationGeneral::initialiseSimulation for the reasons behind this
+    if (same_simulation && (!do_phonon || do_multi_potential_tds) && !do_plasmon && !moving_stem_frame) {
+        CLOG(DEBUG, "sim") << "Manager already initialised, reusing that data";
+        return true;
+    }
+    current_manager = job->simManager;
+
+    CLOG(DEBUG, "sim") << "Initialising all buffers";
+    initialiseBuffers();
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Sample our parameters
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    auto params = job->simManager->structureParameters();
+    double table_r_min = 0.25 * job->simManager->realScale();
+    uint64_t table_key = TransmissionKey().add(params.parameters).add(params.form).add(params.i_per_atom)
+            .add(table_r_min).value();
+    if (potential_table.empty() || table_key != potential_table_key) {
+        CLOG(DEBUG, "sim") << "Sampling potential table";
+        NativeKernels::projectedPotentialTable(potential_table, params.parameters, static_cast<unsigned int>(params.form),
+                                               params.i_per_atom, params.max_atomic_number,
+                                               NativeKernels::potential_table_samples, table_r_min);
+        potential_table_key = table_key;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Sort our atoms!
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    bool force_tds_resort = job->simManager->forcePhononAtomResort();
+
+    if (!same_simulation || (do_phonon && (!do_multi_potential_tds || force_tds_resort)))
+        sortAtoms();
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Get local copies of variables (for convenience)
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    CLOG(DEBUG, "sim") << "Starting general initialisation";
+    auto current_pixel = job->getPixel();
+
+    unsigned int resolution = job->simManager->resolution();
+    auto mParams = job->simManager->microscopeParams();
+    double wavenumber = mParams->Wavenumber();
+    std::valarray<double> wavevector = mParams->Wavevector();
+    double pixelscale = job->simManager->realScale();
+    double startx = job->simManager->paddedSimLimitsX(current_pixel)[0];
+    double starty = job->simManager->paddedSimLimitsY(current_pixel)[0];
+
+    double SimSizeX = pixelscale * resolution;
+    double SimSizeY = SimSizeX;
+
+    double sigma = mParams->Sigma() * wavenumber / wavevector[2];
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Set up our frequency calibrations
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    auto imidx = (unsigned int) std::floor(static_cast<double>(resolution) / 2.0 + 0.5);
+    auto imidy = (unsigned int) std::floor(static_cast<double>(resolution) / 2.0 + 0.5);
+
+    for (unsigned int i = 0; i < resolution; i++) {
+        if (i >= imidx)
+            x_frequencies[i] = signed(i - resolution) / SimSizeX;
+        else
+            x_frequencies[i] = i / SimSizeX;
+    }
+
+    for (unsigned int i = 0; i < resolution; i++) {
+        if (i >= imidy)
+            y_frequencies[i] = signed(i - resolution) / SimSizeY;
+        else
+            y_frequencies[i] = i / SimSizeY;
+    }
+
+    // Find maximum frequency for bandwidth limiting rule
+    T kmaxx = std::abs(x_frequencies[imidx]);
+    T kmaxy = std::abs(y_frequencies[imidy]);
+
+    bandwidth_k_max = std::min(kmaxy, kmaxx);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Set up the potential arguments
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    double dz = job->simManager->simulationCell()->sliceThickness();
+    auto full_lims_x = job->simManager->paddedFullLimitsX();
+    auto full_lims_y = job->simManager->paddedFullLimitsY();
+    int number_of_slices = job->simManager->simulationCell()->sliceCount();
+
+    potential_args.width = resolution;
+    potential_args.height = resolution;
+    potential_args.total_slices = number_of_slices;
+    potential_args.pixelscale = static_cast<T>(pixelscale);
+    potential_args.blocks_x = job->simManager->blocksX();
+    potential_args.blocks_y = job->simManager->blocksY();
+    potential_args.max_x = static_cast<T>(full_lims_x[1]);
+    potential_args.min_x = static_cast<T>(full_lims_x[0]);
+    potential_args.max_y = static_cast<T>(full_lims_y[1]);
+    potential_args.min_y = static_cast<T>(full_lims_y[0]);
+    potential_args.block_load_x = (int) std::ceil(8.0 / job->simManager->blockScaleX());
+    potential_args.block_load_y = (int) std::ceil(8.0 / job->simManager->blockScaleY());
+    potential_args.sigma = static_cast<T>(sigma);
+    potential_args.startx = static_cast<T>(startx + reference_perturb_x);
+    potential_args.starty = static_cast<T>(starty + reference_perturb_y);
+    potential_args.beam_theta = static_cast<T>(mParams->BeamTilt);
+    potential_args.beam_phi = static_cast<T>(mParams->BeamAzimuth);
+    potential_args.table_r_min = static_cast<T>(table_r_min);
+
+    if (job->simManager->precalculateTransmission()) {
+        int n_random = job->simManager->parallelPotentialsCount();
+
+        for (int j = 0; j < n_random; ++j) {
+            for (int i = 0; i < number_of_slices; ++i) {
+                calculateTransmissionFunction(transmission_function[j][i], i);
+
+                if (pool.isStopped())
+                    return false;
+            }
+
+            // sort for our next iteration
+            if (j < n_random - 1)
+                sortAtoms(j + 1);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Set up the propagator
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    propagator_dz = dz;
+
+    NativeKernels::propagator(*threads, propagator, x_frequencies, y_frequencies, static_cast<T>(dz),
+                              static_cast<T>(wavenumber), static_cast<T>(wavevector[0]), static_cast<T>(wavevector[1]),
+                              static_cast<T>(wavevector[2]), static_cast<T>(bandwidth_k_max * job->simManager->inverseLimitFactor()));
+
+    return true;
+}
+
+template <class T>
+void SimulationNative<T>::calculateTransmissionFunction(std::vector<std::complex<T>> &transmission, int slice) {
+    CLOG(DEBUG, "sim") << "Calculating potentials";
+    NativeKernels::transmissionPotentialsProjected(*threads, transmission, atom_binner.sortedX(), atom_binner.sortedY(),
+                                                   atom_binner.sortedA(), potential_table,
+                                                   NativeKernels::potential_table_samples,
+                                                   atom_binner.blockStartPositions(),
+                                                   slice, potential_args);
+
+    /// Apply low pass filter to transmission function
+    fourier_trans.run(transmission, wave_function_temp_1, Direction::Forwards);
+    NativeKernels::bandLimit(*threads, wave_function_temp_1, x_frequencies, y_frequencies,
+                             static_cast<T>(bandwidth_k_max), static_cast<T>(job->simManager->inverseLimitFactor()));
+    fourier_trans.run(wave_function_temp_1, transmission, Direction::Inverse);
+}
+
+template <class T>
+void SimulationNative<T>::modifyBeamTilt(double kx, double ky, double kz) {
+    // the transmission function uses the tilt in mrad from the surface normal (and the azimuth in radians)
+    potential_args.beam_theta = static_cast<T>(1000.0 * std::atan(std::sqrt(kx * kx + ky * ky) / kz));
+    potential_args.beam_phi = static_cast<T>(std::atan2(ky, kx));
+
+    // The propagator does need to be recalculated now
+    auto mParams = job->simManager->microscopeParams();
+    NativeKernels::propagator(*threads, propagator, x_frequencies, y_frequencies, static_cast<T>(propagator_dz),
+                              static_cast<T>(mParams->Wavenumber()), static_cast<T>(kx), static_cast<T>(ky),
+                              static_cast<T>(kz), static_cast<T>(bandwidth_k_max * job->simManager->inverseLimitFactor()));
+}
+
+template <class T>
+void SimulationNative<T>::doMultiSliceStep(int slice) {
+    CLOG(DEBUG, "sim") << "Start multislice step " << slice;
+
+    int n_parallel = job->simManager->parallelPixels();
+
+    int trans_id = slice;
+
+    if (!job->simManager->precalculateTransmission()) {
+        trans_id = 0;
+        calculateTransmissionFunction(transmission_function[0][0], slice);
+    }
+
+    bool do_multi_potential_tds = job->simManager->useParallelPotentials();
+
+    for (int i = 0; i < n_parallel; i++) {
+        CLOG(DEBUG, "sim") << "Propogating (" << i << " of " << n_parallel << " parallel)";
+
+        int nv = 0;
+
+        if (do_multi_potential_tds)
+            nv = dist(rng);
+
+        // Multiply transmission function with wavefunction
+        NativeKernels::complexMultiply(*threads, transmission_function[nv][trans_id], wave_function_real[i], wave_function_recip[i]);
+
+        // go to reciprocal space
+        fourier_trans.run(wave_function_recip[i], wave_function_temp_1, Direction::Forwards);
+
+        // convolve with propagator
+        NativeKernels::complexMultiply(*threads, wave_function_temp_1, propagator, wave_function_recip[i]);
+
+        // IFFT back to real space
+        fourier_trans.run(wave_function_recip[i], wave_function_real[i], Direction::Inverse);
+    }
+}
+
+template <class T>
+void SimulationNative<T>::diffractionToTemp(int parallel_ind, double d_kx, double d_ky) {
+    unsigned int resolution = job->simManager->resolution();
+
+    NativeKernels::fftShift(*threads, wave_function_recip[parallel_ind], wave_function_temp_1, resolution, resolution);
+
+    int output_type = 4; // square abs
+
+    if (d_kx != 0.0 || d_ky != 0.0) {
+        NativeKernels::complexToReal(*threads, wave_function_temp_1, wave_function_temp_2, output_type);
+
+        double scale = job->simManager->inverseScale();
+        double shift_x = d_kx / scale;
+        double shift_y = d_ky / scale;
+
+        int int_shift_x = std::floor(shift_x);
+        int int_shift_y = std::floor(shift_y);
+
+        NativeKernels::bilinearTranslate(*threads, wave_function_temp_2, wave_function_temp_3, int_shift_x, int_shift_y,
+                                         static_cast<T>(shift_x - int_shift_x), static_cast<T>(shift_y - int_shift_y),
+                                         resolution, resolution);
+    } else {
+        NativeKernels::complexToReal(*threads, wave_function_temp_1, wave_function_temp_3, output_type);
+    }
+}
+
+template <class T>
+std::vector<double> SimulationNative<T>::getDiffractionImage(int parallel_ind, double d_kx, double d_ky) {
+    CLOG(DEBUG, "sim") << "Getting diffraction image";
+    diffractionToTemp(parallel_ind, d_kx, d_ky);
+    return std::vector<double>(wave_function_temp_3.begin(), wave_function_temp_3.end());
+}
+
+template <class T>
+std::vector<double> SimulationNative<T>::getExitWaveImage() {
+    CLOG(DEBUG, "sim") << "Getting exit wave image";
+    const auto &compdata = wave_function_real[0];
+    std::vector<double> data_out(2 * compdata.size());
+
+    for (size_t k = 0; k < compdata.size(); ++k) {
+        data_out[2 * k] = compdata[k].real();
+        data_out[2 * k + 1] = compdata[k].imag();
+    }
+
+    return data_out;
+}
+
+template <class T>
+void SimulationNative<T>::initialiseProbeWave(double posx, double posy, int n_parallel) {
+    CLOG(DEBUG, "sim") << "Initialising probe wavefunction";
+    auto mParams = job->simManager->microscopeParams();
+    double wavelength = mParams->Wavelength();
+
+    auto current_pixel = job->getPixel();
+
+    // account for the simulation area start point
+    posx = posx - job->simManager->paddedSimLimitsX(current_pixel)[0];
+    posy = posy - job->simManager->paddedSimLimitsY(current_pixel)[0];
+
+    double delta_focus = 0.0;
+    if (job->simManager->incoherenceEffects()->chromatic()->enabled())
+        delta_focus = job->simManager->incoherenceEffects()->chromatic()->getFocusChange(mParams->Voltage);
+
+    NativeKernels::initProbeWave(*threads, wave_function_recip[n_parallel], x_frequencies, y_frequencies,
+                                 static_cast<T>(posx), static_cast<T>(posy), static_cast<T>(wavelength),
+                                 getAberrations(mParams, delta_focus), static_cast<T>(mParams->CondenserAperture),
+                                 static_cast<T>(mParams->CondenserApertureSmoothing));
+
+    fourier_trans.run(wave_function_recip[n_parallel], wave_function_real[n_parallel], Direction::Inverse);
+}
+
+template <class T>
+void SimulationNative<T>::simulateCtemImage() {
+    // Check if have a CCD set, then do that method instead
+    std::string ccd = job->simManager->ccdName();
+    if (CCDParams::nameExists(ccd)) {
+        std::vector<double> dqe_d = CCDParams::getDQE(ccd);
+        std::vector<double> ntf_d = CCDParams::getNTF(ccd);
+        std::vector<T> dqe(dqe_d.begin(), dqe_d.end());
+        std::vector<T> ntf(ntf_d.begin(), ntf_d.end());
+        int binning = job->simManager->ccdBinning();
+        double dose = job->simManager->ccdDose(); // electrons per area
+        double scale = job->simManager->realScale();
+        scale *= scale; // square it to get area of pixel
+        double dose_per_pix = dose * scale;
+
+        simulateImageDose(dqe, ntf, binning, dose_per_pix);
+    } else {
+        simulateImagePerfect();
+    }
+}
+
+template <class T>
+void SimulationNative<T>::simulateImagePerfect() {
+    CLOG(DEBUG, "sim") << "Start CTEM image simulation (no dose calculation)";
+    auto mParams = job->simManager->microscopeParams();
+
+    NativeKernels::ctemImage(*threads, wave_function_recip[0], image_wave_function, x_frequencies, y_frequencies,
+                             static_cast<T>(mParams->Wavelength()), getAberrations(mParams),
+                             static_cast<T>(mParams->ObjectiveAperture), static_cast<T>(mParams->ObjectiveApertureSmoothing),
+                             static_cast<T>(mParams->Alpha), static_cast<T>(mParams->Delta));
+
+    fourier_trans.run(image_wave_function, wave_function_temp_1, Direction::Inverse);
+
+    NativeKernels::sqAbs(*threads, wave_function_temp_1, image_wave_function);
+}
+
+template <class T>
+void SimulationNative<T>::simulateImageDose(const std::vector<T> &dqe_data, const std::vector<T> &ntf_data, int binning,
+                                            double doseperpix, double conversionfactor) {
+    // all the NTF, DQE stuff can be found here: 10.1016/j.jsb.2013.05.008
+    CLOG(DEBUG, "sim") << "Start CTEM image simulation (with calculation)";
+    unsigned int resolution = job->simManager->resolution();
+
+    simulateImagePerfect();
+
+    fourier_trans.run(image_wave_function, temp_buffer, Direction::Forwards);
+    NativeKernels::ccdTransfer(*threads, temp_buffer, dqe_data, resolution, resolution, binning, true);
+    fourier_trans.run(temp_buffer, image_wave_function, Direction::Inverse);
+
+    CLOG(DEBUG, "sim") << "Add noise";
+    double N_tot = doseperpix * binning * binning;
+
+    std::mt19937_64 noise_rng(std::chrono::system_clock::now().time_since_epoch().count());
+
+    for (auto &v : image_wave_function) {
+        std::poisson_distribution<int> noise_dist(N_tot * v.real());
+        v = std::complex<T>(static_cast<T>(conversionfactor * noise_dist(noise_rng)), T(0));
+    }
+
+    fourier_trans.run(image_wave_function, temp_buffer, Direction::Forwards);
+    NativeKernels::ccdTransfer(*threads, temp_buffer, ntf_data, resolution, resolution, binning, false);
+    fourier_trans.run(temp_buffer, image_wave_function, Direction::Inverse);
+}
+
+template <class T>
+std::vector<double> SimulationNative<T>::getCtemImage() {
+    std::vector<double> data_out(image_wave_function.size());
+    for (size_t i = 0; i < image_wave_function.size(); i++)
+        data_out[i] = image_wave_function[i].real();
+    return data_out;
+}
+
+template <class T>
+double SimulationNative<T>::getStemPixel(double inner, double outer, double xc, double yc, int parallel_ind, double d_kx, double d_ky) {
+    CLOG(DEBUG, "sim") << "Getting STEM pixel";
+    unsigned int resolution = job->simManager->resolution();
+    double angle_scale = job->simManager->inverseScaleAngle();
+
+    diffractionToTemp(parallel_ind, d_kx, d_ky);
+
+    NativeKernels::bandPass(*threads, wave_function_temp_3, wave_function_temp_2, resolution, resolution,
+                            static_cast<T>(inner / angle_scale), static_cast<T>(outer / angle_scale),
+                            static_cast<T>(xc / angle_scale), static_cast<T>(yc / angle_scale));
+
+    return NativeKernels::sumReduction(*threads, wave_function_temp_2);
+}
+
+template <class T>
+void SimulationNative<T>::simulateCtem() {
+    // should never be needed, but just to be safe
+    reference_perturb_x = 0.0;
+    reference_perturb_y = 0.0;
+
+    if (!initialiseSimulation())
+        return;
+
+    NativeKernels::initPlaneWave(*threads, wave_function_real[0], T(1));
+
+    typedef std::map<std::string, Image<double>> return_map;
+    return_map Images;
+
+    unsigned int numberOfSlices = job->simManager->simulationCell()->sliceCount();
+    unsigned int resolution = job->simManager->resolution();
+    std::valarray<unsigned int> im_crop = job->simManager->imageCrop();
+    bool sim_im = job->simManager->ctemImageEnabled();
+
+    unsigned int slice_step = job->simManager->intermediateSliceStep();
+    unsigned int output_count = 1;
+    if (slice_step > 0)
+        output_count = std::ceil((float) numberOfSlices / slice_step);
+
+    auto ew = Image<double>(resolution, resolution, output_count, im_crop[0], im_crop[1], im_crop[2], im_crop[3]);
+    auto diff = Image<double>(resolution, resolution, output_count);
+    Image<double> ctem_im;
+    if (sim_im)
+        ctem_im = Image<double>(resolution, resolution, output_count, im_crop[0], im_crop[1], im_crop[2], im_crop[3]);
+
+    //
+    // plasmon setup
+    //
+    std::shared_ptr<PlasmonScattering> plasmon = job->simManager->incoherenceEffects()->plasmons();
+    bool do_plasmons = plasmon->enabled();
+    double slice_dz = job->simManager->simulationCell()->sliceThickness();
+    int padding_slices = (int) job->simManager->simulationCell()->preSliceCount();
+    unsigned int scattering_count = 0;
+    double next_scattering_depth = plasmon->getGeneratedDepth(job->id, scattering_count);
+
+    auto mp = job->simManager->microscopeParams();
+    double k_v = mp->Wavenumber();
+    auto orig_k = mp->Wavevector();
+    Eigen::Vector3d k_vec(0.0, 0.0, k_v);
+    Eigen::Vector3d y_axis(0.0, 1.0, 0.0);
+    Utils::rotateVectorSpherical(k_vec, y_axis, mp->BeamTilt / 1000.0, mp->BeamAzimuth);
+
+    unsigned int output_counter = 0;
+    for (int i = 0; i < numberOfSlices; ++i) {
+        doMultiSliceStep(i);
+
+        double current_depth = (i + 1 - padding_slices) * slice_dz;
+        if (do_plasmons && current_depth >= next_scattering_depth) {
+            Utils::rotateVectorSpherical(k_vec, y_axis, plasmon->getScatteringPolar() / 1000.0, plasmon->getScatteringAzimuth());
+            modifyBeamTilt(k_vec(0), k_vec(1), k_vec(2));
+
+            scattering_count++;
+            next_scattering_depth = plasmon->getGeneratedDepth(job->id, scattering_count);
+        }
+
+        if (pool.isStopped())
+            return;
+
+        if (slice_step > 0 && (i + 1) % slice_step == 0) {
+            ew.getSliceRef(output_counter) = getExitWaveImage();
+            diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+
+            if (sim_im) {
+                simulateCtemImage();
+                ctem_im.getSliceRef(output_counter) = getCtemImage();
+            }
+
+            ++output_counter;
+        }
+
+        if (pool.isStopped())
+            return;
+
+        job->simManager->reportSliceProgress(static_cast<double>(i + 1) / numberOfSlices);
+    }
+
+    if (output_counter < output_count) {
+        ew.getSliceRef(output_counter) = getExitWaveImage();
+        diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+        if (sim_im) {
+            simulateCtemImage();
+            ctem_im.getSliceRef(output_counter) = getCtemImage();
+        }
+    }
+
+    Images.insert(return_map::value_type("EW", ew));
+    Images.insert(return_map::value_type("Diff", diff));
+    if (sim_im)
+        Images.insert(return_map::value_type("Image", ctem_im));
+
+    job->simManager->updateImages(Images, 1);
+}
+
+template <class T>
+void SimulationNative<T>::simulateCbed() {
+    auto ss = job->simManager->incoherenceEffects()->source();
+    if (ss->enabled()) {
+        reference_perturb_x = ss->getOffset();
+        reference_perturb_y = ss->getOffset();
+    } else {
+        reference_perturb_x = 0.0;
+        reference_perturb_y = 0.0;
+    }
+
+    if (!initialiseSimulation())
+        return;
+
+    typedef std::map<std::string, Image<double>> return_map;
+    return_map Images;
+
+    unsigned int numberOfSlices = job->simManager->simulationCell()->sliceCount();
+    auto pos = job->simManager->cbedPosition();
+    unsigned int resolution = job->simManager->resolution();
+
+    initialiseProbeWave(pos->getXPos(), pos->getYPos());
+
+    unsigned int slice_step = job->simManager->intermediateSliceStep();
+    unsigned int output_count = 1;
+    if (slice_step > 0)
+        output_count = std::ceil((double) numberOfSlices / slice_step);
+
+    auto diff = Image<double>(resolution, resolution, output_count);
+
+    //
+    // plasmon setup
+    //
+    std::shared_ptr<PlasmonScattering> plasmon = job->simManager->incoherenceEffects()->plasmons();
+    bool do_plasmons = plasmon->enabled();
+    double slice_dz = job->simManager->simulationCell()->sliceThickness();
+    int padding_slices = (int) job->simManager->simulationCell()->preSliceCount();
+    unsigned int scattering_count = 0;
+    double next_scattering_depth = plasmon->getGeneratedDepth(job->id, scattering_count);
+
+    auto mp = job->simManager->microscopeParams();
+    double k_v = mp->Wavenumber();
+    auto orig_k = mp->Wavevector();
+    Eigen::Vector3d k_vec(0.0, 0.0, k_v);
+    Eigen::Vector3d y_axis(0.0, 1.0, 0.0);
+    Utils::rotateVectorSpherical(k_vec, y_axis, mp->BeamTilt / 1000.0, mp->BeamAzimuth);
+
+    unsigned int output_counter = 0;
+    for (int i = 0; i < numberOfSlices; ++i) {
+        doMultiSliceStep(i);
+
+        double current_depth = (i + 1 - padding_slices) * slice_dz;
+        if (do_plasmons && current_depth >= next_scattering_depth) {
+            Utils::rotateVectorSpherical(k_vec, y_axis, plasmon->getScatteringPolar() / 1000.0, plasmon->getScatteringAzimuth());
+            modifyBeamTilt(k_vec(0), k_vec(1), k_vec(2));
+
+            scattering_count++;
+            next_scattering_depth = plasmon->getGeneratedDepth(job->id, scattering_count);
+        }
+
+        if (pool.isStopped())
+            return;
+
+        if (slice_step > 0 && (i + 1) % slice_step == 0) {
+            diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+            output_counter++;
+        }
+
+        if (pool.isStopped())
+            return;
+
+        job->simManager->reportSliceProgress(static_cast<double>(i + 1) / numberOfSlices);
+    }
+
+    if (output_counter < output_count)
+        diff.getSliceRef(output_counter) = getDiffractionImage(0, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+
+    Images.insert(return_map::value_type("Diff", diff));
+
+    job->simManager->updateImages(Images, 1);
+}
+
+template <class T>
+void SimulationNative<T>::simulateStem() {
+    auto ss = job->simManager->incoherenceEffects()->source();
+    if (ss->enabled()) {
+        reference_perturb_x = ss->getOffset();
+        reference_perturb_y = ss->getOffset();
+    } else {
+        reference_perturb_x = 0.0;
+        reference_perturb_y = 0.0;
+    }
+
+    if (!initialiseSimulation())
+        return;
+
+    // only the pixels this job simulates are returned (as [detector][output slice][pixel index])
+    std::map<std::string, std::vector<std::vector<double>>> pixel_images;
+
+    auto stemPixels = job->simManager->stemArea();
+    unsigned int numberOfSlices = job->simManager->simulationCell()->sliceCount();
+
+    double start_x = stemPixels->getRawLimitsX()[0];
+    double start_y = stemPixels->getRawLimitsY()[0];
+
+    int num_x = stemPixels->getPixelsX();
+
+    double step_x = stemPixels->getScaleX();
+    double step_y = stemPixels->getScaleY();
+
+    unsigned int px_x = stemPixels->getPixelsX();
+    unsigned int px_y = stemPixels->getPixelsY();
+
+    unsigned int slice_step = job->simManager->intermediateSliceStep();
+    unsigned int output_count = 1;
+    if (slice_step > 0)
+        output_count = std::ceil((float) numberOfSlices / slice_step);
+
+    for (const auto &det : job->simManager->stemDetectors())
+        pixel_images[det.name] = std::vector<std::vector<double>>(output_count);
+
+    for (int i = 0; i < job->pixels.size(); ++i) {
+        int p = job->pixels[i];
+        int x_i = p % num_x;
+        int y_i = (int) std::floor(p / num_x);
+
+        initialiseProbeWave(start_x + x_i * step_x, start_y + y_i * step_y, i);
+    }
+
+    //
+    // plasmon setup
+    //
+    std::shared_ptr<PlasmonScattering> plasmon = job->simManager->incoherenceEffects()->plasmons();
+    bool do_plasmons = plasmon->enabled();
+    double slice_dz = job->simManager->simulationCell()->sliceThickness();
+    int padding_slices = (int) job->simManager->simulationCell()->preSliceCount();
+    unsigned int scattering_count = 0;
+    double next_scattering_depth = plasmon->getGeneratedDepth(job->id, scattering_count);
+
+    auto mp = job->simManager->microscopeParams();
+    double k_v = mp->Wavenumber();
+    auto orig_k = mp->Wavevector();
+    Eigen::Vector3d k_vec(0.0, 0.0, k_v);
+    Eigen::Vector3d y_axis(0.0, 1.0, 0.0);
+    Utils::rotateVectorSpherical(k_vec, y_axis, mp->BeamTilt / 1000.0, mp->BeamAzimuth);
+
+    auto getDetectorImages = [&](unsigned int output_index) {
+        for (const auto &det : job->simManager->stemDetectors()) {
+            std::vector<double> im(job->pixels.size(), 0.0);
+
+            for (int j = 0; j < job->pixels.size(); ++j)
+                im[j] = getStemPixel(det.inner, det.outer, det.xcentre, det.ycentre, j, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+
+            pixel_images[det.name][output_index] = std::move(im);
+        }
+    };
+
+    unsigned int output_counter = 0;
+    for (int i = 0; i < numberOfSlices; ++i) {
+        doMultiSliceStep(i);
+
+        double current_depth = (i + 1 - padding_slices) * slice_dz;
+        if (do_plasmons && current_depth >= next_scattering_depth) {
+            Utils::rotateVectorSpherical(k_vec, y_axis, plasmon->getScatteringPolar() / 1000.0, plasmon->getScatteringAzimuth());
+            modifyBeamTilt(k_vec(0), k_vec(1), k_vec(2));
+
+            scattering_count++;
+            next_scattering_depth = plasmon->getGeneratedDepth(job->id, scattering_count);
+        }
+
+        if (pool.isStopped())
+            return;
+
+        if (slice_step > 0 && (i + 1) % slice_step == 0) {
+            getDetectorImages(output_counter);
+            ++output_counter;
+        }
+
+        if (pool.isStopped())
+            return;
+
+        job->simManager->reportSliceProgress(static_cast<double>(i + 1) / numberOfSlices);
+    }
+
+    if (output_counter < output_count)
+        getDetectorImages(output_counter);
+
+    job->simManager->updateImagePixels(pixel_images, job->pixels, px_x, px_y, 1, job->simManager->liveStemEnabled());
+}
+
+template class SimulationNative<float>;
+template class SimulationNative<double>;
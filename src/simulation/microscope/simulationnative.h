@@ -0,0 +1,112 @@
+#ifndef CLTEM_SIMULATIONNATIVE_H
+#define CLTEM_SIMULATIONNATIVE_H
+
+#include <complex>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "clwrapper.h"
+#include "utilities/atombinner.h"
+#include "utilities/logging.h"
+
+#include "simulationmanager.h"
+#include "threading/simulationjob.h"
+#include "threading/threadworker.h"
+
+#include "native/nativethreads.h"
+#include "native/nativefourier.h"
+#include "native/nativekernels.h"
+#include "utilities/transmissioncache.h"
+
+// This is a multislice worker that runs entirely on the host (using a pool of CPU threads) instead of an OpenCL device.
+// It follows the same steps as the SimulationGeneral/Ctem/Cbed/Stem classes (and uses host versions of the same
+// kernels) so the results should match the OpenCL path. Only the projected potentials are supported (not full 3D).
+template <class T>
+class SimulationNative : public ThreadWorker
+{
+public:
+    SimulationNative(clDevice &_dev, ThreadPool &s, unsigned int _id);
+
+    void Run(const std::shared_ptr<SimulationJob> &_job) override;
+
+private:
+    // shared so this worker can still be copied into its thread
+    std::shared_ptr<NativeThreads> threads;
+
+    std::shared_ptr<SimulationJob> job;
+
+    // this is only used to check if the manager has changed (only to avoid sorting atoms multiple times)
+    std::shared_ptr<SimulationManager> current_manager;
+
+    // these are used to perturb the reference frame (i.e. when moving the source)
+    double reference_perturb_x, reference_perturb_y;
+
+    void simulateCtem();
+    void simulateCbed();
+    void simulateStem();
+
+    bool initialiseSimulation();
+
+    void initialiseBuffers();
+
+    // config picks the phonon configuration (for the parallel potentials)
+    void sortAtoms(unsigned int config = 0);
+
+    void calculateTransmissionFunction(std::vector<std::complex<T>> &transmission, int slice);
+
+    void doMultiSliceStep(int slice);
+
+    // this tilts the beam mid simulation - used for plasmon scattering.
+    void modifyBeamTilt(double kx, double ky, double kz);
+
+    void initialiseProbeWave(double posx, double posy, int n_parallel = 0);
+
+    std::vector<double> getDiffractionImage(int parallel_ind, double d_kx = 0.0, double d_ky = 0.0);
+
+    std::vector<double> getExitWaveImage();
+
+    void simulateCtemImage();
+    void simulateImagePerfect();
+    void simulateImageDose(const std::vector<T> &dqe_data, const std::vector<T> &ntf_data, int binning, double doseperpix, double conversionfactor = 1);
+    std::vector<double> getCtemImage();
+
+    double getStemPixel(double inner, double outer, double xc, double yc, int parallel_ind, double d_kx = 0.0, double d_ky = 0.0);
+
+    // puts the squared abs of the shifted diffraction pattern into temp_3 (translating it if needed)
+    void diffractionToTemp(int parallel_ind, double d_kx, double d_ky);
+
+    // the projected potential of each element, only remade when the parameters or pixel scale change
+    std::vector<T> potential_table;
+    uint64_t potential_table_key;
+
+    // sorts the atoms (the same layout as the OpenCL buffers), kept so the arrays are reused for each configuration
+    AtomBinner<T> atom_binner;
+
+    std::vector<T> x_frequencies;
+    std::vector<T> y_frequencies;
+    std::vector<std::complex<T>> propagator;
+    std::vector<std::vector<std::vector<std::complex<T>>>> transmission_function;
+
+    std::vector<std::vector<std::complex<T>>> wave_function_real;
+    std::vector<std::vector<std::complex<T>>> wave_function_recip;
+    std::vector<std::complex<T>> wave_function_temp_1;
+    std::vector<T> wave_function_temp_2;
+    std::vector<T> wave_function_temp_3;
+
+    // CTEM only
+    std::vector<std::complex<T>> image_wave_function;
+    std::vector<std::complex<T>> temp_buffer;
+
+    NativeFourier<T> fourier_trans;
+
+    // the arguments that are fixed for the potential/propagator calculations (set in initialiseSimulation)
+    NativeKernels::ProjectedPotentialArgs<T> potential_args;
+    double bandwidth_k_max;
+    double propagator_dz;
+
+    std::mt19937_64 rng;
+    std::uniform_int_distribution<> dist;
+};
+
+#endif //CLTEM_SIMULATIONNATIVE_H
@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <cmath>
+
+#include "simulationprism.h"
+
+template <>
+void SimulationPrism<float>::initialiseKernels() {
+
+    if (do_initialise_prism)
+        PrismProbes = Kernels::prism_probes_f.BuildToKernel(ctx);
+
+    do_initialise_prism = false;
+}
+
+template <>
+void SimulationPrism<double>::initialiseKernels() {
+
+    if (do_initialise_prism)
+        PrismProbes = Kernels::prism_probes_d.BuildToKernel(ctx);
+
+    do_initialise_prism = false;
+}
+
+template<class GPU_Type>
+void SimulationPrism<GPU_Type>::simulate() {
+    typedef std::complex<GPU_Type> complex_type;
+
+    if(!SimulationStem<GPU_Type>::initialiseSimulation())
+        return;
+
+    initialiseKernels();
+
+    auto sm = job->simManager;
+    unsigned int resolution = sm->resolution();
+    unsigned int n_parallel = sm->parallelPixels();
+    unsigned int numberOfSlices = sm->simulationCell()->sliceCount();
+    size_t n_det = sm->stemDetectors().size();
+
+    // the windows have to tile the simulation exactly
+    unsigned int interpolation = std::min(sm->prismInterpolation(), resolution);
+    while (resolution % interpolation != 0)
+        --interpolation;
+    unsigned int window = resolution / interpolation;
+
+    unsigned int slice_step = sm->intermediateSliceStep();
+    unsigned int output_count = 1;
+    if (slice_step > 0)
+        output_count = std::ceil((float) numberOfSlices / slice_step);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Choose the beams
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // A probe at the start of the frame gives the aperture and aberrations, the position is then just a phase
+    double start_x = sm->paddedSimLimitsX(job->getPixel())[0];
+    double start_y = sm->paddedSimLimitsY(job->getPixel())[0];
+
+    initialiseProbeWave(start_x, start_y, 0);
+    ctx->WaitForQueueFinish();
+
+    std::vector<complex_type> probe_recip = clWaveFunctionRecip[0].GetLocal();
+    std::vector<GPU_Type> k_x = clXFrequencies.GetLocal();
+    std::vector<GPU_Type> k_y = clYFrequencies.GetLocal();
+
+    std::vector<unsigned int> beam_x, beam_y;
+    for (unsigned int j = 0; j < resolution; j += interpolation)
+        for (unsigned int i = 0; i < resolution; i += interpolation)
+            if (std::norm(probe_recip[i + resolution * j]) > 0) {
+                beam_x.push_back(i);
+                beam_y.push_back(j);
+            }
+
+    auto n_beams = static_cast<unsigned int>(beam_x.size());
+    if (n_beams == 0)
+        throw std::runtime_error("The probe aperture does not contain any PRISM beams");
+
+    unsigned int n_batches = (n_beams + n_parallel - 1) / n_parallel;
+
+    CLOG(DEBUG, "sim") << "PRISM with " << n_beams << " beams (interpolation " << interpolation << ") in " << n_batches
+                       << " batches";
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Make the S-matrix
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    size_t stack_size = wave_stride * n_parallel;
+
+    // The runner checks this up front, but it only estimates the number of beams (this would otherwise fail part way).
+    // This leaves space for the wave function stacks and the probe windows (up to 1/8 of the memory).
+    size_t s_matrix_bytes = output_count * n_batches * stack_size * sizeof(complex_type);
+    size_t other_bytes = 3 * stack_size * sizeof(complex_type);
+    if (size_t mem = ctx->GetContextDevice().GetGlobalMemSize(); mem > 0 && s_matrix_bytes + other_bytes > mem - mem / 8)
+        throw std::runtime_error("The PRISM S-matrix (" + std::to_string(s_matrix_bytes / (1024 * 1024)) +
+                                 " MB) does not fit in the device memory, use a larger interpolation or fewer intermediate slices");
+
+    if (clSMatrix.size() != output_count || clSMatrix[0].size() != n_batches || clSMatrix[0][0].GetSize() != stack_size) {
+        // free the old one first, this is probably most of the memory
+        clSMatrix.clear();
+
+        CLOG(DEBUG, "sim") << "Allocating S-matrix (" << output_count * n_batches * stack_size * sizeof(complex_type) / (1024 * 1024) << " MB)";
+        clSMatrix.resize(output_count);
+        for (auto &s : clSMatrix)
+            for (unsigned int b = 0; b < n_batches; ++b)
+                s.emplace_back(ctx, stack_size);
+    }
+
+    // each beam starts as a single reciprocal space pixel (i.e. a tilted plane wave)
+    std::vector<complex_type> beam_amplitude(n_parallel, complex_type(1));
+
+    for (unsigned int b = 0; b < n_batches; ++b) {
+        clWaveFunctionRecipStack.Fill(complex_type(0)).Wait();
+        for (unsigned int i = 0; i < n_parallel && b * n_parallel + i < n_beams; ++i) {
+            unsigned int beam = b * n_parallel + i;
+            clWaveFunctionRecipStack.Write(&beam_amplitude[i], i * wave_stride + beam_x[beam] + resolution * beam_y[beam], 1);
+        }
+        ctx->WaitForIOQueueFinish();
+
+        FourierTransBatch.run(clWaveFunctionRecipStack, clWaveFunctionRealStack, Direction::Inverse);
+
+        unsigned int output_counter = 0;
+        for (int i = 0; i < numberOfSlices; ++i) {
+            doMultiSliceStep(i);
+
+            if (pool.isStopped())
+                return;
+
+            if (slice_step > 0 && (i+1) % slice_step == 0) {
+                clWaveFunctionRealStack.CopyTo(clSMatrix[output_counter][b]);
+                ctx->WaitForIOQueueFinish();
+                ++output_counter;
+            }
+
+            sm->reportSliceProgress(static_cast<double>(b * numberOfSlices + i + 1) / (n_batches * numberOfSlices));
+        }
+
+        if (output_counter < output_count) {
+            clWaveFunctionRealStack.CopyTo(clSMatrix[output_counter][b]);
+            ctx->WaitForIOQueueFinish();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    /// Make the probes from the S-matrix
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    size_t n_pixels = job->pixels.size();
+    size_t window_size = static_cast<size_t>(window) * window;
+
+    // use up to 1/8 of the device memory for the probe windows (the S-matrix is the big part)
+    size_t n_probes;
+    if (size_t mem = ctx->GetContextDevice().GetGlobalMemSize(); mem > 0)
+        n_probes = mem / 8 / (2 * window_size * sizeof(complex_type));
+    else
+        n_probes = static_cast<size_t>(n_parallel) * interpolation * interpolation;
+    n_probes = std::max<size_t>(std::min(n_probes, n_pixels), 1);
+
+    if (clPrismProbes.GetSize() != n_probes * window_size) {
+        clPrismProbes = clMemory<complex_type, Manual>(ctx, n_probes * window_size);
+        clPrismProbesRecip = clMemory<complex_type, Manual>(ctx, n_probes * window_size);
+    }
+    if (clPrismCoefficients.GetSize() != n_probes * n_beams)
+        clPrismCoefficients = clMemory<complex_type, Manual>(ctx, n_probes * n_beams);
+    if (clPrismOrigins.GetSize() != 2 * n_probes)
+        clPrismOrigins = clMemory<int, Manual>(ctx, 2 * n_probes);
+    if (FourierTransPrism.GetWidth() != window || FourierTransPrism.GetBatchSize() != n_probes) {
+        FourierTransPrism.releasePlan();
+        FourierTransPrism = clFourier<GPU_Type>(ctx, window, window, n_probes);
+    }
+
+    // the reciprocal pixels of the windows are interpolation times bigger
+    if (n_det > 0) {
+        std::vector<GPU_Type> window_table(detector_table.size());
+        for (size_t i = 0; i < detector_table.size(); ++i)
+            window_table[i] = detector_table[i] / interpolation;
+
+        if (clPrismDetectorTable.GetSize() != window_table.size())
+            clPrismDetectorTable = clMemory<GPU_Type, Manual>(ctx, window_table.size());
+        clPrismDetectorTable.Write(window_table);
+        ctx->WaitForIOQueueFinish();
+    }
+
+    // The window only has 1/interpolation^2 of the (repeating) probe, which is made from 1/interpolation^2 as many
+    // beams. This scale keeps the total intensity the same as the normal STEM probe.
+    double scale = static_cast<double>(interpolation) * interpolation;
+
+    PrismProbes.SetArg(1, clPrismProbes, ArgumentType::InputOutput);
+    PrismProbes.SetArg(2, clPrismCoefficients, ArgumentType::Input);
+    PrismProbes.SetArg(3, clPrismOrigins, ArgumentType::Input);
+    PrismProbes.SetArg(4, resolution);
+    PrismProbes.SetArg(5, resolution);
+    PrismProbes.SetArg(6, static_cast<unsigned int>(wave_stride));
+    PrismProbes.SetArg(9, n_beams);
+    PrismProbes.SetArg(10, window);
+    PrismProbes.SetArg(11, static_cast<GPU_Type>(scale));
+
+    clWorkGroup ProbeWork(window, window, static_cast<unsigned int>(n_probes));
+
+    auto stemPixels = sm->stemArea();
+    int num_x = stemPixels->getPixelsX();
+    double scan_x = stemPixels->getRawLimitsX()[0];
+    double scan_y = stemPixels->getRawLimitsY()[0];
+    double step_x = stemPixels->getScaleX();
+    double step_y = stemPixels->getScaleY();
+    double pixelscale = sm->realScale();
+
+    // only the pixels this job simulates are returned (as [detector][output slice][pixel index])
+    std::map<std::string, std::vector<std::vector<double>>> pixel_images;
+    for (const auto &det : sm->stemDetectors())
+        pixel_images[det.name] = std::vector<std::vector<double>>(output_count);
+
+    std::vector<complex_type> coefficients(n_probes * n_beams);
+    std::vector<int> origins(2 * n_probes);
+
+    CLOG(DEBUG, "sim") << "Making " << n_pixels << " probes (" << n_probes << " at a time)";
+    for (size_t first = 0; first < n_pixels; first += n_probes) {
+        size_t count = std::min(n_probes, n_pixels - first);
+
+        // unused probes (in the last batch) are just left as zero
+        std::fill(coefficients.begin(), coefficients.end(), complex_type(0));
+        std::fill(origins.begin(), origins.end(), 0);
+
+        for (size_t p = 0; p < count; ++p) {
+            int px = job->pixels[first + p];
+            // position relative to the start of the frame
+            double x_pos = scan_x + (px % num_x) * step_x - start_x;
+            double y_pos = scan_y + (px / num_x) * step_y - start_y;
+
+            // centre the window on the probe (wrapping around the S-matrix)
+            auto o_x = static_cast<int>(std::floor(x_pos / pixelscale + 0.5)) - static_cast<int>(window / 2);
+            auto o_y = static_cast<int>(std::floor(y_pos / pixelscale + 0.5)) - static_cast<int>(window / 2);
+            auto n = static_cast<int>(resolution);
+            origins[2 * p] = (o_x % n + n) % n;
+            origins[2 * p + 1] = (o_y % n + n) % n;
+
+            // same position phase as the init_probe_wave kernel
+            for (unsigned int m = 0; m < n_beams; ++m) {
+                double phase = -2.0 * M_PI * (k_x[beam_x[m]] * x_pos + k_y[beam_y[m]] * y_pos);
+                std::complex<double> a = probe_recip[beam_x[m] + resolution * beam_y[m]];
+                coefficients[p * n_beams + m] = static_cast<complex_type>(a * std::polar(1.0, phase));
+            }
+        }
+
+        clPrismCoefficients.Write(coefficients);
+        clPrismOrigins.Write(origins);
+        ctx->WaitForIOQueueFinish();
+
+        for (unsigned int o = 0; o < output_count; ++o) {
+            clPrismProbes.Fill(complex_type(0)).Wait();
+
+            for (unsigned int b = 0; b < n_batches; ++b) {
+                PrismProbes.SetArg(0, clSMatrix[o][b], ArgumentType::Input);
+                PrismProbes.SetArg(7, std::min(n_parallel, n_beams - b * n_parallel));
+                PrismProbes.SetArg(8, b * n_parallel);
+                PrismProbes.run(ProbeWork);
+            }
+
+            FourierTransPrism.run(clPrismProbes, clPrismProbesRecip, Direction::Forwards);
+
+            auto values = integrateDetectors(clPrismProbesRecip, clPrismDetectorTable, window, window_size,
+                                             static_cast<unsigned int>(n_probes));
+
+            auto &detectors = sm->stemDetectors();
+            for (size_t d = 0; d < detectors.size(); ++d) {
+                auto &im = pixel_images[detectors[d].name][o];
+                im.insert(im.end(), values[d].begin(), values[d].begin() + count);
+            }
+
+            if (pool.isStopped())
+                return;
+        }
+    }
+
+    sm->updateImagePixels(pixel_images, job->pixels, stemPixels->getPixelsX(), stemPixels->getPixelsY(), 1,
+                          sm->liveStemEnabled());
+}
+
+template class SimulationPrism<float>;
+template class SimulationPrism<double>;
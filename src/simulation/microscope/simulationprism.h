@@ -0,0 +1,64 @@
+#ifndef CLTEM_SIMULATIONPRISM_H
+#define CLTEM_SIMULATIONPRISM_H
+
+#include "simulationstem.h"
+
+// STEM using the PRISM interpolation algorithm (Ophus, 2017). Instead of propagating every probe, the plane waves at
+// every f-th reciprocal pixel inside the probe aperture are propagated once (using the normal multislice, batched as
+// the parallel probes) to make the S-matrix. Each probe is then the sum of these exit waves weighted by the aperture,
+// aberrations and position phase, but only in a window 1/f the size of the simulation around the probe. The windows
+// are transformed and integrated by the same detectors as the normal STEM.
+template <class GPU_Type>
+class SimulationPrism : public SimulationStem<GPU_Type>
+{
+protected:
+    using SimulationGeneral<GPU_Type>::pool;
+    using SimulationGeneral<GPU_Type>::job;
+    using SimulationGeneral<GPU_Type>::ctx;
+
+    using SimulationGeneral<GPU_Type>::clWaveFunctionRealStack;
+    using SimulationGeneral<GPU_Type>::clWaveFunctionRecipStack;
+    using SimulationGeneral<GPU_Type>::clWaveFunctionRecip;
+    using SimulationGeneral<GPU_Type>::wave_stride;
+    using SimulationGeneral<GPU_Type>::clXFrequencies;
+    using SimulationGeneral<GPU_Type>::clYFrequencies;
+    using SimulationGeneral<GPU_Type>::FourierTransBatch;
+
+    using SimulationGeneral<GPU_Type>::doMultiSliceStep;
+
+    using SimulationCbed<GPU_Type>::initialiseProbeWave;
+
+    using SimulationStem<GPU_Type>::detector_table;
+    using SimulationStem<GPU_Type>::integrateDetectors;
+
+    void initialiseKernels();
+
+    clKernel PrismProbes;
+
+    bool do_initialise_prism;
+
+    // The exit waves of all the beams, for each output slice. Each entry is a copy of the wave stack after a batch of
+    // beams has been propagated (so the beams are wave_stride apart).
+    std::vector<std::vector<clMemory<std::complex<GPU_Type>, Manual>>> clSMatrix;
+
+    // the coefficient of every beam for every probe in a batch of probes, and the start of each probe's window
+    clMemory<std::complex<GPU_Type>, Manual> clPrismCoefficients;
+    clMemory<int, Manual> clPrismOrigins;
+
+    // the windowed probes (in real and reciprocal space)
+    clMemory<std::complex<GPU_Type>, Manual> clPrismProbes;
+    clMemory<std::complex<GPU_Type>, Manual> clPrismProbesRecip;
+    clFourier<GPU_Type> FourierTransPrism;
+
+    // the detectors in pixels of the (smaller) probe windows
+    clMemory<GPU_Type, Manual> clPrismDetectorTable;
+
+public:
+    explicit SimulationPrism(clDevice &_dev, ThreadPool &s, unsigned int _id) : SimulationStem<GPU_Type>(_dev, s, _id), do_initialise_prism(true) {}
+
+    ~SimulationPrism() {ctx->WaitForQueueFinish(); ctx->WaitForIOQueueFinish(); FourierTransPrism.releasePlan();}
+
+    void simulate();
+};
+
+#endif //CLTEM_SIMULATIONPRISM_H
@@ -2,6 +2,9 @@
 // Created by Jon on 31/01/2020.
 //
 
+#include <algorithm>
+#include <limits>
+
 #include "simulationstem.h"
 #include "utilities/vectorutils.h"
 
@@ -9,10 +12,16 @@ template <class T>
 void SimulationStem<T>::initialiseBuffers() {
 
     auto sm = job->simManager;
-    unsigned int rs = sm->resolution();
+    size_t n_det = sm->stemDetectors().size();
+
+    if (4 * n_det != clDetectorTable.GetSize() && n_det > 0)
+        clDetectorTable = clMemory<T, Manual>(ctx, 4 * n_det);
 
-    if (rs*rs / 256 != clReductionBuffer.GetSize()) {
-        clReductionBuffer = clMemory<T, Manual>(ctx, rs*rs / 256); // STEM only
+    if (sm->stem4DWriter()) {
+        size_t n = sm->stem4DPatternSize();
+        size_t pattern_size = n * n * sm->parallelPixels();
+        if (pattern_size != clDiffractionPatterns.GetSize())
+            clDiffractionPatterns = clMemory<T, Manual>(ctx, pattern_size);
     }
 }
 
@@ -20,8 +29,8 @@ template <>
 void SimulationStem<float>::initialiseKernels() {
 
     if (do_initialise_stem) {
-        SumReduction = Kernels::sum_reduction_f.BuildToKernel(ctx);
-        BandPassAbs = Kernels::band_pass_f.BuildToKernel(ctx);
+        StemDetectors = Kernels::stem_detectors_f.BuildToKernel(ctx);
+        DiffractionPattern = Kernels::diffraction_pattern_f.BuildToKernel(ctx);
     }
 
     do_initialise_stem = false;
@@ -31,104 +40,194 @@ template <>
 void SimulationStem<double>::initialiseKernels() {
 
     if (do_initialise_stem) {
-        SumReduction = Kernels::sum_reduction_d.BuildToKernel(ctx);
-        BandPassAbs = Kernels::band_pass_d.BuildToKernel(ctx);
+        StemDetectors = Kernels::stem_detectors_d.BuildToKernel(ctx);
+        DiffractionPattern = Kernels::diffraction_pattern_d.BuildToKernel(ctx);
     }
 
     do_initialise_stem = false;
 }
 
 template <class T>
-double SimulationStem<T>::doSumReduction(clMemory<T, Manual> data, clWorkGroup globalSizeSum,
-                                           clWorkGroup localSizeSum, unsigned int nGroups, int totalSize)
+std::vector<std::vector<double>> SimulationStem<T>::getStemPixels(double d_kx, double d_ky)
 {
-    CLOG(DEBUG, "sim") << "Starting sum reduction";
-    CLOG(DEBUG, "sim") << "Create local buffer";
-//    clReductionBuffer = clMemory<float, Manual>(ctx, nGroups);
-
-    CLOG(DEBUG, "sim") << "Doing sum reduction";
-    SumReduction.SetArg(0, data, ArgumentType::Input);
-
-    // Only really need to do these 3 once... (but we make a local 'outArray' so can't do that)
-    SumReduction.SetArg(1, clReductionBuffer);
-    SumReduction.SetArg(2, totalSize);
-    SumReduction.SetLocalMemoryArg<T>(3, 256);
+    CLOG(DEBUG, "sim") << "Getting STEM pixels";
+    unsigned int resolution = job->simManager->resolution();
+    unsigned int n_parallel = job->simManager->parallelPixels();
 
-    SumReduction.run(globalSizeSum, localSizeSum);
+    // this is the same shift as translateDiffImage
+    double scale = job->simManager->inverseScale();
+    double shift_x = d_kx / scale;
+    double shift_y = d_ky / scale;
 
-    ctx->WaitForQueueFinish();
+    return integrateDetectors(clWaveFunctionRecipStack, clDetectorTable, resolution, wave_stride, n_parallel, shift_x, shift_y);
+}
 
-    // Now copy back
-    CLOG(DEBUG, "sim") << "Copy from buffer";
-    std::vector<T> sums = clReductionBuffer.GetLocal();
-
-    CLOG(DEBUG, "sim") << "Doing final sum on CPU (" << nGroups << " parts)";
-    // Find out which numbers to read back
-    double sum = 0;
-    for (int i = 0; i < nGroups; i++)
-        sum += sums[i];
-    return sum;
+template <class T>
+unsigned int SimulationStem<T>::setDetectorArgs(clMemory<std::complex<T>, Manual> &waves, clMemory<T, Manual> &table,
+                                                unsigned int width, size_t stride, unsigned int n_probes,
+                                                double shift_x, double shift_y, unsigned int local_size)
+{
+    unsigned int n_det = job->simManager->stemDetectors().size();
+
+    // Aim for enough work groups to fill the device, but each detector/probe only needs a few when there are lots of
+    // them (and we have to read all the partial sums back)
+    unsigned int max_groups = std::max(width * width / local_size, 1u);
+    unsigned int detector_groups = static_cast<unsigned int>(256 / std::max<size_t>(n_det * n_probes, 1));
+    detector_groups = std::min(std::max(detector_groups, 1u), max_groups);
+
+    size_t n_sums = static_cast<size_t>(n_det) * n_probes * detector_groups;
+    if (n_sums != clDetectorSums.GetSize())
+        clDetectorSums = clMemory<T, Manual>(ctx, n_sums);
+
+    int int_shift_x = std::floor(shift_x);
+    int int_shift_y = std::floor(shift_y);
+
+    double sub_shift_x = shift_x - int_shift_x;
+    double sub_shift_y = shift_y - int_shift_y;
+
+    StemDetectors.SetArg(0, waves, ArgumentType::Input);
+    StemDetectors.SetArg(1, clDetectorSums, ArgumentType::Output);
+    StemDetectors.SetArg(2, table, ArgumentType::Input);
+    StemDetectors.SetArg(3, n_det);
+    StemDetectors.SetArg(4, width);
+    StemDetectors.SetArg(5, width);
+    StemDetectors.SetArg(6, static_cast<unsigned int>(stride));
+    StemDetectors.SetArg(7, int_shift_x);
+    StemDetectors.SetArg(8, int_shift_y);
+    StemDetectors.SetArg(9, static_cast<T>(sub_shift_x));
+    StemDetectors.SetArg(10, static_cast<T>(sub_shift_y));
+    StemDetectors.SetLocalMemoryArg<T>(11, local_size);
+
+    return detector_groups;
 }
 
 template <class T>
-double SimulationStem<T>::getStemPixel(double inner, double outer, double xc, double yc, int parallel_ind, double d_kx, double d_ky)
+void SimulationStem<T>::initialiseDetectorLaunch(clMemory<std::complex<T>, Manual> &waves, clMemory<T, Manual> &table,
+                                                 unsigned int width, size_t stride, unsigned int n_probes)
 {
-    CLOG(DEBUG, "sim") << "Getting STEM pixel";
-    unsigned int resolution = job->simManager->resolution();
-    double angle_scale = job->simManager->inverseScaleAngle();
+    auto &profiles = DeviceProfiles::getInstance();
+    clDevice &device = ctx->GetContextDevice();
+    unsigned int n_det = job->simManager->stemDetectors().size();
+    size_t max_local = StemDetectors.GetMaxWorkGroupSize();
 
-    clWorkGroup WorkSize(resolution, resolution, 1);
+    std::string key = StemDetectors.GetName() + "_" + std::to_string(width);
 
-    CLOG(DEBUG, "sim") << "FFT shifting diffraction pattern";
-    FftShift.SetArg(0, clWaveFunctionRecip[parallel_ind], ArgumentType::Input);
-    FftShift.run(WorkSize);
+    std::vector<unsigned int> settings;
+    if (profiles.get(device, key, settings) && settings.size() == 1 && settings[0] > 0 && settings[0] <= max_local) {
+        detector_local = settings[0];
+        return;
+    }
 
-    int output_type = 4; // square abs
+    detector_local = static_cast<unsigned int>(std::min<size_t>(256, max_local));
+    if (!profiles.enabled())
+        return;
 
-    CLOG(DEBUG, "sim") << "Getting abs of diffraction pattern";
+    CLOG(INFO, "sim") << "Tuning " << key << " for " << device.GetDeviceName();
+
+    double best_time = std::numeric_limits<double>::max();
+    for (unsigned int local_size : {32u, 64u, 128u, 256u, 512u, 1024u}) {
+        if (local_size > max_local)
+            continue;
+
+        try {
+            unsigned int detector_groups = setDetectorArgs(waves, table, width, stride, n_probes, 0.0, 0.0, local_size);
+            double t = benchmarkKernel(StemDetectors, clWorkGroup(detector_groups * local_size, n_det, n_probes),
+                                       clWorkGroup(local_size, 1, 1));
+            CLOG(DEBUG, "sim") << "  " << local_size << ": " << t * 1000.0 << " ms";
+            if (t < best_time) {
+                best_time = t;
+                detector_local = local_size;
+            }
+        } catch (const std::runtime_error &e) {
+            CLOG(DEBUG, "sim") << "  " << local_size << " failed: " << e.what();
+        }
+    }
 
-    if (d_kx != 0.0 || d_ky != 0.0) {
-        ComplexToReal.SetArg(0, clWaveFunctionTemp_1, ArgumentType::Input);
-        ComplexToReal.SetArg(1, clWaveFunctionTemp_2, ArgumentType::Output);
-        ComplexToReal.SetArg(2, output_type); // should be 4
-        ComplexToReal.run(WorkSize);
+    if (best_time == std::numeric_limits<double>::max())
+        return;
 
-        translateDiffImage(d_kx, d_ky);
+    CLOG(INFO, "sim") << "Using " << detector_local << " work items for " << key;
+    profiles.put(device, key, {detector_local});
+}
 
-    } else {
-        ComplexToReal.SetArg(0, clWaveFunctionTemp_1, ArgumentType::Input);
-        ComplexToReal.SetArg(1, clWaveFunctionTemp_3, ArgumentType::Output);
-        ComplexToReal.SetArg(2, output_type); // should be 4
-        ComplexToReal.run(WorkSize);
-    }
+template <class T>
+std::vector<std::vector<double>> SimulationStem<T>::integrateDetectors(clMemory<std::complex<T>, Manual> &waves,
+                                                                       clMemory<T, Manual> &table, unsigned int width,
+                                                                       size_t stride, unsigned int n_probes,
+                                                                       double shift_x, double shift_y)
+{
+    unsigned int n_det = job->simManager->stemDetectors().size();
 
-    double innerPx = inner / angle_scale;
-    double outerPx = outer / angle_scale;
+    std::vector<std::vector<double>> pixels(n_det, std::vector<double>(n_probes, 0.0));
+    if (n_det == 0)
+        return pixels;
 
-    double xcPx = xc / angle_scale;
-    double ycPx = yc / angle_scale;
+    if (detector_local == 0)
+        initialiseDetectorLaunch(waves, table, width, stride, n_probes);
 
-    CLOG(DEBUG, "sim") << "Masking diffraction pattern";
-    BandPassAbs.SetArg(0, clWaveFunctionTemp_3, ArgumentType::Input);
-    BandPassAbs.SetArg(1, clWaveFunctionTemp_2, ArgumentType::Output);
-    BandPassAbs.SetArg(2, resolution);
-    BandPassAbs.SetArg(3, resolution);
-    BandPassAbs.SetArg(4, static_cast<T>(innerPx));
-    BandPassAbs.SetArg(5, static_cast<T>(outerPx));
-    BandPassAbs.SetArg(6, static_cast<T>(xcPx));
-    BandPassAbs.SetArg(7, static_cast<T>(ycPx));
+    CLOG(DEBUG, "sim") << "Integrating " << n_det << " detectors for " << n_probes << " probes";
+    unsigned int detector_groups = setDetectorArgs(waves, table, width, stride, n_probes, shift_x, shift_y, detector_local);
 
-    BandPassAbs.run(WorkSize);
+    clWorkGroup GlobalWork(detector_groups * detector_local, n_det, n_probes);
+    clWorkGroup LocalWork(detector_local, 1, 1);
 
-    ctx->WaitForQueueFinish();
+    StemDetectors.run(GlobalWork, LocalWork);
 
-    unsigned int totalSize = resolution * resolution;
-    unsigned int nGroups = totalSize / 256;
+    syncStep();
 
-    clWorkGroup globalSizeSum(totalSize, 1, 1);
-    clWorkGroup localSizeSum(256, 1, 1);
+    // Now copy back (once for everything)
+    CLOG(DEBUG, "sim") << "Copy from buffer";
+    auto sums = clDetectorSums.GetMapped();
+
+    CLOG(DEBUG, "sim") << "Doing final sums on CPU (" << detector_groups << " parts each)";
+    for (unsigned int p = 0; p < n_probes; ++p)
+        for (unsigned int d = 0; d < n_det; ++d) {
+            double sum = 0.0;
+            size_t offset = (static_cast<size_t>(p) * n_det + d) * detector_groups;
+            for (unsigned int g = 0; g < detector_groups; ++g)
+                sum += sums[offset + g];
+            pixels[d][p] = sum;
+        }
+
+    return pixels;
+}
 
-    return doSumReduction(clWaveFunctionTemp_2, globalSizeSum, localSizeSum, nGroups, totalSize);
+template <class T>
+void SimulationStem<T>::writeDiffractionPatterns(unsigned int output)
+{
+    auto sm = job->simManager;
+    auto writer = sm->stem4DWriter();
+
+    unsigned int resolution = sm->resolution();
+    unsigned int n_parallel = sm->parallelPixels();
+    unsigned int crop = sm->stem4DCropSize();
+    unsigned int n = sm->stem4DPatternSize();
+    size_t pattern_size = static_cast<size_t>(n) * n;
+
+    DiffractionPattern.SetArg(0, clWaveFunctionRecipStack, ArgumentType::Input);
+    DiffractionPattern.SetArg(1, clDiffractionPatterns, ArgumentType::Output);
+    DiffractionPattern.SetArg(2, resolution);
+    DiffractionPattern.SetArg(3, resolution);
+    DiffractionPattern.SetArg(4, static_cast<unsigned int>(wave_stride));
+    DiffractionPattern.SetArg(5, crop);
+    DiffractionPattern.SetArg(6, crop / n);
+
+    clWorkGroup WorkSize(n, n, n_parallel);
+    DiffractionPattern.run(WorkSize);
+    syncStep();
+
+    auto patterns = clDiffractionPatterns.GetMapped();
+
+    // the jobs are split the same way for every iteration, so this gives the iteration this job is part of
+    uint64_t iteration = job->id / (sm->totalParts() / sm->incoherenceEffects()->iterations(sm->mode()));
+    uint64_t num_x = sm->stemArea()->getPixelsX();
+
+    // the writer does the compression and the disk access on its own thread (this only waits if it is far behind)
+    for (size_t i = 0; i < job->pixels.size(); ++i) {
+        uint64_t p = job->pixels[i];
+        std::vector<float> pattern(patterns.begin() + i * pattern_size, patterns.begin() + (i + 1) * pattern_size);
+        writer->writeChunk(sm->stem4DDataset(), {iteration, output, p / num_x, p % num_x, 0, 0}, std::move(pattern));
+    }
 }
 
 template<class GPU_Type>
@@ -136,6 +235,19 @@ bool SimulationStem<GPU_Type>::initialiseSimulation() {
     initialiseBuffers();
     initialiseKernels();
 
+    // detectors are given to the kernel in pixels
+    double angle_scale = job->simManager->inverseScaleAngle();
+    auto &detectors = job->simManager->stemDetectors();
+    detector_table.resize(4 * detectors.size());
+    for (size_t i = 0; i < detectors.size(); ++i) {
+        detector_table[4 * i] = static_cast<GPU_Type>(detectors[i].inner / angle_scale);
+        detector_table[4 * i + 1] = static_cast<GPU_Type>(detectors[i].outer / angle_scale);
+        detector_table[4 * i + 2] = static_cast<GPU_Type>(detectors[i].xcentre / angle_scale);
+        detector_table[4 * i + 3] = static_cast<GPU_Type>(detectors[i].ycentre / angle_scale);
+    }
+    if (!detectors.empty())
+        clDetectorTable.Write(detector_table);
+
     return SimulationCbed<GPU_Type>::initialiseSimulation();
 }
 
@@ -146,8 +258,8 @@ void SimulationStem<GPU_Type>::simulate() {
 
     CLOG(DEBUG, "sim") << "Parallel pixels: " << job->pixels.size();
 
-    typedef std::map<std::string, Image<double>> return_map;
-    return_map Images;
+    // only the pixels this job simulates are returned (as [detector][output slice][pixel index])
+    std::map<std::string, std::vector<std::vector<double>>> pixel_images;
 
     // now need to work out where our probes need to be made
     auto stemPixels = job->simManager->stemArea();
@@ -171,7 +283,7 @@ void SimulationStem<GPU_Type>::simulate() {
 
     // initialise our images
     for (const auto &det : job->simManager->stemDetectors()) {
-        Images[det.name] = Image<double>(px_x, px_y, output_count);
+        pixel_images[det.name] = std::vector<std::vector<double>>(output_count);
     }
 
     CLOG(DEBUG, "sim") << "Initialising probe(s)";
@@ -209,6 +321,9 @@ void SimulationStem<GPU_Type>::simulate() {
     double current_azimuth = mp->BeamAzimuth;
     Utils::rotateVectorSpherical(k_vec, y_axis, current_tilt/1000.0, current_azimuth);
 
+    // the patterns are saved as they are (i.e. without the shift of any plasmon scattering)
+    bool write_4d = static_cast<bool>(job->simManager->stem4DWriter());
+
     CLOG(DEBUG, "sim") << "Starting multislice loop";
     // loop through slices
     unsigned int output_counter = 0;
@@ -235,18 +350,12 @@ void SimulationStem<GPU_Type>::simulate() {
             return;
 
         if (slice_step > 0 && (i+1) % slice_step == 0) {
-            for (const auto &det : job->simManager->stemDetectors()) {
-                std::vector<double> im(stemPixels->getNumPixels(), 0.0);
-                std::vector<double> im_w(stemPixels->getNumPixels(), 0.0);
-
-                for (int j = 0; j < job->pixels.size(); ++j) {
-                    im[job->pixels[j]] = getStemPixel(det.inner, det.outer, det.xcentre, det.ycentre, j, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
-                    im_w[job->pixels[j]] = 1.0;
-                }
-
-                Images[det.name].getSliceRef(output_counter) = im;
-                Images[det.name].getWeightingRef() = im_w;
-            }
+            auto pixel_values = getStemPixels(k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+            auto &detectors = job->simManager->stemDetectors();
+            for (int d = 0; d < detectors.size(); ++d)
+                pixel_images[detectors[d].name][output_counter] = std::move(pixel_values[d]);
+            if (write_4d)
+                writeDiffractionPatterns(output_counter);
             ++output_counter;
         }
 
@@ -260,21 +369,15 @@ void SimulationStem<GPU_Type>::simulate() {
 
 
     if (output_counter < output_count) {
-        for (const auto &det : job->simManager->stemDetectors()) {
-            std::vector<double> im(stemPixels->getNumPixels(), 0.0);
-            std::vector<double> im_w(stemPixels->getNumPixels(), 0.0);
-
-            for (int i = 0; i < job->pixels.size(); ++i) {
-                im[job->pixels[i]] = getStemPixel(det.inner, det.outer, det.xcentre, det.ycentre, i, k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
-                im_w[job->pixels[i]] = 1.0;
-            }
-
-            Images[det.name].getSliceRef(output_counter) = im;
-            Images[det.name].getWeightingRef() = im_w;
-        }
+        auto pixel_values = getStemPixels(k_vec(0) - orig_k[0], k_vec(1) - orig_k[1]);
+        auto &detectors = job->simManager->stemDetectors();
+        for (int d = 0; d < detectors.size(); ++d)
+            pixel_images[detectors[d].name][output_counter] = std::move(pixel_values[d]);
+        if (write_4d)
+            writeDiffractionPatterns(output_counter);
     }
 
-    job->simManager->updateImages(Images, 1, job->simManager->liveStemEnabled());
+    job->simManager->updateImagePixels(pixel_images, job->pixels, px_x, px_y, 1, job->simManager->liveStemEnabled());
 }
 
 template class SimulationStem<float>;
@@ -15,45 +15,70 @@ protected:
     using SimulationGeneral<GPU_Type>::job;
     using SimulationGeneral<GPU_Type>::last_mode;
     using SimulationGeneral<GPU_Type>::ctx;
+    using SimulationGeneral<GPU_Type>::syncStep;
 
     using SimulationGeneral<GPU_Type>::clWaveFunctionRecip;
     using SimulationGeneral<GPU_Type>::clWaveFunctionReal;
-    using SimulationGeneral<GPU_Type>::clWaveFunctionTemp_1;
-    using SimulationGeneral<GPU_Type>::FftShift;
+    using SimulationGeneral<GPU_Type>::clWaveFunctionRecipStack;
+    using SimulationGeneral<GPU_Type>::wave_stride;
 
     using SimulationGeneral<GPU_Type>::doMultiSliceStep;
     using SimulationGeneral<GPU_Type>::modifyBeamTilt;
-    using SimulationGeneral<GPU_Type>::ComplexToReal;
+    using SimulationGeneral<GPU_Type>::benchmarkKernel;
 
     using SimulationCbed<GPU_Type>::initialiseProbeWave;
-    using SimulationCbed<GPU_Type>::clWaveFunctionTemp_2;
-    using SimulationCbed<GPU_Type>::clWaveFunctionTemp_3;
-
-    using SimulationGeneral<GPU_Type>::translateDiffImage;
 
     bool initialiseSimulation();
 
     void initialiseBuffers();
     void initialiseKernels();
 
-    clKernel BandPassAbs;
-    clKernel SumReduction;
-    clMemory<GPU_Type, Manual> clReductionBuffer;
+    // integrates all the detectors for all the parallel probes at once
+    clKernel StemDetectors;
+    // the inner, outer, x centre and y centre (in pixels) of each detector
+    std::vector<GPU_Type> detector_table;
+    clMemory<GPU_Type, Manual> clDetectorTable;
+    // the partial sums of every work group, for every detector and probe
+    clMemory<GPU_Type, Manual> clDetectorSums;
+    // the work group size of the detector kernel, tuned for each device the first time it is used (0 until then)
+    unsigned int detector_local;
+
+    // 4D-STEM: bins and crops the diffraction patterns of all the parallel probes
+    clKernel DiffractionPattern;
+    clMemory<GPU_Type, Manual> clDiffractionPatterns;
 
     bool do_initialise_stem;
 
+    // Gets the value of every detector (outer index) for every probe (inner index) in a stack of reciprocal space
+    // waves. The detector table is in pixels of these waves and the shift (in pixels) is the same as translateDiffImage
+    std::vector<std::vector<double>> integrateDetectors(clMemory<std::complex<GPU_Type>, Manual> &waves,
+                                                        clMemory<GPU_Type, Manual> &table, unsigned int width,
+                                                        size_t stride, unsigned int n_probes,
+                                                        double shift_x = 0.0, double shift_y = 0.0);
+
+    // sets the detector kernel arguments for this work group size, returns the number of work groups for each
+    // detector/probe
+    unsigned int setDetectorArgs(clMemory<std::complex<GPU_Type>, Manual> &waves, clMemory<GPU_Type, Manual> &table,
+                                 unsigned int width, size_t stride, unsigned int n_probes, double shift_x,
+                                 double shift_y, unsigned int local_size);
+
+    // uses the device profile for the detector work group size, or times the candidates with these waves
+    void initialiseDetectorLaunch(clMemory<std::complex<GPU_Type>, Manual> &waves, clMemory<GPU_Type, Manual> &table,
+                                  unsigned int width, size_t stride, unsigned int n_probes);
+
 public:
-    explicit SimulationStem(clDevice &_dev, ThreadPool &s, unsigned int _id) : SimulationCbed<GPU_Type>(_dev, s, _id), do_initialise_stem(true) {}
+    explicit SimulationStem(clDevice &_dev, ThreadPool &s, unsigned int _id) : SimulationCbed<GPU_Type>(_dev, s, _id), detector_local(0), do_initialise_stem(true) {}
 
     ~SimulationStem() {ctx->WaitForQueueFinish(); ctx->WaitForIOQueueFinish();}
 
     void simulate();
 
 private:
-    double doSumReduction(clMemory<GPU_Type, Manual> data, clWorkGroup globalSizeSum,
-                          clWorkGroup localSizeSum, unsigned int nGroups, int totalSize);
+    // gets the value of every detector (outer index) for every parallel probe (inner index)
+    std::vector<std::vector<double>> getStemPixels(double d_kx=0.0, double d_ky=0.0);
 
-    double getStemPixel(double inner, double outer, double xc, double yc, int parallel_ind, double d_kx=0.0, double d_ky=0.0);
+    // queues the diffraction pattern of every probe to be written to the 4D-STEM file (for this output slice)
+    void writeDiffractionPatterns(unsigned int output);
 };
 
 #endif //CLTEM_SIMULATIONSTEM_H
\ No newline at end of file
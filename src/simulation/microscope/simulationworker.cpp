@@ -13,6 +13,12 @@ void SimulationWorker<GPU_Type>::Run(const std::shared_ptr<SimulationJob> &_job)
 
     el::Helpers::setThreadName("p" + std::to_string(p_num) + ":d" + std::to_string(d_num));
 
+    if (clProfiler::enabled()) {
+        clProfiler::setThreadName("p" + std::to_string(p_num) + ":d" + std::to_string(d_num) + " worker " + std::to_string(this->id));
+        clProfiler::setJob(_job->id);
+        clProfiler::setSlice(-1);
+    }
+
     CLOG(DEBUG, "sim") << "Running simulation worker";
 
     job = _job;
@@ -45,6 +51,9 @@ void SimulationWorker<GPU_Type>::Run(const std::shared_ptr<SimulationJob> &_job)
         } else if (mode == SimulationMode::CBED) {
             CLOG(DEBUG, "sim") << "Doing CBED simulation";
             SimulationCbed<GPU_Type>::simulate();
+        } else if (mode == SimulationMode::STEM && _job->simManager->stemPrismEnabled()) {
+            CLOG(DEBUG, "sim") << "Doing PRISM STEM simulation";
+            SimulationPrism<GPU_Type>::simulate();
         } else if (mode == SimulationMode::STEM) {
             CLOG(DEBUG, "sim") << "Doing STEM simulation";
             SimulationStem<GPU_Type>::simulate();
@@ -14,16 +14,17 @@
 #include "simulationctem.h"
 #include "simulationcbed.h"
 #include "simulationstem.h"
+#include "simulationprism.h"
 
 template <class GPU_Type>
-class SimulationWorker : public SimulationStem<GPU_Type>
+class SimulationWorker : public SimulationPrism<GPU_Type>
 {
     using SimulationGeneral<GPU_Type>::pool;
     using SimulationGeneral<GPU_Type>::job;
     using SimulationGeneral<GPU_Type>::ctx;
 
 public:
-    SimulationWorker(clDevice &_dev, ThreadPool &_s, unsigned int _id) : SimulationStem<GPU_Type>(_dev, _s, _id) {}
+    SimulationWorker(clDevice &_dev, ThreadPool &_s, unsigned int _id) : SimulationPrism<GPU_Type>(_dev, _s, _id) {}
 
     ~SimulationWorker() = default;
 
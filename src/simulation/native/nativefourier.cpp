@@ -0,0 +1,215 @@
+#include "nativefourier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+    // number of columns that are gathered together for the column transforms (keeps the row reads contiguous)
+    const unsigned int column_block = 8;
+
+    // complex multiply without the inf/nan checks that std::complex does (lets the compiler vectorise these)
+    template <class T>
+    inline std::complex<T> cMult(const std::complex<T> &a, const std::complex<T> &b) {
+        return {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+    }
+
+    std::vector<unsigned int> factorise(unsigned int n) {
+        std::vector<unsigned int> factors;
+        unsigned int p = 4;
+        unsigned int remaining = n;
+
+        // radix 4 first, then 2, then odd numbers
+        while (remaining > 1) {
+            while (remaining % p != 0) {
+                if (p == 4)
+                    p = 2;
+                else if (p == 2)
+                    p = 3;
+                else
+                    p += 2;
+
+                if (p * p > remaining)
+                    p = remaining;
+            }
+            remaining /= p;
+            factors.push_back(p);
+            factors.push_back(remaining);
+        }
+
+        return factors;
+    }
+
+    template <class T>
+    std::vector<std::complex<T>> makeTwiddles(unsigned int n, bool inverse) {
+        std::vector<std::complex<T>> tw(n);
+        double sign = inverse ? 1.0 : -1.0;
+        for (unsigned int i = 0; i < n; ++i) {
+            double phase = sign * 2.0 * M_PI * i / n;
+            tw[i] = std::complex<T>(static_cast<T>(std::cos(phase)), static_cast<T>(std::sin(phase)));
+        }
+        return tw;
+    }
+
+    template <class T>
+    void butterfly2(std::complex<T> *out, size_t f_stride, const std::complex<T> *tw, unsigned int m) {
+        std::complex<T> *out2 = out + m;
+        for (unsigned int k = 0; k < m; ++k) {
+            std::complex<T> t = cMult(out2[k], tw[k * f_stride]);
+            out2[k] = out[k] - t;
+            out[k] += t;
+        }
+    }
+
+    template <class T>
+    void butterfly4(std::complex<T> *out, size_t f_stride, const std::complex<T> *tw, unsigned int m, bool inverse) {
+        for (unsigned int k = 0; k < m; ++k) {
+            std::complex<T> s0 = cMult(out[k + m], tw[k * f_stride]);
+            std::complex<T> s1 = cMult(out[k + 2 * m], tw[2 * k * f_stride]);
+            std::complex<T> s2 = cMult(out[k + 3 * m], tw[3 * k * f_stride]);
+
+            std::complex<T> s5 = out[k] - s1;
+            std::complex<T> s6 = out[k] + s1;
+            std::complex<T> s3 = s0 + s2;
+            std::complex<T> s4 = s0 - s2;
+
+            out[k + 2 * m] = s6 - s3;
+            out[k] = s6 + s3;
+
+            if (inverse) {
+                out[k + m] = std::complex<T>(s5.real() - s4.imag(), s5.imag() + s4.real());
+                out[k + 3 * m] = std::complex<T>(s5.real() + s4.imag(), s5.imag() - s4.real());
+            } else {
+                out[k + m] = std::complex<T>(s5.real() + s4.imag(), s5.imag() - s4.real());
+                out[k + 3 * m] = std::complex<T>(s5.real() - s4.imag(), s5.imag() + s4.real());
+            }
+        }
+    }
+
+    template <class T>
+    void butterflyGeneric(std::complex<T> *out, size_t f_stride, const std::complex<T> *tw, unsigned int m,
+                          unsigned int p, size_t n) {
+        // radices here are small, so this is fine on the stack
+        std::complex<T> temp[64];
+        std::vector<std::complex<T>> temp_large;
+        std::complex<T> *t = temp;
+        if (p > 64) {
+            temp_large.resize(p);
+            t = temp_large.data();
+        }
+
+        for (unsigned int u = 0; u < m; ++u) {
+            for (unsigned int q = 0; q < p; ++q)
+                t[q] = out[u + q * m];
+
+            for (unsigned int q1 = 0; q1 < p; ++q1) {
+                size_t k = u + q1 * m;
+                size_t tw_id = 0;
+                std::complex<T> sum = t[0];
+                for (unsigned int q = 1; q < p; ++q) {
+                    tw_id += f_stride * k;
+                    tw_id %= n;
+                    sum += cMult(t[q], tw[tw_id]);
+                }
+                out[k] = sum;
+            }
+        }
+    }
+
+    // Recursive decimation in time transform, reads the input with a stride and writes a contiguous output
+    template <class T>
+    void transform(std::complex<T> *out, const std::complex<T> *in, size_t f_stride, size_t in_stride,
+                   const unsigned int *factors, const std::complex<T> *tw, size_t n, bool inverse) {
+        unsigned int p = factors[0];
+        unsigned int m = factors[1];
+
+        if (m == 1) {
+            for (unsigned int q = 0; q < p; ++q)
+                out[q] = in[q * f_stride * in_stride];
+        } else {
+            for (unsigned int q = 0; q < p; ++q)
+                transform(out + q * m, in + q * f_stride * in_stride, f_stride * p, in_stride, factors + 2, tw, n, inverse);
+        }
+
+        if (p == 2)
+            butterfly2(out, f_stride, tw, m);
+        else if (p == 4)
+            butterfly4(out, f_stride, tw, m, inverse);
+        else
+            butterflyGeneric(out, f_stride, tw, m, p, n);
+    }
+
+}
+
+template <class T>
+NativeFourier<T>::NativeFourier(std::shared_ptr<NativeThreads> _threads, unsigned int _width, unsigned int _height)
+        : threads(std::move(_threads)), width(_width), height(_height) {
+    if (width == 0 || height == 0)
+        throw std::runtime_error("NativeFourier: cannot create transform with zero size");
+
+    factors_x = factorise(width);
+    factors_y = factorise(height);
+
+    twiddles_x_f = makeTwiddles<T>(width, false);
+    twiddles_x_i = makeTwiddles<T>(width, true);
+    twiddles_y_f = makeTwiddles<T>(height, false);
+    twiddles_y_i = makeTwiddles<T>(height, true);
+
+    size_t scratch_size = std::max(static_cast<size_t>(width), 2 * column_block * static_cast<size_t>(height));
+    scratch.resize(threads->size(), std::vector<std::complex<T>>(scratch_size));
+}
+
+template <class T>
+void NativeFourier<T>::run(const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output,
+                           Direction::TransformDirection direction) {
+    size_t total = static_cast<size_t>(width) * height;
+    if (input.size() != total)
+        throw std::runtime_error("NativeFourier: input does not match the transform size");
+    if (output.size() != total)
+        output.resize(total);
+
+    bool inverse = direction == Direction::Inverse;
+    const std::complex<T> *tw_x = inverse ? twiddles_x_i.data() : twiddles_x_f.data();
+    const std::complex<T> *tw_y = inverse ? twiddles_y_i.data() : twiddles_y_f.data();
+
+    const std::complex<T> *in_ptr = input.data();
+    std::complex<T> *out_ptr = output.data();
+
+    // transform the rows, going through scratch so that the input and output can be the same
+    threads->parallelFor(height, [&](size_t begin, size_t end, unsigned int t_id) {
+        std::complex<T> *row = scratch[t_id].data();
+        for (size_t j = begin; j < end; ++j) {
+            transform(row, in_ptr + j * width, 1, 1, factors_x.data(), tw_x, width, inverse);
+            std::copy(row, row + width, out_ptr + j * width);
+        }
+    });
+
+    // then the columns (in blocks so we read along the rows) and apply the scaling at the same time
+    T scale = static_cast<T>(1.0 / std::sqrt(static_cast<double>(total)));
+    size_t n_blocks = (width + column_block - 1) / column_block;
+
+    threads->parallelFor(n_blocks, [&](size_t begin, size_t end, unsigned int t_id) {
+        std::complex<T> *cols_in = scratch[t_id].data();
+        std::complex<T> *cols_out = cols_in + column_block * height;
+
+        for (size_t b = begin; b < end; ++b) {
+            size_t i_start = b * column_block;
+            size_t n_cols = std::min(static_cast<size_t>(column_block), width - i_start);
+
+            for (size_t j = 0; j < height; ++j)
+                for (size_t c = 0; c < n_cols; ++c)
+                    cols_in[c * height + j] = out_ptr[i_start + c + j * width];
+
+            for (size_t c = 0; c < n_cols; ++c)
+                transform(cols_out + c * height, cols_in + c * height, 1, 1, factors_y.data(), tw_y, height, inverse);
+
+            for (size_t j = 0; j < height; ++j)
+                for (size_t c = 0; c < n_cols; ++c)
+                    out_ptr[i_start + c + j * width] = cols_out[c * height + j] * scale;
+        }
+    });
+}
+
+template class NativeFourier<float>;
+template class NativeFourier<double>;
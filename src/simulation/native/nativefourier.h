@@ -0,0 +1,54 @@
+#ifndef CLTEM_NATIVEFOURIER_H
+#define CLTEM_NATIVEFOURIER_H
+
+#include <complex>
+#include <memory>
+#include <vector>
+
+#include "nativethreads.h"
+
+// this is the same enum as is used by clFourier, so the native code reads the same as the OpenCL code
+#ifndef CLTEM_FOURIER_DIRECTION
+#define CLTEM_FOURIER_DIRECTION
+namespace Direction
+{
+    enum TransformDirection
+    {
+        Forwards,
+        Inverse
+    };
+}
+#endif
+
+// Mixed radix (4, 2, 3, 5 and generic) 2D FFT that runs on the host. The rows and columns are each split over the
+// threads of a NativeThreads pool. Both directions are scaled by 1/sqrt(width * height) to match clFourier.
+template <class T>
+class NativeFourier
+{
+    std::shared_ptr<NativeThreads> threads;
+
+    unsigned int width, height;
+
+    // factors are stored as (radix, remaining length) pairs
+    std::vector<unsigned int> factors_x, factors_y;
+
+    // twiddle factors for each axis and direction
+    std::vector<std::complex<T>> twiddles_x_f, twiddles_x_i;
+    std::vector<std::complex<T>> twiddles_y_f, twiddles_y_i;
+
+    // per thread scratch space (sized for the column blocks)
+    std::vector<std::vector<std::complex<T>>> scratch;
+
+public:
+    NativeFourier() : width(0), height(0) {}
+
+    NativeFourier(std::shared_ptr<NativeThreads> _threads, unsigned int _width, unsigned int _height);
+
+    // input and output can be the same vector
+    void run(const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output, Direction::TransformDirection direction);
+
+    unsigned int GetWidth() { return width; }
+    unsigned int GetHeight() { return height; }
+};
+
+#endif //CLTEM_NATIVEFOURIER_H
@@ -0,0 +1,643 @@
+#include "nativekernels.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+namespace NativeKernels
+{
+    namespace {
+
+        // size of the tiles used for the potentials (the same as the OpenCL local work size)
+        const unsigned int tile_size = 16;
+
+        // complex multiply without the inf/nan checks that std::complex does (lets the compiler vectorise these)
+        template <class T>
+        inline std::complex<T> cMult(const std::complex<T> &a, const std::complex<T> &b) {
+            return {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+        }
+
+        // runs func(x, y, id) for every pixel, split over the rows
+        template <class F>
+        void forPixels(NativeThreads &threads, unsigned int width, unsigned int height, F func) {
+            threads.parallelFor(height, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t yid = begin; yid < end; ++yid) {
+                    size_t row = yid * width;
+                    for (size_t xid = 0; xid < width; ++xid)
+                        func(xid, yid, row + xid);
+                }
+            });
+        }
+
+        // runs func(id) for every element, split into contiguous chunks
+        template <class F>
+        void forElements(NativeThreads &threads, size_t n, F func) {
+            threads.parallelFor(n, [&](size_t begin, size_t end, unsigned int) {
+                for (size_t id = begin; id < end; ++id)
+                    func(id);
+            });
+        }
+
+        template <class T>
+        inline T smoothStep(T edge0, T edge1, T x) {
+            T t = std::min(std::max((x - edge0) / (edge1 - edge0), T(0)), T(1));
+            return t * t * (T(3) - T(2) * t);
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        /// Bessel functions (see transmission_potentials_projected_f.cl)
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+        const double k0pi[5] = {1.0, 2.346487949187396e-1, 1.187082088663404e-2, 2.150707366040937e-4, 1.425433617130587e-6};
+        const double k0qi[3] = {9.847324170755358e-1, 1.518396076767770e-2, 8.362215678646257e-5};
+        const double k0p[5] = {1.159315156584126e-1, 2.770731240515333e-1, 2.066458134619875e-2, 4.574734709978264e-4, 3.454715527986737e-6};
+        const double k0q[3] = {9.836249671709183e-1, 1.627693622304549e-2, 9.809660603621949e-5};
+        const double k0pp[8] = {1.253314137315499, 1.475731032429900e1, 6.123767403223466e1, 1.121012633939949e2, 9.285288485892228e1, 3.198289277679660e1, 3.595376024148513, 6.160228690102976e-2};
+        const double k0qq[8] = {1.0, 1.189963006673403e1, 5.027773590829784e1, 9.496513373427093e1, 8.318077493230258e1, 3.181399777449301e1, 4.443672926432041, 1.408295601966600e-1};
+
+        const double k1pi[5] = {0.5, 5.598072040178741e-2, 1.818666382168295e-3, 2.397509908859959e-5, 1.239567816344855e-7};
+        const double k1qi[3] = {9.870202601341150e-1, 1.292092053534579e-2, 5.881933053917096e-5};
+        const double k1p[5] = {-3.079657578292062e-1, -8.109417631822442e-2, -3.477550948593604e-3, -5.385594871975406e-5, -3.110372465429008e-7};
+        const double k1q[3] = {9.861813171751389e-1, 1.375094061153160e-2, 6.774221332947002e-5};
+        const double k1pp[8] = {1.253314137315502, 1.457171340220454e1, 6.063161173098803e1, 1.147386690867892e2, 1.040442011439181e2, 4.356596656837691e1, 7.265230396353690, 3.144418558991021e-1};
+        const double k1qq[8] = {1.0, 1.125154514806458e1, 4.427488496597630e1, 7.616113213117645e1, 5.863377227890893e1, 1.850303673841586e1, 1.857244676566022, 2.538540887654872e-2};
+
+        template <class T>
+        inline T poly(const double *cof, int n, T x) {
+            T ans = static_cast<T>(cof[n]);
+            for (int i = n - 1; i >= 0; --i)
+                ans = ans * x + static_cast<T>(cof[i]);
+            return ans;
+        }
+
+        template <class T>
+        T bessk0(T x) {
+            T ax = std::abs(x);
+            if (ax > T(0) && ax <= T(1)) {
+                T z = x * x;
+                T term = poly(k0pi, 4, z) * std::log(x) / poly(k0qi, 2, T(1) - z);
+                return poly(k0p, 4, z) / poly(k0q, 2, T(1) - z) - term;
+            } else if (ax > T(1)) {
+                T z = T(1) / x;
+                return std::exp(-x) * poly(k0pp, 7, z) / poly(k0qq, 7, z) / std::sqrt(x);
+            } else
+                return std::numeric_limits<T>::max();
+        }
+
+        template <class T>
+        T bessk1(T x) {
+            T ax = std::abs(x);
+            if (ax > T(0) && ax <= T(1)) {
+                T z = x * x;
+                T term = poly(k1pi, 4, z) * std::log(x) / poly(k1qi, 2, T(1) - z);
+                return x * (poly(k1p, 4, z) / poly(k1q, 2, T(1) - z) + term) + T(1) / x;
+            } else if (ax > T(1)) {
+                T z = T(1) / x;
+                return std::exp(-x) * poly(k1pp, 7, z) / poly(k1qq, 7, z) / std::sqrt(x);
+            } else
+                return std::numeric_limits<T>::max();
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        /// Projected potential functions (see transmission_potentials_projected_f.cl)
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+        template <class T>
+        T kirkland(const T *params, int i_lim, int ZNum, T rad) {
+            T suml = T(0);
+            T sumg = T(0);
+
+            int z_ofst = (ZNum - 1) * 12;
+
+            // Lorentzians
+            T x = T(2.0 * M_PI) * rad;
+            for (int i = 0; i < i_lim * 2; i += 2) {
+                T a = params[z_ofst + i];
+                T b = params[z_ofst + i + 1];
+                suml += a * bessk0(x * std::sqrt(b));
+            }
+
+            // Gaussians
+            x = T(M_PI) * rad;
+            x = x * x;
+            for (int i = i_lim * 2; i < i_lim * 4; i += 2) {
+                T c = params[z_ofst + i];
+                T d = params[z_ofst + i + 1];
+                T d_inv = T(1) / d;
+                sumg += (c * d_inv) * std::exp(-x * d_inv);
+            }
+
+            return T(300.8242834) * suml + T(150.4121417) * sumg;
+        }
+
+        template <class T>
+        T lobato(const T *params, int i_lim, int ZNum, T rad) {
+            T sum = T(0);
+            int z_ofst = (ZNum - 1) * 10;
+            T x = T(2.0 * M_PI) * rad;
+
+            for (int i = 0; i < i_lim; ++i) {
+                T a = params[z_ofst + i];
+                T b = params[z_ofst + i + 5];
+                T b_inv_root = T(1) / std::sqrt(b);
+                sum += a * (b_inv_root * b_inv_root * b_inv_root) * (bessk0(x * b_inv_root) + rad * bessk1(x * b_inv_root));
+            }
+
+            return T(945.090144399935) * sum;
+        }
+
+        template <class T>
+        T peng(const T *params, int i_lim, int ZNum, T rad) {
+            T sum = T(0);
+            int z_ofst = (ZNum - 1) * 10;
+            T x = T(M_PI) * rad;
+            x = x * x;
+
+            for (int i = 0; i < i_lim; ++i) {
+                T a = params[z_ofst + i];
+                T b = params[z_ofst + i + 5];
+                T b_inv = T(1) / b;
+                sum += a * b_inv * std::exp(-x * b_inv);
+            }
+
+            return T(150.4121417) * sum;
+        }
+
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+        /// Aberration function (see init_probe_wave_f.cl and ctem_image_f.cl)
+        ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+        inline std::complex<double> cPow(const std::complex<double> &a, int n) {
+            std::complex<double> temp = a;
+            for (int j = 1; j < n; ++j)
+                temp = temp * a;
+            return temp;
+        }
+
+        double aberrationChi(double wx, double wy, double wavelength, const Aberrations &ab) {
+            std::complex<double> w(wx, wy);
+            std::complex<double> wc = std::conj(w);
+            double w2 = std::norm(w);
+
+            double tC10 = 0.5 * ab.C10 * w2;
+            std::complex<double> tC12 = 0.5 * ab.C12 * cPow(wc, 2);
+            std::complex<double> tC21 = ab.C21 * cPow(wc, 2) * w / 3.0;
+            std::complex<double> tC23 = ab.C23 * cPow(wc, 3) / 3.0;
+            double tC30 = 0.25 * ab.C30 * w2 * w2;
+            std::complex<double> tC32 = 0.25 * ab.C32 * cPow(wc, 3) * w;
+            std::complex<double> tC34 = 0.25 * ab.C34 * cPow(wc, 4);
+
+            std::complex<double> tC41 = 0.2 * ab.C41 * cPow(wc, 3) * cPow(w, 2);
+            std::complex<double> tC43 = 0.2 * ab.C43 * cPow(wc, 4) * w;
+            std::complex<double> tC45 = 0.2 * ab.C45 * cPow(wc, 5);
+            double tC50 = ab.C50 * w2 * w2 * w2 / 6.0;
+            std::complex<double> tC52 = ab.C52 * cPow(wc, 4) * cPow(w, 2) / 6.0;
+            std::complex<double> tC54 = ab.C54 * cPow(wc, 5) * w / 6.0;
+            std::complex<double> tC56 = ab.C56 * cPow(wc, 6) / 6.0;
+
+            // note because of the conjugates we only have real components left
+            double cchi = tC10 + tC12.real() + tC21.real() + tC23.real() + tC30 + tC32.real() + tC34.real() + tC41.real()
+                          + tC43.real() + tC45.real() + tC50 + tC52.real() + tC54.real() + tC56.real();
+            return 2.0 * M_PI * cchi / wavelength;
+        }
+    }
+
+    template <class T>
+    void projectedPotentialTable(std::vector<T> &table, const std::vector<double> &params, unsigned int param_selector,
+                                 unsigned int param_i_count, unsigned int n_elements, unsigned int n_samples, double r_min) {
+        // always sampled in double precision, it is only done once per parameterisation
+        table.resize(static_cast<size_t>(n_elements) * n_samples);
+        const double *p = params.data();
+        double r_range = potential_table_r_max - r_min;
+
+        for (unsigned int z = 1; z <= n_elements; ++z) {
+            T *t = table.data() + static_cast<size_t>(z - 1) * n_samples;
+            for (unsigned int i = 0; i < n_samples; ++i) {
+                double u = static_cast<double>(i) / (n_samples - 1);
+                double rad = r_min + r_range * u * u;
+
+                double v = 0.0;
+                if (param_selector == 0)
+                    v = kirkland(p, param_i_count, z, rad);
+                else if (param_selector == 1)
+                    v = peng(p, param_i_count, z, rad);
+                else if (param_selector == 2)
+                    v = lobato(p, param_i_count, z, rad);
+
+                t[i] = static_cast<T>(v);
+            }
+        }
+    }
+
+    template <class T>
+    void transmissionPotentialsProjected(NativeThreads &threads, std::vector<std::complex<T>> &potential,
+                                         const std::vector<T> &pos_x, const std::vector<T> &pos_y,
+                                         const std::vector<int> &atomic_num, const std::vector<T> &potential_table,
+                                         unsigned int table_samples, const std::vector<int> &block_start_pos,
+                                         int current_slice, const ProjectedPotentialArgs<T> &args) {
+        unsigned int width = args.width;
+        unsigned int height = args.height;
+        unsigned int tiles_x = (width + tile_size - 1) / tile_size;
+        unsigned int tiles_y = (height + tile_size - 1) / tile_size;
+
+        // convert from mrad to radians (and get beam tilt from the surface)
+        T beam_theta = T(M_PI_2) - args.beam_theta * T(0.001);
+        T cos_beam_phi = std::cos(args.beam_phi);
+        T sin_beam_phi = std::sin(args.beam_phi);
+        T sin_beam_2theta = std::sin(T(2) * beam_theta);
+        T tan_beam_theta = std::tan(beam_theta);
+
+        T r_min = args.table_r_min;
+        T table_scale = T(1) / (T(potential_table_r_max) - r_min);
+
+        T recip_range_x = T(1) / (args.max_x - args.min_x);
+        T recip_range_y = T(1) / (args.max_y - args.min_y);
+        T group_size = tile_size * args.pixelscale;
+
+        int k = std::min(std::max(current_slice, 0), args.total_slices - 1);
+        size_t slice_ofst = static_cast<size_t>(k) * args.blocks_x * args.blocks_y;
+
+        const T *table = potential_table.data();
+
+        threads.parallelFor(static_cast<size_t>(tiles_x) * tiles_y, [&](size_t begin, size_t end, unsigned int) {
+            T sumz[tile_size * tile_size];
+
+            for (size_t t = begin; t < end; ++t) {
+                unsigned int gx = t % tiles_x;
+                unsigned int gy = t / tiles_x;
+
+                std::fill(sumz, sumz + tile_size * tile_size, T(0));
+
+                // get the start and end position of the current tile
+                T group_start_x = args.startx + gx * group_size;
+                T group_end_x = group_start_x + group_size;
+                T group_start_y = args.starty + gy * group_size;
+                T group_end_y = group_start_y + group_size;
+
+                int starti = static_cast<int>(std::max(std::floor(args.blocks_x * (group_start_x - args.min_x) * recip_range_x) - args.block_load_x, T(0)));
+                int endi = static_cast<int>(std::min(std::ceil(args.blocks_x * (group_end_x - args.min_x) * recip_range_x) + args.block_load_x, T(args.blocks_x - 1)));
+                int startj = static_cast<int>(std::max(std::floor(args.blocks_y * (group_start_y - args.min_y) * recip_range_y) - args.block_load_y, T(0)));
+                int endj = static_cast<int>(std::min(std::ceil(args.blocks_y * (group_end_y - args.min_y) * recip_range_y) + args.block_load_y, T(args.blocks_y - 1)));
+
+                for (int j = startj; j <= endj; ++j) {
+                    int start = block_start_pos[slice_ofst + args.blocks_x * j + starti];
+                    int stop = block_start_pos[slice_ofst + args.blocks_x * j + endi + 1];
+
+                    for (int l = start; l < stop; ++l) {
+                        T at_x = pos_x[l];
+                        T at_y = pos_y[l];
+                        int at_z = atomic_num[l];
+
+                        for (unsigned int ly = 0; ly < tile_size; ++ly) {
+                            T rad_y = args.starty + (gy * tile_size + ly) * args.pixelscale - at_y;
+
+                            for (unsigned int lx = 0; lx < tile_size; ++lx) {
+                                T rad_x = args.startx + (gx * tile_size + lx) * args.pixelscale - at_x;
+
+                                T z_prime = T(-0.5) * (rad_x * cos_beam_phi + rad_y * sin_beam_phi) * sin_beam_2theta;
+                                T z_by_tan_beam_theta = z_prime / tan_beam_theta;
+                                T x_prime = rad_x + z_by_tan_beam_theta * cos_beam_phi;
+                                T y_prime = rad_y + z_by_tan_beam_theta * sin_beam_phi;
+
+                                T rad = std::sqrt(z_prime * z_prime + x_prime * x_prime + y_prime * y_prime);
+
+                                if (rad > T(8))
+                                    continue;
+
+                                if (rad < r_min)
+                                    rad = r_min;
+
+                                sumz[lx + ly * tile_size] += potentialLookup(table, table_samples, at_z, rad, r_min, table_scale);
+                            }
+                        }
+                    }
+                }
+
+                for (unsigned int ly = 0; ly < tile_size; ++ly) {
+                    unsigned int yid = gy * tile_size + ly;
+                    if (yid >= height)
+                        break;
+                    for (unsigned int lx = 0; lx < tile_size; ++lx) {
+                        unsigned int xid = gx * tile_size + lx;
+                        if (xid >= width)
+                            break;
+                        T phase = args.sigma * sumz[lx + ly * tile_size];
+                        potential[xid + width * yid] = std::complex<T>(std::cos(phase), std::sin(phase));
+                    }
+                }
+            }
+        });
+    }
+
+    template <class T>
+    void propagator(NativeThreads &threads, std::vector<std::complex<T>> &propagator, const std::vector<T> &k_x,
+                    const std::vector<T> &k_y, T dz, T beam_k, T beam_k_x, T beam_k_y, T beam_k_z, T k_max) {
+        T k_max_2 = k_max * k_max;
+        T f = beam_k_z / beam_k;
+
+        forPixels(threads, k_x.size(), k_y.size(), [&](size_t xid, size_t yid, size_t id) {
+            T k0x = k_x[xid] * k_x[xid];
+            T k0y = k_y[yid] * k_y[yid];
+
+            if (k0x + k0y < k_max_2) {
+                T s_u = beam_k * beam_k - beam_k_z * beam_k_z - (beam_k_x + k_x[xid]) * (beam_k_x + k_x[xid]) - (beam_k_y + k_y[yid]) * (beam_k_y + k_y[yid]);
+                s_u = s_u / beam_k_z;
+                propagator[id] = std::complex<T>(f * std::cos(T(M_PI) * s_u * dz), f * std::sin(T(M_PI) * s_u * dz));
+            } else {
+                propagator[id] = std::complex<T>(T(0), T(0));
+            }
+        });
+    }
+
+    template <class T>
+    void complexMultiply(NativeThreads &threads, const std::vector<std::complex<T>> &input_a,
+                         const std::vector<std::complex<T>> &input_b, std::vector<std::complex<T>> &output) {
+        const std::complex<T> *a = input_a.data();
+        const std::complex<T> *b = input_b.data();
+        std::complex<T> *o = output.data();
+        forElements(threads, output.size(), [&](size_t id) { o[id] = cMult(a[id], b[id]); });
+    }
+
+    template <class T>
+    void bandLimit(NativeThreads &threads, std::vector<std::complex<T>> &input_output, const std::vector<T> &k_x,
+                   const std::vector<T> &k_y, T k_max, T limit_factor) {
+        T lim = k_max * limit_factor;
+        T lim_2 = lim * lim;
+        forPixels(threads, k_x.size(), k_y.size(), [&](size_t xid, size_t yid, size_t id) {
+            T k2 = k_x[xid] * k_x[xid] + k_y[yid] * k_y[yid];
+            if (k2 > lim_2)
+                input_output[id] = std::complex<T>(T(0), T(0));
+        });
+    }
+
+    template <class T>
+    void fftShift(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output,
+                  unsigned int width, unsigned int height) {
+        unsigned int x_mid = width / 2;
+        unsigned int y_mid = height / 2;
+
+        // this is the same as swapping the quadrants (for even sizes)
+        forPixels(threads, width, height, [&](size_t xid, size_t yid, size_t id) {
+            size_t new_x = xid < x_mid ? xid + x_mid : xid - x_mid;
+            size_t new_y = yid < y_mid ? yid + y_mid : yid - y_mid;
+            output[new_x + width * new_y] = input[id];
+        });
+    }
+
+    template <class T>
+    void complexToReal(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<T> &output, int method) {
+        forElements(threads, input.size(), [&](size_t id) {
+            const std::complex<T> &v = input[id];
+            if (method == 0)
+                output[id] = v.real();
+            else if (method == 1)
+                output[id] = v.imag();
+            else if (method == 2)
+                output[id] = std::sqrt(v.real() * v.real() + v.imag() * v.imag());
+            else if (method == 3)
+                output[id] = std::atan2(v.imag(), v.real());
+            else if (method == 4)
+                output[id] = v.real() * v.real() + v.imag() * v.imag();
+            else
+                output[id] = T(0);
+        });
+    }
+
+    template <class T>
+    void bilinearTranslate(NativeThreads &threads, const std::vector<T> &input, std::vector<T> &output,
+                           int pixel_shift_x, int pixel_shift_y, T subpixel_shift_x, T subpixel_shift_y,
+                           unsigned int width, unsigned int height) {
+        // the are the factors for 'how much to take' from the nearest neighbours
+        // they are applied to the 'opposite' corners
+        T f_br = subpixel_shift_x * subpixel_shift_y;
+        T f_bl = (T(1) - subpixel_shift_x) * subpixel_shift_y;
+        T f_tr = subpixel_shift_x * (T(1) - subpixel_shift_y);
+        T f_tl = (T(1) - subpixel_shift_x) * (T(1) - subpixel_shift_y);
+
+        int w = width;
+        int h = height;
+
+        forPixels(threads, width, height, [&](size_t xid, size_t yid, size_t id) {
+            // first account for pixel shifts (and wrap around)
+            int new_xid = static_cast<int>(xid) - pixel_shift_x;
+            int new_yid = static_cast<int>(yid) - pixel_shift_y;
+
+            if (new_xid < 0)
+                new_xid = w + new_xid;
+            else if (new_xid >= w)
+                new_xid = new_xid - w;
+
+            if (new_yid < 0)
+                new_yid = h + new_yid;
+            else if (new_yid >= h)
+                new_yid = new_yid - h;
+
+            if (new_xid < 0 || new_xid >= w || new_yid < 0 || new_yid >= h) {
+                output[id] = T(0);
+                return;
+            }
+
+            int new_id = new_xid + w * new_yid;
+
+            int br_px = new_id;
+            int bl_px = new_id - 1;
+            int tr_px = new_id - w;
+            int tl_px = new_id - w - 1;
+
+            if (new_xid == 0) {
+                bl_px += w;
+                tl_px += w;
+            }
+            if (new_yid == 0) {
+                tr_px += w * h;
+                tl_px += w * h;
+            }
+
+            output[id] = f_tl * input[br_px] + f_tr * input[bl_px] + f_bl * input[tr_px] + f_br * input[tl_px];
+        });
+    }
+
+    template <class T>
+    void bandPass(NativeThreads &threads, const std::vector<T> &input, std::vector<T> &output, unsigned int width,
+                  unsigned int height, T inner, T outer, T x_centre, T y_centre) {
+        T cent_x = width / T(2) + x_centre;
+        T cent_y = height / T(2) + y_centre;
+
+        forPixels(threads, width, height, [&](size_t xid, size_t yid, size_t id) {
+            T dx = xid - cent_x;
+            T dy = yid - cent_y;
+            T radius = std::sqrt(dx * dx + dy * dy);
+            output[id] = (radius <= outer && radius >= inner) ? input[id] : T(0);
+        });
+    }
+
+    template <class T>
+    double sumReduction(NativeThreads &threads, const std::vector<T> &input) {
+        std::mutex sum_mutex;
+        double sum = 0.0;
+
+        threads.parallelFor(input.size(), [&](size_t begin, size_t end, unsigned int) {
+            double part = 0.0;
+            for (size_t i = begin; i < end; ++i)
+                part += input[i];
+
+            std::lock_guard<std::mutex> lock(sum_mutex);
+            sum += std::abs(part);
+        });
+
+        return sum * M_SQRT2;
+    }
+
+    template <class T>
+    void initPlaneWave(NativeThreads &threads, std::vector<std::complex<T>> &output, T value) {
+        forElements(threads, output.size(), [&](size_t id) { output[id] = std::complex<T>(value, T(0)); });
+    }
+
+    template <class T>
+    void initProbeWave(NativeThreads &threads, std::vector<std::complex<T>> &output, const std::vector<T> &k_x,
+                       const std::vector<T> &k_y, T pos_x, T pos_y, T wavelength, const Aberrations &ab, T cond_ap,
+                       T ap_smooth) {
+        double cond_ap2 = (cond_ap * 0.001) / wavelength;
+        double ap_smooth_radius = (ap_smooth * 0.001) / wavelength;
+
+        forPixels(threads, k_x.size(), k_y.size(), [&](size_t xid, size_t yid, size_t id) {
+            double kx = k_x[xid];
+            double ky = k_y[yid];
+            double k = std::sqrt(kx * kx + ky * ky);
+
+            if (k < cond_ap2 + ap_smooth_radius) {
+                double pos_term = 2.0 * M_PI * (kx * pos_x + ky * pos_y);
+                double chi = aberrationChi(wavelength * kx, wavelength * ky, wavelength, ab);
+
+                // the edge smoothing is calculated, but not used, by the OpenCL kernel so we don't use it here either
+                output[id] = std::complex<T>(static_cast<T>(std::cos(-pos_term - chi)), static_cast<T>(std::sin(-pos_term - chi)));
+            } else {
+                output[id] = std::complex<T>(T(0), T(0));
+            }
+        });
+    }
+
+    template <class T>
+    void ctemImage(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output,
+                   const std::vector<T> &k_x, const std::vector<T> &k_y, T wavelength, const Aberrations &ab,
+                   T obj_ap, T ap_smooth, T beta, T delta) {
+        double obj_ap2 = (obj_ap * 0.001) / wavelength;
+        double beta2 = (beta * 0.001) / wavelength;
+        double ap_smooth_radius = (ap_smooth * 0.001) / wavelength;
+        double wl = wavelength;
+        double dl = delta;
+
+        forPixels(threads, k_x.size(), k_y.size(), [&](size_t xid, size_t yid, size_t id) {
+            double kx = k_x[xid];
+            double ky = k_y[yid];
+            double k = std::sqrt(kx * kx + ky * ky);
+
+            if (k < obj_ap2 + ap_smooth_radius) {
+                double w2 = wl * wl * (kx * kx + ky * ky);
+
+                double temporal_coh = std::exp(-0.25 * M_PI * M_PI * dl * dl * w2 * w2 / (wl * wl));
+                double defocus_terms = ab.C10 + ab.C30 * w2 + ab.C50 * w2 * w2;
+                double spatial_coh = std::exp(-1.0 * M_PI * M_PI * beta2 * beta2 * w2 * defocus_terms * defocus_terms);
+                double chi = aberrationChi(wl * kx, wl * ky, wl, ab);
+
+                // smooth the aperture edge
+                double edge_factor = 1.0;
+                if (std::abs(k - obj_ap2) < ap_smooth_radius)
+                    edge_factor = 1.0 - smoothStep(obj_ap2 - ap_smooth_radius, obj_ap2 + ap_smooth_radius, k);
+
+                double f = edge_factor * temporal_coh * spatial_coh;
+                double c = std::cos(chi);
+                double s = std::sin(chi);
+                double re = input[id].real();
+                double im = input[id].imag();
+
+                output[id] = std::complex<T>(static_cast<T>(f * (re * c + im * s)), static_cast<T>(f * (im * c - re * s)));
+            } else {
+                output[id] = std::complex<T>(T(0), T(0));
+            }
+        });
+    }
+
+    template <class T>
+    void sqAbs(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output) {
+        forElements(threads, input.size(), [&](size_t id) {
+            T re = input[id].real();
+            T im = input[id].imag();
+            output[id] = std::complex<T>(re * re + im * im, T(0));
+        });
+    }
+
+    template <class T>
+    void ccdTransfer(NativeThreads &threads, std::vector<std::complex<T>> &input_output, const std::vector<T> &data,
+                     unsigned int width, unsigned int height, int binning, bool use_sqrt) {
+        int last = static_cast<int>(data.size()) - 1;
+
+        forPixels(threads, width, height, [&](size_t xid, size_t yid, size_t id) {
+            double mid_x = xid < width / 2 ? 0.0 : width;
+            double mid_y = yid < height / 2 ? 0.0 : height;
+
+            double xp = xid - mid_x;
+            double yp = yid - mid_y;
+            double rad = std::sqrt(xp * xp + yp * yp);
+
+            int i1 = static_cast<int>(std::floor(rad / binning));
+            int i2 = i1 + 1;
+            double v1 = data[std::min(i1, last)];
+            double v2 = data[std::min(i2, last)];
+            double interp = rad / binning - std::floor(rad / binning);
+            double final_val = interp * v2 + (1.0 - interp) * v1;
+
+            if (use_sqrt)
+                final_val = std::sqrt(final_val);
+
+            input_output[id] *= static_cast<T>(final_val);
+        });
+    }
+
+    template void projectedPotentialTable<float>(std::vector<float>&, const std::vector<double>&, unsigned int, unsigned int, unsigned int, unsigned int, double);
+    template void projectedPotentialTable<double>(std::vector<double>&, const std::vector<double>&, unsigned int, unsigned int, unsigned int, unsigned int, double);
+
+    template void transmissionPotentialsProjected<float>(NativeThreads&, std::vector<std::complex<float>>&, const std::vector<float>&, const std::vector<float>&, const std::vector<int>&, const std::vector<float>&, unsigned int, const std::vector<int>&, int, const ProjectedPotentialArgs<float>&);
+    template void transmissionPotentialsProjected<double>(NativeThreads&, std::vector<std::complex<double>>&, const std::vector<double>&, const std::vector<double>&, const std::vector<int>&, const std::vector<double>&, unsigned int, const std::vector<int>&, int, const ProjectedPotentialArgs<double>&);
+
+    template void propagator<float>(NativeThreads&, std::vector<std::complex<float>>&, const std::vector<float>&, const std::vector<float>&, float, float, float, float, float, float);
+    template void propagator<double>(NativeThreads&, std::vector<std::complex<double>>&, const std::vector<double>&, const std::vector<double>&, double, double, double, double, double, double);
+
+    template void complexMultiply<float>(NativeThreads&, const std::vector<std::complex<float>>&, const std::vector<std::complex<float>>&, std::vector<std::complex<float>>&);
+    template void complexMultiply<double>(NativeThreads&, const std::vector<std::complex<double>>&, const std::vector<std::complex<double>>&, std::vector<std::complex<double>>&);
+
+    template void bandLimit<float>(NativeThreads&, std::vector<std::complex<float>>&, const std::vector<float>&, const std::vector<float>&, float, float);
+    template void bandLimit<double>(NativeThreads&, std::vector<std::complex<double>>&, const std::vector<double>&, const std::vector<double>&, double, double);
+
+    template void fftShift<float>(NativeThreads&, const std::vector<std::complex<float>>&, std::vector<std::complex<float>>&, unsigned int, unsigned int);
+    template void fftShift<double>(NativeThreads&, const std::vector<std::complex<double>>&, std::vector<std::complex<double>>&, unsigned int, unsigned int);
+
+    template void complexToReal<float>(NativeThreads&, const std::vector<std::complex<float>>&, std::vector<float>&, int);
+    template void complexToReal<double>(NativeThreads&, const std::vector<std::complex<double>>&, std::vector<double>&, int);
+
+    template void bilinearTranslate<float>(NativeThreads&, const std::vector<float>&, std::vector<float>&, int, int, float, float, unsigned int, unsigned int);
+    template void bilinearTranslate<double>(NativeThreads&, const std::vector<double>&, std::vector<double>&, int, int, double, double, unsigned int, unsigned int);
+
+    template void bandPass<float>(NativeThreads&, const std::vector<float>&, std::vector<float>&, unsigned int, unsigned int, float, float, float, float);
+    template void bandPass<double>(NativeThreads&, const std::vector<double>&, std::vector<double>&, unsigned int, unsigned int, double, double, double, double);
+
+    template double sumReduction<float>(NativeThreads&, const std::vector<float>&);
+    template double sumReduction<double>(NativeThreads&, const std::vector<double>&);
+
+    template void initPlaneWave<float>(NativeThreads&, std::vector<std::complex<float>>&, float);
+    template void initPlaneWave<double>(NativeThreads&, std::vector<std::complex<double>>&, double);
+
+    template void initProbeWave<float>(NativeThreads&, std::vector<std::complex<float>>&, const std::vector<float>&, const std::vector<float>&, float, float, float, const Aberrations&, float, float);
+    template void initProbeWave<double>(NativeThreads&, std::vector<std::complex<double>>&, const std::vector<double>&, const std::vector<double>&, double, double, double, const Aberrations&, double, double);
+
+    template void ctemImage<float>(NativeThreads&, const std::vector<std::complex<float>>&, std::vector<std::complex<float>>&, const std::vector<float>&, const std::vector<float>&, float, const Aberrations&, float, float, float, float);
+    template void ctemImage<double>(NativeThreads&, const std::vector<std::complex<double>>&, std::vector<std::complex<double>>&, const std::vector<double>&, const std::vector<double>&, double, const Aberrations&, double, double, double, double);
+
+    template void sqAbs<float>(NativeThreads&, const std::vector<std::complex<float>>&, std::vector<std::complex<float>>&);
+    template void sqAbs<double>(NativeThreads&, const std::vector<std::complex<double>>&, std::vector<std::complex<double>>&);
+
+    template void ccdTransfer<float>(NativeThreads&, std::vector<std::complex<float>>&, const std::vector<float>&, unsigned int, unsigned int, int, bool);
+    template void ccdTransfer<double>(NativeThreads&, std::vector<std::complex<double>>&, const std::vector<double>&, unsigned int, unsigned int, int, bool);
+}
@@ -0,0 +1,123 @@
+#ifndef CLTEM_NATIVEKERNELS_H
+#define CLTEM_NATIVEKERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+#include "nativethreads.h"
+
+// These are host versions of the OpenCL kernels (in the kernels folder) used by the native simulation backend.
+// They try to mirror the OpenCL versions as closely as possible, so the comments in the .cl files also apply here.
+// All the images are stored in row major order (i.e. id = x + width * y), the same as for the OpenCL buffers.
+namespace NativeKernels
+{
+    // aberration coefficients, in the same units as passed to the init_probe_wave and ctem_image kernels
+    struct Aberrations {
+        double C10;
+        std::complex<double> C12, C21, C23;
+        double C30;
+        std::complex<double> C32, C34;
+        std::complex<double> C41, C43, C45;
+        double C50;
+        std::complex<double> C52, C54, C56;
+    };
+
+    // the projected potential tables are sampled evenly in sqrt(r - r_min) up to the cut off (the same as the kernels)
+    const unsigned int potential_table_samples = 2048;
+    const double potential_table_r_max = 8.0;
+
+    // Samples the projected potential (kirkland, peng or lobato) of every element in the parameterisation so the
+    // potential kernels only need to interpolate. The table is n_samples per element, starting with Z = 1.
+    template <class T>
+    void projectedPotentialTable(std::vector<T> &table, const std::vector<double> &params, unsigned int param_selector,
+                                 unsigned int param_i_count, unsigned int n_elements, unsigned int n_samples, double r_min);
+
+    // linear interpolation from the projected potential table (see transmission_potentials_projected_f.cl)
+    template <class T>
+    inline T potentialLookup(const T *table, unsigned int n_samples, int ZNum, T rad, T r_min, T table_scale) {
+        T u = std::sqrt((rad - r_min) * table_scale) * T(n_samples - 1);
+        int i = std::min(static_cast<int>(u), static_cast<int>(n_samples) - 2);
+        const T *t = table + static_cast<size_t>(ZNum - 1) * n_samples + i;
+        return t[0] + (t[1] - t[0]) * (u - T(i));
+    }
+
+    // the loop invariant arguments of the transmission_potentials_projected kernel
+    template <class T>
+    struct ProjectedPotentialArgs {
+        unsigned int width, height;
+        int total_slices;
+        T pixelscale;
+        int blocks_x, blocks_y;
+        T max_x, min_x, max_y, min_y;
+        int block_load_x, block_load_y;
+        T sigma;
+        T startx, starty;
+        T table_r_min; // the radius of the first sample in the potential table
+        T beam_theta, beam_phi; // mrad and radians (as for the kernel)
+    };
+
+    template <class T>
+    void transmissionPotentialsProjected(NativeThreads &threads, std::vector<std::complex<T>> &potential,
+                                         const std::vector<T> &pos_x, const std::vector<T> &pos_y,
+                                         const std::vector<int> &atomic_num, const std::vector<T> &potential_table,
+                                         unsigned int table_samples, const std::vector<int> &block_start_pos,
+                                         int current_slice, const ProjectedPotentialArgs<T> &args);
+
+    template <class T>
+    void propagator(NativeThreads &threads, std::vector<std::complex<T>> &propagator, const std::vector<T> &k_x,
+                    const std::vector<T> &k_y, T dz, T beam_k, T beam_k_x, T beam_k_y, T beam_k_z, T k_max);
+
+    template <class T>
+    void complexMultiply(NativeThreads &threads, const std::vector<std::complex<T>> &input_a,
+                         const std::vector<std::complex<T>> &input_b, std::vector<std::complex<T>> &output);
+
+    template <class T>
+    void bandLimit(NativeThreads &threads, std::vector<std::complex<T>> &input_output, const std::vector<T> &k_x,
+                   const std::vector<T> &k_y, T k_max, T limit_factor);
+
+    template <class T>
+    void fftShift(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output,
+                  unsigned int width, unsigned int height);
+
+    // method is the same as Utils::ComplexDisplay (0 = real, 1 = imaginary, 2 = magnitude, 3 = phase, 4 = square abs)
+    template <class T>
+    void complexToReal(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<T> &output, int method);
+
+    template <class T>
+    void bilinearTranslate(NativeThreads &threads, const std::vector<T> &input, std::vector<T> &output,
+                           int pixel_shift_x, int pixel_shift_y, T subpixel_shift_x, T subpixel_shift_y,
+                           unsigned int width, unsigned int height);
+
+    template <class T>
+    void bandPass(NativeThreads &threads, const std::vector<T> &input, std::vector<T> &output, unsigned int width,
+                  unsigned int height, T inner, T outer, T x_centre, T y_centre);
+
+    // includes the same sqrt(2) factor as the sum_reduction kernel
+    template <class T>
+    double sumReduction(NativeThreads &threads, const std::vector<T> &input);
+
+    template <class T>
+    void initPlaneWave(NativeThreads &threads, std::vector<std::complex<T>> &output, T value);
+
+    template <class T>
+    void initProbeWave(NativeThreads &threads, std::vector<std::complex<T>> &output, const std::vector<T> &k_x,
+                       const std::vector<T> &k_y, T pos_x, T pos_y, T wavelength, const Aberrations &ab, T cond_ap,
+                       T ap_smooth);
+
+    template <class T>
+    void ctemImage(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output,
+                   const std::vector<T> &k_x, const std::vector<T> &k_y, T wavelength, const Aberrations &ab,
+                   T obj_ap, T ap_smooth, T beta, T delta);
+
+    template <class T>
+    void sqAbs(NativeThreads &threads, const std::vector<std::complex<T>> &input, std::vector<std::complex<T>> &output);
+
+    // applies the ccd_dqe (use_sqrt = true) or ccd_ntf (use_sqrt = false) transfer functions
+    template <class T>
+    void ccdTransfer(NativeThreads &threads, std::vector<std::complex<T>> &input_output, const std::vector<T> &data,
+                     unsigned int width, unsigned int height, int binning, bool use_sqrt);
+}
+
+#endif //CLTEM_NATIVEKERNELS_H
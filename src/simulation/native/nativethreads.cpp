@@ -0,0 +1,100 @@
+#include "nativethreads.h"
+
+#include <algorithm>
+
+NativeThreads::NativeThreads(unsigned int n) : n_threads(std::max(n, 1u)), current_func(nullptr), current_n(0),
+                                               chunk_size(1), next_index(0), generation(0), pending(0), stop(false)
+{
+    // thread 0 is always the calling thread
+    for (unsigned int i = 1; i < n_threads; ++i)
+        workers.emplace_back(&NativeThreads::workerLoop, this, i);
+}
+
+NativeThreads::~NativeThreads()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        stop = true;
+    }
+    start_condition.notify_all();
+
+    for (auto &w : workers)
+        w.join();
+}
+
+void NativeThreads::parallelFor(size_t n, const RangeFunction &func)
+{
+    if (n == 0)
+        return;
+
+    if (workers.empty() || n == 1) {
+        func(0, n, 0);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        current_func = &func;
+        current_n = n;
+        // a few chunks per thread so that uneven work (e.g. potentials near the edges) is balanced out
+        chunk_size = std::max<size_t>(1, n / (4 * n_threads));
+        next_index = 0;
+        pending = static_cast<unsigned int>(workers.size());
+        error = nullptr;
+        ++generation;
+    }
+    start_condition.notify_all();
+
+    runChunks(0);
+
+    std::unique_lock<std::mutex> lock(mtx);
+    done_condition.wait(lock, [this]{ return pending == 0; });
+    current_func = nullptr;
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void NativeThreads::runChunks(unsigned int index)
+{
+    try {
+        while (true) {
+            size_t begin = next_index.fetch_add(chunk_size);
+            if (begin >= current_n)
+                break;
+            size_t end = std::min(begin + chunk_size, current_n);
+            (*current_func)(begin, end, index);
+        }
+    } catch (...) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!error)
+            error = std::current_exception();
+        // make sure nobody else picks up more work
+        next_index = current_n;
+    }
+}
+
+void NativeThreads::workerLoop(unsigned int index)
+{
+    unsigned int seen = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            start_condition.wait(lock, [this, &seen]{ return stop || generation != seen; });
+
+            if (stop)
+                return;
+
+            seen = generation;
+        }
+
+        runChunks(index);
+
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (--pending == 0)
+                done_condition.notify_one();
+        }
+    }
+}
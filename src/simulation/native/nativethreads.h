@@ -0,0 +1,58 @@
+#ifndef CLTEM_NATIVETHREADS_H
+#define CLTEM_NATIVETHREADS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small persistent pool of threads used by the native (host) simulation backend.
+// The thread calling parallelFor also takes part in the work, so a pool of n threads only starts n-1 extra threads.
+class NativeThreads
+{
+public:
+    // begin and end of the range to process, and the index (0 to size()-1) of the thread doing the processing
+    typedef std::function<void(size_t, size_t, unsigned int)> RangeFunction;
+
+    explicit NativeThreads(unsigned int n_threads);
+
+    ~NativeThreads();
+
+    NativeThreads(const NativeThreads&) = delete;
+    NativeThreads& operator=(const NativeThreads&) = delete;
+
+    unsigned int size() const {return n_threads;}
+
+    // splits [0, n) into chunks that are processed by all threads, blocks until the whole range is complete
+    void parallelFor(size_t n, const RangeFunction &func);
+
+private:
+    void workerLoop(unsigned int index);
+
+    void runChunks(unsigned int index);
+
+    unsigned int n_threads;
+
+    std::vector<std::thread> workers;
+
+    std::mutex mtx;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+
+    const RangeFunction *current_func;
+    size_t current_n;
+    size_t chunk_size;
+    std::atomic<size_t> next_index;
+
+    unsigned int generation;
+    unsigned int pending;
+    bool stop;
+
+    std::exception_ptr error;
+};
+
+
+#endif //CLTEM_NATIVETHREADS_H
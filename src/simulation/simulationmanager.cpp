@@ -3,21 +3,49 @@
 #include <ios>
 #include <fstream>
 #include <memory>
+#include <random>
 #include <utilities/fileio.h>
 
+namespace {
+    uint64_t makeSeed() {
+        std::random_device rd;
+        return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+    }
+}
+
 SimulationManager::SimulationManager() : sim_resolution(256), complete_jobs(0),
                                          blocks_x(80), blocks_y(80), max_inverse_factor(2.0 / 3.0), parallel_pixels(1), simulate_ctem_image(false),
-                                         ccd_binning(1), ccd_dose(10000.0),
+                                         ccd_binning(1), ccd_dose(10000.0), dose_realisations(1), dose_seed(makeSeed()), dose_seed_fixed(false),
                                          structure_parameters_name("kirkland"), maintain_area(false),
                                          simulation_mode(SimulationMode::CTEM), use_double_precision(false), intermediate_slices_enabled(false), intermediate_slices(0)
 {
     parallel_stem = true;
+    stem_tiling = false;
+    stem_tile_x = 1;
+    stem_tile_y = 1;
+    stem_prism = false;
+    prism_interpolation = 4;
+    stem_4d = false;
+    stem_4d_binning = 1;
+    stem_4d_crop = true;
+    stem_4d_path = "";
+    stem_4d_dataset = 0;
     precalc_transmission = true;
+    fused_propagation = true;
+
+    transmission_cache_size = 0;
+    transmission_cache_dir = "";
+
+    atom_slab_slices = 0;
+    queue_depth = 0;
+    reciprocal_potentials = false;
 
     parallel_potentials = false;
     parallel_potentials_count = 5;
 
     force_tds_atom_resort = false;
+    phonon_batching = false;
+    phonon_batch_size = 1;
 
     last_update = std::chrono::system_clock::now() - std::chrono::hours(24);
 
@@ -56,6 +84,8 @@ SimulationManager::SimulationManager(const SimulationManager &sm)
           image_container(sm.image_container), simulation_mode(sm.simulation_mode), stem_dets(sm.stem_dets),
           blocks_x(sm.blocks_x), blocks_y(sm.blocks_y), simulate_ctem_image(sm.simulate_ctem_image),
           max_inverse_factor(sm.max_inverse_factor), ccd_name(sm.ccd_name), ccd_binning(sm.ccd_binning), ccd_dose(sm.ccd_dose),
+          dose_realisations(sm.dose_realisations), dose_seed(sm.dose_seed_fixed ? sm.dose_seed : makeSeed()),
+          dose_seed_fixed(sm.dose_seed_fixed),
           structure_parameters_name(sm.structure_parameters_name), maintain_area(sm.maintain_area),
           use_double_precision(sm.use_double_precision), live_stem(sm.live_stem),
           intermediate_slices_enabled(sm.intermediate_slices_enabled), intermediate_slices(sm.intermediate_slices)
@@ -67,9 +97,28 @@ SimulationManager::SimulationManager(const SimulationManager &sm)
     sim_end_time = sm.sim_end_time;
 
     force_tds_atom_resort = sm.force_tds_atom_resort;
+    phonon_batching = sm.phonon_batching;
+    phonon_batch_size = sm.phonon_batch_size;
 
     parallel_stem = sm.parallel_stem;
+    stem_tiling = sm.stem_tiling;
+    stem_tile_x = sm.stem_tile_x;
+    stem_tile_y = sm.stem_tile_y;
+    stem_prism = sm.stem_prism;
+    prism_interpolation = sm.prism_interpolation;
+    stem_4d = sm.stem_4d;
+    stem_4d_binning = sm.stem_4d_binning;
+    stem_4d_crop = sm.stem_4d_crop;
+    stem_4d_path = sm.stem_4d_path;
+    stem_4d_writer = sm.stem_4d_writer;
+    stem_4d_dataset = sm.stem_4d_dataset;
     precalc_transmission = sm.precalc_transmission;
+    fused_propagation = sm.fused_propagation;
+    transmission_cache_size = sm.transmission_cache_size;
+    transmission_cache_dir = sm.transmission_cache_dir;
+    atom_slab_slices = sm.atom_slab_slices;
+    queue_depth = sm.queue_depth;
+    reciprocal_potentials = sm.reciprocal_potentials;
 
     parallel_potentials = sm.parallel_potentials;
     parallel_potentials_count = sm.parallel_potentials_count;
@@ -81,6 +130,11 @@ SimulationManager::SimulationManager(const SimulationManager &sm)
     incoherence_effects = std::make_shared<IncoherentEffects>(*(sm.incoherence_effects));
 
     simulation_cell = std::make_shared<SimulationCell>(*(sm.simulation_cell));
+
+    // the copy gets the current sums as normal images
+    if (auto acc = std::atomic_load(&sm.accumulated_images))
+        for (auto &a : *acc)
+            image_container[a.first] = a.second->image();
 }
 
 SimulationManager &SimulationManager::operator=(const SimulationManager &sm) {
@@ -91,10 +145,29 @@ SimulationManager &SimulationManager::operator=(const SimulationManager &sm) {
     sim_end_time = sm.sim_end_time;
 
     force_tds_atom_resort = sm.force_tds_atom_resort;
+    phonon_batching = sm.phonon_batching;
+    phonon_batch_size = sm.phonon_batch_size;
     parallel_potentials = sm.parallel_potentials;
     parallel_potentials_count = sm.parallel_potentials_count;
     parallel_stem = sm.parallel_stem;
+    stem_tiling = sm.stem_tiling;
+    stem_tile_x = sm.stem_tile_x;
+    stem_tile_y = sm.stem_tile_y;
+    stem_prism = sm.stem_prism;
+    prism_interpolation = sm.prism_interpolation;
+    stem_4d = sm.stem_4d;
+    stem_4d_binning = sm.stem_4d_binning;
+    stem_4d_crop = sm.stem_4d_crop;
+    stem_4d_path = sm.stem_4d_path;
+    stem_4d_writer = sm.stem_4d_writer;
+    stem_4d_dataset = sm.stem_4d_dataset;
     precalc_transmission = sm.precalc_transmission;
+    fused_propagation = sm.fused_propagation;
+    transmission_cache_size = sm.transmission_cache_size;
+    transmission_cache_dir = sm.transmission_cache_dir;
+    atom_slab_slices = sm.atom_slab_slices;
+    queue_depth = sm.queue_depth;
+    reciprocal_potentials = sm.reciprocal_potentials;
     intermediate_slices_enabled = sm.intermediate_slices_enabled;
     intermediate_slices = sm.intermediate_slices;
     use_double_precision = sm.use_double_precision;
@@ -107,6 +180,10 @@ SimulationManager &SimulationManager::operator=(const SimulationManager &sm) {
     report_progress_total_func = sm.report_progress_total_func;
     report_progress_slice_func = sm.report_progress_slice_func;
     image_container = sm.image_container;
+    std::atomic_store(&accumulated_images, std::shared_ptr<const AccumulatorMap>());
+    if (auto acc = std::atomic_load(&sm.accumulated_images))
+        for (auto &a : *acc)
+            image_container[a.first] = a.second->image();
     simulation_mode = sm.simulation_mode;
     stem_dets = sm.stem_dets;
     blocks_x = sm.blocks_x;
@@ -116,6 +193,9 @@ SimulationManager &SimulationManager::operator=(const SimulationManager &sm) {
     ccd_name = sm.ccd_name;
     ccd_binning = sm.ccd_binning;
     ccd_dose = sm.ccd_dose;
+    dose_realisations = sm.dose_realisations;
+    dose_seed = sm.dose_seed_fixed ? sm.dose_seed : makeSeed();
+    dose_seed_fixed = sm.dose_seed_fixed;
     structure_parameters_name = sm.structure_parameters_name;
     maintain_area = sm.maintain_area;
     live_stem = sm.live_stem;
@@ -257,6 +337,23 @@ double SimulationManager::inverseMaxAngle()
     return 0.5 * angle_scale * sim_resolution * inverseLimitFactor(); // half because we have a centered 0, 1000 to be in mrad
 }
 
+unsigned int SimulationManager::stem4DCropSize()
+{
+    unsigned int bin = std::min(stem_4d_binning, sim_resolution);
+
+    // anything outside the band limit is zero anyway
+    unsigned int crop = sim_resolution;
+    if (stem_4d_crop)
+        crop = static_cast<unsigned int>(std::ceil(sim_resolution * inverseLimitFactor()));
+
+    // round up to whole bins (but not bigger than the image)
+    crop = ((crop + bin - 1) / bin) * bin;
+    if (crop > sim_resolution)
+        crop = (sim_resolution / bin) * bin;
+
+    return crop;
+}
+
 unsigned long SimulationManager::totalParts()
 {
     if (simulation_mode == SimulationMode::CTEM || simulation_mode == SimulationMode::CBED)
@@ -264,6 +361,14 @@ unsigned long SimulationManager::totalParts()
     else if (simulation_mode == SimulationMode::STEM) {
         // round up as still need to complete that 'fraction of a job'
         unsigned int inelastic_runs = incoherence_effects->iterations(simulation_mode);
+        // every pixel is done by the same job (they all use the same S-matrix)
+        if (stemPrismEnabled())
+            return inelastic_runs;
+        if (stemTilesEnabled()) {
+            unsigned long tiles_x = (stemArea()->getPixelsX() + stem_tile_x - 1) / stem_tile_x;
+            unsigned long tiles_y = (stemArea()->getPixelsY() + stem_tile_y - 1) / stem_tile_y;
+            return inelastic_runs * tiles_x * tiles_y;
+        }
         return static_cast<unsigned long>(inelastic_runs * std::ceil(
                 static_cast<double>(stemArea()->getNumPixels()) / parallelPixels()));
     }
@@ -271,47 +376,120 @@ unsigned long SimulationManager::totalParts()
     return 0;
 }
 
+std::map<std::string, Image<double>> SimulationManager::images() {
+    auto ims = image_container;
+    if (auto acc = std::atomic_load(&accumulated_images))
+        for (auto &a : *acc)
+            ims[a.first] = a.second->image();
+    return ims;
+}
+
 void SimulationManager::updateImages(std::map<std::string, Image<double>> &ims, int jobCount, bool update)
 {
     CLOG(DEBUG, "sim") << "Updating images";
-    std::lock_guard<std::mutex> lck(image_update_mutex);
-    CLOG(DEBUG, "sim") << "Got a mutex lock";
-
-    for (auto const& i : ims)
     {
-        CLOG(DEBUG, "sim") << "Processing image " << i.first;
-        if (image_container.find(i.first) != image_container.end()) {
-            CLOG(DEBUG, "sim") << "Adding to existing image";
-            auto current = image_container[i.first];
-            auto im = i.second;
-
-            if (im.getSliceSize() != current.getSliceSize()) {
-                CLOG(ERROR, "sim") << "Tried to merge simulation jobs with different output size";
-                throw std::runtime_error("Tried to merge simulation jobs with different output size");
-            }
-            if (im.getWeightingSize() != current.getWeightingSize()) {
-                CLOG(ERROR, "sim") << "Tried to merge simulation jobs with different weighting sizes";
-                throw std::runtime_error("Tried to merge simulation jobs with different weighting sizes");
+        std::lock_guard<std::mutex> lck(image_update_mutex);
+        CLOG(DEBUG, "sim") << "Got a mutex lock";
+
+        for (auto &i : ims)
+        {
+            CLOG(DEBUG, "sim") << "Processing image " << i.first;
+            auto it = image_container.find(i.first);
+            if (it != image_container.end()) {
+                CLOG(DEBUG, "sim") << "Adding to existing image";
+                // add in place (no copies of the images)
+                auto &current = it->second;
+                auto &im = i.second;
+
+                if (im.getSliceSize() != current.getSliceSize()) {
+                    CLOG(ERROR, "sim") << "Tried to merge simulation jobs with different output size";
+                    throw std::runtime_error("Tried to merge simulation jobs with different output size");
+                }
+                if (im.getWeightingSize() != current.getWeightingSize()) {
+                    CLOG(ERROR, "sim") << "Tried to merge simulation jobs with different weighting sizes";
+                    throw std::runtime_error("Tried to merge simulation jobs with different weighting sizes");
+                }
+
+                CLOG(DEBUG, "sim") << "Copying data";
+                for (int j = 0; j < current.getDepth(); ++j) {
+                    // we need to account for my complex number, that I have sort of bodged in, hence I calculate the k range as I have (and not slicesize)
+                    auto &current_slice = current.getSliceRef(j);
+                    auto &im_slice = im.getSliceRef(j);
+                    for (int k = 0; k < current_slice.size(); ++k)
+                        current_slice[k] += im_slice[k]; // average factor is calculated using weighting now...
+                }
+
+                // there is no weighting per slice at the moment
+                auto &current_weighting = current.getWeightingRef();
+                auto &im_weighting = im.getWeightingRef();
+                for (int k = 0; k < current.getWeightingSize(); ++k)
+                    current_weighting[k] += im_weighting[k];
+            } else {
+                CLOG(DEBUG, "sim") << "First time so creating image";
+                // weighting is not done inside the image class
+                image_container[i.first] = std::move(i.second);
             }
+        }
+    }
+
+    finishedJobs(jobCount, update);
+}
+
+std::shared_ptr<const SimulationManager::AccumulatorMap> SimulationManager::getAccumulators(
+        const std::map<std::string, std::vector<std::vector<double>>> &values, unsigned int width, unsigned int height) {
+    auto acc = std::atomic_load(&accumulated_images);
+
+    bool have_all = static_cast<bool>(acc);
+    for (auto &v : values)
+        have_all = have_all && acc->find(v.first) != acc->end();
+    if (have_all)
+        return acc;
 
-            CLOG(DEBUG, "sim") << "Copying data";
-            for (int j = 0; j < current.getDepth(); ++j)
-                // we need to account for my complex number, that I have sort of bodged in, hence I calculate the k range as I have (and not slicesize)
-                for (int k = 0; k < current.getSliceRef(j).size(); ++k)
-                    current.getSliceRef(j)[k] += im.getSliceRef(j)[k]; // average factor is calculated using weighting now...
-
-            // there is no weighting per slice at the moment
-            for (int k = 0; k < current.getWeightingSize(); ++k)
-                current.getWeightingRef()[k] += im.getWeightingRef()[k];
-
-            image_container[i.first] = current;
-        } else {
-            CLOG(DEBUG, "sim") << "First time so creating image";
-            // weighting is not done inside the image class
-            image_container[i.first] = i.second;
+    // only one thread makes the new images (check again now we have the lock)
+    std::lock_guard<std::mutex> lck(accumulator_mutex);
+    acc = std::atomic_load(&accumulated_images);
+
+    auto new_acc = acc ? std::make_shared<AccumulatorMap>(*acc) : std::make_shared<AccumulatorMap>();
+    for (auto &v : values)
+        if (new_acc->find(v.first) == new_acc->end())
+            (*new_acc)[v.first] = std::make_shared<ImageAccumulator>(width, height, v.second.size());
+
+    acc = new_acc;
+    std::atomic_store(&accumulated_images, acc);
+    return acc;
+}
+
+void SimulationManager::updateImagePixels(const std::map<std::string, std::vector<std::vector<double>>> &values,
+                                          const std::vector<int> &pixels, unsigned int width, unsigned int height,
+                                          int jobCount, bool update)
+{
+    CLOG(DEBUG, "sim") << "Updating image pixels";
+    auto acc = getAccumulators(values, width, height);
+
+    for (auto &v : values) {
+        auto &im = *acc->at(v.first);
+
+        if (im.getWidth() != width || im.getHeight() != height || im.getDepth() != v.second.size()) {
+            CLOG(ERROR, "sim") << "Tried to merge simulation jobs with different output size";
+            throw std::runtime_error("Tried to merge simulation jobs with different output size");
         }
+
+        for (unsigned int j = 0; j < v.second.size(); ++j)
+            for (size_t k = 0; k < pixels.size(); ++k)
+                im.add(j, pixels[k], v.second[j][k]);
+
+        for (int p : pixels)
+            im.addWeighting(p, 1.0);
     }
 
+    finishedJobs(jobCount, update);
+}
+
+void SimulationManager::finishedJobs(int jobCount, bool update)
+{
+    // this is only the counting and reporting, the images are already added
+    std::lock_guard<std::mutex> lck(image_update_mutex);
+
     // count how many jobs have been done...
     complete_jobs += jobCount;
 
@@ -342,6 +520,7 @@ void SimulationManager::updateImages(std::map<std::string, Image<double>> &ims,
             stopTimer();
 
         // call the function that will return this class (and therefore all the actual results)
+        // the copy this makes is where the accumulated images are turned into full images
         image_return_func(*this);
 
         // this makes sure we aren't updating too often
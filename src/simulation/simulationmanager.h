@@ -11,6 +11,7 @@
 #include <mutex>
 #include <map>
 #include <valarray>
+#include <algorithm>
 #include "incoherence/inelastic/phonon.h"
 #include "incoherence/inelastic/plasmon.h"
 #include <incoherence/incoherenteffects.h>
@@ -19,6 +20,8 @@
 
 #include "structure/structureparameters.h"
 #include "utilities/commonstructs.h"
+#include "utilities/imageaccumulator.h"
+#include "utilities/chunkedfile.h"
 #include "utilities/enums.h"
 #include "utilities/stringutils.h"
 #include "utilities/logging.h"
@@ -104,6 +107,16 @@ public:
     double const ccdDose() {return ccd_dose;}
     void setCcdDose(double dose) {ccd_dose = dose;}
 
+    // the number of independent noisy images made from each noiseless CTEM image (only when there is a CCD dose)
+    unsigned int doseRealisations() {return dose_realisations;}
+    void setDoseRealisations(unsigned int n) {dose_realisations = std::max(n, 1u);}
+
+    // the key for the shot noise, a new one is made for each copy (so each simulation is different) unless it has been
+    // set (so the noise can be reproduced)
+    uint64_t doseSeed() {return dose_seed;}
+    void setDoseSeed(uint64_t s) {dose_seed = s; dose_seed_fixed = true;}
+    bool doseSeedFixed() {return dose_seed_fixed;}
+
     //
     bool maintainAreas() {return maintain_area;}
     void setMaintainAreas(bool maintain) {maintain_area = maintain;}
@@ -120,6 +133,8 @@ public:
 
     unsigned int storedParallelPixels() { return parallel_pixels; }
     unsigned int parallelPixels() {
+        if (stemTilesEnabled())
+            return stem_tile_x * stem_tile_y;
         return (simulation_mode != SimulationMode::STEM || !parallelStem()) ? 1 : parallel_pixels;
     }
     void setParallelPixels(unsigned int npp) { parallel_pixels = npp;}
@@ -166,8 +181,14 @@ public:
     void setProgressTotalReporterFunc(std::function<void(double)> f) { report_progress_total_func = std::move(f);}
     void setProgressSliceReporterFunc(std::function<void(double)> f) { report_progress_slice_func = std::move(f);}
 
-    std::map<std::string, Image<double>> images() { return image_container; }
+    // this makes the full images from anything that has been accumulated (so it is a copy)
+    std::map<std::string, Image<double>> images();
     void updateImages(std::map<std::string, Image<double>> &ims, int jobCount, bool update=false);
+    // Adds only the pixels a job has simulated (values are [image name][slice][i] for pixel pixels[i]), each pixel also
+    // gets a weighting of 1. The pixels are summed without a lock, so the workers don't wait for each other.
+    void updateImagePixels(const std::map<std::string, std::vector<std::vector<double>>> &values,
+                           const std::vector<int> &pixels, unsigned int width, unsigned int height, int jobCount,
+                           bool update=false);
     void failedSimulation();
 
     void reportTotalProgress(double prog);
@@ -199,6 +220,167 @@ public:
         parallel_stem = set;
     }
 
+    // Groups neighbouring STEM pixels into tiles that share one (moving) frame, so the potentials are only calculated
+    // once per tile (only used when the static area/parallel STEM is off)
+    bool stemTiling() {
+        return stem_tiling;
+    }
+
+    void setStemTiling(bool set) {
+        stem_tiling = set;
+    }
+
+    bool stemTilesEnabled() {
+        return simulation_mode == SimulationMode::STEM && !parallel_stem && stem_tiling;
+    }
+
+    // the tile size (in pixels) is worked out from the device memory when the simulation is started
+    unsigned int stemTileX() {return stem_tile_x;}
+    unsigned int stemTileY() {return stem_tile_y;}
+
+    void setStemTileSize(unsigned int x, unsigned int y) {
+        stem_tile_x = std::max(x, 1u);
+        stem_tile_y = std::max(y, 1u);
+    }
+
+    // PRISM STEM: a reduced set of plane waves (every prism_interpolation reciprocal pixels inside the probe aperture)
+    // is propagated once, then each probe is made from these around its position. Needs the static area and does not
+    // support plasmons (these would be the same for every probe).
+    bool stemPrism() {
+        return stem_prism;
+    }
+
+    void setStemPrism(bool set) {
+        stem_prism = set;
+    }
+
+    bool stemPrismEnabled() {
+        return simulation_mode == SimulationMode::STEM && parallel_stem && stem_prism && !incoherence_effects->plasmons()->enabled();
+    }
+
+    unsigned int prismInterpolation() {
+        return prism_interpolation;
+    }
+
+    void setPrismInterpolation(unsigned int f) {
+        prism_interpolation = std::max(f, 1u);
+    }
+
+    // 4D-STEM: the diffraction pattern of every probe (binned and optionally cropped to the band limit) is streamed to
+    // a chunked file as the simulation runs, so other detectors can be integrated from it later. Not supported by
+    // PRISM or the native (host CPU) device.
+    bool stem4D() {
+        return stem_4d;
+    }
+
+    void setStem4D(bool set) {
+        stem_4d = set;
+    }
+
+    bool stem4DEnabled() {
+        return simulation_mode == SimulationMode::STEM && stem_4d;
+    }
+
+    unsigned int stem4DBinning() {
+        return stem_4d_binning;
+    }
+
+    void setStem4DBinning(unsigned int b) {
+        stem_4d_binning = std::max(b, 1u);
+    }
+
+    bool stem4DCrop() {
+        return stem_4d_crop;
+    }
+
+    void setStem4DCrop(bool set) {
+        stem_4d_crop = set;
+    }
+
+    std::string stem4DPath() {
+        return stem_4d_path;
+    }
+
+    void setStem4DPath(std::string path) {
+        stem_4d_path = std::move(path);
+    }
+
+    // width (and height) of the part of the diffraction pattern that is kept (before binning), this is a multiple of
+    // the binning
+    unsigned int stem4DCropSize();
+
+    // width (and height) of the saved diffraction patterns
+    unsigned int stem4DPatternSize() {return stem4DCropSize() / std::min(stem_4d_binning, sim_resolution);}
+
+    // the file is opened (and closed) by the simulation runner, the copies of this manager share it
+    std::shared_ptr<fileio::ChunkedFileWriter> stem4DWriter() {
+        return stem_4d_writer;
+    }
+
+    uint32_t stem4DDataset() {
+        return stem_4d_dataset;
+    }
+
+    void setStem4DWriter(std::shared_ptr<fileio::ChunkedFileWriter> writer, uint32_t dataset) {
+        stem_4d_writer = std::move(writer);
+        stem_4d_dataset = dataset;
+    }
+
+    // applies the propagator inside the FFT (if clFFT supports it), otherwise it is a separate multiply
+    bool fusedPropagation() {
+        return fused_propagation;
+    }
+
+    void setFusedPropagation(bool set) {
+        fused_propagation = set;
+    }
+
+    // size (in MB) of the memory cache of precalculated transmission functions (0 to disable)
+    unsigned int transmissionCacheSize() {
+        return transmission_cache_size;
+    }
+
+    void setTransmissionCacheSize(unsigned int size) {
+        transmission_cache_size = size;
+    }
+
+    // where the transmission functions are also cached on disk (empty to disable)
+    std::string transmissionCacheDirectory() {
+        return transmission_cache_dir;
+    }
+
+    void setTransmissionCacheDirectory(std::string dir) {
+        transmission_cache_dir = std::move(dir);
+    }
+
+    // number of slices whose atoms are kept on the device at once (0 keeps all the atoms on the device)
+    unsigned int atomSlabSlices() {
+        return atom_slab_slices;
+    }
+
+    void setAtomSlabSlices(unsigned int n) {
+        atom_slab_slices = n;
+    }
+
+    // number of slices that can be queued on the device ahead of the host, 0 finishes the queue after every step
+    unsigned int queueDepth() {
+        return queue_depth;
+    }
+
+    void setQueueDepth(unsigned int n) {
+        queue_depth = n;
+    }
+
+    // builds the projected potentials in reciprocal space (one FFT per species) instead of summing each atom in real
+    // space, this is faster for slices with very many atoms
+    bool reciprocalPotentials() {
+        return reciprocal_potentials;
+    }
+
+    void setReciprocalPotentials(bool use) {
+        reciprocal_potentials = use;
+    }
+
     bool storedUseParallelPotentials() {
         return parallel_potentials;
     }
@@ -223,7 +405,8 @@ public:
         bool do_parallel = fp && pr && pp;
 
         if (mode() == SimulationMode::STEM) {
-            return (do_parallel && parallelStem()) ? parallel_potentials_count : 1;
+            // the PRISM beams must all see the same specimen
+            return (do_parallel && parallelStem() && !stemPrismEnabled()) ? parallel_potentials_count : 1;
         } else {
             // only bother if we have fewer parallel than the tds iterations
             int fp_count = incoherenceEffects()->iterations(mode());
@@ -243,6 +426,32 @@ public:
         force_tds_atom_resort = set;
     }
 
+    // CTEM/CBED: propagates several frozen phonon configurations side by side in one pass (as a stack of waves, like
+    // parallel STEM) and sums them on the device, so only one set of outputs is read back per batch
+    bool phononBatching() {
+        return phonon_batching;
+    }
+
+    void setPhononBatching(bool set) {
+        phonon_batching = set;
+    }
+
+    // the number of configurations in each batch is worked out from the device memory when the simulation is started
+    unsigned int phononBatchSize() {
+        return phonon_batch_size;
+    }
+
+    void setPhononBatchSize(unsigned int n) {
+        phonon_batch_size = std::max(n, 1u);
+    }
+
+    // the number of waves propagated at once (probes for STEM, phonon configurations for CTEM/CBED)
+    unsigned int waveStackSize() {
+        if (simulation_mode == SimulationMode::STEM)
+            return parallelPixels();
+        return phonon_batch_size;
+    }
+
     void startTimer() {
         std::lock_guard<std::mutex> lck(timer_mutex);
         if (!timer_started) {
@@ -341,12 +550,48 @@ private:
 
     bool parallel_stem;
 
+    bool stem_tiling;
+
+    unsigned int stem_tile_x, stem_tile_y;
+
+    bool stem_prism;
+
+    unsigned int prism_interpolation;
+
+    bool stem_4d;
+
+    unsigned int stem_4d_binning;
+
+    bool stem_4d_crop;
+
+    std::string stem_4d_path;
+
+    std::shared_ptr<fileio::ChunkedFileWriter> stem_4d_writer;
+
+    uint32_t stem_4d_dataset;
+
+    bool fused_propagation;
+
+    unsigned int transmission_cache_size;
+
+    std::string transmission_cache_dir;
+
+    unsigned int atom_slab_slices;
+
+    unsigned int queue_depth;
+
+    bool reciprocal_potentials;
+
     bool parallel_potentials;
 
     unsigned int parallel_potentials_count;
 
     bool force_tds_atom_resort;
 
+    bool phonon_batching;
+
+    unsigned int phonon_batch_size;
+
     //
     std::chrono::time_point<std::chrono::system_clock> last_update;
 
@@ -365,6 +610,9 @@ private:
     std::string ccd_name;
     int ccd_binning;
     double ccd_dose;
+    unsigned int dose_realisations;
+    uint64_t dose_seed;
+    bool dose_seed_fixed;
 
     std::string structure_parameters_name;
 
@@ -392,6 +640,18 @@ private:
 
     std::map<std::string, Image<double>> image_container;
 
+    // The images that are summed pixel by pixel (i.e. STEM). The map is replaced (never changed) when an image is added
+    // so it can be read without a lock, accumulator_mutex is only needed to add to it.
+    typedef std::map<std::string, std::shared_ptr<ImageAccumulator>> AccumulatorMap;
+    std::shared_ptr<const AccumulatorMap> accumulated_images;
+    std::mutex accumulator_mutex;
+
+    std::shared_ptr<const AccumulatorMap> getAccumulators(const std::map<std::string, std::vector<std::vector<double>>> &values,
+                                                          unsigned int width, unsigned int height);
+
+    // counts the finished jobs and returns the images when needed
+    void finishedJobs(int jobCount, bool update);
+
 
 };
 
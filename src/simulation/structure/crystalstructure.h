@@ -83,7 +83,7 @@ public:
 
     std::string fileName() {return file_path;}
 
-    std::vector<AtomSite> atoms() {return atom_list;}
+    const std::vector<AtomSite>& atoms() const {return atom_list;}
 
     int atomCountInRange(double xs, double xf, double ys, double yf);
 
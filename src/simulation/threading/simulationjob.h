@@ -38,6 +38,9 @@ public:
 
     // only used for STEM simulations, here are the (randomised) pixel indices to simulate.
     std::vector<int> pixels;
+
+    // only used for CTEM/CBED, the number of (batched) phonon configurations this job simulates
+    unsigned int configs = 1;
 };
 
 #endif //CLTEM_JOBSPLITTER_H
@@ -2,10 +2,13 @@
 // Created by jon on 02/08/17.
 //
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
 #include <random>
 #include <utility>
 #include "simulationrunner.h"
+#include "utilities/jsonutils.h"
 
 SimulationRunner::SimulationRunner(std::vector<std::shared_ptr<SimulationManager>> mans, std::vector<clDevice> devs, bool double_precision) : managers(
         std::move(mans)), start(true), use_double_precision(double_precision)
@@ -23,6 +26,35 @@ void SimulationRunner::runSimulations()
 
 void SimulationRunner::runSingle(std::shared_ptr<SimulationManager> sim_pointer)
 {
+    if (sim_pointer->stemPrismEnabled())
+        checkPrismMemory(sim_pointer);
+
+    if (sim_pointer->stemTilesEnabled())
+        calculateStemTileSize(sim_pointer);
+
+    if (sim_pointer->mode() != SimulationMode::STEM)
+        calculatePhononBatchSize(sim_pointer);
+
+    if (sim_pointer->stem4DEnabled()) {
+        // only the OpenCL STEM (not PRISM) writes the diffraction patterns, so the file would be left empty
+        bool has_native = std::any_of(dev_list.begin(), dev_list.end(), [](clDevice &d) { return d.isNative(); });
+        if (sim_pointer->stemPrismEnabled() || has_native) {
+            CLOG(ERROR, "gui") << "4D-STEM is not supported by " << (has_native ? "the native backend" : "PRISM STEM");
+            sim_pointer->failedSimulation();
+            return;
+        }
+
+        try {
+            openStem4DFile(sim_pointer);
+        } catch (const std::exception &e) {
+            CLOG(ERROR, "gui") << "Could not open 4D-STEM file: " << e.what();
+            sim_pointer->failedSimulation();
+            return;
+        }
+    }
+
+    auto writer_4d = sim_pointer->stem4DWriter();
+
     CLOG(DEBUG, "gui") << "Splitting jobs";
     auto jobs = SplitJobs(std::move(sim_pointer));
 
@@ -47,6 +79,48 @@ void SimulationRunner::runSingle(std::shared_ptr<SimulationManager> sim_pointer)
 
     for (auto && result: results)
         result.get();
+
+    // everything has been queued, this waits for the last patterns to be written
+    if (writer_4d) {
+        try {
+            writer_4d->close();
+        } catch (const std::exception &e) {
+            CLOG(ERROR, "gui") << "Error writing 4D-STEM file: " << e.what();
+        }
+    }
+}
+
+void SimulationRunner::openStem4DFile(const std::shared_ptr<SimulationManager> &simManager)
+{
+    unsigned int n_slices = simManager->simulationCell()->sliceCount();
+    unsigned int slice_step = simManager->intermediateSliceStep();
+    unsigned int output_count = 1;
+    if (slice_step > 0)
+        output_count = std::ceil((float) n_slices / slice_step);
+
+    unsigned int iterations = simManager->incoherenceEffects()->iterations(simManager->mode());
+    unsigned int px = simManager->stemArea()->getPixelsX();
+    unsigned int py = simManager->stemArea()->getPixelsY();
+    unsigned int n = simManager->stem4DPatternSize();
+
+    auto writer = std::make_shared<fileio::ChunkedFileWriter>();
+    writer->open(simManager->stem4DPath());
+
+    // the patterns are centred on the optic axis with pixels this size
+    unsigned int bin = simManager->stem4DCropSize() / n;
+    auto j = JSONUtils::BasicManagerToJson(*simManager, false, true);
+    j["4d"]["dimensions"] = {"iteration", "slice", "y", "x", "ky", "kx"};
+    j["4d"]["binning"] = bin;
+    j["4d"]["crop"] = simManager->stem4DCropSize();
+    j["4d"]["scale"]["val"] = simManager->inverseScaleAngle() * bin;
+    j["4d"]["scale"]["units"] = "mrad";
+    writer->writeMetadata(j.dump(4));
+
+    // every pattern is its own chunk (so each probe can be written as soon as it is done)
+    auto id = writer->addDataset("diffraction", {iterations, output_count, py, px, n, n}, {1, 1, 1, 1, n, n});
+    simManager->setStem4DWriter(writer, id);
+
+    CLOG(DEBUG, "gui") << "Writing " << n << " x " << n << " diffraction patterns to " << simManager->stem4DPath();
 }
 
 std::vector<std::shared_ptr<SimulationJob>> SimulationRunner::SplitJobs(std::shared_ptr<SimulationManager> simManager)
@@ -59,13 +133,56 @@ std::vector<std::shared_ptr<SimulationJob>> SimulationRunner::SplitJobs(std::sha
     // make the jobs, I'll have to implement a system for the simulation to recognise when it is done and to
     // export the files. That at least makes this simple, just create a list of jobs
 
-    // later on might want a way to combine (some of) the TDS runs into individual jobs.
-    if (mode == SimulationMode::CTEM)
-        for (int i = 0; i < nJobs; ++i)
-            jobs[i] = std::make_shared<SimulationJob>(simManager, i);
-    else if (mode == SimulationMode::CBED)
-        for (int i = 0; i < nJobs; ++i)
+    // the phonon configurations can be batched into fewer jobs (the last job takes what is left)
+    if (mode == SimulationMode::CTEM || mode == SimulationMode::CBED) {
+        unsigned int batch = simManager->phononBatchSize();
+        jobs.resize((nJobs + batch - 1) / batch);
+        for (int i = 0; i < jobs.size(); ++i) {
             jobs[i] = std::make_shared<SimulationJob>(simManager, i);
+            jobs[i]->configs = static_cast<unsigned int>(std::min<unsigned long>(batch, nJobs - i * batch));
+        }
+    }
+    else if (mode == SimulationMode::STEM && simManager->stemPrismEnabled())
+    {
+        // PRISM does every pixel in one job (for each inelastic iteration), the S-matrix is only made once per job
+        int px = simManager->stemArea()->getPixelsX();
+        int py = simManager->stemArea()->getPixelsY();
+
+        std::vector<int> temp;
+        temp.reserve(static_cast<size_t>(px) * py);
+        for (int y = py - 1; y >= 0; --y)
+            for (int x = 0; x < px; ++x)
+                temp.push_back(x + y * px);
+
+        unsigned int inelastic_iterations = simManager->incoherenceEffects()->iterations(mode);
+        for (int i = 0; i < inelastic_iterations; ++i)
+            jobs[i] = std::make_shared<SimulationJob>(simManager, temp, i);
+    }
+    else if (mode == SimulationMode::STEM && simManager->stemTilesEnabled())
+    {
+        // each job is a tile of neighbouring pixels, these all use the same frame (and potentials)
+        int px = simManager->stemArea()->getPixelsX();
+        int py = simManager->stemArea()->getPixelsY();
+        int tile_x = simManager->stemTileX();
+        int tile_y = simManager->stemTileY();
+
+        unsigned int jobCount = 0;
+        unsigned int inelastic_iterations = simManager->incoherenceEffects()->iterations(mode);
+        for (int i = 0; i < inelastic_iterations; ++i)
+            // this scans the tiles from top to bottom (like a real STEM)
+            for (int y_start = ((py - 1) / tile_y) * tile_y; y_start >= 0; y_start -= tile_y)
+                for (int x_start = 0; x_start < px; x_start += tile_x) {
+                    // The first pixel has to be the lowest x and y of the tile, as the frame starts from that pixel
+                    // (the frame always covers the whole STEM area from its start, so the rest of the tile fits)
+                    std::vector<int> temp;
+                    for (int y = y_start; y < std::min(y_start + tile_y, py); ++y)
+                        for (int x = x_start; x < std::min(x_start + tile_x, px); ++x)
+                            temp.push_back(x + y * px);
+
+                    jobs[jobCount] = std::make_shared<SimulationJob>(simManager, temp, jobCount);
+                    jobCount++;
+                }
+    }
     else if (mode == SimulationMode::STEM)
     {
         unsigned int StemParallel = simManager->parallelPixels();
@@ -132,3 +249,162 @@ std::vector<std::shared_ptr<SimulationJob>> SimulationRunner::SplitJobs(std::sha
 
     return jobs;
 }
+
+void SimulationRunner::calculateStemTileSize(const std::shared_ptr<SimulationManager> &simManager)
+{
+    unsigned int px = simManager->stemArea()->getPixelsX();
+    unsigned int py = simManager->stemArea()->getPixelsY();
+
+    // every device gets the same size jobs, so the smallest device sets the size
+    size_t dev_memory = 0;
+    for (auto &dev : dev_list) {
+        size_t m = dev.GetGlobalMemSize();
+        if (m > 0 && (dev_memory == 0 || m < dev_memory))
+            dev_memory = m;
+    }
+
+    size_t n_probes;
+    if (dev_memory == 0) {
+        // native devices use the host memory, so just use the normal number of parallel pixels
+        n_probes = simManager->storedParallelPixels();
+    } else {
+        size_t resolution = simManager->resolution();
+        size_t real_size = use_double_precision ? sizeof(double) : sizeof(float);
+        size_t wave_size = resolution * resolution * 2 * real_size;
+
+        // the buffers that don't depend on the number of probes (the transmission functions, propagator, temporary
+        // images and the atoms)
+        size_t fixed = 4 * wave_size + 2 * resolution * resolution * real_size;
+        if (simManager->precalculateTransmission())
+            fixed += simManager->simulationCell()->sliceCount() * wave_size;
+        fixed += simManager->simulationCell()->crystalStructure()->atoms().size() * (3 * real_size + sizeof(int));
+
+        // Each probe needs a real, reciprocal and intermediate wave function. Only plan to use half the memory to leave
+        // space for the FFT plans etc. and each stack needs to fit in one allocation (at least 1/4 of the memory).
+        size_t budget = dev_memory / 2;
+        n_probes = budget > fixed ? (budget - fixed) / (3 * wave_size) : 1;
+        n_probes = std::min(n_probes, dev_memory / 4 / wave_size);
+    }
+
+    n_probes = std::max<size_t>(std::min<size_t>(n_probes, static_cast<size_t>(px) * py), 1);
+
+    // keep the tiles as square as we can (so they are as compact as possible)
+    auto tile_x = static_cast<unsigned int>(std::floor(std::sqrt(static_cast<double>(n_probes))));
+    tile_x = std::max(std::min(tile_x, px), 1u);
+    auto tile_y = static_cast<unsigned int>(std::max<size_t>(std::min<size_t>(n_probes / tile_x, py), 1));
+
+    simManager->setStemTileSize(tile_x, tile_y);
+
+    CLOG(DEBUG, "gui") << "Using STEM tiles of " << tile_x << " x " << tile_y << " pixels";
+}
+
+void SimulationRunner::checkPrismMemory(const std::shared_ptr<SimulationManager> &simManager)
+{
+    // every device makes the whole S-matrix, so the smallest device has to fit it
+    size_t dev_memory = 0;
+    for (auto &dev : dev_list) {
+        size_t m = dev.GetGlobalMemSize();
+        if (m > 0 && (dev_memory == 0 || m < dev_memory))
+            dev_memory = m;
+    }
+
+    // the native devices use the host memory
+    if (dev_memory == 0)
+        return;
+
+    // count the beams the same way as the simulation (every interpolation pixels inside the probe aperture), this
+    // doesn't know about the bandwidth limit so it might be a few too many
+    size_t resolution = simManager->resolution();
+    unsigned int interpolation = std::min(simManager->prismInterpolation(), static_cast<unsigned int>(resolution));
+    while (resolution % interpolation != 0)
+        --interpolation;
+
+    auto mp = simManager->microscopeParams();
+    double k_max = (mp->CondenserAperture + mp->CondenserApertureSmoothing) / (1000.0 * mp->Wavelength());
+    double dk = simManager->inverseScale();
+    auto half = static_cast<long>(resolution / 2);
+
+    size_t n_beams = 0;
+    for (size_t j = 0; j < resolution; j += interpolation)
+        for (size_t i = 0; i < resolution; i += interpolation) {
+            double kx = dk * static_cast<double>(static_cast<long>(i) < half ? static_cast<long>(i) : static_cast<long>(i) - static_cast<long>(resolution));
+            double ky = dk * static_cast<double>(static_cast<long>(j) < half ? static_cast<long>(j) : static_cast<long>(j) - static_cast<long>(resolution));
+            if (kx * kx + ky * ky < k_max * k_max)
+                ++n_beams;
+        }
+
+    size_t n_parallel = simManager->parallelPixels();
+    size_t n_batches = (n_beams + n_parallel - 1) / n_parallel;
+
+    unsigned int slice_step = simManager->intermediateSliceStep();
+    size_t output_count = 1;
+    if (slice_step > 0)
+        output_count = std::ceil((float) simManager->simulationCell()->sliceCount() / slice_step);
+
+    size_t real_size = use_double_precision ? sizeof(double) : sizeof(float);
+    size_t wave_size = resolution * resolution * 2 * real_size;
+    size_t s_matrix = output_count * n_batches * n_parallel * wave_size;
+
+    // Only plan to use half the memory (as for the tiles), this needs the wave function stacks and the probe windows
+    // (up to 1/8 of the memory) as well
+    size_t fixed = 3 * n_parallel * wave_size + dev_memory / 8;
+    if (s_matrix + fixed <= dev_memory / 2)
+        return;
+
+    CLOG(WARNING, "gui") << "PRISM S-matrix (" << s_matrix / (1024 * 1024) << " MB) will not fit on the device, using parallel STEM";
+    simManager->setStemPrism(false);
+}
+
+void SimulationRunner::calculatePhononBatchSize(const std::shared_ptr<SimulationManager> &simManager)
+{
+    simManager->setPhononBatchSize(1);
+
+    // Each configuration has its own atoms (displaced on the device) and transmission functions, so anything that
+    // changes the atoms on the host (or is different for each job) can't be batched.
+    auto incoherence = simManager->incoherenceEffects();
+    auto mode = simManager->mode();
+    unsigned int iterations = incoherence->iterations(mode);
+    if (!simManager->phononBatching() || !incoherence->phonons()->getFrozenPhononEnabled() || iterations < 2 ||
+        incoherence->plasmons()->enabled() || incoherence->source()->enabled() || simManager->useParallelPotentials() ||
+        simManager->atomSlabSlices() > 0 || simManager->forcePhononAtomResort())
+        return;
+
+    // every device gets the same size jobs, so the smallest device sets the size
+    size_t dev_memory = 0;
+    for (auto &dev : dev_list) {
+        size_t m = dev.GetGlobalMemSize();
+        // the native simulation doesn't batch the configurations
+        if (m == 0)
+            return;
+        if (dev_memory == 0 || m < dev_memory)
+            dev_memory = m;
+    }
+
+    if (dev_memory == 0)
+        return;
+
+    size_t resolution = simManager->resolution();
+    size_t real_size = use_double_precision ? sizeof(double) : sizeof(float);
+    size_t wave_size = resolution * resolution * 2 * real_size;
+
+    // the buffers that don't depend on the number of configurations (the propagator, temporary images, sums and the
+    // undisplaced and displaced atoms)
+    size_t fixed = 6 * wave_size + simManager->simulationCell()->crystalStructure()->atoms().size() * (9 * real_size + 2 * sizeof(int));
+
+    // Each configuration needs a real, reciprocal and intermediate wave function and its transmission functions. Only
+    // plan to use half the memory to leave space for the FFT plans etc. and each stack needs to fit in one allocation.
+    size_t per_config = 3 * wave_size;
+    if (simManager->precalculateTransmission())
+        per_config += simManager->simulationCell()->sliceCount() * wave_size;
+    else
+        per_config += wave_size;
+
+    size_t budget = dev_memory / 2;
+    size_t n_configs = budget > fixed ? (budget - fixed) / per_config : 1;
+    n_configs = std::min(n_configs, dev_memory / 4 / wave_size);
+    n_configs = std::max<size_t>(std::min<size_t>(n_configs, iterations), 1);
+
+    simManager->setPhononBatchSize(static_cast<unsigned int>(n_configs));
+
+    CLOG(DEBUG, "gui") << "Batching " << n_configs << " phonon configurations per job";
+}
@@ -43,6 +43,18 @@ private:
     bool use_double_precision;
 
     std::vector<std::shared_ptr<SimulationJob>> SplitJobs(std::shared_ptr<SimulationManager> simManager);
+
+    // works out how many STEM pixels can be in each tile from the device memory
+    void calculateStemTileSize(const std::shared_ptr<SimulationManager> &simManager);
+
+    // uses the normal parallel STEM if the PRISM S-matrix would not fit on the devices
+    void checkPrismMemory(const std::shared_ptr<SimulationManager> &simManager);
+
+    // works out how many phonon configurations can be batched into each CTEM/CBED job from the device memory
+    void calculatePhononBatchSize(const std::shared_ptr<SimulationManager> &simManager);
+
+    // opens the file the 4D-STEM diffraction patterns are streamed to, the writer is shared through the manager
+    void openStem4DFile(const std::shared_ptr<SimulationManager> &simManager);
 };
 
 
@@ -3,14 +3,32 @@
 //
 
 #include "threadpool.h"
+
+#include <algorithm>
+
 #include "microscope/simulationworker.h"
+#include "microscope/simulationnative.h"
 
 // the constructor just launches some amount of workers
 ThreadPool::ThreadPool(std::vector<clDevice> devList, int num_jobs, bool double_precision) : stop(false)
 {
     size_t n_threads = std::min(devList.size(), (size_t) num_jobs);
+
+    // these need to exist before the workers start
+    worker_tasks.resize(n_threads);
+    job_times.resize(n_threads, 0.0);
+    jobs_done.resize(n_threads, 0);
+    worker_busy.resize(n_threads, false);
+    job_starts.resize(n_threads);
+
     for(unsigned int i = 0; i < n_threads; ++i) { // TODO: depends what is lower, n jobs or n devices
-        if (double_precision)
+        if (devList[i].isNative()) {
+            // the native 'device' runs on the host, so it doesn't need any OpenCL context
+            if (double_precision)
+                workers.emplace_back(std::thread(std::move(SimulationNative<double>(devList[i], *this, i))));
+            else
+                workers.emplace_back(std::thread(std::move(SimulationNative<float>(devList[i], *this, i))));
+        } else if (double_precision)
             workers.emplace_back(std::thread(std::move(SimulationWorker<double>(devList[i], *this, i))));
         else
             workers.emplace_back(std::thread(std::move(SimulationWorker<float>(devList[i], *this, i))));
@@ -40,6 +58,12 @@ void ThreadPool::stopThreads()
     for (auto &task : tasks)
         task->promise.set_value();
     tasks.clear();
+
+    for (auto &queue : worker_tasks) {
+        for (auto &task : queue)
+            task->promise.set_value();
+        queue.clear();
+    }
 }
 
 auto ThreadPool::enqueue(std::shared_ptr<SimulationJob> job) -> std::future<void> {
@@ -54,7 +78,100 @@ auto ThreadPool::enqueue(std::shared_ptr<SimulationJob> job) -> std::future<void
         tasks.push_back(job);
     } // release lock
 
-    // wake up one thread
-    condition.notify_one();
+    // wake up all the threads (the first to wake might leave this job for a faster one)
+    condition.notify_all();
     return res;
 }
+
+double ThreadPool::remainingTime(unsigned int worker_id, std::chrono::steady_clock::time_point now) {
+    if (!worker_busy[worker_id])
+        return 0.0;
+    double elapsed = std::chrono::duration<double>(now - job_starts[worker_id]).count();
+    return std::max(job_times[worker_id] - elapsed, 0.0);
+}
+
+std::shared_ptr<SimulationJob> ThreadPool::nextTask(unsigned int worker_id) {
+    auto now = std::chrono::steady_clock::now();
+    auto &own = worker_tasks[worker_id];
+    double own_time = job_times[worker_id];
+
+    if (own.empty() && !tasks.empty()) {
+        // take a share of what is left depending on how fast we are (half of it, so there is still some to balance
+        // out at the end). Until we know how fast we are, just take one at a time.
+        size_t chunk = 1;
+        if (own_time > 0.0) {
+            double total_rate = 0.0;
+            for (double t : job_times)
+                total_rate += (t > 0.0) ? 1.0 / t : 1.0 / own_time;
+            double share = (1.0 / own_time) / total_rate;
+            chunk = std::max<size_t>(static_cast<size_t>(0.5 * share * tasks.size()), 1);
+        }
+
+        // Near the end, don't take the last jobs if another (busy) worker would still finish them sooner
+        if (chunk == 1 && own_time > 0.0 && tasks.size() < job_times.size()) {
+            for (unsigned int i = 0; i < job_times.size(); ++i) {
+                if (i == worker_id || job_times[i] <= 0.0)
+                    continue;
+                double other_finish = remainingTime(i, now) + job_times[i] * (worker_tasks[i].size() + 1);
+                if (other_finish < own_time)
+                    return nullptr;
+            }
+        }
+
+        for (size_t i = 0; i < chunk && !tasks.empty(); ++i) {
+            own.push_back(std::move(tasks.front()));
+            tasks.pop_front();
+        }
+    }
+
+    if (own.empty()) {
+        // steal from the worker that has the most queued work (by time)
+        int victim = -1;
+        double victim_time = 0.0;
+        for (unsigned int i = 0; i < worker_tasks.size(); ++i) {
+            if (i == worker_id || worker_tasks[i].empty())
+                continue;
+            // if we don't know how fast the other worker is, assume it is the same speed as us
+            double t = job_times[i] > 0.0 ? job_times[i] : own_time;
+            double queued = remainingTime(i, now) + t * worker_tasks[i].size();
+            if (victim < 0 || queued > victim_time) {
+                victim = i;
+                victim_time = queued;
+            }
+        }
+
+        if (victim < 0)
+            return nullptr;
+
+        // only steal if we would finish the job before the owner would get to it
+        if (own_time > 0.0 && job_times[victim] > 0.0 && own_time >= victim_time)
+            return nullptr;
+
+        // take the job the owner would do last
+        own.push_back(std::move(worker_tasks[victim].back()));
+        worker_tasks[victim].pop_back();
+    }
+
+    auto task = std::move(own.front());
+    own.pop_front();
+
+    worker_busy[worker_id] = true;
+    job_starts[worker_id] = now;
+    return task;
+}
+
+void ThreadPool::finishedTask(unsigned int worker_id) {
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - job_starts[worker_id]).count();
+
+    // the first job also includes building the kernels, loading the binary cache and tuning them, so it would make
+    // this worker look much slower than it is (keep updating this after as it can change)
+    if (jobs_done[worker_id] > 0) {
+        if (job_times[worker_id] > 0.0)
+            job_times[worker_id] = 0.5 * (job_times[worker_id] + t);
+        else
+            job_times[worker_id] = t;
+    }
+
+    ++jobs_done[worker_id];
+    worker_busy[worker_id] = false;
+}
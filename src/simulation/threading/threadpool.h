@@ -10,6 +10,7 @@
 #include <condition_variable>
 #include <vector>
 #include <deque>
+#include <chrono>
 #include <clwrapper/clwrapper.h>
 #include <future>
 //#include "threadworker.h"
@@ -39,8 +40,27 @@ private:
 
     std::vector<std::thread> workers;
 
+    // Jobs that have not been given to a worker yet. Workers take these in chunks sized by how fast they are compared
+    // to the other workers (so the chunks get smaller towards the end) and put them in their own queue.
     std::deque<std::shared_ptr<SimulationJob>> tasks;
 
+    // the jobs each worker has taken, idle workers can steal from the back of these
+    std::vector<std::deque<std::shared_ptr<SimulationJob>>> worker_tasks;
+
+    // average time (in seconds) each worker takes for a job (0 until it has done one after its first)
+    std::vector<double> job_times;
+    std::vector<unsigned int> jobs_done;
+    std::vector<bool> worker_busy;
+    std::vector<std::chrono::steady_clock::time_point> job_starts;
+
+    // These must be called with the queue_mutex locked. Returns nullptr if there is nothing this worker should do right
+    // now (i.e. a faster worker would finish the job sooner even though it is busy)
+    std::shared_ptr<SimulationJob> nextTask(unsigned int worker_id);
+    void finishedTask(unsigned int worker_id);
+
+    // estimated time until the worker has finished its current job
+    double remainingTime(unsigned int worker_id, std::chrono::steady_clock::time_point now);
+
     std::mutex queue_mutex;
     std::condition_variable condition;
     bool stop;
@@ -14,18 +14,28 @@ void ThreadWorker::operator()()
             std::unique_lock<std::mutex> lock(pool.queue_mutex);
 
             // only proceed if we are stopping (so we can exit) or we have a task to do (so we can do it)
-            pool.condition.wait(lock, [this]{ return this->pool.stop || !this->pool.tasks.empty(); });
+            pool.condition.wait(lock, [this, &task]{
+                if (this->pool.stop)
+                    return true;
+                task = this->pool.nextTask(this->id);
+                return task != nullptr;
+            });
 
             if(pool.stop) // exit if the pool is stopped
                 return;
 
-            // get the task from the queue
-            task = std::move(pool.tasks.front());
-            pool.tasks.pop_front();
-
         }   // release lock
 
         // execute the task
         Run(task);
+        task.reset();
+
+        {
+            std::unique_lock<std::mutex> lock(pool.queue_mutex);
+            pool.finishedTask(id);
+        }
+
+        // other workers might have been waiting for us to finish (or can now steal from us)
+        pool.condition.notify_all();
     }
-}
\ No newline at end of file
+}
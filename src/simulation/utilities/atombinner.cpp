@@ -0,0 +1,146 @@
+#include "atombinner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace {
+    // below this it is not worth starting any threads
+    const size_t min_atoms_per_thread = 65536;
+
+    template <class F>
+    void runChunks(size_t n_chunks, size_t n, F func) {
+        size_t chunk = (n + n_chunks - 1) / n_chunks;
+
+        std::vector<std::thread> threads;
+        threads.reserve(n_chunks - 1);
+        for (size_t t = 1; t < n_chunks; ++t)
+            threads.emplace_back(func, t, std::min(t * chunk, n), std::min((t + 1) * chunk, n));
+
+        // this thread does the first chunk
+        func(0, 0, std::min(chunk, n));
+
+        for (auto &th : threads)
+            th.join();
+    }
+}
+
+template <class T>
+void AtomBinner<T>::setGrid(double _min_x, double _max_x, double _min_y, double _max_y, double _max_z, double _dz,
+                            unsigned int _blocks_x, unsigned int _blocks_y, unsigned int _n_slices) {
+    // same precision as the simulation (this used to be done by a kernel)
+    min_x = static_cast<T>(_min_x);
+    max_x = static_cast<T>(_max_x);
+    min_y = static_cast<T>(_min_y);
+    max_y = static_cast<T>(_max_y);
+    max_z = static_cast<T>(_max_z);
+    dz = static_cast<T>(_dz);
+    blocks_x = _blocks_x;
+    blocks_y = _blocks_y;
+    n_slices = _n_slices;
+}
+
+template <class T>
+void AtomBinner<T>::clear(size_t _out_size) {
+    out_size = _out_size;
+
+    in_x.clear();
+    in_y.clear();
+    in_z.clear();
+    in_a.clear();
+
+    in_x.reserve(out_size);
+    in_y.reserve(out_size);
+    in_z.reserve(out_size);
+    in_a.reserve(out_size);
+}
+
+template <class T>
+int AtomBinner<T>::binId(T x, T y, T z) const {
+    if (x < min_x || x > max_x || y < min_y || y > max_y)
+        return -1;
+
+    // get the fractional position of the atoms (in the structure), times by the number of blocks and floor
+    auto bidx = static_cast<int>(std::floor((x - min_x) / (max_x - min_x) * blocks_x));
+    auto bidy = static_cast<int>(std::floor((y - min_y) / (max_y - min_y) * blocks_y));
+    // This sorts the top atoms (largest z) to be the first atoms (i.e. we simulate top down)
+    auto zid = static_cast<int>(std::floor((max_z - z) / dz));
+
+    // account for any edge cases that are exactly on the limit
+    zid -= (zid == static_cast<int>(n_slices));
+    bidx -= (bidx == static_cast<int>(blocks_x));
+    bidy -= (bidy == static_cast<int>(blocks_y));
+
+    if (zid < 0 || zid >= static_cast<int>(n_slices) || bidx < 0 || bidy < 0)
+        return -1;
+
+    return (zid * static_cast<int>(blocks_y) + bidy) * static_cast<int>(blocks_x) + bidx;
+}
+
+template <class T>
+void AtomBinner<T>::sort() {
+    size_t n_atoms = in_a.size();
+    size_t n_bins = static_cast<size_t>(n_slices) * blocks_x * blocks_y;
+
+    size_t n_threads = std::max(1u, std::thread::hardware_concurrency());
+    n_threads = std::max(static_cast<size_t>(1), std::min(n_threads, n_atoms / min_atoms_per_thread));
+
+    bin_ids.resize(n_atoms);
+    thread_counts.assign(n_threads * n_bins, 0);
+
+    // get the bin of every atom and count how many are in each bin (for each thread's chunk)
+    runChunks(n_threads, n_atoms, [this, n_bins](size_t t, size_t begin, size_t end) {
+        int *counts = thread_counts.data() + t * n_bins;
+        for (size_t i = begin; i < end; ++i) {
+            int b = binId(in_x[i], in_y[i], in_z[i]);
+            bin_ids[i] = b;
+            if (b >= 0)
+                ++counts[b];
+        }
+    });
+
+    // turn the counts into the offsets each thread writes to, threads in order within each bin keeps the sort stable
+    block_starts.resize(n_bins + 1);
+    int total = 0;
+    for (size_t b = 0; b < n_bins; ++b) {
+        block_starts[b] = total;
+        for (size_t t = 0; t < n_threads; ++t) {
+            int c = thread_counts[t * n_bins + b];
+            thread_counts[t * n_bins + b] = total;
+            total += c;
+        }
+    }
+    // Last element indicates end of last block as total number of atoms.
+    block_starts[n_bins] = total;
+
+    // zero the padding so it is the same each time (the arrays are also used to identify the atoms)
+    size_t n_out = std::max(static_cast<size_t>(total), out_size);
+    out_x.resize(n_out);
+    out_y.resize(n_out);
+    out_z.resize(n_out);
+    out_a.resize(n_out);
+    out_i.resize(n_out);
+    std::fill(out_x.begin() + total, out_x.end(), T(0));
+    std::fill(out_y.begin() + total, out_y.end(), T(0));
+    std::fill(out_z.begin() + total, out_z.end(), T(0));
+    std::fill(out_a.begin() + total, out_a.end(), 0);
+    std::fill(out_i.begin() + total, out_i.end(), 0);
+
+    runChunks(n_threads, n_atoms, [this, n_bins](size_t t, size_t begin, size_t end) {
+        int *offsets = thread_counts.data() + t * n_bins;
+        for (size_t i = begin; i < end; ++i) {
+            int b = bin_ids[i];
+            if (b < 0)
+                continue;
+            int p = offsets[b]++;
+            out_x[p] = in_x[i];
+            out_y[p] = in_y[i];
+            out_z[p] = in_z[i];
+            out_a[p] = in_a[i];
+            out_i[p] = static_cast<int>(i);
+        }
+    });
+}
+
+template class AtomBinner<float>;
+template class AtomBinner<double>;
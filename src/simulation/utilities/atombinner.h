@@ -0,0 +1,65 @@
+#ifndef CLTEM_ATOMBINNER_H
+#define CLTEM_ATOMBINNER_H
+
+#include <cstddef>
+#include <vector>
+
+// Sorts the atoms into the blocks (x, y) and slices (z) used by the potential kernels. This is a counting sort over
+// flat arrays (split over a few threads for large structures) so the atoms are binned in one pass without any
+// nested vectors. The arrays are kept between calls so re-sorting (i.e. for frozen phonon) does not reallocate.
+// Output is ordered by z then y then x and keeps the original order of the atoms within each bin.
+template <class T>
+class AtomBinner
+{
+public:
+    AtomBinner() : min_x(0), max_x(0), min_y(0), max_y(0), max_z(0), dz(1), blocks_x(1), blocks_y(1), n_slices(1),
+                   out_size(0) {}
+
+    void setGrid(double _min_x, double _max_x, double _min_y, double _max_y, double _max_z, double _dz,
+                 unsigned int _blocks_x, unsigned int _blocks_y, unsigned int _n_slices);
+
+    // clears the input atoms (keeping the memory), the sorted arrays will be at least out_size long (padded with zeros)
+    // so they can be written straight to buffers sized for all the atoms
+    void clear(size_t _out_size = 0);
+
+    void addAtom(T x, T y, T z, int a) {
+        in_x.push_back(x);
+        in_y.push_back(y);
+        in_z.push_back(z);
+        in_a.push_back(a);
+    }
+
+    // sorts the atoms that have been added, atoms outside the grid are dropped
+    void sort();
+
+    std::vector<T>& sortedX() {return out_x;}
+    std::vector<T>& sortedY() {return out_y;}
+    std::vector<T>& sortedZ() {return out_z;}
+    std::vector<int>& sortedA() {return out_a;}
+
+    // where each sorted atom was in the order they were added
+    std::vector<int>& sortedIndex() {return out_i;}
+
+    // start of each bin in the sorted arrays, with the total atom count as the last entry
+    std::vector<int>& blockStartPositions() {return block_starts;}
+
+private:
+    T min_x, max_x, min_y, max_y, max_z, dz;
+    unsigned int blocks_x, blocks_y, n_slices;
+    size_t out_size;
+
+    std::vector<T> in_x, in_y, in_z;
+    std::vector<int> in_a;
+
+    std::vector<int> bin_ids;
+    // the bin counts (then offsets) for each thread, thread major
+    std::vector<int> thread_counts;
+
+    std::vector<T> out_x, out_y, out_z;
+    std::vector<int> out_a, out_i;
+    std::vector<int> block_starts;
+
+    int binId(T x, T y, T z) const;
+};
+
+#endif //CLTEM_ATOMBINNER_H
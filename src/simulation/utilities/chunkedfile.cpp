@@ -0,0 +1,368 @@
+#include "chunkedfile.h"
+
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+#include <zlib.h>
+
+#include "json.hpp"
+
+namespace fileio
+{
+    namespace {
+        const char chunked_magic[4] = {'C', 'L', 'T', 'C'};
+        const uint32_t chunked_version = 1;
+
+        template <class T>
+        void appendValue(std::vector<char> &buffer, T value) {
+            auto p = reinterpret_cast<const char*>(&value);
+            buffer.insert(buffer.end(), p, p + sizeof(T));
+        }
+
+        template <class T>
+        bool readFromFile(std::ifstream &f, T &value) {
+            return static_cast<bool>(f.read(reinterpret_cast<char*>(&value), sizeof(T)));
+        }
+    }
+
+    size_t ChunkedDataset::chunkSize() const {
+        return std::accumulate(chunk.begin(), chunk.end(), static_cast<size_t>(1), std::multiplies<>());
+    }
+
+    ChunkedFileWriter::ChunkedFileWriter(size_t max_queued_mb) : queued_bytes(0),
+            max_queued_bytes(max_queued_mb * 1024 * 1024), in_progress(0), stop(false) {}
+
+    ChunkedFileWriter::~ChunkedFileWriter() {
+        try {
+            close();
+        } catch (const std::exception &e) {}
+    }
+
+    void ChunkedFileWriter::open(const std::string &path, bool append) {
+        close();
+
+        std::lock_guard<std::mutex> lock(dataset_mutex);
+        datasets.clear();
+        if (append) {
+            // carry on numbering the datasets from what is already there
+            std::ifstream test(path, std::ios::binary);
+            if (test.good()) {
+                test.close();
+                ChunkedFileReader existing(path);
+                datasets = existing.datasets();
+            } else
+                append = false;
+        }
+
+        auto mode = std::ios::binary | std::ios::out | (append ? std::ios::app : std::ios::trunc);
+        file.open(path, mode);
+        if (!file.is_open())
+            throw std::runtime_error("Could not open chunked file for writing: " + path);
+        file_path = path;
+
+        if (!append) {
+            file.write(chunked_magic, 4);
+            file.write(reinterpret_cast<const char*>(&chunked_version), sizeof(uint32_t));
+        }
+
+        stop = false;
+        error.clear();
+        writer = std::thread(&ChunkedFileWriter::writeLoop, this);
+    }
+
+    void ChunkedFileWriter::writeMetadata(const std::string &metadata) {
+        Item item{ChunkRecord::Metadata, 0, false, {}, {}, metadata};
+        enqueue(std::move(item));
+    }
+
+    uint32_t ChunkedFileWriter::addDataset(const std::string &name, const std::vector<uint64_t> &shape,
+                                           const std::vector<uint64_t> &chunk, bool compress,
+                                           const std::string &attributes) {
+        if (shape.size() != chunk.size())
+            throw std::runtime_error("Chunked dataset shape and chunk shape must have the same dimensions");
+
+        ChunkedDataset ds;
+        ds.name = name;
+        ds.shape = shape;
+        ds.chunk = chunk;
+        ds.compressed = compress;
+        ds.attributes = attributes;
+        {
+            std::lock_guard<std::mutex> lock(dataset_mutex);
+            ds.id = static_cast<uint32_t>(datasets.size());
+            datasets.push_back(ds);
+        }
+
+        nlohmann::json j;
+        j["name"] = ds.name;
+        j["id"] = ds.id;
+        j["type"] = "float32";
+        j["shape"] = ds.shape;
+        j["chunk"] = ds.chunk;
+        j["compression"] = compress ? "zlib" : "none";
+        if (!attributes.empty())
+            j["attributes"] = nlohmann::json::parse(attributes);
+
+        Item item{ChunkRecord::Dataset, ds.id, false, {}, {}, j.dump()};
+        enqueue(std::move(item));
+
+        return ds.id;
+    }
+
+    void ChunkedFileWriter::writeChunk(uint32_t dataset, const std::vector<uint64_t> &coords, std::vector<float> data) {
+        bool compress;
+        {
+            std::lock_guard<std::mutex> lock(dataset_mutex);
+            if (dataset >= datasets.size())
+                throw std::runtime_error("Writing chunk to unknown dataset");
+            auto &ds = datasets[dataset];
+            if (coords.size() != ds.shape.size())
+                throw std::runtime_error("Chunk coordinates do not match the dimensions of dataset: " + ds.name);
+            if (data.size() != ds.chunkSize())
+                throw std::runtime_error("Chunk data is not the chunk size of dataset: " + ds.name);
+            compress = ds.compressed;
+        }
+
+        Item item{ChunkRecord::Chunk, dataset, compress, coords, std::move(data), ""};
+        enqueue(std::move(item));
+    }
+
+    void ChunkedFileWriter::enqueue(Item item) {
+        if (!writer.joinable())
+            throw std::runtime_error("Chunked file is not open");
+        checkError();
+
+        size_t bytes = item.data.size() * sizeof(float) + item.text.size();
+
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        // always let one item through, however big it is
+        queue_cond.wait(lock, [this, bytes]{ return queue.empty() || queued_bytes + bytes <= max_queued_bytes || !error.empty(); });
+        queued_bytes += bytes;
+        queue.push_back(std::move(item));
+        lock.unlock();
+        queue_cond.notify_all();
+    }
+
+    void ChunkedFileWriter::writeLoop() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cond.wait(lock, [this]{ return stop || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            Item item = std::move(queue.front());
+            queue.pop_front();
+            ++in_progress;
+            size_t bytes = item.data.size() * sizeof(float) + item.text.size();
+            lock.unlock();
+
+            std::string err;
+            try {
+                writeItem(item);
+            } catch (const std::exception &e) {
+                err = e.what();
+            }
+
+            lock.lock();
+            --in_progress;
+            queued_bytes -= bytes;
+            if (!err.empty() && error.empty())
+                error = err;
+            lock.unlock();
+            queue_cond.notify_all();
+        }
+    }
+
+    void ChunkedFileWriter::writeItem(Item &item) {
+        // an error means the file is no good, so just drain the queue
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (!error.empty())
+                return;
+        }
+
+        std::vector<char> payload;
+        if (item.type == ChunkRecord::Chunk) {
+            appendValue<uint32_t>(payload, item.dataset);
+            appendValue<uint32_t>(payload, static_cast<uint32_t>(item.coords.size()));
+            for (auto c : item.coords)
+                appendValue<uint64_t>(payload, c);
+
+            auto raw = reinterpret_cast<const Bytef*>(item.data.data());
+            uLong raw_size = item.data.size() * sizeof(float);
+            appendValue<uint64_t>(payload, raw_size);
+
+            size_t header = payload.size();
+            if (item.compress) {
+                uLongf out_size = compressBound(raw_size);
+                payload.resize(header + out_size);
+                // level 1 as this needs to keep up with the simulation (and diffraction patterns compress well anyway)
+                if (compress2(reinterpret_cast<Bytef*>(payload.data() + header), &out_size, raw, raw_size, 1) != Z_OK)
+                    throw std::runtime_error("Could not compress chunk");
+                payload.resize(header + out_size);
+            } else
+                payload.insert(payload.end(), reinterpret_cast<const char*>(raw), reinterpret_cast<const char*>(raw) + raw_size);
+        } else
+            payload.assign(item.text.begin(), item.text.end());
+
+        auto type = static_cast<uint32_t>(item.type);
+        auto size = static_cast<uint64_t>(payload.size());
+        file.write(reinterpret_cast<const char*>(&type), sizeof(uint32_t));
+        file.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
+        file.write(payload.data(), payload.size());
+
+        if (!file.good())
+            throw std::runtime_error("Could not write to chunked file: " + file_path);
+    }
+
+    void ChunkedFileWriter::flush() {
+        if (!writer.joinable())
+            return;
+
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_cond.wait(lock, [this]{ return queue.empty() && in_progress == 0; });
+        lock.unlock();
+
+        file.flush();
+        checkError();
+    }
+
+    void ChunkedFileWriter::close() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                stop = true;
+            }
+            queue_cond.notify_all();
+            writer.join();
+        }
+
+        if (file.is_open())
+            file.close();
+
+        checkError();
+    }
+
+    void ChunkedFileWriter::checkError() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (!error.empty())
+            throw std::runtime_error(error);
+    }
+
+    ChunkedFileReader::ChunkedFileReader(const std::string &path) {
+        file.open(path, std::ios::binary);
+        if (!file.is_open())
+            throw std::runtime_error("Could not open chunked file: " + path);
+
+        char magic[4];
+        uint32_t version;
+        if (!file.read(magic, 4) || !std::equal(magic, magic + 4, chunked_magic) || !readFromFile(file, version))
+            throw std::runtime_error("Not a chunked file: " + path);
+        if (version > chunked_version)
+            throw std::runtime_error("Chunked file is a newer version (" + std::to_string(version) + "): " + path);
+
+        file.seekg(0, std::ios::end);
+        auto file_size = static_cast<uint64_t>(file.tellg());
+        uint64_t pos = 4 + sizeof(uint32_t);
+
+        uint32_t type;
+        uint64_t size;
+        while (pos + sizeof(uint32_t) + sizeof(uint64_t) <= file_size) {
+            file.seekg(pos);
+            if (!readFromFile(file, type) || !readFromFile(file, size))
+                break;
+            uint64_t start = pos + sizeof(uint32_t) + sizeof(uint64_t);
+            if (start + size > file_size)
+                break;
+
+            if (type == static_cast<uint32_t>(ChunkRecord::Chunk)) {
+                // only need the header, the data is read when it is asked for
+                uint32_t id, n_dims;
+                readFromFile(file, id);
+                readFromFile(file, n_dims);
+                std::vector<uint64_t> coords(n_dims);
+                for (auto &c : coords)
+                    readFromFile(file, c);
+                uint64_t raw_size;
+                readFromFile(file, raw_size);
+
+                uint64_t header = 2 * sizeof(uint32_t) + (n_dims + 1) * sizeof(uint64_t);
+                if (!file.good() || header > size)
+                    break;
+                // a later chunk at the same place replaces an earlier one
+                chunks[{id, coords}] = {start + header, size - header, raw_size};
+            } else if (type == static_cast<uint32_t>(ChunkRecord::Metadata) ||
+                       type == static_cast<uint32_t>(ChunkRecord::Dataset)) {
+                std::string text(size, '\0');
+                if (!file.read(&text[0], size))
+                    break;
+
+                if (type == static_cast<uint32_t>(ChunkRecord::Metadata))
+                    meta = text;
+                else {
+                    auto j = nlohmann::json::parse(text);
+                    ChunkedDataset ds;
+                    ds.name = j["name"].get<std::string>();
+                    ds.id = j["id"].get<uint32_t>();
+                    ds.shape = j["shape"].get<std::vector<uint64_t>>();
+                    ds.chunk = j["chunk"].get<std::vector<uint64_t>>();
+                    ds.compressed = j["compression"].get<std::string>() == "zlib";
+                    if (j.count("attributes") > 0)
+                        ds.attributes = j["attributes"].dump();
+                    if (j["type"].get<std::string>() != "float32")
+                        throw std::runtime_error("Unsupported chunked dataset type: " + j["type"].get<std::string>());
+                    dataset_list.push_back(ds);
+                }
+            }
+            // unknown records are skipped (so newer versions can add to the format)
+
+            pos = start + size;
+        }
+
+        file.clear();
+    }
+
+    const ChunkedDataset& ChunkedFileReader::dataset(const std::string &name) {
+        for (auto it = dataset_list.rbegin(); it != dataset_list.rend(); ++it)
+            if (it->name == name)
+                return *it;
+        throw std::runtime_error("Chunked file does not contain dataset: " + name);
+    }
+
+    bool ChunkedFileReader::hasChunk(uint32_t dataset, const std::vector<uint64_t> &coords) {
+        return chunks.find({dataset, coords}) != chunks.end();
+    }
+
+    std::vector<float> ChunkedFileReader::readChunk(uint32_t dataset, const std::vector<uint64_t> &coords) {
+        auto it = chunks.find({dataset, coords});
+        if (it == chunks.end())
+            throw std::runtime_error("Chunk has not been written");
+
+        const ChunkedDataset *ds = nullptr;
+        for (auto &d : dataset_list)
+            if (d.id == dataset)
+                ds = &d;
+        if (!ds)
+            throw std::runtime_error("Chunk belongs to unknown dataset");
+
+        auto &loc = it->second;
+        std::vector<char> stored(loc.size);
+        file.seekg(loc.offset);
+        if (!file.read(stored.data(), loc.size))
+            throw std::runtime_error("Could not read chunk");
+
+        std::vector<float> out(loc.raw_size / sizeof(float));
+        if (ds->compressed) {
+            uLongf out_size = loc.raw_size;
+            if (uncompress(reinterpret_cast<Bytef*>(out.data()), &out_size, reinterpret_cast<const Bytef*>(stored.data()), loc.size) != Z_OK || out_size != loc.raw_size)
+                throw std::runtime_error("Could not decompress chunk");
+        } else {
+            if (loc.size != loc.raw_size)
+                throw std::runtime_error("Uncompressed chunk is the wrong size");
+            std::copy(stored.begin(), stored.end(), reinterpret_cast<char*>(out.data()));
+        }
+
+        return out;
+    }
+}
@@ -0,0 +1,149 @@
+#ifndef CLTEM_CHUNKEDFILE_H
+#define CLTEM_CHUNKEDFILE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A simple chunked (and zlib compressed) container for outputs that are made a piece at a time (i.e. 4D-STEM or stacks
+// of images).
+// The file is a header ("CLTC" and a version) then a list of records, each of which is a type, a size and the data:
+//  - metadata: a JSON string (the last one in the file is used)
+//  - dataset: a JSON description of a float32 array (name, id, shape, chunk shape, compression and any attributes)
+//  - chunk: the dataset id, the chunk coordinates (in units of chunks) and the (compressed) data
+// Records are only ever appended, so the file can be read while it is being written (or if the simulation stopped
+// part way through) and a file can be opened again to add to it. Chunks can be written in any order and a later dataset
+// with the same name replaces an earlier one (i.e. when the images are updated during a simulation).
+
+namespace fileio
+{
+    enum class ChunkRecord : uint32_t {
+        Metadata = 1,
+        Dataset = 2,
+        Chunk = 3
+    };
+
+    struct ChunkedDataset {
+        std::string name;
+        uint32_t id = 0;
+        std::vector<uint64_t> shape;
+        std::vector<uint64_t> chunk;
+        bool compressed = true;
+        // JSON (empty if there are none)
+        std::string attributes;
+
+        // number of floats in each (full) chunk
+        size_t chunkSize() const;
+    };
+
+    // Writes the records on a background thread (that also does the compression) so the simulation can carry on. The
+    // queue is bounded, so if the disk can't keep up, writeChunk will wait instead of using all the memory.
+    class ChunkedFileWriter
+    {
+    public:
+        explicit ChunkedFileWriter(size_t max_queued_mb = 256);
+
+        ~ChunkedFileWriter();
+
+        ChunkedFileWriter(const ChunkedFileWriter&) = delete;
+        ChunkedFileWriter& operator=(const ChunkedFileWriter&) = delete;
+
+        // opens the file (an existing file is added to if append is true, it is overwritten otherwise)
+        void open(const std::string &path, bool append = false);
+
+        bool isOpen() {return file.is_open();}
+
+        std::string path() {return file_path;}
+
+        void writeMetadata(const std::string &metadata);
+
+        // returns the id of the new dataset, the attributes are JSON (e.g. the settings for this image)
+        uint32_t addDataset(const std::string &name, const std::vector<uint64_t> &shape,
+                            const std::vector<uint64_t> &chunk, bool compress = true,
+                            const std::string &attributes = "");
+
+        // coords are in units of the chunk shape, data is the whole chunk (in row major order)
+        void writeChunk(uint32_t dataset, const std::vector<uint64_t> &coords, std::vector<float> data);
+
+        // waits for everything queued so far to be on the disk
+        void flush();
+
+        // flushes and closes the file, any error from the background thread is thrown here (or from the next write)
+        void close();
+
+    private:
+        struct Item {
+            ChunkRecord type;
+            uint32_t dataset;
+            bool compress;
+            std::vector<uint64_t> coords;
+            std::vector<float> data;
+            std::string text;
+        };
+
+        std::string file_path;
+        std::ofstream file;
+
+        // the writes can come from any thread
+        std::vector<ChunkedDataset> datasets;
+        std::mutex dataset_mutex;
+
+        std::thread writer;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cond;
+        std::deque<Item> queue;
+        size_t queued_bytes;
+        size_t max_queued_bytes;
+        // the number of items the writer has taken but not finished
+        unsigned int in_progress;
+        bool stop;
+        std::string error;
+
+        void enqueue(Item item);
+
+        void writeLoop();
+
+        void writeItem(Item &item);
+
+        void checkError();
+    };
+
+    class ChunkedFileReader
+    {
+    public:
+        // reads the record list (not the chunks), any incomplete record at the end of the file is ignored
+        explicit ChunkedFileReader(const std::string &path);
+
+        std::string metadata() {return meta;}
+
+        const std::vector<ChunkedDataset>& datasets() {return dataset_list;}
+
+        // finds the latest dataset with this name
+        const ChunkedDataset& dataset(const std::string &name);
+
+        bool hasChunk(uint32_t dataset, const std::vector<uint64_t> &coords);
+
+        // reads (and decompresses) one chunk, throws if the chunk was never written
+        std::vector<float> readChunk(uint32_t dataset, const std::vector<uint64_t> &coords);
+
+    private:
+        struct ChunkLocation {
+            uint64_t offset;
+            uint64_t size;
+            uint64_t raw_size;
+        };
+
+        std::ifstream file;
+        std::string meta;
+        std::vector<ChunkedDataset> dataset_list;
+        std::map<std::pair<uint32_t, std::vector<uint64_t>>, ChunkLocation> chunks;
+    };
+}
+
+#endif //CLTEM_CHUNKEDFILE_H
@@ -0,0 +1,115 @@
+#include "deviceprofiles.h"
+
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#include "json.hpp"
+#include "utilities/logging.h"
+
+void DeviceProfiles::setDirectory(const std::string &directory) {
+    std::lock_guard<std::mutex> lck(mtx);
+    dir = directory;
+    profiles.clear();
+}
+
+bool DeviceProfiles::enabled() {
+    std::lock_guard<std::mutex> lck(mtx);
+    return !dir.empty();
+}
+
+std::string DeviceProfiles::fileName(clDevice &device) {
+    // the platform/device numbers can change, so the name is used (with anything awkward for a file name removed)
+    std::string name;
+    for (char c : device.GetPlatformName() + "_" + device.GetDeviceName())
+        name += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    return name + ".json";
+}
+
+DeviceProfiles::Profile& DeviceProfiles::load(clDevice &device) {
+    std::string file_name = fileName(device);
+
+    auto it = profiles.find(file_name);
+    if (it != profiles.end())
+        return it->second;
+
+    Profile &profile = profiles[file_name];
+    profile.device = device.GetDeviceName();
+    profile.driver = device.GetDriverVersion();
+
+    std::ifstream f((std::filesystem::path(dir) / file_name).string());
+    if (!f.is_open())
+        return profile;
+
+    try {
+        nlohmann::json j;
+        f >> j;
+
+        // the best settings might be different with a different driver, so just start again
+        if (j.at("driver").get<std::string>() != profile.driver)
+            return profile;
+
+        for (auto &k : j.at("kernels").items())
+            profile.kernels[k.key()] = k.value().get<std::vector<unsigned int>>();
+    } catch (const std::exception &e) {
+        CLOG(WARNING, "sim") << "Could not read device profile " << file_name << ": " << e.what();
+    }
+
+    return profile;
+}
+
+void DeviceProfiles::save(const std::string &file_name, const Profile &profile) {
+    nlohmann::json j;
+    j["device"] = profile.device;
+    j["driver"] = profile.driver;
+    j["kernels"] = nlohmann::json::object();
+    for (auto &k : profile.kernels)
+        j["kernels"][k.first] = k.second;
+
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+
+    // write to a temporary file and rename it so other processes never see a partial file
+    std::string path = (std::filesystem::path(dir) / file_name).string();
+    std::string temp_path = path + "." + std::to_string(std::random_device()()) + ".tmp";
+    {
+        std::ofstream f(temp_path);
+        if (!f.is_open()) {
+            CLOG(WARNING, "sim") << "Could not save device profile " << path;
+            return;
+        }
+        f << j.dump(4);
+    }
+
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec)
+        std::remove(temp_path.c_str());
+}
+
+bool DeviceProfiles::get(clDevice &device, const std::string &kernel, std::vector<unsigned int> &settings) {
+    std::lock_guard<std::mutex> lck(mtx);
+    if (dir.empty())
+        return false;
+
+    auto &profile = load(device);
+    auto it = profile.kernels.find(kernel);
+    if (it == profile.kernels.end())
+        return false;
+
+    settings = it->second;
+    return true;
+}
+
+void DeviceProfiles::put(clDevice &device, const std::string &kernel, const std::vector<unsigned int> &settings) {
+    std::lock_guard<std::mutex> lck(mtx);
+    if (dir.empty())
+        return;
+
+    // reload it in case another process has added to it
+    profiles.erase(fileName(device));
+    auto &profile = load(device);
+    profile.kernels[kernel] = settings;
+    save(fileName(device), profile);
+}
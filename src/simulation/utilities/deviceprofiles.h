@@ -0,0 +1,55 @@
+#ifndef CLTEM_DEVICEPROFILES_H
+#define CLTEM_DEVICEPROFILES_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "clwrapper/clwrapper.h"
+
+// Stores the tuned launch settings (i.e. the work group size) of each kernel for each device. The simulation benchmarks
+// the candidates the first time a kernel is used on a device and saves the fastest here, so later simulations (and
+// later runs, the profiles are saved as one .json file per device) can just use them.
+// A profile is ignored (and remade) if the driver version changes.
+class DeviceProfiles
+{
+public:
+    static DeviceProfiles& getInstance() { static DeviceProfiles instance; return instance; }
+
+    DeviceProfiles(DeviceProfiles const &) = delete;
+    DeviceProfiles &operator=(DeviceProfiles const &) = delete;
+
+    // an empty directory disables the tuning (the kernels use the default settings)
+    void setDirectory(const std::string &directory);
+
+    bool enabled();
+
+    // the settings are whatever the kernel needs (i.e. local sizes), returns false if this kernel hasn't been tuned
+    bool get(clDevice &device, const std::string &kernel, std::vector<unsigned int> &settings);
+
+    void put(clDevice &device, const std::string &kernel, const std::vector<unsigned int> &settings);
+
+private:
+    DeviceProfiles() = default;
+
+    struct Profile {
+        std::string device;
+        std::string driver;
+        std::map<std::string, std::vector<unsigned int>> kernels;
+    };
+
+    std::mutex mtx;
+    std::string dir;
+
+    // the profiles that have been loaded, by file name
+    std::map<std::string, Profile> profiles;
+
+    std::string fileName(clDevice &device);
+
+    Profile& load(clDevice &device);
+
+    void save(const std::string &file_name, const Profile &profile);
+};
+
+#endif //CLTEM_DEVICEPROFILES_H
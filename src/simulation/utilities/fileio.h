@@ -13,6 +13,7 @@
 #include <cmath>
 #include <iostream>
 #include <fstream>
+#include <type_traits>
 #include "tiffio.h"
 
 #include "json.hpp"
@@ -41,7 +42,7 @@ namespace fileio //D:
 //    }
 
     template <typename T_out, typename T_in>
-    void SaveTiff(const std::string &filepath, std::vector<T_in> data, unsigned int size_x, unsigned int size_y)
+    void SaveTiff(const std::string &filepath, const std::vector<T_in> &data, unsigned int size_x, unsigned int size_y)
     {
         if (size_x * size_y != data.size())
             throw std::runtime_error("Attempting to save image with incommensurate data size and image dimensions");
@@ -63,14 +64,19 @@ namespace fileio //D:
         TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
         TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
 
-        // virtually nothing supports 64-bit tiff so we will convert it here.
-        std::vector<T_out> buffer(data.size());
-
-        for (int i = 0; i < data.size(); ++i)
-            buffer[i] = static_cast<T_out>(data[i]);
+        // virtually nothing supports 64-bit tiff so we will convert it here (if it isn't already the right type)
+        tmsize_t written;
+        if constexpr (std::is_same<T_in, T_out>::value)
+            written = TIFFWriteEncodedStrip(out, 0, const_cast<T_out*>(data.data()), sizeof(T_out) * data.size());
+        else {
+            std::vector<T_out> buffer(data.begin(), data.end());
+            written = TIFFWriteEncodedStrip(out, 0, buffer.data(), sizeof(T_out) * buffer.size());
+        }
 
-        if( (TIFFWriteEncodedStrip(out, 0, &buffer[0], sizeof(float)*buffer.size())) == -1)
+        if (written == -1) {
+            TIFFClose(out);
             throw std::runtime_error("Unable to write data to .tif file");
+        }
 
         TIFFClose(out);
     }
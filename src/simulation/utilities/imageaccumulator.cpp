@@ -0,0 +1,28 @@
+#include "imageaccumulator.h"
+
+ImageAccumulator::ImageAccumulator(unsigned int w, unsigned int h, unsigned int d) : width(w), height(h), depth(d) {
+    size_t slice_size = static_cast<size_t>(w) * h;
+
+    data.reset(new std::atomic<double>[slice_size * d]);
+    weighting.reset(new std::atomic<double>[slice_size]);
+
+    for (size_t i = 0; i < slice_size * d; ++i)
+        data[i].store(0.0, std::memory_order_relaxed);
+    for (size_t i = 0; i < slice_size; ++i)
+        weighting[i].store(0.0, std::memory_order_relaxed);
+}
+
+Image<double> ImageAccumulator::image() const {
+    size_t slice_size = static_cast<size_t>(width) * height;
+
+    std::vector<std::vector<double>> slices(depth, std::vector<double>(slice_size));
+    for (unsigned int s = 0; s < depth; ++s)
+        for (size_t i = 0; i < slice_size; ++i)
+            slices[s][i] = data[s * slice_size + i].load(std::memory_order_relaxed);
+
+    std::vector<double> wt(slice_size);
+    for (size_t i = 0; i < slice_size; ++i)
+        wt[i] = weighting[i].load(std::memory_order_relaxed);
+
+    return Image<double>(slices, width, height, 0, 0, 0, 0, wt);
+}
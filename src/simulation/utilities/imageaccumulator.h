@@ -0,0 +1,47 @@
+#ifndef CLTEM_IMAGEACCUMULATOR_H
+#define CLTEM_IMAGEACCUMULATOR_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "commonstructs.h"
+
+// Sums the (sparse) pixel values from many jobs into one image stack. The adds are atomic so any number of workers can
+// add their pixels at the same time without taking a lock, and the full image is only made when it is asked for.
+class ImageAccumulator
+{
+public:
+    ImageAccumulator(unsigned int w, unsigned int h, unsigned int d);
+
+    ImageAccumulator(const ImageAccumulator&) = delete;
+    ImageAccumulator& operator=(const ImageAccumulator&) = delete;
+
+    unsigned int getWidth() const {return width;}
+    unsigned int getHeight() const {return height;}
+    unsigned int getDepth() const {return depth;}
+
+    void add(unsigned int slice, unsigned int pixel, double value) {
+        atomicAdd(data[static_cast<size_t>(slice) * width * height + pixel], value);
+    }
+
+    void addWeighting(unsigned int pixel, double value) {
+        atomicAdd(weighting[pixel], value);
+    }
+
+    // copy of the current sums (any adds that are happening at the same time may or may not be included)
+    Image<double> image() const;
+
+private:
+    unsigned int width, height, depth;
+
+    std::unique_ptr<std::atomic<double>[]> data;
+    std::unique_ptr<std::atomic<double>[]> weighting;
+
+    static void atomicAdd(std::atomic<double> &target, double value) {
+        double current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+    }
+};
+
+#endif //CLTEM_IMAGEACCUMULATOR_H
@@ -51,6 +51,24 @@ namespace JSONUtils {
         try { man.setPrecalculateTransmission( readJsonEntry<bool>(j, "precalculate transmission") );
         } catch (std::exception& e) {}
 
+        try { man.setFusedPropagation( readJsonEntry<bool>(j, "fused propagation") );
+        } catch (std::exception& e) {}
+
+        try { man.setTransmissionCacheSize( readJsonEntry<unsigned int>(j, "transmission cache", "size", "val") );
+        } catch (std::exception& e) {}
+
+        try { man.setTransmissionCacheDirectory( readJsonEntry<std::string>(j, "transmission cache", "directory") );
+        } catch (std::exception& e) {}
+
+        try { man.setAtomSlabSlices( readJsonEntry<unsigned int>(j, "atom slab slices") );
+        } catch (std::exception& e) {}
+
+        try { man.setQueueDepth( readJsonEntry<unsigned int>(j, "queue depth") );
+        } catch (std::exception& e) {}
+
+        try { man.setReciprocalPotentials( readJsonEntry<bool>(j, "reciprocal potentials") );
+        } catch (std::exception& e) {}
+
         try { man.setMaintainAreas( readJsonEntry<bool>(j, "maintain areas") );
         } catch (std::exception& e) {}
 
@@ -182,6 +200,13 @@ namespace JSONUtils {
         try { man.setCcdBinning(readJsonEntry<int>(j, "ctem", "ccd", "binning"));
         } catch (std::exception& e) {}
 
+        try { man.setDoseRealisations(readJsonEntry<unsigned int>(j, "ctem", "ccd", "realisations"));
+        } catch (std::exception& e) {}
+
+        // a random seed is used if this isn't given
+        try { man.setDoseSeed(readJsonEntry<uint64_t>(j, "ctem", "ccd", "seed"));
+        } catch (std::exception& e) {}
+
         try {
             auto xs = readJsonEntry<double>(j, "ctem", "area", "x", "start");
             auto xf = readJsonEntry<double>(j, "ctem", "area", "x", "finish");
@@ -224,6 +249,27 @@ namespace JSONUtils {
         try { man.setParallelStem(readJsonEntry<bool>(j, "stem", "static area", "enabled"));
         } catch (std::exception& e) {}
 
+        try { man.setStemTiling(readJsonEntry<bool>(j, "stem", "tiled area", "enabled"));
+        } catch (std::exception& e) {}
+
+        try { man.setStemPrism(readJsonEntry<bool>(j, "stem", "prism", "enabled"));
+        } catch (std::exception& e) {}
+
+        try { man.setPrismInterpolation(readJsonEntry<unsigned int>(j, "stem", "prism", "interpolation"));
+        } catch (std::exception& e) {}
+
+        try { man.setStem4D(readJsonEntry<bool>(j, "stem", "4d", "enabled"));
+        } catch (std::exception& e) {}
+
+        try { man.setStem4DBinning(readJsonEntry<unsigned int>(j, "stem", "4d", "binning"));
+        } catch (std::exception& e) {}
+
+        try { man.setStem4DCrop(readJsonEntry<bool>(j, "stem", "4d", "crop to band limit"));
+        } catch (std::exception& e) {}
+
+        try { man.setStem4DPath(readJsonEntry<std::string>(j, "stem", "4d", "file"));
+        } catch (std::exception& e) {}
+
         // detectors...
 
         try {
@@ -328,6 +374,9 @@ namespace JSONUtils {
         try { man.setForcePhononAtomResort(readJsonEntry<bool>(j, "incoherence", "inelastic scattering", "phonon", "force atom resort"));
         } catch (std::exception& e) {}
 
+        try { man.setPhononBatching(readJsonEntry<bool>(j, "incoherence", "inelastic scattering", "phonon", "batch configurations"));
+        } catch (std::exception& e) {}
+
         // plasmon
 
         try {
@@ -392,6 +441,10 @@ namespace JSONUtils {
         try { override_file = readJsonEntry<bool>(j, "incoherence", "inelastic scattering", "phonon", "override file");
         } catch (std::exception& e) {}
 
+        // a random seed is used if this isn't given
+        try { out_therms.setSeed(readJsonEntry<uint64_t>(j, "incoherence", "inelastic scattering", "phonon", "seed"));
+        } catch (std::exception& e) {}
+
         try { def = readJsonEntry<double>(j, "incoherence", "inelastic scattering", "phonon", "default", "value");
         } catch (std::exception& e) {}
 
@@ -514,6 +567,13 @@ namespace JSONUtils {
             j["full 3d"]["state"] = f3d;
 
         j["precalculate transmission"] = man.precalculateTransmission();
+        j["fused propagation"] = man.fusedPropagation();
+        j["transmission cache"]["size"]["val"] = man.transmissionCacheSize();
+        j["transmission cache"]["size"]["units"] = "MB";
+        j["transmission cache"]["directory"] = man.transmissionCacheDirectory();
+        j["atom slab slices"] = man.atomSlabSlices();
+        j["queue depth"] = man.queueDepth();
+        j["reciprocal potentials"] = man.reciprocalPotentials();
 
         //
         //
@@ -612,6 +672,9 @@ namespace JSONUtils {
                     j["ctem"]["ccd"]["dose"]["val"] = man.ccdDose();
                     j["ctem"]["ccd"]["dose"]["units"] = "e- per square Å";
                     j["ctem"]["ccd"]["binning"] = man.ccdBinning();
+                    j["ctem"]["ccd"]["realisations"] = man.doseRealisations();
+                    if (man.doseSeedFixed())
+                        j["ctem"]["ccd"]["seed"] = man.doseSeed();
                 } else {
                     j["ctem"]["ccd"] = "Perfect";
                 }
@@ -643,6 +706,13 @@ namespace JSONUtils {
 
             j["stem"]["static area"]["concurrent pixels"] = man.parallelPixels();
             j["stem"]["static area"]["enabled"] = man.parallelStem();
+            j["stem"]["tiled area"]["enabled"] = man.stemTiling();
+            j["stem"]["prism"]["enabled"] = man.stemPrism();
+            j["stem"]["prism"]["interpolation"] = man.prismInterpolation();
+            j["stem"]["4d"]["enabled"] = man.stem4D();
+            j["stem"]["4d"]["binning"] = man.stem4DBinning();
+            j["stem"]["4d"]["crop to band limit"] = man.stem4DCrop();
+            j["stem"]["4d"]["file"] = man.stem4DPath();
         }
 
         // If CBED, get position info
@@ -725,6 +795,9 @@ namespace JSONUtils {
             }
 
             j["incoherence"]["inelastic scattering"]["phonon"]["force atom resort"] = man.forcePhononAtomResort();
+            j["incoherence"]["inelastic scattering"]["phonon"]["batch configurations"] = man.phononBatching();
+            if (man.incoherenceEffects()->phonons()->seedFixed())
+                j["incoherence"]["inelastic scattering"]["phonon"]["seed"] = man.incoherenceEffects()->phonons()->getSeed();
         }
 
         // plasmon
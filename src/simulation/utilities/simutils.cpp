@@ -3,6 +3,8 @@
 //
 
 #include "simutils.h"
+#include "chunkedfile.h"
+#include "jsonutils.h"
 
 namespace Utils {
     bool checkSimulationPrerequisites(std::shared_ptr<SimulationManager> Manager, std::vector<clDevice> &Devices) {
@@ -45,12 +47,31 @@ namespace Utils {
         if (Manager->full3dEnabled() && Manager->full3dIntegrals() < 1)
             errorList.emplace_back("Full 3d integrals must be non-zero positive number.");
 
+        if (Manager->full3dEnabled())
+            for (auto &d : Devices)
+                if (d.isNative()) {
+                    errorList.emplace_back("Full 3d potentials are not supported by the native (host CPU) device.");
+                    break;
+                }
+
         if (Manager->mode() == SimulationMode::STEM && Manager->parallelPixels() < 1)
             errorList.emplace_back("Parallel STEM pixels must be non-zero positive number.");
 
         if (Manager->mode() == SimulationMode::STEM && Manager->parallelPixels() < 1)
             errorList.emplace_back("Parallel STEM pixels must be non-zero positive number.");
 
+        if (Manager->stem4DEnabled()) {
+            if (Manager->stem4DPath().empty())
+                errorList.emplace_back("4D-STEM requires an output file.");
+            if (Manager->stemPrismEnabled())
+                errorList.emplace_back("4D-STEM is not supported by PRISM.");
+            for (auto &d : Devices)
+                if (d.isNative()) {
+                    errorList.emplace_back("4D-STEM is not supported by the native (host CPU) device.");
+                    break;
+                }
+        }
+
         // check TDS entries
         if (Manager->parallelPotentialsCount() < 1)
             errorList.emplace_back("Mixed potential phonon approximation must be a non-zero positive number.");
@@ -88,4 +109,70 @@ namespace Utils {
 
         return true;
     }
+    std::map<std::string, Image<double>> integrateStemDetectors(const std::string &path,
+                                                                const std::vector<StemDetector> &detectors) {
+        fileio::ChunkedFileReader file(path);
+
+        auto meta = nlohmann::json::parse(file.metadata());
+        auto bin = JSONUtils::readJsonEntry<unsigned int>(meta, "4d", "binning");
+        auto crop = JSONUtils::readJsonEntry<unsigned int>(meta, "4d", "crop");
+        double scale = JSONUtils::readJsonEntry<double>(meta, "4d", "scale", "val") / bin;
+
+        auto &ds = file.dataset("diffraction");
+        if (ds.shape.size() != 6)
+            throw std::runtime_error("4D-STEM file has the wrong dimensions");
+        auto iterations = ds.shape[0];
+        auto outputs = static_cast<unsigned int>(ds.shape[1]);
+        auto py = static_cast<unsigned int>(ds.shape[2]);
+        auto px = static_cast<unsigned int>(ds.shape[3]);
+        auto n = static_cast<unsigned int>(ds.shape[4]);
+
+        // the pixels that are in each detector (the same test as the stem_detectors kernel, using the centre of each
+        // bin and with the zero frequency at crop / 2 in the unbinned pattern)
+        std::vector<std::vector<size_t>> masks(detectors.size());
+        for (size_t d = 0; d < detectors.size(); ++d)
+            for (unsigned int j = 0; j < n; ++j)
+                for (unsigned int i = 0; i < n; ++i) {
+                    double x = (i * bin + (bin - 1) / 2.0 - crop / 2) * scale - detectors[d].xcentre;
+                    double y = (j * bin + (bin - 1) / 2.0 - crop / 2) * scale - detectors[d].ycentre;
+                    double r = std::sqrt(x * x + y * y);
+                    if (r >= detectors[d].inner && r <= detectors[d].outer)
+                        masks[d].push_back(i + j * n);
+                }
+
+        size_t n_pixels = static_cast<size_t>(px) * py;
+        std::vector<std::vector<std::vector<double>>> sums(detectors.size(),
+                std::vector<std::vector<double>>(outputs, std::vector<double>(n_pixels, 0.0)));
+        std::vector<std::vector<unsigned int>> counts(outputs, std::vector<unsigned int>(n_pixels, 0));
+
+        for (uint64_t it = 0; it < iterations; ++it)
+            for (uint64_t o = 0; o < outputs; ++o)
+                for (uint64_t p = 0; p < n_pixels; ++p) {
+                    std::vector<uint64_t> coords = {it, o, p / px, p % px, 0, 0};
+                    if (!file.hasChunk(ds.id, coords))
+                        continue;
+
+                    auto pattern = file.readChunk(ds.id, coords);
+                    ++counts[o][p];
+                    for (size_t d = 0; d < detectors.size(); ++d) {
+                        double sum = 0.0;
+                        for (auto m : masks[d])
+                            sum += pattern[m];
+                        // same normalisation as the stem_detectors kernel
+                        sums[d][o][p] += sum * M_SQRT2;
+                    }
+                }
+
+        std::map<std::string, Image<double>> images;
+        for (size_t d = 0; d < detectors.size(); ++d) {
+            for (unsigned int o = 0; o < outputs; ++o)
+                for (size_t p = 0; p < n_pixels; ++p)
+                    if (counts[o][p] > 0)
+                        sums[d][o][p] /= counts[o][p];
+
+            images[detectors[d].name] = Image<double>(sums[d], px, py);
+        }
+
+        return images;
+    }
 }
\ No newline at end of file
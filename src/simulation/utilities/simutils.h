@@ -21,6 +21,12 @@ namespace Utils {
 
     bool checkSimulationPrerequisites(std::shared_ptr<SimulationManager> Manager, std::vector<clDevice> &Devices);
 
+    // Integrates STEM detectors from the diffraction patterns in a 4D-STEM file (so new detectors don't need a new
+    // simulation). The images are the same as the simulated ones, i.e. a slice for each intermediate output and the
+    // average of the inelastic iterations. Probes that have no patterns in the file are left as zero.
+    std::map<std::string, Image<double>> integrateStemDetectors(const std::string &path,
+                                                                const std::vector<StemDetector> &detectors);
+
     // This is basically for debugging
     template<typename T>
     void saveComplexBuffer(std::string path, clMemory<std::complex<T>, Manual> buf, ComplexDisplay complex_type) {
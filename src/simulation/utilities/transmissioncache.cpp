@@ -0,0 +1,152 @@
+#include "transmissioncache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include "utilities/logging.h"
+
+namespace {
+    const char file_magic[4] = {'C', 'L', 'T', 'F'};
+}
+
+void TransmissionCache::setLimits(size_t max_bytes, const std::string &directory) {
+    std::lock_guard<std::mutex> lck(mtx);
+
+    max_size = max_bytes;
+    cache_directory = directory;
+
+    // remove anything that no longer fits
+    while (current_size > max_size && !usage.empty()) {
+        auto it = entries.find(usage.back());
+        current_size -= it->second.data.size();
+        entries.erase(it);
+        usage.pop_back();
+    }
+}
+
+bool TransmissionCache::enabled() {
+    std::lock_guard<std::mutex> lck(mtx);
+    return max_size > 0 || !cache_directory.empty();
+}
+
+template <class T>
+bool TransmissionCache::get(uint64_t key, std::vector<std::complex<T>> &data) {
+    std::lock_guard<std::mutex> lck(mtx);
+
+    std::vector<unsigned char> bytes;
+
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        // move to the front as it is now the most recently used
+        usage.splice(usage.begin(), usage, it->second.usage_it);
+        bytes = it->second.data;
+    } else if (readFile(key, bytes)) {
+        insert(key, bytes);
+    } else {
+        return false;
+    }
+
+    if (bytes.size() % sizeof(std::complex<T>) != 0)
+        return false;
+
+    data.resize(bytes.size() / sizeof(std::complex<T>));
+    std::memcpy(data.data(), bytes.data(), bytes.size());
+    return true;
+}
+
+template <class T>
+void TransmissionCache::put(uint64_t key, const std::vector<std::complex<T>> &data) {
+    std::lock_guard<std::mutex> lck(mtx);
+
+    std::vector<unsigned char> bytes(data.size() * sizeof(std::complex<T>));
+    std::memcpy(bytes.data(), data.data(), bytes.size());
+
+    writeFile(key, bytes);
+    insert(key, std::move(bytes));
+}
+
+void TransmissionCache::insert(uint64_t key, std::vector<unsigned char> data) {
+    if (data.size() > max_size || entries.find(key) != entries.end())
+        return;
+
+    while (current_size + data.size() > max_size && !usage.empty()) {
+        auto it = entries.find(usage.back());
+        current_size -= it->second.data.size();
+        entries.erase(it);
+        usage.pop_back();
+    }
+
+    usage.push_front(key);
+    current_size += data.size();
+    entries[key] = Entry{std::move(data), usage.begin()};
+}
+
+std::string TransmissionCache::filePath(uint64_t key) {
+    std::stringstream ss;
+    ss << cache_directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".cltf";
+    return ss.str();
+}
+
+bool TransmissionCache::readFile(uint64_t key, std::vector<unsigned char> &data) {
+    if (cache_directory.empty())
+        return false;
+
+    std::ifstream in(filePath(key), std::ios::binary);
+    if (!in)
+        return false;
+
+    char magic[4];
+    uint64_t size = 0;
+    in.read(magic, 4);
+    in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (!in || std::memcmp(magic, file_magic, 4) != 0)
+        return false;
+
+    data.resize(size);
+    in.read(reinterpret_cast<char*>(data.data()), size);
+    if (!in) {
+        CLOG(WARNING, "sim") << "Could not read cached transmission function: " << filePath(key);
+        return false;
+    }
+
+    return true;
+}
+
+void TransmissionCache::writeFile(uint64_t key, const std::vector<unsigned char> &data) {
+    if (cache_directory.empty())
+        return;
+
+    // write to a temporary file first so other threads/processes never see a partial file
+    std::string path = filePath(key);
+    std::stringstream tmp_ss;
+    tmp_ss << path << "." << std::this_thread::get_id() << ".tmp";
+    std::string tmp_path = tmp_ss.str();
+
+    {
+        std::ofstream out(tmp_path, std::ios::binary);
+        uint64_t size = data.size();
+        out.write(file_magic, 4);
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.write(reinterpret_cast<const char*>(data.data()), size);
+
+        if (!out) {
+            CLOG(WARNING, "sim") << "Could not write transmission function to cache: " << path;
+            out.close();
+            std::remove(tmp_path.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+        std::remove(tmp_path.c_str());
+}
+
+template bool TransmissionCache::get<float>(uint64_t key, std::vector<std::complex<float>> &data);
+template bool TransmissionCache::get<double>(uint64_t key, std::vector<std::complex<double>> &data);
+
+template void TransmissionCache::put<float>(uint64_t key, const std::vector<std::complex<float>> &data);
+template void TransmissionCache::put<double>(uint64_t key, const std::vector<std::complex<double>> &data);
@@ -0,0 +1,100 @@
+#ifndef CLTEM_TRANSMISSIONCACHE_H
+#define CLTEM_TRANSMISSIONCACHE_H
+
+#include <complex>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Builds the key for the transmission cache by hashing (FNV-1a) everything that goes into a transmission function
+class TransmissionKey
+{
+public:
+    TransmissionKey() : hash(14695981039346656037ull) {}
+
+    template <class V>
+    TransmissionKey& add(const V &value) {
+        addBytes(&value, sizeof(V));
+        return *this;
+    }
+
+    TransmissionKey& add(const std::string &value) {
+        add(value.size());
+        addBytes(value.data(), value.size());
+        return *this;
+    }
+
+    template <class V>
+    TransmissionKey& add(const std::vector<V> &values) {
+        add(values.size());
+        addBytes(values.data(), values.size() * sizeof(V));
+        return *this;
+    }
+
+    uint64_t value() const { return hash; }
+
+private:
+    uint64_t hash;
+
+    void addBytes(const void *data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    }
+};
+
+// Stores calculated transmission functions (one slice per entry) so they can be reused by later simulations that
+// have the same structure/potentials/sampling (e.g. when only changing the optics). The contexts (and the device
+// buffers) only last as long as the thread pool, so entries are kept in host memory (least recently used are removed
+// first) and can also be written to a directory so they are kept between runs.
+class TransmissionCache
+{
+public:
+    static TransmissionCache& getInstance() { static TransmissionCache instance; return instance; }
+
+    TransmissionCache(TransmissionCache const &) = delete;
+    TransmissionCache &operator=(TransmissionCache const &) = delete;
+
+    // max_bytes of 0 disables the memory cache, an empty directory disables the disk cache
+    void setLimits(size_t max_bytes, const std::string &directory);
+
+    bool enabled();
+
+    template <class T>
+    bool get(uint64_t key, std::vector<std::complex<T>> &data);
+
+    template <class T>
+    void put(uint64_t key, const std::vector<std::complex<T>> &data);
+
+private:
+    TransmissionCache() : max_size(0), current_size(0) {}
+
+    std::mutex mtx;
+
+    size_t max_size;
+    size_t current_size;
+    std::string cache_directory;
+
+    // most recently used at the front
+    std::list<uint64_t> usage;
+    struct Entry {
+        std::vector<unsigned char> data;
+        std::list<uint64_t>::iterator usage_it;
+    };
+    std::unordered_map<uint64_t, Entry> entries;
+
+    void insert(uint64_t key, std::vector<unsigned char> data);
+
+    std::string filePath(uint64_t key);
+
+    bool readFile(uint64_t key, std::vector<unsigned char> &data);
+
+    void writeFile(uint64_t key, const std::vector<unsigned char> &data);
+};
+
+#endif //CLTEM_TRANSMISSIONCACHE_H